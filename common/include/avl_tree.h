@@ -50,6 +50,12 @@ struct avl_tree {
     /* This should be a total order (<=) on tree nodes. If two elements compare equal, the newer
      * will be on the left (side of smaller elements) from the older one. */
     bool (*cmp)(struct avl_tree_node*, struct avl_tree_node*);
+    /* Optional (can be NULL). Recomputes augmented data of `node` (e.g. a subtree maximum) from
+     * the node itself and its direct children, which are already up to date. The result must
+     * depend only on the (ordered) set of nodes in the subtree, not on its shape. Called by all
+     * functions modifying the tree; users that modify a node in place (without changing its order)
+     * must call `avl_tree_update_path` afterwards. */
+    void (*update)(struct avl_tree_node*);
 };
 
 void avl_tree_insert(struct avl_tree* tree, struct avl_tree_node* node);
@@ -64,6 +70,9 @@ void avl_tree_delete(struct avl_tree* tree, struct avl_tree_node* node);
 void avl_tree_swap_node(struct avl_tree* tree, struct avl_tree_node* old_node,
                         struct avl_tree_node* new_node);
 
+/* Recomputes augmented data (see `avl_tree.update`) of `node` and all its ancestors. O(log(n)). */
+void avl_tree_update_path(struct avl_tree* tree, struct avl_tree_node* node);
+
 /* These functions return respectively previous and next node or NULL if such does not exist.
  * O(log(n)) in worst case, but amortized O(1). */
 struct avl_tree_node* avl_tree_prev(struct avl_tree_node* node);
@@ -67,6 +67,23 @@ static inline bool read_seqretry(seqlock_t* sl, uint32_t start) {
     return start != __atomic_load_n(&sl->sequence, __ATOMIC_RELAXED);
 }
 
+/*!
+ * \brief Start a locking reader-side critical section (acquires spinlock).
+ *
+ * Excludes writers and other locking readers, but does not disturb lockless readers. Useful for
+ * readers that cannot be retried, e.g. because they take references or have other side effects.
+ */
+static inline void read_seqlock_excl(seqlock_t* sl) {
+    spinlock_lock(&sl->lock);
+}
+
+/*!
+ * \brief End a locking reader-side critical section (releases spinlock).
+ */
+static inline void read_sequnlock_excl(seqlock_t* sl) {
+    spinlock_unlock(&sl->lock);
+}
+
 /*!
  * \brief Start a writer-side critical section (acquires spinlock).
  */
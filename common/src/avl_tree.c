@@ -10,6 +10,23 @@
 #include "api.h"
 #include "assert.h"
 
+static void avl_tree_update_node(struct avl_tree* tree, struct avl_tree_node* node) {
+    if (tree->update) {
+        tree->update(node);
+    }
+}
+
+void avl_tree_update_path(struct avl_tree* tree, struct avl_tree_node* node) {
+    if (!tree->update) {
+        return;
+    }
+
+    while (node) {
+        tree->update(node);
+        node = node->parent;
+    }
+}
+
 static void avl_tree_init_node(struct avl_tree_node* node) {
     node->left    = NULL;
     node->right   = NULL;
@@ -70,9 +87,11 @@ static void fixup_link(struct avl_tree_node* old_node, struct avl_tree_node* new
  * The next 4 functions do rotations (rot1 - single, rot2 - double, which is a concatenation of two
  * single rotations). L stands for left (counterclockwise) rotation and R for right (clockwise).
  * The naming convention is: `p` is topmost node and parent of `q`, which in turn is parent of `r`.
+ * Rotations do not change the set of nodes in the rotated subtree, so only the nodes that were
+ * moved need their augmented data (if any) recomputed, bottom-up.
  */
 
-static void rot1L(struct avl_tree_node* q, struct avl_tree_node* p) {
+static void rot1L(struct avl_tree* tree, struct avl_tree_node* q, struct avl_tree_node* p) {
     assert(q->parent == p);
     assert(p->right == q);
     assert(q->balance == 1 || q->balance == 0);
@@ -95,9 +114,12 @@ static void rot1L(struct avl_tree_node* q, struct avl_tree_node* p) {
         p->balance = 1;
         q->balance = -1;
     }
+
+    avl_tree_update_node(tree, p);
+    avl_tree_update_node(tree, q);
 }
 
-static void rot1R(struct avl_tree_node* q, struct avl_tree_node* p) {
+static void rot1R(struct avl_tree* tree, struct avl_tree_node* q, struct avl_tree_node* p) {
     assert(q->parent == p);
     assert(p->left == q);
     assert(q->balance == -1 || q->balance == 0);
@@ -120,9 +142,13 @@ static void rot1R(struct avl_tree_node* q, struct avl_tree_node* p) {
         p->balance = -1;
         q->balance = 1;
     }
+
+    avl_tree_update_node(tree, p);
+    avl_tree_update_node(tree, q);
 }
 
-static void rot2RL(struct avl_tree_node* r, struct avl_tree_node* q, struct avl_tree_node* p) {
+static void rot2RL(struct avl_tree* tree, struct avl_tree_node* r, struct avl_tree_node* q,
+                   struct avl_tree_node* p) {
     assert(q->parent == p);
     assert(p->right == q);
     assert(q->balance == -1);
@@ -161,9 +187,14 @@ static void rot2RL(struct avl_tree_node* r, struct avl_tree_node* q, struct avl_
         q->balance = 0;
     }
     r->balance = 0;
+
+    avl_tree_update_node(tree, p);
+    avl_tree_update_node(tree, q);
+    avl_tree_update_node(tree, r);
 }
 
-static void rot2LR(struct avl_tree_node* r, struct avl_tree_node* q, struct avl_tree_node* p) {
+static void rot2LR(struct avl_tree* tree, struct avl_tree_node* r, struct avl_tree_node* q,
+                   struct avl_tree_node* p) {
     assert(q->parent == p);
     assert(p->left == q);
     assert(q->balance == 1);
@@ -202,12 +233,17 @@ static void rot2LR(struct avl_tree_node* r, struct avl_tree_node* q, struct avl_
         p->balance = 0;
     }
     r->balance = 0;
+
+    avl_tree_update_node(tree, p);
+    avl_tree_update_node(tree, q);
+    avl_tree_update_node(tree, r);
 }
 
 /* Does appropriate rotation of node, which mush have disturbed balance (i.e. +2/-2).
  * Returns whether height might have changed and sets `new_root_ptr` to root of this subtree after
  * rotation. */
-static bool avl_tree_do_balance(struct avl_tree_node* node, struct avl_tree_node** new_root_ptr) {
+static bool avl_tree_do_balance(struct avl_tree* tree, struct avl_tree_node* node,
+                                struct avl_tree_node** new_root_ptr) {
     assert(node->balance == -2 || node->balance == 2);
 
     struct avl_tree_node* child = NULL;
@@ -218,12 +254,12 @@ static bool avl_tree_do_balance(struct avl_tree_node* node, struct avl_tree_node
         if (child->balance == 1) {
             assert(child->right);
             *new_root_ptr = child->right;
-            rot2LR(child->right, child, node);
+            rot2LR(tree, child->right, child, node);
             return true;
         } else { // child->balance <= 0
             *new_root_ptr = child;
             ret = child->balance != 0;
-            rot1R(child, node);
+            rot1R(tree, child, node);
             return ret;
         }
     } else { // node->balance == 2
@@ -231,12 +267,12 @@ static bool avl_tree_do_balance(struct avl_tree_node* node, struct avl_tree_node
         if (child->balance >= 0) {
             *new_root_ptr = child;
             ret = child->balance != 0;
-            rot1L(child, node);
+            rot1L(tree, child, node);
             return ret;
         } else { // child->balance == -1
             assert(child->left);
             *new_root_ptr = child->left;
-            rot2RL(child->left, child, node);
+            rot2RL(tree, child->left, child, node);
             return true;
         }
     }
@@ -255,8 +291,8 @@ enum side {
  *
  * Returns the root of the subtree that balancing stopped at.
  */
-static struct avl_tree_node* avl_tree_balance(struct avl_tree_node* node, enum side side,
-                                              bool height_increased) {
+static struct avl_tree_node* avl_tree_balance(struct avl_tree* tree, struct avl_tree_node* node,
+                                              enum side side, bool height_increased) {
     assert(node);
 
     while (1) {
@@ -283,7 +319,7 @@ static struct avl_tree_node* avl_tree_balance(struct avl_tree_node* node, enum s
 
         assert(-2 <= node->balance && node->balance <= 2);
         if (node->balance == -2 || node->balance == 2) {
-            height_changed = avl_tree_do_balance(node, &node);
+            height_changed = avl_tree_do_balance(tree, node, &node);
             /* On inserting height never changes. */
             height_changed = height_increased ? false : height_changed;
         }
@@ -309,6 +345,7 @@ void avl_tree_insert(struct avl_tree* tree, struct avl_tree_node* node) {
     /* Inserting into an empty tree. */
     if (!tree->root) {
         tree->root = node;
+        avl_tree_update_node(tree, node);
         return;
     }
 
@@ -316,13 +353,17 @@ void avl_tree_insert(struct avl_tree* tree, struct avl_tree_node* node) {
 
     assert(node->parent);
 
+    /* Fix augmented data of all ancestors before balancing, so that rotations below compute it from
+     * up-to-date children. */
+    avl_tree_update_path(tree, node);
+
     struct avl_tree_node* new_root;
 
     if (node->parent->left == node) {
-        new_root = avl_tree_balance(node->parent, LEFT, /*height_increased=*/true);
+        new_root = avl_tree_balance(tree, node->parent, LEFT, /*height_increased=*/true);
     } else {
         assert(node->parent->right == node);
-        new_root = avl_tree_balance(node->parent, RIGHT, /*height_increased=*/true);
+        new_root = avl_tree_balance(tree, node->parent, RIGHT, /*height_increased=*/true);
     }
 
     if (!new_root->parent) {
@@ -352,6 +393,8 @@ void avl_tree_swap_node(struct avl_tree* tree, struct avl_tree_node* old_node,
     if (tree->root == old_node) {
         tree->root = new_node;
     }
+
+    avl_tree_update_path(tree, new_node);
 }
 
 struct avl_tree_node* avl_tree_prev(struct avl_tree_node* node) {
@@ -481,7 +524,8 @@ void avl_tree_delete(struct avl_tree* tree, struct avl_tree_node* node) {
 
     /* After removal the tree might need balancing. */
     if (node->parent) {
-        new_root = avl_tree_balance(node->parent, side, /*height_increased=*/false);
+        avl_tree_update_path(tree, node->parent);
+        new_root = avl_tree_balance(tree, node->parent, side, /*height_increased=*/false);
     }
 
     if ((new_root && !new_root->parent) || !node->parent) {
@@ -12,13 +12,22 @@
 
 #include "libos_types.h"
 
+/*
+ * File data is stored in fixed-size pages, which are leaves of a radix tree indexed by the page
+ * number (see `libos_fs_mem.c`). Pages that were never written (holes) are not allocated and read
+ * as zeros.
+ */
+union mem_file_block;
+
 struct libos_mem_file {
-    char* buf;
     file_off_t size;
-    size_t buf_size;
+    union mem_file_block* root; /* root of the radix tree (a page if `height` is 0), or NULL */
+    unsigned int height;        /* number of levels of inner nodes above the pages */
 };
 
-void mem_file_init(struct libos_mem_file* mem, char* data, size_t size);
+int init_mem_files(void);
+
+void mem_file_init(struct libos_mem_file* mem);
 void mem_file_destroy(struct libos_mem_file* mem);
 
 /*
@@ -27,6 +36,10 @@ void mem_file_destroy(struct libos_mem_file* mem);
  * `write`) update it themselves after a successful operation.
  */
 ssize_t mem_file_read(struct libos_mem_file* mem, file_off_t pos_start, void* buf, size_t size);
+/* Same as `mem_file_read`, but `buf` must be already zeroed (e.g. freshly allocated memory): holes
+ * in the file are skipped instead of being copied. */
+ssize_t mem_file_read_into_zeroed(struct libos_mem_file* mem, file_off_t pos_start, void* buf,
+                                  size_t size);
 ssize_t mem_file_write(struct libos_mem_file* mem, file_off_t pos_start, const void* buf,
                        size_t size);
 int mem_file_truncate(struct libos_mem_file* mem, file_off_t size);
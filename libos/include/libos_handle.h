@@ -132,6 +132,14 @@ struct libos_epoll_handle {
     LISTP_TYPE(libos_epoll_item) items;
     size_t items_count;
     size_t last_returned_index;
+    LISTP_TYPE(libos_epoll_item) ready_items;
+    size_t ready_items_count;
+    size_t unnotified_count;
+    /* Arrays used by `epoll_wait`, kept between calls. */
+    struct libos_epoll_item** cached_items;
+    PAL_HANDLE* cached_pal_handles;
+    pal_wait_flags_t* cached_pal_events;
+    size_t cached_arrays_len;
 };
 
 struct libos_eventfd_handle {
@@ -196,6 +204,13 @@ struct libos_handle {
     bool needs_et_poll_in;
     /* Same as above but for `EPOLLOUT` events. */
     bool needs_et_poll_out;
+    /* PAL readiness callback of epoll is installed on the PAL handle (see `libos_epoll.c`).
+     * Protected by `handle->lock`. */
+    bool epoll_notify;
+    /* The handle is queued on the list of notified handles, linked via `epoll_notify_next`. Both
+     * fields are accessed atomically. */
+    bool epoll_notify_queued;
+    struct libos_handle* epoll_notify_next;
 
     char* uri; /* PAL URI for this handle (if any). Does not change. */
 
@@ -187,6 +187,9 @@ long libos_syscall_ppoll(struct pollfd* fds, unsigned int nfds, struct timespec*
                          const __sigset_t* sigmask_ptr, size_t sigsetsize);
 long libos_syscall_set_robust_list(struct robust_list_head* head, size_t len);
 long libos_syscall_get_robust_list(pid_t pid, struct robust_list_head** head, size_t* len);
+long libos_syscall_splice(int fd_in, off_t* off_in, int fd_out, off_t* off_out, size_t len,
+                          unsigned int flags);
+long libos_syscall_vmsplice(int fd, struct iovec* vec, unsigned long vlen, unsigned int flags);
 long libos_syscall_epoll_pwait(int epfd, struct epoll_event* events, int maxevents, int timeout_ms,
                                const __sigset_t* sigmask, size_t sigsetsize);
 long libos_syscall_accept4(int fd, void* addr, int* addrlen, int flags);
@@ -7,5 +7,20 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pal.h"
+
 extern const uint8_t vdso_so[];
 extern const size_t vdso_so_size;
+
+/* Size of the read-only data page mapped right before the vDSO image (similar to the "vvar" page
+ * of Linux). Must match the offset of `vdso_vvar_page` in the vDSO linker script. */
+#define VDSO_VVAR_SIZE 4096
+
+/* Contents of the vvar page, filled by LibOS when mapping the vDSO and read by vDSO functions */
+struct vdso_vvar {
+    /* copied from PAL; if `tsc_time_info.mult` is zero, time functions fall back to syscalls */
+    struct pal_tsc_time_info tsc_time_info;
+};
@@ -41,6 +41,24 @@ struct libos_vma_info {
  * migration */
 #define VMA_TAINTED 0x40000000
 
+/* Returns the huge-page size requested via `MAP_HUGETLB` (optionally with `MAP_HUGE_2MB` or
+ * `MAP_HUGE_1GB`) in mmap `flags`; returns 0 if huge pages are not requested or the requested size
+ * is not supported. */
+static inline size_t mmap_huge_page_size(int flags) {
+    if (!(flags & MAP_HUGETLB))
+        return 0;
+
+    switch ((flags >> MAP_HUGE_SHIFT) & MAP_HUGE_MASK) {
+        case 0: /* default huge-page size */
+        case 21:
+            return 2UL * 1024 * 1024;
+        case 30:
+            return 1UL * 1024 * 1024 * 1024;
+        default:
+            return 0;
+    }
+}
+
 int init_vma(void);
 
 /*
@@ -81,7 +99,8 @@ int bkeep_mmap_fixed(void* addr, size_t length, int prot, int flags, struct libo
 /*
  * Bookkeeping an allocation of memory at any address in the range [`bottom_addr`, `top_addr`).
  * The search is top-down, starting from `top_addr` - `length` and returning the first unoccupied
- * area capable of fitting the requested size.
+ * area capable of fitting the requested size. Anonymous `MAP_HUGETLB` areas are additionally
+ * aligned to the huge-page size, so that the PAL can back them with large pages.
  * Start of bookkept range is returned in `*ret_val_ptr`.
  */
 int bkeep_mmap_any_in_range(void* bottom_addr, void* top_addr, size_t length, int prot, int flags,
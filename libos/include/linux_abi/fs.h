@@ -51,5 +51,11 @@ struct linux_dirent_tail {
 #define SEEK_DATA 3 /* seek to the next data */
 #define SEEK_HOLE 4 /* seek to the next hole */
 
+#define SPLICE_F_MOVE     1 /* move pages instead of copying */
+#define SPLICE_F_NONBLOCK 2 /* don't block on the pipe splicing */
+#define SPLICE_F_MORE     4 /* expect more data */
+#define SPLICE_F_GIFT     8 /* pages passed in are a gift */
+#define SPLICE_F_ALL      (SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT)
+
 #define CLOSE_RANGE_UNSHARE (1U << 1)
 #define CLOSE_RANGE_CLOEXEC (1U << 2)
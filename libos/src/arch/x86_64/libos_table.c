@@ -289,10 +289,10 @@ libos_syscall_t libos_syscall_table[LIBOS_SYSCALL_BOUND] = {
     [__NR_unshare]                 = (libos_syscall_t)0, // libos_syscall_unshare
     [__NR_set_robust_list]         = (libos_syscall_t)libos_syscall_set_robust_list,
     [__NR_get_robust_list]         = (libos_syscall_t)libos_syscall_get_robust_list,
-    [__NR_splice]                  = (libos_syscall_t)0, // libos_syscall_splice
+    [__NR_splice]                  = (libos_syscall_t)libos_syscall_splice,
     [__NR_tee]                     = (libos_syscall_t)0, // libos_syscall_tee
     [__NR_sync_file_range]         = (libos_syscall_t)0, // libos_syscall_sync_file_range
-    [__NR_vmsplice]                = (libos_syscall_t)0, // libos_syscall_vmsplice
+    [__NR_vmsplice]                = (libos_syscall_t)libos_syscall_vmsplice,
     [__NR_move_pages]              = (libos_syscall_t)0, // libos_syscall_move_pages
     [__NR_utimensat]               = (libos_syscall_t)0, // libos_syscall_utimensat
     [__NR_epoll_pwait]             = (libos_syscall_t)libos_syscall_epoll_pwait,
@@ -834,6 +834,10 @@ BEGIN_CP_FUNC(handle) {
          * `libos_epoll.c` for more details. */
         INIT_LISTP(&new_hdl->epoll_items);
         new_hdl->epoll_items_count = 0;
+        /* PAL readiness callbacks are not inherited, they are installed anew in the child. */
+        new_hdl->epoll_notify = false;
+        new_hdl->epoll_notify_queued = false;
+        new_hdl->epoll_notify_next = NULL;
 
         /* TODO: move this into epoll specific `checkout` callback.
          * It's impossible at the moment, because `DO_CP` is a macro that can be only used inside
@@ -844,6 +848,13 @@ BEGIN_CP_FUNC(handle) {
             INIT_LISTP(&epoll->waiters);
             INIT_LISTP(&epoll->items);
             epoll->items_count = 0;
+            INIT_LISTP(&epoll->ready_items);
+            epoll->ready_items_count = 0;
+            epoll->unnotified_count = 0;
+            epoll->cached_items = NULL;
+            epoll->cached_pal_handles = NULL;
+            epoll->cached_pal_events = NULL;
+            epoll->cached_arrays_len = 0;
             DO_CP(epoll_items_list, hdl, new_hdl);
         }
 
@@ -924,6 +935,7 @@ BEGIN_RS_FUNC(handle) {
                 return -ENOMEM;
             }
             CP_REBASE(epoll->waiters);
+            CP_REBASE(epoll->ready_items);
             /* `epoll->items` is rebased in epoll_items_list RS_FUNC. */
             break;
         default:
@@ -22,6 +22,7 @@
 #include "libos_utils.h"
 #include "libos_vma.h"
 #include "linux_abi/memory.h"
+#include "seqlock.h"
 #include "spinlock.h"
 
 /* The amount of total memory usage, all accesses must be protected by `vma_tree_lock`. */
@@ -54,6 +55,12 @@ struct libos_vma {
          * of to-be-freed vmas (used by _vma_bkeep_remove). Such lists use the field below. */
         struct libos_vma* next_free;
     };
+    /* Augmented data of `vma_tree`, describing the subtree rooted at this vma (only valid if this
+     * vma is in the tree): the lowest begin and the highest end of all vmas in the subtree and
+     * the size of the largest hole between two consecutive vmas in the subtree. */
+    uintptr_t subtree_begin;
+    uintptr_t subtree_end;
+    size_t subtree_max_gap;
     char comment[VMA_COMMENT_LEN];
 };
 
@@ -85,6 +92,26 @@ static bool vma_tree_cmp(struct avl_tree_node* node_a, struct avl_tree_node* nod
     return a->end <= b->end;
 }
 
+static void vma_tree_update(struct avl_tree_node* node) {
+    struct libos_vma* vma = container_of(node, struct libos_vma, tree_node);
+
+    vma->subtree_begin = vma->begin;
+    vma->subtree_end = vma->end;
+    vma->subtree_max_gap = 0;
+
+    if (node->left) {
+        struct libos_vma* left = container_of(node->left, struct libos_vma, tree_node);
+        vma->subtree_begin = left->subtree_begin;
+        vma->subtree_max_gap = MAX(left->subtree_max_gap, vma->begin - left->subtree_end);
+    }
+    if (node->right) {
+        struct libos_vma* right = container_of(node->right, struct libos_vma, tree_node);
+        vma->subtree_end = right->subtree_end;
+        vma->subtree_max_gap = MAX(vma->subtree_max_gap,
+                                   MAX(right->subtree_max_gap, right->subtree_begin - vma->end));
+    }
+}
+
 static bool is_addr_in_vma(uintptr_t addr, struct libos_vma* vma) {
     return vma->begin <= addr && addr < vma->end;
 }
@@ -100,12 +127,24 @@ static bool cmp_addr_to_vma(void* addr, struct avl_tree_node* node) {
  * "vma_tree" holds all vmas with the assumption that no 2 overlap (though they could be adjacent).
  * Currently we do not merge similar adjacent vmas - if we ever start doing it, this code needs
  * to be revisited as there might be some optimizations that would break due to it.
+ * The tree is augmented with the largest hole in each subtree (see `vma_tree_update`), so every
+ * in-place change of `begin` or `end` of a vma in the tree must be followed by
+ * `vma_tree_update_path`.
+ *
+ * All modifications (of the tree and of vmas in it) are done under `vma_tree_lock` taken as
+ * a writer. Functions that only look up vmas use lockless readers (see `_lookup_vma_lockless`) or,
+ * if they need a consistent view for a longer time, take the lock without bumping its sequence.
  */
-static struct avl_tree vma_tree = {.cmp = vma_tree_cmp};
-static spinlock_t vma_tree_lock = INIT_SPINLOCK_UNLOCKED;
+static struct avl_tree vma_tree = {.cmp = vma_tree_cmp, .update = vma_tree_update};
+static seqlock_t vma_tree_lock = INIT_SEQLOCK_UNLOCKED;
+
+static void vma_tree_update_path(struct libos_vma* vma) {
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
+    avl_tree_update_path(&vma_tree, &vma->tree_node);
+}
 
 static void total_memory_size_add(size_t length) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
 
     g_total_memory_size += length;
 
@@ -117,7 +156,7 @@ static void total_memory_size_add(size_t length) {
 }
 
 static void total_memory_size_sub(size_t length) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
     assert(g_total_memory_size >= length);
 
     g_total_memory_size -= length;
@@ -131,29 +170,19 @@ static struct libos_vma* node2vma(struct avl_tree_node* node) {
 }
 
 static struct libos_vma* _get_next_vma(struct libos_vma* vma) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
     return node2vma(avl_tree_next(&vma->tree_node));
 }
 
-static struct libos_vma* _get_prev_vma(struct libos_vma* vma) {
-    assert(spinlock_is_locked(&vma_tree_lock));
-    return node2vma(avl_tree_prev(&vma->tree_node));
-}
-
-static struct libos_vma* _get_last_vma(void) {
-    assert(spinlock_is_locked(&vma_tree_lock));
-    return node2vma(avl_tree_last(&vma_tree));
-}
-
 static struct libos_vma* _get_first_vma(void) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
     return node2vma(avl_tree_first(&vma_tree));
 }
 
 /* Returns the vma that contains `addr`. If there is no such vma, returns the closest vma with
  * higher address. */
 static struct libos_vma* _lookup_vma(uintptr_t addr) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
 
     struct avl_tree_node* node = avl_tree_lower_bound_fn(&vma_tree, (void*)addr, cmp_addr_to_vma);
     if (!node) {
@@ -176,7 +205,7 @@ typedef bool (*traverse_visitor)(struct libos_vma* vma, void* visitor_arg);
 // TODO: Probably other VMA functions could make use of this helper.
 static bool _traverse_vmas_in_range(uintptr_t begin, uintptr_t end, traverse_visitor visitor,
                                     void* visitor_arg) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
     assert(begin <= end);
 
     if (begin == end)
@@ -206,6 +235,130 @@ static bool _traverse_vmas_in_range(uintptr_t begin, uintptr_t end, traverse_vis
     return is_continuous;
 }
 
+/*
+ * Lockless readers of `vma_tree`.
+ *
+ * These walk the tree without taking `vma_tree_lock`, inside a seqlock read-side section, and the
+ * caller retries if a writer modified the tree in the meantime. They can observe inconsistent
+ * state (pointers to just removed vmas, half-done rotations), which is fine because:
+ * - memory of vmas is never unmapped (`vma_mgr` is never freed, initial vmas and the temporary vma
+ *   of `alloc_vma` are static), so following a stale pointer does not fault,
+ * - every walk is bounded and gives up on anything that cannot happen in a consistent tree,
+ * - the result is used only after `read_seqretry()` confirms that no writer ran concurrently,
+ * - nothing is modified and no references (e.g. to `vma->file`) are taken speculatively.
+ * After `VMA_LOCKLESS_TRIES` failed attempts, readers fall back to taking the lock.
+ */
+#define VMA_LOCKLESS_TRIES 4
+/* The height of an AVL tree is less than 1.45 * log2(number of nodes). */
+#define VMA_TREE_MAX_HEIGHT 96
+
+static struct avl_tree_node* load_node(struct avl_tree_node** node_ptr) {
+    return __atomic_load_n(node_ptr, __ATOMIC_RELAXED);
+}
+
+/* Lockless version of `_lookup_vma`. Returns false if the walk was inconsistent. */
+static bool _lookup_vma_lockless(uintptr_t addr, struct libos_vma** out_vma) {
+    struct avl_tree_node* node = load_node(&vma_tree.root);
+    struct libos_vma* found = NULL;
+
+    for (size_t steps = 0; node; steps++) {
+        if (steps >= VMA_TREE_MAX_HEIGHT) {
+            return false;
+        }
+        struct libos_vma* vma = container_of(node, struct libos_vma, tree_node);
+        if (addr < vma->end) {
+            found = vma;
+            node = load_node(&node->left);
+        } else {
+            node = load_node(&node->right);
+        }
+    }
+
+    *out_vma = found;
+    return true;
+}
+
+/* Lockless version of `_get_next_vma`. Returns false if the walk was inconsistent. */
+static bool _get_next_vma_lockless(struct libos_vma* vma, struct libos_vma** out_vma) {
+    struct avl_tree_node* node = &vma->tree_node;
+    struct avl_tree_node* next = load_node(&node->right);
+    size_t steps = 0;
+
+    if (next) {
+        struct avl_tree_node* left;
+        while ((left = load_node(&next->left))) {
+            if (++steps >= VMA_TREE_MAX_HEIGHT) {
+                return false;
+            }
+            next = left;
+        }
+    } else {
+        next = load_node(&node->parent);
+        while (next && load_node(&next->right) == node) {
+            if (++steps >= VMA_TREE_MAX_HEIGHT) {
+                return false;
+            }
+            node = next;
+            next = load_node(&node->parent);
+        }
+    }
+
+    *out_vma = node2vma(next);
+    return true;
+}
+
+/*
+ * Lockless version of `_traverse_vmas_in_range`, to be called after `read_seqbegin()` returned
+ * `seq`. `visitor` can be called on inconsistent vmas and must not have side effects other than
+ * on `visitor_arg`. Returns false if the walk was inconsistent or a writer was detected, otherwise
+ * sets `*out_is_continuous`.
+ */
+static bool _traverse_vmas_in_range_lockless(uintptr_t begin, uintptr_t end,
+                                             traverse_visitor visitor, void* visitor_arg,
+                                             uint32_t seq, bool* out_is_continuous) {
+    assert(begin <= end);
+
+    if (begin == end) {
+        *out_is_continuous = true;
+        return true;
+    }
+
+    struct libos_vma* vma;
+    if (!_lookup_vma_lockless(begin, &vma)) {
+        return false;
+    }
+    if (!vma || end <= vma->begin) {
+        *out_is_continuous = false;
+        return true;
+    }
+
+    bool is_continuous = vma->begin <= begin;
+
+    while (1) {
+        if (!visitor(vma, visitor_arg))
+            break;
+
+        struct libos_vma* prev = vma;
+        /* A concurrent writer could make us walk in circles, bail out as soon as we see one. */
+        if (read_seqretry(&vma_tree_lock, seq) || !_get_next_vma_lockless(prev, &vma)) {
+            return false;
+        }
+        if (!vma || end <= vma->begin) {
+            is_continuous &= end <= prev->end;
+            break;
+        }
+        if (vma->begin < prev->end) {
+            return false;
+        }
+
+        is_continuous &= prev->end == vma->begin;
+    }
+
+    *out_is_continuous = is_continuous;
+    return true;
+}
+
+/* `old_vma` must be in `vma_tree`, the caller is responsible for inserting `new_vma`. */
 static void split_vma(struct libos_vma* old_vma, struct libos_vma* new_vma, uintptr_t addr) {
     assert(old_vma->begin < addr && addr < old_vma->end);
 
@@ -216,6 +369,7 @@ static void split_vma(struct libos_vma* old_vma, struct libos_vma* new_vma, uint
     }
 
     old_vma->end = addr;
+    vma_tree_update_path(old_vma);
 }
 
 /*
@@ -228,7 +382,7 @@ static void split_vma(struct libos_vma* old_vma, struct libos_vma* new_vma, uint
  */
 static int _vma_bkeep_remove(uintptr_t begin, uintptr_t end, bool is_internal,
                              struct libos_vma** new_vma_ptr, struct libos_vma** vmas_to_free) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
     assert(!new_vma_ptr || *new_vma_ptr);
     assert(IS_ALLOC_ALIGNED_PTR(begin) && IS_ALLOC_ALIGNED_PTR(end));
 
@@ -265,6 +419,7 @@ static int _vma_bkeep_remove(uintptr_t begin, uintptr_t end, bool is_internal,
 
             split_vma(vma, new_vma, end);
             vma->end = begin;
+            vma_tree_update_path(vma);
 
             avl_tree_insert(&vma_tree, &new_vma->tree_node);
             total_memory_size_sub(end - begin);
@@ -274,6 +429,7 @@ static int _vma_bkeep_remove(uintptr_t begin, uintptr_t end, bool is_internal,
 
         total_memory_size_sub(vma->end - begin);
         vma->end = begin;
+        vma_tree_update_path(vma);
 
         vma = _get_next_vma(vma);
         if (!vma) {
@@ -304,6 +460,7 @@ static int _vma_bkeep_remove(uintptr_t begin, uintptr_t end, bool is_internal,
         }
         total_memory_size_sub(end - vma->begin);
         vma->begin = end;
+        vma_tree_update_path(vma);
     }
 
     return 0;
@@ -325,11 +482,11 @@ static void* _vma_malloc(size_t size) {
     if (ret < 0) {
         struct libos_vma* vmas_to_free = NULL;
 
-        spinlock_lock(&vma_tree_lock);
+        write_seqbegin(&vma_tree_lock);
         /* Since we are freeing a range we just created, additional vma is not needed. */
         ret = _vma_bkeep_remove((uintptr_t)addr, (uintptr_t)addr + size, /*is_internal=*/true, NULL,
                                 &vmas_to_free);
-        spinlock_unlock(&vma_tree_lock);
+        write_seqend(&vma_tree_lock);
         if (ret < 0) {
             log_error("Removing a vma we just created failed: %s", unix_strerror(ret));
             BUG();
@@ -359,6 +516,10 @@ static void _vma_free(void* ptr, size_t size) {
 static struct libos_lock vma_mgr_lock;
 static MEM_MGR vma_mgr = NULL;
 
+/* Temporarily provided to `enlarge_mem_mgr` in `alloc_vma`, protected by `vma_mgr_lock`. It may be
+ * linked into `vma_tree` and thus seen by lockless readers, so it must not live on the stack. */
+static struct libos_vma g_alloc_tmp_vma;
+
 /*
  * We use a following per-thread caching mechanism of VMAs:
  * Each thread has a singly linked list of free VMAs, with maximal length of 3.
@@ -466,14 +627,15 @@ static struct libos_vma* alloc_vma(void) {
     if (!vma) {
         /* `enlarge_mem_mgr` below will call _vma_malloc, which uses at most 1 vma - so we
          * temporarily provide it. */
-        struct libos_vma tmp_vma = {0};
+        struct libos_vma* tmp_vma = &g_alloc_tmp_vma;
+        memset(tmp_vma, 0, sizeof(*tmp_vma));
         /* vma cache is empty, as we checked it before. */
-        if (!add_to_thread_vma_cache(&tmp_vma)) {
+        if (!add_to_thread_vma_cache(tmp_vma)) {
             log_error("Failed to add tmp vma to cache!");
             BUG();
         }
         if (!enlarge_mem_mgr(vma_mgr, size_align_up(DEFAULT_VMA_COUNT))) {
-            remove_from_thread_vma_cache(&tmp_vma);
+            remove_from_thread_vma_cache(tmp_vma);
             goto out_unlock;
         }
 
@@ -483,22 +645,22 @@ static struct libos_vma* alloc_vma(void) {
             BUG();
         }
 
-        spinlock_lock(&vma_tree_lock);
+        write_seqbegin(&vma_tree_lock);
         /* Currently `tmp_vma` is always used (added to `vma_tree`), but this assumption could
          * easily be changed (e.g. if we implement VMAs merging).*/
-        struct avl_tree_node* node = &tmp_vma.tree_node;
+        struct avl_tree_node* node = &tmp_vma->tree_node;
         if (node->parent || vma_tree.root == node) {
             /* `tmp_vma` is in `vma_tree`, we need to migrate it. */
-            copy_vma(&tmp_vma, vma_migrate);
+            copy_vma(tmp_vma, vma_migrate);
             avl_tree_swap_node(&vma_tree, node, &vma_migrate->tree_node);
             vma_migrate = NULL;
         }
-        spinlock_unlock(&vma_tree_lock);
+        write_seqend(&vma_tree_lock);
 
         if (vma_migrate) {
             free_mem_obj_to_mgr(vma_mgr, vma_migrate);
         }
-        remove_from_thread_vma_cache(&tmp_vma);
+        remove_from_thread_vma_cache(tmp_vma);
 
         vma = get_mem_obj_from_mgr(vma_mgr);
     }
@@ -541,7 +703,7 @@ static void free_vmas_freelist(struct libos_vma* vma) {
 }
 
 static int _bkeep_initial_vma(struct libos_vma* new_vma) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
 
     struct libos_vma* tmp_vma = _lookup_vma(new_vma->begin);
     if (tmp_vma && tmp_vma->begin < new_vma->end) {
@@ -596,7 +758,7 @@ int init_vma(void) {
     }
     assert(1 + idx == ARRAY_SIZE(init_vmas));
 
-    spinlock_lock(&vma_tree_lock);
+    write_seqbegin(&vma_tree_lock);
     int ret = 0;
     /* First of init_vmas is reserved for later usage. */
     for (size_t i = 1; i < ARRAY_SIZE(init_vmas); i++) {
@@ -622,7 +784,7 @@ int init_vma(void) {
         log_debug("Initial VMA region 0x%lx-0x%lx (%s) bookkeeped", init_vmas[i].begin,
                   init_vmas[i].end, init_vmas[i].comment);
     }
-    spinlock_unlock(&vma_tree_lock);
+    write_seqend(&vma_tree_lock);
     /* From now on if we return with an error we might leave a structure local to this function in
      * vma_tree. We do not bother with removing them - this is initialization of VMA subsystem, if
      * it fails the whole application startup fails and we should never call any of functions in
@@ -680,7 +842,7 @@ int init_vma(void) {
         }
     }
 
-    spinlock_lock(&vma_tree_lock);
+    write_seqbegin(&vma_tree_lock);
     for (size_t i = 0; i < ARRAY_SIZE(init_vmas); i++) {
         /* Skip empty areas. */
         if (init_vmas[i].begin == init_vmas[i].end) {
@@ -690,7 +852,7 @@ int init_vma(void) {
         avl_tree_swap_node(&vma_tree, &init_vmas[i].tree_node, &vmas_to_migrate_to[i]->tree_node);
         vmas_to_migrate_to[i] = NULL;
     }
-    spinlock_unlock(&vma_tree_lock);
+    write_seqend(&vma_tree_lock);
 
     for (size_t i = 0; i < ARRAY_SIZE(vmas_to_migrate_to); i++) {
         if (vmas_to_migrate_to[i]) {
@@ -702,7 +864,7 @@ int init_vma(void) {
 }
 
 static void _add_unmapped_vma(uintptr_t begin, uintptr_t end, struct libos_vma* vma) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
 
     vma->begin  = begin;
     vma->end    = end;
@@ -733,7 +895,7 @@ int bkeep_munmap(void* addr, size_t length, bool is_internal, void** tmp_vma_ptr
 
     struct libos_vma* vmas_to_free = NULL;
 
-    spinlock_lock(&vma_tree_lock);
+    write_seqbegin(&vma_tree_lock);
     int ret = _vma_bkeep_remove((uintptr_t)addr, (uintptr_t)addr + length, is_internal,
                                 vma2 ? &vma2 : NULL, &vmas_to_free);
     if (ret >= 0) {
@@ -741,7 +903,7 @@ int bkeep_munmap(void* addr, size_t length, bool is_internal, void** tmp_vma_ptr
         *tmp_vma_ptr = (void*)vma1;
         vma1 = NULL;
     }
-    spinlock_unlock(&vma_tree_lock);
+    write_seqend(&vma_tree_lock);
 
     free_vmas_freelist(vmas_to_free);
     if (vma1) {
@@ -765,10 +927,10 @@ void bkeep_remove_tmp_vma(void* _vma) {
 
     assert(vma->flags == (VMA_INTERNAL | VMA_UNMAPPED));
 
-    spinlock_lock(&vma_tree_lock);
+    write_seqbegin(&vma_tree_lock);
     avl_tree_delete(&vma_tree, &vma->tree_node);
     total_memory_size_sub(vma->end - vma->begin);
-    spinlock_unlock(&vma_tree_lock);
+    write_seqend(&vma_tree_lock);
 
     free_vma(vma);
 }
@@ -776,10 +938,10 @@ void bkeep_remove_tmp_vma(void* _vma) {
 void bkeep_convert_tmp_vma_to_user(void* _vma) {
     struct libos_vma* vma = (struct libos_vma*)_vma;
 
-    spinlock_lock(&vma_tree_lock);
+    write_seqbegin(&vma_tree_lock);
     assert(vma->flags == (VMA_INTERNAL | VMA_UNMAPPED));
     vma->flags &= ~VMA_INTERNAL;
-    spinlock_unlock(&vma_tree_lock);
+    write_seqend(&vma_tree_lock);
 }
 
 static bool is_file_prot_matching(struct libos_handle* file_hdl, int prot) {
@@ -816,7 +978,7 @@ int bkeep_mmap_fixed(void* addr, size_t length, int prot, int flags, struct libo
 
     struct libos_vma* vmas_to_free = NULL;
 
-    spinlock_lock(&vma_tree_lock);
+    write_seqbegin(&vma_tree_lock);
     int ret = 0;
     if (flags & MAP_FIXED_NOREPLACE) {
         struct libos_vma* tmp_vma = _lookup_vma(new_vma->begin);
@@ -831,7 +993,7 @@ int bkeep_mmap_fixed(void* addr, size_t length, int prot, int flags, struct libo
         avl_tree_insert(&vma_tree, &new_vma->tree_node);
         total_memory_size_add(new_vma->end - new_vma->begin);
     }
-    spinlock_unlock(&vma_tree_lock);
+    write_seqend(&vma_tree_lock);
 
     free_vmas_freelist(vmas_to_free);
     if (vma1) {
@@ -853,7 +1015,7 @@ static void vma_update_prot(struct libos_vma* vma, int prot) {
 
 static int _vma_bkeep_change(uintptr_t begin, uintptr_t end, int prot, bool is_internal,
                              struct libos_vma** new_vma_ptr1, struct libos_vma** new_vma_ptr2) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
     assert(IS_ALLOC_ALIGNED_PTR(begin) && IS_ALLOC_ALIGNED_PTR(end));
     assert(begin < end);
 
@@ -982,10 +1144,10 @@ int bkeep_mprotect(void* addr, size_t length, int prot, bool is_internal) {
         return -ENOMEM;
     }
 
-    spinlock_lock(&vma_tree_lock);
+    write_seqbegin(&vma_tree_lock);
     int ret = _vma_bkeep_change((uintptr_t)addr, (uintptr_t)addr + length, prot, is_internal, &vma1,
                                 &vma2);
-    spinlock_unlock(&vma_tree_lock);
+    write_seqend(&vma_tree_lock);
 
     if (vma1) {
         free_vma(vma1);
@@ -997,12 +1159,55 @@ int bkeep_mprotect(void* addr, size_t length, int prot, bool is_internal) {
     return ret;
 }
 
-/* TODO consider:
- * maybe it's worth to keep another tree, complementary to `vma_tree`, that would hold free areas.
- * It would give O(logn) unmapped lookup, which now is O(n) in the worst case, but it would also
- * double the memory usage of this subsystem and add some complexity.
- * Another idea is to merge adjacent vmas, that are not backed by any file and have the same prot
- * and flags (the question is whether that happens often). */
+/*
+ * Finds the highest address aligned to `alignment`, such that `[addr; addr + length)` is inside
+ * `[bottom_addr; top_addr)` and does not overlap any vma. Only holes in the subtree rooted at `vma`
+ * are considered, including the ones between the subtree and its neighbours: `prev_end` is the end
+ * of the closest vma before the subtree (or 0) and `next_begin` is the begin of the closest vma
+ * after it (or `UINTPTR_MAX`).
+ *
+ * Subtrees whose largest hole is too small or which lie outside of the range are skipped, so this
+ * is O(log(n)) unless many holes are big enough but unusable due to alignment.
+ */
+static bool _find_free_range(struct avl_tree_node* node, uintptr_t prev_end, uintptr_t next_begin,
+                             uintptr_t bottom_addr, uintptr_t top_addr, size_t length,
+                             size_t alignment, uintptr_t* out_addr) {
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
+
+    if (next_begin <= bottom_addr || top_addr <= prev_end) {
+        return false;
+    }
+
+    if (!node) {
+        uintptr_t low = MAX(prev_end, bottom_addr);
+        uintptr_t high = MIN(next_begin, top_addr);
+        if (high - low < length) {
+            return false;
+        }
+        uintptr_t addr = ALIGN_DOWN_POW2(high - length, alignment);
+        if (addr < low) {
+            return false;
+        }
+        *out_addr = addr;
+        return true;
+    }
+
+    struct libos_vma* vma = container_of(node, struct libos_vma, tree_node);
+    size_t max_gap = MAX(vma->subtree_max_gap, MAX(vma->subtree_begin - prev_end,
+                                                   next_begin - vma->subtree_end));
+    if (max_gap < length) {
+        return false;
+    }
+
+    /* Higher addresses first. */
+    return _find_free_range(node->right, vma->end, next_begin, bottom_addr, top_addr, length,
+                            alignment, out_addr)
+           || _find_free_range(node->left, prev_end, vma->begin, bottom_addr, top_addr, length,
+                               alignment, out_addr);
+}
+
+/* TODO consider: merging adjacent vmas, that are not backed by any file and have the same prot and
+ * flags (the question is whether that happens often). */
 /* This function allocates at most 1 vma. If in the future it uses more, `_vma_malloc` should be
  * updated as well. */
 int bkeep_mmap_any_in_range(void* _bottom_addr, void* _top_addr, size_t length, int prot, int flags,
@@ -1050,6 +1255,11 @@ int bkeep_mmap_any_in_range(void* _bottom_addr, void* _top_addr, size_t length,
     }
 #endif
 
+    size_t alignment = ALLOC_ALIGNMENT;
+    if ((flags & MAP_ANONYMOUS) && mmap_huge_page_size(flags)) {
+        alignment = mmap_huge_page_size(flags);
+    }
+
     struct libos_vma* new_vma = alloc_vma();
     if (!new_vma) {
         return -ENOMEM;
@@ -1065,37 +1275,17 @@ int bkeep_mmap_any_in_range(void* _bottom_addr, void* _top_addr, size_t length,
     new_vma->offset = file ? offset : 0;
     copy_comment(new_vma, comment ?: "");
 
-    spinlock_lock(&vma_tree_lock);
+    write_seqbegin(&vma_tree_lock);
 
-    struct libos_vma* vma = _lookup_vma(top_addr);
-    uintptr_t max_addr;
-    if (!vma) {
-        vma = _get_last_vma();
-        max_addr = top_addr;
-    } else {
-        max_addr = MIN(top_addr, vma->begin);
-        vma = _get_prev_vma(vma);
-    }
-    assert(!vma || vma->end <= max_addr);
-
-    while (vma && bottom_addr <= vma->end) {
-        assert(vma->end <= max_addr);
-        if (max_addr - vma->end >= length) {
-            goto out_found;
-        }
-
-        max_addr = vma->begin;
-        vma = _get_prev_vma(vma);
-    }
-
-    if (!(bottom_addr <= max_addr && max_addr - bottom_addr >= length)) {
+    uintptr_t addr;
+    if (!_find_free_range(vma_tree.root, /*prev_end=*/0, /*next_begin=*/UINTPTR_MAX, bottom_addr,
+                          top_addr, length, alignment, &addr)) {
         ret = -ENOMEM;
         goto out;
     }
 
-out_found:
-    new_vma->end   = max_addr;
-    new_vma->begin = new_vma->end - length;
+    new_vma->begin = addr;
+    new_vma->end   = new_vma->begin + length;
 
     avl_tree_insert(&vma_tree, &new_vma->tree_node);
     total_memory_size_add(new_vma->end - new_vma->begin);
@@ -1104,7 +1294,7 @@ out_found:
     new_vma = NULL;
 
 out:
-    spinlock_unlock(&vma_tree_lock);
+    write_seqend(&vma_tree_lock);
     if (new_vma) {
         free_vma(new_vma);
     }
@@ -1156,25 +1346,57 @@ static int pal_mem_bkeep_free(uintptr_t addr, size_t size) {
     return 0;
 }
 
-static void dump_vma(struct libos_vma_info* vma_info, struct libos_vma* vma) {
+/* Copies `vma` into `vma_info` without taking a reference to the file. */
+static void copy_vma_info(struct libos_vma_info* vma_info, struct libos_vma* vma) {
     vma_info->addr        = (void*)vma->begin;
     vma_info->length      = vma->end - vma->begin;
     vma_info->prot        = vma->prot;
     vma_info->flags       = vma->flags;
     vma_info->file_offset = vma->offset;
     vma_info->file        = vma->file;
+    static_assert(sizeof(vma_info->comment) == sizeof(vma->comment), "Comments sizes do not match");
+    memcpy(vma_info->comment, vma->comment, sizeof(vma_info->comment));
+}
+
+static void dump_vma(struct libos_vma_info* vma_info, struct libos_vma* vma) {
+    copy_vma_info(vma_info, vma);
     if (vma_info->file) {
         get_handle(vma_info->file);
     }
-    static_assert(sizeof(vma_info->comment) == sizeof(vma->comment), "Comments sizes do not match");
-    memcpy(vma_info->comment, vma->comment, sizeof(vma_info->comment));
 }
 
 int lookup_vma(void* addr, struct libos_vma_info* vma_info) {
     assert(vma_info);
     int ret = 0;
 
-    spinlock_lock(&vma_tree_lock);
+    for (size_t i = 0; i < VMA_LOCKLESS_TRIES; i++) {
+        uint32_t seq = read_seqbegin(&vma_tree_lock);
+
+        struct libos_vma* vma;
+        if (!_lookup_vma_lockless((uintptr_t)addr, &vma)) {
+            continue;
+        }
+        bool found = vma && is_addr_in_vma((uintptr_t)addr, vma);
+        struct libos_vma_info info;
+        if (found) {
+            copy_vma_info(&info, vma);
+        }
+
+        if (read_seqretry(&vma_tree_lock, seq)) {
+            continue;
+        }
+        if (!found) {
+            return -ENOENT;
+        }
+        if (info.file) {
+            /* A reference to the file cannot be taken locklessly, the vma could be gone already. */
+            break;
+        }
+        *vma_info = info;
+        return 0;
+    }
+
+    read_seqlock_excl(&vma_tree_lock);
     struct libos_vma* vma = _lookup_vma((uintptr_t)addr);
     if (!vma || !is_addr_in_vma((uintptr_t)addr, vma)) {
         ret = -ENOENT;
@@ -1184,7 +1406,7 @@ int lookup_vma(void* addr, struct libos_vma_info* vma_info) {
     dump_vma(vma_info, vma);
 
 out:
-    spinlock_unlock(&vma_tree_lock);
+    read_sequnlock_excl(&vma_tree_lock);
     return ret;
 }
 
@@ -1206,14 +1428,29 @@ bool is_in_adjacent_user_vmas(const void* addr, size_t length, int prot) {
     uintptr_t end = begin + length;
     assert(begin <= end);
 
-    struct adj_visitor_ctx ctx = {
+    struct adj_visitor_ctx ctx;
+    bool is_continuous;
+
+    for (size_t i = 0; i < VMA_LOCKLESS_TRIES; i++) {
+        uint32_t seq = read_seqbegin(&vma_tree_lock);
+        ctx = (struct adj_visitor_ctx){
+            .prot = prot,
+            .is_ok = true,
+        };
+        if (_traverse_vmas_in_range_lockless(begin, end, adj_visitor, &ctx, seq, &is_continuous)
+                && !read_seqretry(&vma_tree_lock, seq)) {
+            return is_continuous && ctx.is_ok;
+        }
+    }
+
+    ctx = (struct adj_visitor_ctx){
         .prot = prot,
         .is_ok = true,
     };
 
-    spinlock_lock(&vma_tree_lock);
-    bool is_continuous = _traverse_vmas_in_range(begin, end, adj_visitor, &ctx);
-    spinlock_unlock(&vma_tree_lock);
+    read_seqlock_excl(&vma_tree_lock);
+    is_continuous = _traverse_vmas_in_range(begin, end, adj_visitor, &ctx);
+    read_sequnlock_excl(&vma_tree_lock);
 
     return is_continuous && ctx.is_ok;
 }
@@ -1224,7 +1461,7 @@ static size_t dump_vmas_with_buf(struct libos_vma_info* infos, size_t max_count,
     size_t size = 0;
     struct libos_vma_info* vma_info = infos;
 
-    spinlock_lock(&vma_tree_lock);
+    read_seqlock_excl(&vma_tree_lock);
     struct libos_vma* vma;
 
     for (vma = _lookup_vma(begin); vma && vma->begin < end; vma = _get_next_vma(vma)) {
@@ -1237,7 +1474,7 @@ static size_t dump_vmas_with_buf(struct libos_vma_info* infos, size_t max_count,
         size++;
     }
 
-    spinlock_unlock(&vma_tree_lock);
+    read_sequnlock_excl(&vma_tree_lock);
 
     return size;
 }
@@ -1266,14 +1503,14 @@ static int dump_vmas(struct libos_vma_info** out_infos, size_t* out_count,
 }
 
 static bool vma_filter_all(struct libos_vma* vma, void* arg) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
     __UNUSED(arg);
 
     return !(vma->flags & VMA_INTERNAL);
 }
 
 static bool vma_filter_exclude_unmapped(struct libos_vma* vma, void* arg) {
-    assert(spinlock_is_locked(&vma_tree_lock));
+    assert(spinlock_is_locked(&vma_tree_lock.lock));
     __UNUSED(arg);
 
     return !(vma->flags & (VMA_INTERNAL | VMA_UNMAPPED));
@@ -1362,9 +1599,9 @@ int madvise_dontneed_range(uintptr_t begin, uintptr_t end) {
         .error = 0,
     };
 
-    spinlock_lock(&vma_tree_lock);
+    read_seqlock_excl(&vma_tree_lock);
     bool is_continuous = _traverse_vmas_in_range(begin, end, madvise_dontneed_visitor, &ctx);
-    spinlock_unlock(&vma_tree_lock);
+    read_sequnlock_excl(&vma_tree_lock);
 
     if (!is_continuous)
         return -ENOMEM;
@@ -1701,7 +1938,7 @@ static void debug_print_vma(struct libos_vma* vma) {
 }
 
 void debug_print_all_vmas(void) {
-    spinlock_lock(&vma_tree_lock);
+    read_seqlock_excl(&vma_tree_lock);
 
     struct libos_vma* vma = _get_first_vma();
     while (vma) {
@@ -1709,7 +1946,7 @@ void debug_print_all_vmas(void) {
         vma = _get_next_vma(vma);
     }
 
-    spinlock_unlock(&vma_tree_lock);
+    read_sequnlock_excl(&vma_tree_lock);
 }
 
 size_t get_peak_memory_usage(void) {
@@ -1717,9 +1954,9 @@ size_t get_peak_memory_usage(void) {
 }
 
 size_t get_total_memory_usage(void) {
-    spinlock_lock(&vma_tree_lock);
+    read_seqlock_excl(&vma_tree_lock);
     size_t total_memory_size = g_total_memory_size;
-    spinlock_unlock(&vma_tree_lock);
+    read_sequnlock_excl(&vma_tree_lock);
     /* This memory accounting is just a simple heuristic, which does not account swap, reserved
      * memory, unmapped VMAs etc. */
     return MIN(total_memory_size, g_pal_public_state->mem_total);
@@ -67,6 +67,9 @@ int init_fs(void) {
 
     INIT_LISTP(&g_mount_list);
 
+    if ((ret = init_mem_files()) < 0)
+        goto err;
+
     if ((ret = init_encrypted_files()) < 0)
         goto err;
 
@@ -3,46 +3,198 @@
  *                    Paweł Marczewski <pawel@invisiblethingslab.com>
  */
 
+/*
+ * In-memory file data is kept in a radix tree of fixed-size blocks. Leaves are data pages, inner
+ * nodes are arrays of `MEM_FILE_NODE_SLOTS` pointers to the level below. A tree of height `h`
+ * covers page numbers `0 .. MEM_FILE_NODE_SLOTS^h - 1`; the tree grows at the root when a write goes
+ * past that range. Missing pages (NULL slots) are holes and read as zeros.
+ *
+ * Data pages are allocated directly from the system (they are page-sized, so the slab allocator
+ * would round them up to its next size class) and are returned to the system once freed, so that
+ * deleting or truncating a big file releases its memory. Inner nodes are rare (one per 512 pages)
+ * and are served by a fixed-size allocator that keeps freed nodes for reuse.
+ */
+
 #include "api.h"
+#include "asan.h"
 #include "libos_fs.h"
 #include "libos_fs_mem.h"
+#include "libos_internal.h"
+#include "libos_lock.h"
 
-/* Minimum allocation size in `slabmgr.h` */
-#define MIN_RESIZE ((size_t)16)
+#define MEM_FILE_PAGE_SHIFT 12
+#define MEM_FILE_PAGE_SIZE  ((size_t)1 << MEM_FILE_PAGE_SHIFT)
+#define MEM_FILE_NODE_SHIFT (MEM_FILE_PAGE_SHIFT - 3)
+#define MEM_FILE_NODE_SLOTS ((size_t)1 << MEM_FILE_NODE_SHIFT)
 
-static int mem_file_resize(struct libos_mem_file* mem, size_t buf_size) {
-    assert(buf_size > 0);
+/* Enough levels to cover any non-negative `file_off_t` */
+#define MEM_FILE_MAX_HEIGHT                                                                  \
+    ((sizeof(file_off_t) * 8 - 1 - MEM_FILE_PAGE_SHIFT + MEM_FILE_NODE_SHIFT - 1)            \
+     / MEM_FILE_NODE_SHIFT)
 
-    char* buf = malloc(buf_size);
-    if (!buf)
-        return -ENOMEM;
+union mem_file_block {
+    char data[MEM_FILE_PAGE_SIZE];
+    union mem_file_block* slots[MEM_FILE_NODE_SLOTS];
+};
+
+static_assert(sizeof(union mem_file_block) == MEM_FILE_PAGE_SIZE, "unexpected block size");
+
+static struct libos_lock g_mem_file_mgr_lock;
+
+#define SYSTEM_LOCK()   lock(&g_mem_file_mgr_lock)
+#define SYSTEM_UNLOCK() unlock(&g_mem_file_mgr_lock)
+#define SYSTEM_LOCKED() locked(&g_mem_file_mgr_lock)
+
+#define MEM_FILE_MGR_ALLOC 64
+
+#define OBJ_TYPE union mem_file_block
+#include "memmgr.h"
 
-    size_t min_size = MIN(buf_size, (size_t)mem->size);
-    memcpy(buf, mem->buf, min_size);
+static MEM_MGR g_mem_file_mgr = NULL;
 
-    /* if the new buffer is larger, zero out the new portion */
-    if (buf_size > min_size)
-        memset(buf + min_size, 0, buf_size - min_size);
+int init_mem_files(void) {
+    if (!create_lock(&g_mem_file_mgr_lock))
+        return -ENOMEM;
 
-    free(mem->buf);
-    mem->buf = buf;
-    mem->buf_size = buf_size;
+    g_mem_file_mgr = create_mem_mgr(init_align_up(MEM_FILE_MGR_ALLOC));
+    if (!g_mem_file_mgr) {
+        destroy_lock(&g_mem_file_mgr_lock);
+        return -ENOMEM;
+    }
     return 0;
 }
 
-void mem_file_init(struct libos_mem_file* mem, char* data, size_t size) {
-    assert(!OVERFLOWS(file_off_t, size));
+static union mem_file_block* alloc_node(void) {
+    union mem_file_block* node =
+        get_mem_obj_from_mgr_enlarge(g_mem_file_mgr, size_align_up(MEM_FILE_MGR_ALLOC));
+    if (!node)
+        return NULL;
+    memset(node, 0, sizeof(*node));
+    return node;
+}
+
+static void free_node(union mem_file_block* node) {
+    free_mem_obj_to_mgr(g_mem_file_mgr, node);
+}
 
-    mem->buf = data;
-    mem->buf_size = size;
-    mem->size = size;
+/* Returns a zeroed data page */
+static union mem_file_block* alloc_page(void) {
+    union mem_file_block* page = system_malloc(MEM_FILE_PAGE_SIZE);
+    if (!page)
+        return NULL;
+#ifdef ASAN
+    asan_unpoison_region((uintptr_t)page, MEM_FILE_PAGE_SIZE);
+#endif
+    return page;
+}
+
+static void free_page(union mem_file_block* page) {
+    system_free(page, MEM_FILE_PAGE_SIZE);
+}
+
+/* Allocates a block for a slot at given height (data page at height 0, inner node otherwise) */
+static union mem_file_block* alloc_block(unsigned int height) {
+    return height ? alloc_node() : alloc_page();
+}
+
+static void free_block(union mem_file_block* block, unsigned int height) {
+    if (height)
+        free_node(block);
+    else
+        free_page(block);
+}
+
+/* Number of pages covered by a subtree of given height */
+static uint64_t subtree_pages(unsigned int height) {
+    assert(height <= MEM_FILE_MAX_HEIGHT);
+    return (uint64_t)1 << (height * MEM_FILE_NODE_SHIFT);
+}
+
+static size_t slot_index(uint64_t page_idx, unsigned int height) {
+    assert(height > 0);
+    return (page_idx >> ((height - 1) * MEM_FILE_NODE_SHIFT)) & (MEM_FILE_NODE_SLOTS - 1);
+}
+
+static bool is_zero(const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        if (data[i])
+            return false;
+    return true;
+}
+
+static char* lookup_page(struct libos_mem_file* mem, uint64_t page_idx) {
+    if (page_idx >= subtree_pages(mem->height))
+        return NULL;
+
+    union mem_file_block* block = mem->root;
+    for (unsigned int height = mem->height; block && height > 0; height--)
+        block = block->slots[slot_index(page_idx, height)];
+    return block ? block->data : NULL;
+}
+
+/* Returns the page with given index, allocating it (and the path to it) if it's a hole. */
+static char* get_page(struct libos_mem_file* mem, uint64_t page_idx) {
+    while (page_idx >= subtree_pages(mem->height)) {
+        if (mem->root) {
+            union mem_file_block* node = alloc_node();
+            if (!node)
+                return NULL;
+            node->slots[0] = mem->root;
+            mem->root = node;
+        }
+        mem->height++;
+    }
+
+    union mem_file_block** slot = &mem->root;
+    for (unsigned int height = mem->height; ; height--) {
+        if (!*slot) {
+            *slot = alloc_block(height);
+            if (!*slot)
+                return NULL;
+        }
+        if (height == 0)
+            break;
+        slot = &(*slot)->slots[slot_index(page_idx, height)];
+    }
+    return (*slot)->data;
+}
+
+/* Frees all pages with index `first_page` or higher in the subtree at `*slot`, and any inner nodes
+ * left empty. */
+static void free_pages_from(union mem_file_block** slot, unsigned int height, uint64_t first_page) {
+    union mem_file_block* block = *slot;
+    if (!block)
+        return;
+
+    if (height > 0) {
+        uint64_t child_pages = subtree_pages(height - 1);
+        size_t start = first_page == 0 ? 0 : slot_index(first_page, height);
+        for (size_t i = start; i < MEM_FILE_NODE_SLOTS; i++) {
+            uint64_t child_first = i == start ? first_page & (child_pages - 1) : 0;
+            free_pages_from(&block->slots[i], height - 1, child_first);
+        }
+    }
+
+    if (first_page == 0) {
+        free_block(block, height);
+        *slot = NULL;
+    }
+}
+
+void mem_file_init(struct libos_mem_file* mem) {
+    mem->size = 0;
+    mem->root = NULL;
+    mem->height = 0;
 }
 
 void mem_file_destroy(struct libos_mem_file* mem) {
-    free(mem->buf);
+    free_pages_from(&mem->root, mem->height, /*first_page=*/0);
+    mem->height = 0;
+    mem->size = 0;
 }
 
-ssize_t mem_file_read(struct libos_mem_file* mem, file_off_t pos_start, void* buf, size_t size) {
+static ssize_t do_read(struct libos_mem_file* mem, file_off_t pos_start, void* buf, size_t size,
+                       bool buf_zeroed) {
     assert(pos_start >= 0);
 
     file_off_t pos_end;
@@ -50,11 +202,34 @@ ssize_t mem_file_read(struct libos_mem_file* mem, file_off_t pos_start, void* bu
         pos_end = mem->size;
 
     size = pos_end >= pos_start ? pos_end - pos_start : 0;
-    if (size > 0)
-        memcpy(buf, mem->buf + pos_start, size);
+
+    file_off_t pos = pos_start;
+    char* out = buf;
+    while (pos < pos_end) {
+        size_t page_off = pos & (MEM_FILE_PAGE_SIZE - 1);
+        size_t chunk = MIN(MEM_FILE_PAGE_SIZE - page_off, (size_t)(pos_end - pos));
+
+        char* page = lookup_page(mem, (uint64_t)pos >> MEM_FILE_PAGE_SHIFT);
+        if (page) {
+            memcpy(out, page + page_off, chunk);
+        } else if (!buf_zeroed) {
+            memset(out, 0, chunk);
+        }
+        pos += chunk;
+        out += chunk;
+    }
     return size;
 }
 
+ssize_t mem_file_read(struct libos_mem_file* mem, file_off_t pos_start, void* buf, size_t size) {
+    return do_read(mem, pos_start, buf, size, /*buf_zeroed=*/false);
+}
+
+ssize_t mem_file_read_into_zeroed(struct libos_mem_file* mem, file_off_t pos_start, void* buf,
+                                  size_t size) {
+    return do_read(mem, pos_start, buf, size, /*buf_zeroed=*/true);
+}
+
 ssize_t mem_file_write(struct libos_mem_file* mem, file_off_t pos_start, const void* buf,
                        size_t size) {
     assert(pos_start >= 0);
@@ -63,56 +238,63 @@ ssize_t mem_file_write(struct libos_mem_file* mem, file_off_t pos_start, const v
     if (__builtin_add_overflow(pos_start, size, &pos_end))
         return -EFBIG;
 
-    if (OVERFLOWS(size_t, pos_end))
-        return -EFBIG;
+    file_off_t pos = pos_start;
+    const char* in = buf;
+    while (pos < pos_end) {
+        size_t page_off = pos & (MEM_FILE_PAGE_SIZE - 1);
+        size_t chunk = MIN(MEM_FILE_PAGE_SIZE - page_off, (size_t)(pos_end - pos));
+        uint64_t page_idx = (uint64_t)pos >> MEM_FILE_PAGE_SHIFT;
 
-    if (size > 0) {
-        if (mem->buf_size < (size_t)pos_end) {
-            size_t buf_size = MAX(mem->buf_size, MIN_RESIZE);
-            while (buf_size < (size_t)pos_end)
-                if (__builtin_mul_overflow(buf_size, 2, &buf_size))
-                    return -EFBIG;
+        char* page = lookup_page(mem, page_idx);
+        if (!page) {
+            /* Writing a whole page of zeros into a hole (e.g. on `msync` of a sparse mapping)
+             * doesn't change its contents, so keep it unallocated. */
+            if (chunk == MEM_FILE_PAGE_SIZE && is_zero(in, chunk))
+                goto next;
 
-            int ret = mem_file_resize(mem, buf_size);
-            if (ret < 0)
-                return ret;
+            page = get_page(mem, page_idx);
+            if (!page) {
+                if (pos == pos_start)
+                    return -ENOMEM;
+                break;
+            }
         }
-        assert((size_t)pos_end <= mem->buf_size);
-        if (pos_end > mem->size)
-            mem->size = pos_end;
-        memcpy(mem->buf + pos_start, buf, size);
+        memcpy(page + page_off, in, chunk);
+    next:
+        pos += chunk;
+        in += chunk;
     }
 
-    return size;
+    if (pos > mem->size)
+        mem->size = pos;
+    return pos - pos_start;
 }
 
 int mem_file_truncate(struct libos_mem_file* mem, file_off_t size) {
     assert(size >= 0);
 
-    if (OVERFLOWS(size_t, size))
-        return -EFBIG;
+    if (size < mem->size) {
+        uint64_t num_pages = ALIGN_UP_POW2((uint64_t)size, MEM_FILE_PAGE_SIZE)
+                             >> MEM_FILE_PAGE_SHIFT;
+        if (num_pages < subtree_pages(mem->height))
+            free_pages_from(&mem->root, mem->height, num_pages);
+
+        /* Zero the tail of the last page, so that it reads as zeros if the file grows again */
+        size_t page_off = size & (MEM_FILE_PAGE_SIZE - 1);
+        char* page = page_off ? lookup_page(mem, num_pages - 1) : NULL;
+        if (page)
+            memset(page + page_off, 0, MEM_FILE_PAGE_SIZE - page_off);
 
-    size_t buf_size = mem->buf_size;
-    if (buf_size < (size_t)size) {
-        buf_size = MAX(buf_size, MIN_RESIZE);
-        while (buf_size < (size_t)size) {
-            if (__builtin_mul_overflow(buf_size, 2, &buf_size))
-                return -EFBIG;
+        /* Shrink the tree while the root only has the first slot in use */
+        while (mem->height > 0 && (!mem->root || num_pages <= subtree_pages(mem->height - 1))) {
+            union mem_file_block* root = mem->root;
+            mem->root = root ? root->slots[0] : NULL;
+            if (root)
+                free_node(root);
+            mem->height--;
         }
-    } else if (size > 0) {
-        while (buf_size / 2 >= (size_t)size)
-            buf_size /= 2;
-        buf_size = MAX(buf_size, MIN_RESIZE);
-    } else {
-        buf_size = MIN_RESIZE;
     }
 
-    assert((size_t)size <= buf_size);
-    if (buf_size != mem->buf_size) {
-        int ret = mem_file_resize(mem, buf_size);
-        if (ret < 0)
-            return ret;
-    }
     mem->size = size;
     return 0;
 }
@@ -138,9 +138,17 @@ static int pseudo_open(struct libos_handle* hdl, struct libos_dentry* dent, int
                 str = NULL;
             }
 
+            struct libos_mem_file* mem = &hdl->info.str.mem;
+            mem_file_init(mem);
+            ssize_t written = len > 0 ? mem_file_write(mem, /*pos_start=*/0, str, len) : 0;
+            free(str);
+            if (written < 0 || (size_t)written < len) {
+                mem_file_destroy(mem);
+                return written < 0 ? written : -ENOMEM;
+            }
+
             hdl->type = TYPE_STR;
             hdl->seekable = true;
-            mem_file_init(&hdl->info.str.mem, str, len);
             hdl->pos = 0;
             break;
         }
@@ -169,6 +169,8 @@ static int pipe_setflags(struct libos_handle* handle, unsigned int flags, unsign
     bool nonblocking = flags & O_NONBLOCK;
     if (attr.nonblocking != nonblocking) {
         attr.nonblocking = nonblocking;
+        /* don't touch the buffer size, it may be changed concurrently via the other pipe end */
+        attr.pipe.buf_size = 0;
         ret = PalStreamAttributesSetByHandle(handle->pal_handle, &attr);
         if (ret < 0) {
             ret = pal_to_unix_errno(ret);
@@ -14,6 +14,7 @@
  * the `data` field of the inode (as a pointer to `struct libos_mem_file`).
  */
 
+#include "libos_flags_conv.h"
 #include "libos_fs.h"
 #include "libos_handle.h"
 #include "libos_lock.h"
@@ -37,7 +38,7 @@ static int tmpfs_setup_dentry(struct libos_dentry* dent, mode_t type, mode_t per
         put_inode(inode);
         return -ENOMEM;
     }
-    mem_file_init(mem, /*data=*/NULL, /*size=*/0);
+    mem_file_init(mem);
     inode->data = mem;
 
     uint64_t time_us;
@@ -80,7 +81,9 @@ static int tmpfs_icheckpoint(struct libos_inode* inode, void** out_data, size_t*
     if (!cp)
         return -ENOMEM;
     cp->size = mem->size;
-    memcpy(cp->data, mem->buf, mem->size);
+    ssize_t ret = mem_file_read(mem, /*pos_start=*/0, cp->data, mem->size);
+    assert(ret == mem->size);
+    __UNUSED(ret);
 
     *out_data = cp;
     *out_size = cp_size;
@@ -93,14 +96,15 @@ static int tmpfs_irestore(struct libos_inode* inode, void* data) {
     struct libos_mem_file* mem = malloc(sizeof(*mem));
     if (!mem)
         return -ENOMEM;
-    mem->buf = malloc(cp->size);
-    if (!mem->buf) {
+    mem_file_init(mem);
+
+    /* Pages of zeros are not written, so holes in the original file stay unallocated */
+    ssize_t ret = mem_file_write(mem, /*pos_start=*/0, cp->data, cp->size);
+    if (ret < 0 || (size_t)ret < cp->size) {
+        mem_file_destroy(mem);
         free(mem);
         return -ENOMEM;
     }
-    memcpy(mem->buf, cp->data, cp->size);
-    mem->size = cp->size;
-    mem->buf_size = cp->size;
 
     inode->data = mem;
     return 0;
@@ -308,6 +312,46 @@ out:
     return ret;
 }
 
+/* Same as `generic_emulated_mmap`, but copies only the allocated pages of the file: the memory
+ * returned by `PalVirtualMemoryAlloc` is already zeroed, so holes are left untouched. */
+static int tmpfs_mmap(struct libos_handle* hdl, void* addr, size_t size, int prot, int flags,
+                      uint64_t offset) {
+    assert(addr);
+    assert(hdl->type == TYPE_TMPFS);
+
+    int ret;
+
+    pal_prot_flags_t pal_prot = LINUX_PROT_TO_PAL(prot, flags);
+    pal_prot_flags_t pal_prot_writable = pal_prot | PAL_PROT_WRITE;
+
+    ret = PalVirtualMemoryAlloc(addr, size, pal_prot_writable);
+    if (ret < 0)
+        return pal_to_unix_errno(ret);
+
+    if (!OVERFLOWS(file_off_t, offset)) {
+        lock(&hdl->inode->lock);
+        ssize_t count = mem_file_read_into_zeroed(hdl->inode->data, offset, addr, size);
+        unlock(&hdl->inode->lock);
+        assert(count >= 0);
+        __UNUSED(count);
+    }
+
+    if (pal_prot != pal_prot_writable) {
+        ret = PalVirtualMemoryProtect(addr, size, pal_prot);
+        if (ret < 0) {
+            ret = pal_to_unix_errno(ret);
+            int free_ret = PalVirtualMemoryFree(addr, size);
+            if (free_ret < 0) {
+                log_debug("PalVirtualMemoryFree failed on cleanup: %s", pal_strerror(free_ret));
+                BUG();
+            }
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 struct libos_fs_ops tmp_fs_ops = {
     .mount    = &tmpfs_mount,
     .flush    = &tmpfs_flush,
@@ -317,7 +361,7 @@ struct libos_fs_ops tmp_fs_ops = {
     .hstat    = &generic_inode_hstat,
     .truncate = &tmpfs_truncate,
     .poll     = &generic_inode_poll,
-    .mmap     = &generic_emulated_mmap,
+    .mmap     = &tmpfs_mmap,
     .msync    = &generic_emulated_msync,
     .fchmod   = &tmpfs_fchmod,
 };
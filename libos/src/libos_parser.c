@@ -506,10 +506,13 @@ struct parser_table {
                               parse_pointer_arg, parse_pointer_arg}},
     [__NR_get_robust_list] = {.slow = false, .name = "get_robust_list", .parser = {parse_long_arg,
                               parse_integer_arg, parse_pointer_arg, parse_pointer_arg}},
-    [__NR_splice] = {.slow = false, .name = "splice", .parser = {NULL}},
+    [__NR_splice] = {.slow = true, .name = "splice", .parser = {parse_long_arg, parse_integer_arg,
+                     parse_pointer_arg, parse_integer_arg, parse_pointer_arg, parse_integer_arg,
+                     parse_integer_arg}},
     [__NR_tee] = {.slow = false, .name = "tee", .parser = {NULL}},
     [__NR_sync_file_range] = {.slow = false, .name = "sync_file_range", .parser = {NULL}},
-    [__NR_vmsplice] = {.slow = false, .name = "vmsplice", .parser = {NULL}},
+    [__NR_vmsplice] = {.slow = true, .name = "vmsplice", .parser = {parse_long_arg,
+                       parse_integer_arg, parse_pointer_arg, parse_integer_arg, parse_integer_arg}},
     [__NR_move_pages] = {.slow = false, .name = "move_pages", .parser = {NULL}},
     [__NR_utimensat] = {.slow = false, .name = "utimensat", .parser = {NULL}},
     [__NR_epoll_pwait] = {.slow = true, .name = "epoll_pwait", .parser = {parse_long_arg,
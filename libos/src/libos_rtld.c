@@ -974,25 +974,46 @@ static int vdso_map_init(void) {
      * In host child process, LibOS may or may not be loaded at the same address.
      * When LibOS is loaded at different address, it may overlap with the old vDSO
      * area.
+     *
+     * The vDSO image is preceded by a read-only data page (vvar), which vDSO functions access
+     * PC-relatively. It holds the TSC-to-time conversion parameters of PAL, which are constant, so
+     * the page is filled only once here.
      */
-    void* addr = NULL;
-    int ret = bkeep_mmap_any_aslr(ALLOC_ALIGN_UP(vdso_so_size), PROT_READ | PROT_EXEC,
-                                  MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0, LINUX_VDSO_FILENAME,
-                                  &addr);
+    assert(IS_ALLOC_ALIGNED(VDSO_VVAR_SIZE));
+    size_t vdso_size = ALLOC_ALIGN_UP(vdso_so_size);
+    size_t total_size = VDSO_VVAR_SIZE + vdso_size;
+
+    void* vvar_addr = NULL;
+    int ret = bkeep_mmap_any_aslr(total_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+                                  NULL, 0, LINUX_VDSO_FILENAME, &vvar_addr);
+    if (ret < 0) {
+        return ret;
+    }
+    void* addr = (char*)vvar_addr + VDSO_VVAR_SIZE;
+
+    ret = bkeep_mprotect(vvar_addr, VDSO_VVAR_SIZE, PROT_READ, /*is_internal=*/false);
     if (ret < 0) {
         return ret;
     }
 
-    ret = PalVirtualMemoryAlloc(addr, ALLOC_ALIGN_UP(vdso_so_size), PAL_PROT_READ | PAL_PROT_WRITE);
+    ret = PalVirtualMemoryAlloc(vvar_addr, total_size, PAL_PROT_READ | PAL_PROT_WRITE);
     if (ret < 0) {
         return pal_to_unix_errno(ret);
     }
 
+    struct vdso_vvar* vvar = vvar_addr;
+    memset(vvar, 0, VDSO_VVAR_SIZE);
+    vvar->tsc_time_info = g_pal_public_state->tsc_time_info;
+
     memcpy(addr, &vdso_so, vdso_so_size);
-    memset(addr + vdso_so_size, 0, ALLOC_ALIGN_UP(vdso_so_size) - vdso_so_size);
+    memset(addr + vdso_so_size, 0, vdso_size - vdso_so_size);
+
+    ret = PalVirtualMemoryProtect(vvar_addr, VDSO_VVAR_SIZE, PAL_PROT_READ);
+    if (ret < 0) {
+        return pal_to_unix_errno(ret);
+    }
 
-    ret = PalVirtualMemoryProtect(addr, ALLOC_ALIGN_UP(vdso_so_size),
-                                  PAL_PROT_READ | PAL_PROT_EXEC);
+    ret = PalVirtualMemoryProtect(addr, vdso_size, PAL_PROT_READ | PAL_PROT_EXEC);
     if (ret < 0) {
         return pal_to_unix_errno(ret);
     }
@@ -16,6 +16,16 @@
  *   design changes if need be,
  * - `EPOLLRDHUP` is always reported together with `EPOLLHUP` - this is current limitation of PAL
  *   API, which does not distinguish these conditions.
+ *
+ * Ready list: if the PAL supports readiness callbacks (see `PalStreamSetNotify`), each monitored
+ * handle gets one installed, and each epoll instance keeps a list of items that may be ready
+ * (`ready_items`). Callbacks run in PAL context, so they only queue the handle on a global lock-free
+ * list and set a global pollable event; threads in `epoll_wait` wake up on this event, move the
+ * queued handles' items to ready lists (see `drain_epoll_notifications()`) and poll only the items
+ * on the ready list. Items which turn out to be not ready are dropped from the list, level-triggered
+ * items which were reported stay on it (moved to the tail, for round robin). If some item of an
+ * epoll instance has no callback (unsupported by the PAL or handle type), `epoll_wait` falls back to
+ * polling all items.
  */
 
 #include <stdint.h>
@@ -34,6 +44,7 @@
 #include "libos_types.h"
 #include "linux_abi/errors.h"
 #include "list.h"
+#include "spinlock.h"
 
 /* This bit is currently unoccupied in epoll events mask. */
 #define EPOLL_NEEDS_REARM ((uint32_t)(1u << 24))
@@ -83,6 +94,14 @@ struct libos_epoll_item {
     uint32_t events;
     uint64_t data;
     refcount_t ref_count;
+    /* Below fields are guarded by `epoll_handle->info.epoll.lock`. */
+    LIST_TYPE(libos_epoll_item) ready_list; // epoll_handle->ready_items
+    /* `handle` has a PAL readiness callback installed (otherwise counted in `unnotified_count`). */
+    bool notify;
+    /* Installing the callback failed only because `handle` had no PAL handle yet. */
+    bool notify_retry;
+    /* `handle` was notified after the item was last picked up for polling from the ready list. */
+    bool ready_pending;
 };
 
 DEFINE_LIST(libos_epoll_waiter);
@@ -113,6 +132,127 @@ static void put_epoll_items_array(struct libos_epoll_item** items, size_t items_
     }
 }
 
+/* Handles notified by PAL readiness callbacks, not yet processed by `drain_epoll_notifications()`. */
+static struct libos_handle* g_epoll_notified_handles = NULL;
+static bool g_epoll_notify_pending = false;
+/* Serializes clearing `g_epoll_notify_event` with resetting `g_epoll_notify_pending`. */
+static spinlock_t g_epoll_notify_drain_lock = INIT_SPINLOCK_UNLOCKED;
+/* Set by readiness callbacks, polled by `epoll_wait` in ready-list mode; created on first use. */
+static struct libos_pollable_event* g_epoll_notify_event = NULL;
+
+static PAL_HANDLE get_pal_handle(struct libos_handle* handle) {
+    if (handle->type == TYPE_SOCK)
+        return __atomic_load_n(&handle->info.sock.pal_handle, __ATOMIC_ACQUIRE);
+    return handle->pal_handle;
+}
+
+static struct libos_pollable_event* get_epoll_notify_event(void) {
+    struct libos_pollable_event* event = __atomic_load_n(&g_epoll_notify_event, __ATOMIC_ACQUIRE);
+    if (event)
+        return event;
+
+    struct libos_pollable_event* new_event = malloc(sizeof(*new_event));
+    if (!new_event)
+        return NULL;
+    if (create_pollable_event(new_event) < 0) {
+        free(new_event);
+        return NULL;
+    }
+
+    if (!__atomic_compare_exchange_n(&g_epoll_notify_event, &event, new_event, /*weak=*/false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* somebody else was faster */
+        destroy_pollable_event(new_event);
+        free(new_event);
+        return event;
+    }
+    return new_event;
+}
+
+/* Called by the PAL with PAL-internal locks held: must not block nor take any LibOS lock. */
+static void epoll_notify_callback(void* arg) {
+    struct libos_handle* handle = arg;
+
+    if (__atomic_exchange_n(&handle->epoll_notify_queued, true, __ATOMIC_ACQ_REL)) {
+        /* already queued, not yet processed */
+        return;
+    }
+
+    /* The callback is uninstalled before the last epoll item (holding a handle reference) goes
+     * away, so the handle is alive here. This reference is dropped after processing. */
+    get_handle(handle);
+
+    struct libos_handle* head = __atomic_load_n(&g_epoll_notified_handles, __ATOMIC_RELAXED);
+    do {
+        handle->epoll_notify_next = head;
+    } while (!__atomic_compare_exchange_n(&g_epoll_notified_handles, &head, handle, /*weak=*/true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (!__atomic_exchange_n(&g_epoll_notify_pending, true, __ATOMIC_ACQ_REL)) {
+        /* `set_pollable_event()` takes a LibOS lock, so write to the pipe directly; the pipe is
+         * non-blocking and a full pipe means that the event is already set */
+        struct libos_pollable_event* event = __atomic_load_n(&g_epoll_notify_event,
+                                                             __ATOMIC_ACQUIRE);
+        char c = 0;
+        size_t size = sizeof(c);
+        (void)PalStreamWrite(event->write_handle, /*offset=*/0, &size, &c);
+    }
+}
+
+/* Installs the readiness callback on `handle`, returns whether it is installed. */
+static bool _install_epoll_notify(struct libos_handle* handle, bool* out_retry) {
+    assert(locked(&handle->lock));
+
+    *out_retry = false;
+    if (handle->epoll_notify)
+        return true;
+
+    PAL_HANDLE pal_handle = get_pal_handle(handle);
+    if (!pal_handle) {
+        /* e.g. UNIX sockets that are still not connected, retry later */
+        *out_retry = true;
+        return false;
+    }
+
+    /* uninstalling is a no-op here, it only checks whether callbacks are supported at all (before
+     * creating the global event) */
+    if (PalStreamSetNotify(pal_handle, /*callback=*/NULL, /*arg=*/NULL) < 0)
+        return false;
+    if (!get_epoll_notify_event())
+        return false;
+    if (PalStreamSetNotify(pal_handle, &epoll_notify_callback, handle) < 0)
+        return false;
+
+    handle->epoll_notify = true;
+    return true;
+}
+
+static void _mark_epoll_item_ready(struct libos_epoll_handle* epoll,
+                                   struct libos_epoll_item* item) {
+    assert(locked(&epoll->lock));
+
+    if (LIST_EMPTY(item, epoll_list)) {
+        /* already unlinked from this epoll instance */
+        return;
+    }
+
+    item->ready_pending = true;
+    if (LIST_EMPTY(item, ready_list)) {
+        LISTP_ADD_TAIL(item, &epoll->ready_items, ready_list);
+        epoll->ready_items_count++;
+    }
+}
+
+static void _unmark_epoll_item_ready(struct libos_epoll_handle* epoll,
+                                     struct libos_epoll_item* item) {
+    assert(locked(&epoll->lock));
+
+    if (!LIST_EMPTY(item, ready_list)) {
+        LISTP_DEL_INIT(item, &epoll->ready_items, ready_list);
+        epoll->ready_items_count--;
+    }
+}
+
 static void _interrupt_epoll_waiters(struct libos_epoll_handle* epoll) {
     assert(locked(&epoll->lock));
 
@@ -157,6 +297,7 @@ void interrupt_epolls(struct libos_handle* handle) {
     for (size_t i = 0; i < items_count; i++) {
         struct libos_epoll_handle* epoll = &items[i]->epoll_handle->info.epoll;
         lock(&epoll->lock);
+        _mark_epoll_item_ready(epoll, items[i]);
         _interrupt_epoll_waiters(epoll);
         unlock(&epoll->lock);
     }
@@ -167,6 +308,49 @@ void interrupt_epolls(struct libos_handle* handle) {
     }
 }
 
+/* Moves items of handles notified by PAL readiness callbacks to ready lists of their epolls. Must be
+ * called without any epoll or handle lock held. */
+static void drain_epoll_notifications(void) {
+    if (!__atomic_load_n(&g_epoll_notify_pending, __ATOMIC_ACQUIRE))
+        return;
+
+    /* The flag is set by the callback that writes the (only) byte to the event, so a consumed byte
+     * means that the flag can be reset: the next callback will write a new byte. If the byte is not
+     * written yet (the callback is between setting the flag and writing), the flag stays set and
+     * the byte is consumed by a later drain. Resetting the flag while leaving a byte in the event
+     * would make pollers spin, and consuming a byte while leaving the flag set would make later
+     * callbacks skip the write, so that `epoll_wait` calls on other epoll instances would sleep
+     * through readiness changes. Drains are serialized, so that at most one reads the byte. */
+    spinlock_lock(&g_epoll_notify_drain_lock);
+    if (__atomic_load_n(&g_epoll_notify_pending, __ATOMIC_ACQUIRE)) {
+        struct libos_pollable_event* event = __atomic_load_n(&g_epoll_notify_event,
+                                                             __ATOMIC_ACQUIRE);
+        char c;
+        size_t size;
+        int ret;
+        do {
+            size = sizeof(c);
+            ret = PalStreamRead(event->read_handle, /*offset=*/0, &size, &c);
+        } while (ret == -PAL_ERROR_INTERRUPTED);
+        if (ret == 0 && size > 0) {
+            /* RMW, so that handles queued by callbacks that found the flag set are visible below */
+            (void)__atomic_exchange_n(&g_epoll_notify_pending, false, __ATOMIC_ACQ_REL);
+        }
+    }
+    spinlock_unlock(&g_epoll_notify_drain_lock);
+
+    struct libos_handle* handle = __atomic_exchange_n(&g_epoll_notified_handles, NULL,
+                                                      __ATOMIC_ACQ_REL);
+    while (handle) {
+        struct libos_handle* next = handle->epoll_notify_next;
+        /* from now on, new notifications queue the handle again */
+        __atomic_store_n(&handle->epoll_notify_queued, false, __ATOMIC_RELEASE);
+        interrupt_epolls(handle);
+        put_handle(handle);
+        handle = next;
+    }
+}
+
 void maybe_epoll_et_trigger(struct libos_handle* handle, int ret, bool in, bool was_partial) {
     bool needs_et = false;
     switch (handle->type) {
@@ -217,11 +401,25 @@ static void _unlink_epoll_item(struct libos_epoll_item* item) {
     if (!LIST_EMPTY(item, handle_list)) {
         LISTP_DEL_INIT(item, &handle->epoll_items, handle_list);
         handle->epoll_items_count--;
+        if (!handle->epoll_items_count && handle->epoll_notify) {
+            /* after this returns, the callback doesn't run anymore and can't touch the handle */
+            int ret = PalStreamSetNotify(get_pal_handle(handle), /*callback=*/NULL, /*arg=*/NULL);
+            if (ret < 0) {
+                log_error("failed to uninstall PAL readiness callback: %s", pal_strerror(ret));
+                BUG();
+            }
+            handle->epoll_notify = false;
+        }
         put_epoll_item(item);
     }
     unlock(&handle->lock);
 
     if (!LIST_EMPTY(item, epoll_list)) {
+        _unmark_epoll_item_ready(epoll, item);
+        if (!item->notify) {
+            assert(epoll->unnotified_count);
+            epoll->unnotified_count--;
+        }
         LISTP_DEL_INIT(item, &epoll->items, epoll_list);
         epoll->items_count--;
         put_epoll_item(item);
@@ -256,6 +454,11 @@ void delete_epoll_items_for_fd(int fd, struct libos_handle* handle) {
             break;
         }
     }
+
+    /* the handle may still be queued by a (now uninstalled) callback; release it now instead of
+     * waiting for the next `epoll_wait`, as the queue holds a reference to it */
+    if (__atomic_load_n(&handle->epoll_notify_queued, __ATOMIC_ACQUIRE))
+        drain_epoll_notifications();
 }
 
 long libos_syscall_epoll_create1(int flags) {
@@ -276,6 +479,13 @@ long libos_syscall_epoll_create1(int flags) {
     INIT_LISTP(&epoll->items);
     epoll->items_count = 0;
     epoll->last_returned_index = -1;
+    INIT_LISTP(&epoll->ready_items);
+    epoll->ready_items_count = 0;
+    epoll->unnotified_count = 0;
+    epoll->cached_items = NULL;
+    epoll->cached_pal_handles = NULL;
+    epoll->cached_pal_events = NULL;
+    epoll->cached_arrays_len = 0;
     if (!create_lock(&epoll->lock)) {
         put_handle(handle);
         return -ENOMEM;
@@ -328,6 +538,10 @@ static int do_epoll_add(struct libos_handle* epoll_handle, struct libos_handle*
     new_item->data = event->data;
     new_item->events = event->events & ~EPOLL_NEEDS_REARM;
     refcount_set(&new_item->ref_count, 1);
+    INIT_LIST_HEAD(new_item, ready_list);
+    new_item->notify = false;
+    new_item->notify_retry = false;
+    new_item->ready_pending = false;
 
     if (!(handle->acc_mode & MAY_READ)) {
         new_item->events &= ~(EPOLLIN | EPOLLRDNORM);
@@ -356,8 +570,14 @@ static int do_epoll_add(struct libos_handle* epoll_handle, struct libos_handle*
     LISTP_ADD_TAIL(new_item, &handle->epoll_items, handle_list);
     get_epoll_item(new_item);
     handle->epoll_items_count++;
+    new_item->notify = _install_epoll_notify(handle, &new_item->notify_retry);
     unlock(&handle->lock);
 
+    if (!new_item->notify)
+        epoll->unnotified_count++;
+    /* readiness of the new item is unknown, it must be polled at least once */
+    _mark_epoll_item_ready(epoll, new_item);
+
     if (new_item->events & EPOLLET) {
         __atomic_store_n(&handle->needs_et_poll_in, true, __ATOMIC_RELEASE);
         __atomic_store_n(&handle->needs_et_poll_out, true, __ATOMIC_RELEASE);
@@ -401,6 +621,7 @@ static int do_epoll_mod(struct libos_handle* epoll_handle, struct libos_handle*
                 __atomic_store_n(&handle->needs_et_poll_out, true, __ATOMIC_RELEASE);
             }
 
+            _mark_epoll_item_ready(epoll, item);
             _interrupt_epoll_waiters(epoll);
 
             log_debug("epoll: modified %d (%p) on epoll handle %p", fd, handle, epoll_handle);
@@ -437,6 +658,10 @@ static int do_epoll_del(struct libos_handle* epoll_handle, struct libos_handle*
     }
 
     unlock(&epoll->lock);
+
+    /* see delete_epoll_items_for_fd() */
+    if (__atomic_load_n(&handle->epoll_notify_queued, __ATOMIC_ACQUIRE))
+        drain_epoll_notifications();
     return ret;
 }
 
@@ -496,6 +721,99 @@ out:
     return ret;
 }
 
+/* Fills the polling arguments for `item`, returns false if the item must not be polled. */
+static bool _prepare_epoll_item_poll(struct libos_epoll_item* item, PAL_HANDLE* out_pal_handle,
+                                     pal_wait_flags_t* out_pal_events) {
+    PAL_HANDLE pal_handle = get_pal_handle(item->handle);
+    if (!pal_handle) {
+        /* UNIX sockets that are still not connected have no `pal_handle`. */
+        return false;
+    }
+
+    if (item->events & EPOLL_NEEDS_REARM) {
+        assert(item->events & EPOLLONESHOT);
+        return false;
+    }
+
+    pal_wait_flags_t pal_events = 0;
+    if (item->events & (EPOLLIN | EPOLLRDNORM)) {
+        pal_events |= PAL_WAIT_READ;
+    }
+    if (item->events & (EPOLLOUT | EPOLLWRNORM)) {
+        pal_events |= PAL_WAIT_WRITE;
+    }
+    if (item->events & EPOLLET) {
+        if (!__atomic_load_n(&item->handle->needs_et_poll_in, __ATOMIC_ACQUIRE)) {
+            pal_events &= ~PAL_WAIT_READ;
+        }
+        if (!__atomic_load_n(&item->handle->needs_et_poll_out, __ATOMIC_ACQUIRE)) {
+            pal_events &= ~PAL_WAIT_WRITE;
+        }
+    }
+
+    *out_pal_handle = pal_handle;
+    *out_pal_events = pal_events;
+    return true;
+}
+
+/* Translates PAL events returned for `item` into epoll events (0 if nothing is to be reported). */
+static uint32_t get_epoll_item_events(struct libos_epoll_item* item,
+                                      pal_wait_flags_t* pal_ret_events) {
+    if (!*pal_ret_events) {
+        return 0;
+    }
+
+    if (item->events & EPOLL_NEEDS_REARM) {
+        /* Another waiter reported events for this EPOLLONESHOT item asynchronously. */
+        return 0;
+    }
+
+    if (item->handle->fs && item->handle->fs->fs_ops && item->handle->fs->fs_ops->post_poll) {
+        item->handle->fs->fs_ops->post_poll(item->handle, pal_ret_events);
+    }
+
+    uint32_t item_events = 0;
+    if (*pal_ret_events & PAL_WAIT_ERROR) {
+        item_events |= EPOLLERR;
+    }
+    if (*pal_ret_events & PAL_WAIT_HANG_UP) {
+        item_events |= EPOLLHUP;
+        /* add RDHUP event only if user requested for it to be reported */
+        item_events |= item->events & EPOLLRDHUP;
+    }
+    if (*pal_ret_events & PAL_WAIT_READ) {
+        item_events |= item->events & (EPOLLIN | EPOLLRDNORM);
+    }
+    if (*pal_ret_events & PAL_WAIT_WRITE) {
+        item_events |= item->events & (EPOLLOUT | EPOLLWRNORM);
+    }
+    return item_events;
+}
+
+/* Updates position of a polled item on the ready list: items with nothing to report are dropped
+ * (unless notified meanwhile), reported edge-triggered and one-shot items too (they are put back on
+ * notification or on `EPOLL_CTL_MOD`), reported level-triggered items go to the tail. */
+static void _requeue_polled_epoll_item(struct libos_epoll_handle* epoll,
+                                       struct libos_epoll_item* item, uint32_t item_events) {
+    assert(locked(&epoll->lock));
+
+    if (LIST_EMPTY(item, ready_list)) {
+        return;
+    }
+
+    bool keep = item->ready_pending;
+    if (item_events && !(item->events & (EPOLLET | EPOLLONESHOT))) {
+        keep = true;
+    }
+
+    LISTP_DEL_INIT(item, &epoll->ready_items, ready_list);
+    if (keep) {
+        LISTP_ADD_TAIL(item, &epoll->ready_items, ready_list);
+    } else {
+        epoll->ready_items_count--;
+    }
+}
+
 static int do_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout_ms) {
     if (maxevents <= 0) {
         return -EINVAL;
@@ -515,104 +833,131 @@ static int do_epoll_wait(int epfd, struct epoll_event* events, int maxevents, in
     }
 
     uint64_t timeout_us = (unsigned int)timeout_ms * TIME_US_IN_MS;
+    uint64_t no_wait_timeout_us = 0;
     struct libos_epoll_waiter waiter = {
         .event = &get_cur_thread()->pollable_event,
     };
 
     int ret;
     struct libos_epoll_handle* epoll = &epoll_handle->info.epoll;
-    size_t arrays_len = 0;
-    struct libos_epoll_item** items = NULL;
-    /* Reserve one slot for the waiter's wakeup handle. */
-    PAL_HANDLE* pal_handles = malloc(1 * sizeof(*pal_handles));
-    /* Double the amount of PAL events - one part are input events, the other - output. */
-    pal_wait_flags_t* pal_events = malloc(2 * sizeof(*pal_events));
-
-    if (!pal_handles || !pal_events) {
-        free(pal_handles);
-        free(pal_events);
-        put_handle(epoll_handle);
-        return -ENOMEM;
-    }
 
+    /* Borrow arrays cached in the epoll instance (concurrent waiters allocate their own). */
     lock(&epoll->lock);
+    size_t arrays_len = epoll->cached_arrays_len;
+    struct libos_epoll_item** items = epoll->cached_items;
+    PAL_HANDLE* pal_handles = epoll->cached_pal_handles;
+    pal_wait_flags_t* pal_events = epoll->cached_pal_events;
+    epoll->cached_arrays_len = 0;
+    epoll->cached_items = NULL;
+    epoll->cached_pal_handles = NULL;
+    epoll->cached_pal_events = NULL;
+    unlock(&epoll->lock);
 
     while (1) {
-        if (arrays_len < epoll->items_count) {
+        drain_epoll_notifications();
+
+        lock(&epoll->lock);
+
+        /* If all items have readiness callbacks, only items on the ready list need polling. */
+        bool ready_mode = epoll->unnotified_count == 0;
+        size_t max_items_count = ready_mode ? epoll->ready_items_count : epoll->items_count;
+
+        /* Reserve two slots: the waiter's wakeup handle and the global notification event. */
+        if (arrays_len < max_items_count + 2) {
             free(items);
             free(pal_handles);
             free(pal_events);
 
-            arrays_len = epoll->items_count;
+            arrays_len = max_items_count + 2;
             items = malloc(arrays_len * sizeof(*items));
-            /* Reserve one slot for the waiter's wakeup handle. */
-            pal_handles = malloc((arrays_len + 1) * sizeof(*pal_handles));
+            pal_handles = malloc(arrays_len * sizeof(*pal_handles));
             /* Double the amount of PAL events - one part are input events, the other - output. */
-            pal_events = malloc(2 * (arrays_len + 1) * sizeof(*pal_events));
+            pal_events = malloc(2 * arrays_len * sizeof(*pal_events));
             if (!items || !pal_handles || !pal_events) {
                 ret = -ENOMEM;
                 goto out_unlock;
             }
         }
 
-        pal_wait_flags_t* pal_ret_events = pal_events + epoll->items_count + 1;
+        pal_wait_flags_t* pal_ret_events = pal_events + arrays_len;
 
         struct libos_epoll_item* item;
+        struct libos_epoll_item* tmp;
         size_t items_count = 0;
-        LISTP_FOR_EACH_ENTRY(item, &epoll->items, epoll_list) {
-            PAL_HANDLE pal_handle = item->handle->pal_handle;
-            if (item->handle->type == TYPE_SOCK) {
-                pal_handle = __atomic_load_n(&item->handle->info.sock.pal_handle, __ATOMIC_ACQUIRE);
-            }
-            if (!pal_handle) {
-                /* UNIX sockets that are still not connected have no `pal_handle`. */
-                continue;
-            }
-
-            if (item->events & EPOLL_NEEDS_REARM) {
-                assert(item->events & EPOLLONESHOT);
-                continue;
-            }
-
-            items[items_count] = item;
-            get_epoll_item(item);
-
-            /* Since we have a reference to `item` (saved above), we can safely copy and use this
-             * PAL handle, even after releasing `epoll->lock`. */
-            pal_handles[items_count] = pal_handle;
-
-            pal_events[items_count] = 0;
-            if (item->events & (EPOLLIN | EPOLLRDNORM)) {
-                pal_events[items_count] |= PAL_WAIT_READ;
-            }
-            if (item->events & (EPOLLOUT | EPOLLWRNORM)) {
-                pal_events[items_count] |= PAL_WAIT_WRITE;
+        if (ready_mode) {
+            LISTP_FOR_EACH_ENTRY_SAFE(item, tmp, &epoll->ready_items, ready_list) {
+                item->ready_pending = false;
+                if (!_prepare_epoll_item_poll(item, &pal_handles[items_count],
+                                              &pal_events[items_count])) {
+                    /* put back on the ready list on `EPOLL_CTL_MOD` */
+                    _unmark_epoll_item_ready(epoll, item);
+                    continue;
+                }
+                items[items_count] = item;
+                get_epoll_item(item);
+                pal_ret_events[items_count] = 0;
+                items_count++;
             }
-            if (item->events & EPOLLET) {
-                if (!__atomic_load_n(&item->handle->needs_et_poll_in, __ATOMIC_ACQUIRE)) {
-                    pal_events[items_count] &= ~PAL_WAIT_READ;
+        } else {
+            LISTP_FOR_EACH_ENTRY(item, &epoll->items, epoll_list) {
+                if (item->notify_retry && get_pal_handle(item->handle)) {
+                    /* the handle got its PAL handle after being added (or this is a forked
+                     * child), try to install the readiness callback once more */
+                    lock(&item->handle->lock);
+                    item->notify = _install_epoll_notify(item->handle, &item->notify_retry);
+                    unlock(&item->handle->lock);
+                    if (item->notify) {
+                        epoll->unnotified_count--;
+                        _mark_epoll_item_ready(epoll, item);
+                    }
                 }
-                if (!__atomic_load_n(&item->handle->needs_et_poll_out, __ATOMIC_ACQUIRE)) {
-                    pal_events[items_count] &= ~PAL_WAIT_WRITE;
+
+                if (!_prepare_epoll_item_poll(item, &pal_handles[items_count],
+                                              &pal_events[items_count])) {
+                    continue;
                 }
+                /* Since we have a reference to `item` (saved below), we can safely copy and use
+                 * this PAL handle, even after releasing `epoll->lock`. */
+                items[items_count] = item;
+                get_epoll_item(item);
+                pal_ret_events[items_count] = 0;
+                items_count++;
+            }
+        }
+        assert(items_count <= max_items_count);
+
+        size_t handles_count = items_count;
+        pal_handles[handles_count] = waiter.event->read_handle;
+        pal_events[handles_count] = PAL_WAIT_READ;
+        pal_ret_events[handles_count] = 0;
+        handles_count++;
+
+        struct libos_pollable_event* notify_event = NULL;
+        if (ready_mode) {
+            notify_event = __atomic_load_n(&g_epoll_notify_event, __ATOMIC_ACQUIRE);
+            if (notify_event) {
+                pal_handles[handles_count] = notify_event->read_handle;
+                pal_events[handles_count] = PAL_WAIT_READ;
+                pal_ret_events[handles_count] = 0;
+                handles_count++;
             }
-            pal_ret_events[items_count] = 0;
-
-            items_count++;
         }
-        assert(items_count <= epoll->items_count);
-
-        pal_handles[items_count] = waiter.event->read_handle;
-        pal_events[items_count] = PAL_WAIT_READ;
-        pal_ret_events[items_count] = 0;
 
         LISTP_ADD_TAIL(&waiter, &epoll->waiters, list);
 
         unlock(&epoll->lock);
 
+        /* Items on the ready list may turn out to be not ready, so first check them without
+         * sleeping; if none is ready, they are dropped and the next iteration sleeps. */
+        bool no_wait = ready_mode && items_count;
+
         if (!have_pending_signals()) {
-            ret = PalStreamsWaitEvents(items_count + 1, pal_handles, pal_events, pal_ret_events,
-                                       timeout_ms == -1 ? NULL : &timeout_us);
+            uint64_t* wait_timeout_us = timeout_ms == -1 ? NULL : &timeout_us;
+            if (no_wait) {
+                wait_timeout_us = &no_wait_timeout_us;
+            }
+            ret = PalStreamsWaitEvents(handles_count, pal_handles, pal_events, pal_ret_events,
+                                       wait_timeout_us);
             ret = pal_to_unix_errno(ret);
         } else {
             ret = -EINTR;
@@ -623,6 +968,12 @@ static int do_epoll_wait(int epfd, struct epoll_event* events, int maxevents, in
             LISTP_DEL(&waiter, &epoll->waiters, list);
         }
 
+        if (ret == -EAGAIN && no_wait) {
+            /* None of the ready-list items is ready. */
+            memset(pal_ret_events, 0, handles_count * sizeof(*pal_ret_events));
+            ret = 0;
+        }
+
         if (ret < 0) {
             if (ret == -EAGAIN) {
                 /* Timed out. */
@@ -640,48 +991,30 @@ static int do_epoll_wait(int epfd, struct epoll_event* events, int maxevents, in
         if (pal_ret_events[items_count]) {
             clear_pollable_event(waiter.event);
         }
+        /* if `notify_event` was set, notified handles are processed (and the event is cleared) by
+         * `drain_epoll_notifications()` at the beginning of the next iteration or by another
+         * thread */
 
         /* Round robin returned events to help avoid starvation scenarios. If there was
          * an asynchronous update on the list of items, it isn't real round robin, but that's fine
-         * - no user app should depend on it anyway. */
-        size_t start_index = items_count ? (epoll->last_returned_index + 1) % items_count : 0;
+         * - no user app should depend on it anyway. In ready-list mode, round robin is achieved by
+         * moving reported items to the tail of the ready list. */
+        size_t start_index = 0;
+        if (!ready_mode && items_count) {
+            start_index = (epoll->last_returned_index + 1) % items_count;
+        }
         size_t counter = 0;
         size_t ret_events_count = 0;
         for (; counter < items_count; counter++) {
             size_t i = (start_index + counter) % items_count;
-            if (!pal_ret_events[i]) {
-                continue;
-            }
 
-            if (items[i]->events & EPOLL_NEEDS_REARM) {
-                /* Another waiter reported events for this EPOLLONESHOT item asynchronously. */
-                continue;
+            uint32_t this_item_events = get_epoll_item_events(items[i], &pal_ret_events[i]);
+            if (ready_mode) {
+                _requeue_polled_epoll_item(epoll, items[i], this_item_events);
             }
-
-            if (items[i]->handle->fs && items[i]->handle->fs->fs_ops
-                    && items[i]->handle->fs->fs_ops->post_poll) {
-                items[i]->handle->fs->fs_ops->post_poll(items[i]->handle, &pal_ret_events[i]);
-            }
-
-            uint32_t this_item_events = 0;
-            if (pal_ret_events[i] & PAL_WAIT_ERROR) {
-                this_item_events |= EPOLLERR;
-            }
-            if (pal_ret_events[i] & PAL_WAIT_HANG_UP) {
-                this_item_events |= EPOLLHUP;
-                /* add RDHUP event only if user requested for it to be reported */
-                this_item_events |= items[i]->events & EPOLLRDHUP;
-            }
-            if (pal_ret_events[i] & PAL_WAIT_READ) {
-                this_item_events |= items[i]->events & (EPOLLIN | EPOLLRDNORM);
-            }
-            if (pal_ret_events[i] & PAL_WAIT_WRITE) {
-                this_item_events |= items[i]->events & (EPOLLOUT | EPOLLWRNORM);
-            }
-
             if (!this_item_events) {
-                /* This handle is not interested in events that were detected - epoll item was
-                 * probably updated asynchronously. */
+                /* Nothing happened or this handle is not interested in events that were detected
+                 * - epoll item was probably updated asynchronously. */
                 continue;
             }
 
@@ -710,24 +1043,42 @@ static int do_epoll_wait(int epfd, struct epoll_event* events, int maxevents, in
         put_epoll_items_array(items, items_count);
 
         if (ret_events_count) {
-            if (counter == items_count) {
-                /* All items were returned to user app. */
-                epoll->last_returned_index = -1;
-            } else {
-                epoll->last_returned_index = (start_index + counter) % items_count;
+            if (!ready_mode) {
+                if (counter == items_count) {
+                    /* All items were returned to user app. */
+                    epoll->last_returned_index = -1;
+                } else {
+                    epoll->last_returned_index = (start_index + counter) % items_count;
+                }
             }
             ret = ret_events_count;
             break;
         }
+        unlock(&epoll->lock);
         /* There was an update on polled items, gather items once again. */
     }
 
 out_unlock:
+    if (ret == -ENOMEM) {
+        free(items);
+        free(pal_handles);
+        free(pal_events);
+    } else if (arrays_len > epoll->cached_arrays_len) {
+        /* Return the arrays to the epoll instance for the next call. */
+        free(epoll->cached_items);
+        free(epoll->cached_pal_handles);
+        free(epoll->cached_pal_events);
+        epoll->cached_arrays_len = arrays_len;
+        epoll->cached_items = items;
+        epoll->cached_pal_handles = pal_handles;
+        epoll->cached_pal_events = pal_events;
+    } else {
+        free(items);
+        free(pal_handles);
+        free(pal_events);
+    }
     unlock(&epoll->lock);
 
-    free(items);
-    free(pal_handles);
-    free(pal_events);
     put_handle(epoll_handle);
     return ret;
 }
@@ -761,7 +1112,12 @@ static int epoll_close(struct libos_handle* epoll_handle) {
     assert(LISTP_EMPTY(&epoll->waiters));
     assert(LISTP_EMPTY(&epoll->items));
     assert(epoll->items_count == 0);
+    assert(LISTP_EMPTY(&epoll->ready_items));
+    assert(epoll->ready_items_count == 0 && epoll->unnotified_count == 0);
 
+    free(epoll->cached_items);
+    free(epoll->cached_pal_handles);
+    free(epoll->cached_pal_events);
     destroy_lock(&epoll->lock);
     return 0;
 }
@@ -796,9 +1152,15 @@ BEGIN_CP_FUNC(epoll_items_list) {
         new_item->events = item->events;
         new_item->data = item->data;
         refcount_set(&new_item->ref_count, 0);
+        /* PAL readiness callbacks are installed anew in the child, on the first `epoll_wait` */
+        INIT_LIST_HEAD(new_item, ready_list);
+        new_item->notify = false;
+        new_item->notify_retry = true;
+        new_item->ready_pending = false;
 
         LISTP_ADD(new_item, &new_handle->info.epoll.items, epoll_list);
         new_handle->info.epoll.items_count++;
+        new_handle->info.epoll.unnotified_count++;
 
         DO_CP(handle, item->handle, &new_item->handle);
 
@@ -14,6 +14,7 @@
  * - F_GETFL, F_SETFL (file status flags)
  * - F_SETLK, F_SETLKW, F_GETLK (POSIX advisory locks)
  * - F_SETOWN (file descriptor owner): dummy implementation
+ * - F_SETPIPE_SZ, F_GETPIPE_SZ (pipe buffer size)
  */
 
 #include "libos_fs.h"
@@ -30,6 +31,11 @@
 
 #define FCNTL_SETFL_MASK (O_APPEND | O_DIRECT | O_NOATIME | O_NONBLOCK)
 
+/* Default pipe size and the limit of F_SETPIPE_SZ, as in Linux (the latter is the default of
+ * /proc/sys/fs/pipe-max-size; we don't emulate CAP_SYS_RESOURCE, which allows to go above it). */
+#define PIPE_DEFAULT_SIZE (16 * PAGE_SIZE)
+#define PIPE_MAX_SIZE     (1024 * 1024)
+
 static int generic_set_flags(struct libos_handle* handle, unsigned int flags, unsigned int mask) {
     /* TODO: DOES THIS WORK LOL
      * The old version of this code did this, but this seem to be incorrect. If a handle type allows
@@ -136,6 +142,60 @@ static int flock_to_file_lock(struct flock* fl, struct libos_handle* hdl,
     return 0;
 }
 
+static int get_pipe_size(struct libos_handle* hdl) {
+    if (hdl->type != TYPE_PIPE || !hdl->pal_handle)
+        return -EBADF;
+
+    PAL_STREAM_ATTR attr;
+    int ret = PalStreamAttributesQueryByHandle(hdl->pal_handle, &attr);
+    if (ret < 0)
+        return pal_to_unix_errno(ret);
+
+    /* zero means that the buffer is managed by the host (e.g. a host pipe or UNIX socket) */
+    return attr.pipe.buf_size ?: PIPE_DEFAULT_SIZE;
+}
+
+static int set_pipe_size(struct libos_handle* hdl, unsigned long size) {
+    if (hdl->type != TYPE_PIPE || !hdl->pal_handle)
+        return -EBADF;
+
+    /* Linux rounds the size up to a power-of-two number of pages (at least one page) */
+    if (size > (1UL << 31))
+        return -EINVAL;
+    size_t new_size = PAGE_SIZE;
+    while (new_size < size)
+        new_size <<= 1;
+    if (new_size > PIPE_MAX_SIZE)
+        return -EPERM;
+
+    lock(&hdl->lock);
+
+    PAL_STREAM_ATTR attr;
+    int ret = PalStreamAttributesQueryByHandle(hdl->pal_handle, &attr);
+    if (ret < 0) {
+        ret = pal_to_unix_errno(ret);
+        goto out;
+    }
+
+    if (attr.pipe.buf_size) {
+        attr.pipe.buf_size = new_size;
+        ret = PalStreamAttributesSetByHandle(hdl->pal_handle, &attr);
+        if (ret < 0) {
+            /* PAL reports overflow if the unread data doesn't fit into the new size */
+            ret = ret == -PAL_ERROR_OVERFLOW ? -EBUSY : pal_to_unix_errno(ret);
+            goto out;
+        }
+        ret = new_size;
+    } else {
+        /* the buffer is managed by the host and cannot be resized, report the size in effect (same
+         * as F_GETPIPE_SZ) */
+        ret = PIPE_DEFAULT_SIZE;
+    }
+out:
+    unlock(&hdl->lock);
+    return ret;
+}
+
 long libos_syscall_fcntl(int fd, int cmd, unsigned long arg) {
     int ret;
     int flags;
@@ -276,6 +336,16 @@ long libos_syscall_fcntl(int fd, int cmd, unsigned long arg) {
             /* XXX: DUMMY for now */
             break;
 
+        /* F_SETPIPE_SZ (int) */
+        case F_SETPIPE_SZ:
+            ret = set_pipe_size(hdl, arg);
+            break;
+
+        /* F_GETPIPE_SZ (void) */
+        case F_GETPIPE_SZ:
+            ret = get_pipe_size(hdl);
+            break;
+
         default:
             ret = -EINVAL;
             break;
@@ -3,7 +3,7 @@
 
 /*
  * Implementation of system calls "unlink", "unlinkat", "mkdir", "mkdirat", "rmdir", "umask",
- * "chmod", "fchmod", "fchmodat", "rename", "renameat" and "sendfile".
+ * "chmod", "fchmod", "fchmodat", "rename", "renameat", "sendfile", "splice" and "vmsplice".
  */
 
 #include "libos_fs.h"
@@ -18,17 +18,33 @@
 #include "stat.h"
 
 /*
- * Read/write in 64KB chunks in the sendfile() syscall. This syscall also has an optimization of
- * using a statically allocated buffer instead of allocating on the heap (as our internal malloc()
- * has subpar performance). To prevent data races of multiple threads executing sendfile() at the
- * same time and thus potentially corrupting a single static buffer, we optimize for a common case:
- * only the first thread uses the static buffer whereas other threads fall back to a slower heap
- * allocation.
+ * Read/write in 64KB chunks in the sendfile() and splice() syscalls. These syscalls also have an
+ * optimization of using a statically allocated buffer instead of allocating on the heap (as our
+ * internal malloc() has subpar performance). To prevent data races of multiple threads executing
+ * these syscalls at the same time and thus potentially corrupting a single static buffer, we
+ * optimize for a common case: only the first thread uses the static buffer whereas other threads
+ * fall back to a slower heap allocation.
  */
 #define BUF_SIZE (64 * 1024)
 static char g_sendfile_buf[BUF_SIZE];
 static bool g_sendfile_buf_in_use = false;
 
+static char* get_sendfile_buf(void) {
+    bool buf_in_use = __atomic_exchange_n(&g_sendfile_buf_in_use, true, __ATOMIC_ACQUIRE);
+    if (!buf_in_use) {
+        /* no other thread was using the static buffer */
+        return g_sendfile_buf;
+    }
+    return malloc(BUF_SIZE);
+}
+
+static void put_sendfile_buf(char* buf) {
+    if (buf == g_sendfile_buf)
+        __atomic_store_n(&g_sendfile_buf_in_use, 0, __ATOMIC_RELEASE);
+    else
+        free(buf);
+}
+
 /* The kernel would look up the parent directory, and remove the child from the inode. But we are
  * working with the PAL, so we open the file, truncate and close it. */
 long libos_syscall_unlink(const char* file) {
@@ -452,16 +468,10 @@ long libos_syscall_sendfile(int out_fd, int in_fd, off_t* offset, size_t count)
      *        input FD in BUF_SIZE chunks and writes into output FD. Mmap-based emulation may be
      *        more efficient but adds complexity (not all handle types provide mmap callback). */
 
-    bool buf_in_use = __atomic_exchange_n(&g_sendfile_buf_in_use, true, __ATOMIC_ACQUIRE);
-    if (!buf_in_use) {
-        /* no other thread was using the static buffer */
-        buf = g_sendfile_buf;
-    } else {
-        buf = malloc(BUF_SIZE);
-        if (!buf) {
-            ret = -ENOMEM;
-            goto out;
-        }
+    buf = get_sendfile_buf();
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
     }
 
     if (!count) {
@@ -550,15 +560,258 @@ out_update:
     }
 
 out:
-    if (buf == g_sendfile_buf)
-        __atomic_store_n(&g_sendfile_buf_in_use, 0, __ATOMIC_RELEASE);
-    else
-        free(buf);
+    if (buf)
+        put_sendfile_buf(buf);
+    put_handle(in_hdl);
+    put_handle(out_hdl);
+    return copied_to_out ? (long)copied_to_out : ret;
+}
+
+/* Writes to `hdl` at `*offset` (and updates it) if `offset` is not NULL, at the handle position
+ * otherwise. */
+static ssize_t splice_write(struct libos_handle* hdl, const void* buf, size_t count,
+                            off_t* offset) {
+    if (offset) {
+        file_off_t pos = *offset;
+        ssize_t ret = hdl->fs->fs_ops->write(hdl, buf, count, &pos);
+        if (ret > 0)
+            *offset = pos;
+        return ret;
+    }
+
+    maybe_lock_pos_handle(hdl);
+    ssize_t ret = hdl->fs->fs_ops->write(hdl, buf, count, &hdl->pos);
+    maybe_unlock_pos_handle(hdl);
+    return ret;
+}
+
+/* Returns how many bytes can be written into the pipe `hdl` without blocking (BUF_SIZE if the pipe
+ * buffer is managed by the host and its free space is unknown). */
+static ssize_t pipe_free_space(struct libos_handle* hdl) {
+    assert(hdl->type == TYPE_PIPE);
+    if (!hdl->pal_handle)
+        return -EBADF;
+
+    PAL_STREAM_ATTR attr;
+    int ret = PalStreamAttributesQueryByHandle(hdl->pal_handle, &attr);
+    if (ret < 0)
+        return pal_to_unix_errno(ret);
+
+    if (!attr.pipe.buf_size)
+        return BUF_SIZE;
+    assert(attr.pending_size <= attr.pipe.buf_size);
+    return attr.pipe.buf_size - attr.pending_size;
+}
+
+/* Waits until `hdl` becomes writable. */
+static int wait_writable(struct libos_handle* hdl) {
+    PAL_HANDLE pal_handle = hdl->type == TYPE_SOCK
+                            ? __atomic_load_n(&hdl->info.sock.pal_handle, __ATOMIC_ACQUIRE)
+                            : hdl->pal_handle;
+    if (!pal_handle)
+        return -EBADF;
+
+    pal_wait_flags_t events = PAL_WAIT_WRITE;
+    pal_wait_flags_t ret_events = 0;
+    int ret = PalStreamsWaitEvents(1, &pal_handle, &events, &ret_events, /*timeout_us=*/NULL);
+    if (ret < 0)
+        return pal_to_unix_errno(ret);
+    return ret_events & PAL_WAIT_WRITE ? 0 : -EPIPE;
+}
+
+/* FIXME: Pages are not moved between pipes and files: splice() is emulated by reading from input FD
+ *        into an intermediate buffer (once, at most BUF_SIZE bytes, like a single pipe read) and
+ *        writing it into output FD. SPLICE_F_NONBLOCK only applies to waiting for space in an output
+ *        pipe; otherwise blocking is controlled by O_NONBLOCK of the FDs. */
+long libos_syscall_splice(int fd_in, off_t* off_in, int fd_out, off_t* off_out, size_t len,
+                          unsigned int flags) {
+    long ret;
+    char* buf = NULL;
+    size_t copied_to_out = 0;
+
+    if (flags & ~SPLICE_F_ALL)
+        return -EINVAL;
+
+    if (off_in && !is_user_memory_writable(off_in, sizeof(*off_in)))
+        return -EFAULT;
+    if (off_out && !is_user_memory_writable(off_out, sizeof(*off_out)))
+        return -EFAULT;
+
+    struct libos_handle* in_hdl = get_fd_handle(fd_in, NULL, NULL);
+    if (!in_hdl)
+        return -EBADF;
+
+    struct libos_handle* out_hdl = get_fd_handle(fd_out, NULL, NULL);
+    if (!out_hdl) {
+        put_handle(in_hdl);
+        return -EBADF;
+    }
+
+    if (!(in_hdl->acc_mode & MAY_READ) || !(out_hdl->acc_mode & MAY_WRITE)) {
+        ret = -EBADF;
+        goto out;
+    }
+
+    if (!in_hdl->fs || !in_hdl->fs->fs_ops || !in_hdl->fs->fs_ops->read || !out_hdl->fs
+            || !out_hdl->fs->fs_ops || !out_hdl->fs->fs_ops->write) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* one of the FDs must be a pipe, and offsets make no sense for pipes */
+    if (in_hdl->type != TYPE_PIPE && out_hdl->type != TYPE_PIPE) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if ((off_in && (in_hdl->type == TYPE_PIPE || !in_hdl->fs->fs_ops->seek))
+            || (off_out && (out_hdl->type == TYPE_PIPE || !out_hdl->fs->fs_ops->seek))) {
+        ret = -ESPIPE;
+        goto out;
+    }
+    if ((off_in && *off_in < 0) || (off_out && *off_out < 0)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (out_hdl->flags & O_APPEND) {
+        /* Linux errors out if output fd has the O_APPEND flag set; comply with this behavior */
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!len) {
+        ret = 0;
+        goto out;
+    }
+
+    size_t to_read = MIN(len, BUF_SIZE);
+    if (out_hdl->type == TYPE_PIPE) {
+        /* read only as much as the output pipe can take, so that the write below doesn't block (or
+         * fail) with the data already consumed from input FD */
+        while (true) {
+            ssize_t free_space = pipe_free_space(out_hdl);
+            if (free_space < 0) {
+                ret = free_space;
+                goto out;
+            }
+            if (free_space > 0) {
+                to_read = MIN(to_read, (size_t)free_space);
+                break;
+            }
+            if ((flags & SPLICE_F_NONBLOCK) || (out_hdl->flags & O_NONBLOCK)) {
+                ret = -EAGAIN;
+                goto out;
+            }
+            ret = wait_writable(out_hdl);
+            if (ret < 0)
+                goto out;
+        }
+    }
+
+    buf = get_sendfile_buf();
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /*
+     * If input FD is seekable, read at a copy of its position and advance the position only by the
+     * number of bytes actually written, so that no data is lost if the write fails. The handle
+     * position stays locked for the whole operation, as in Linux.
+     */
+    bool in_seekable = off_in || in_hdl->seekable;
+    file_off_t pos_in = 0;
+    if (off_in) {
+        pos_in = *off_in;
+    } else if (in_seekable) {
+        maybe_lock_pos_handle(in_hdl);
+        pos_in = in_hdl->pos;
+    }
+    file_off_t pos_in_start = pos_in;
+
+    ssize_t x;
+    if (in_seekable) {
+        x = in_hdl->fs->fs_ops->read(in_hdl, buf, to_read, &pos_in);
+    } else {
+        maybe_lock_pos_handle(in_hdl);
+        x = in_hdl->fs->fs_ops->read(in_hdl, buf, to_read, &in_hdl->pos);
+        maybe_unlock_pos_handle(in_hdl);
+    }
+    if (x <= 0) {
+        /* error or no more data in input FD */
+        ret = x;
+        goto out_update;
+    }
+    assert((size_t)x <= to_read);
+
+    while (copied_to_out < (size_t)x) {
+        ssize_t y = splice_write(out_hdl, buf + copied_to_out, x - copied_to_out, off_out);
+        if (y > 0) {
+            copied_to_out += y;
+            continue;
+        }
+
+        ret = y ?: -EIO;
+        if (in_seekable) {
+            /* the rest of the data stays in input FD, see the position update below */
+            break;
+        }
+
+        /* The data is already consumed from input FD (a pipe or a socket), so it must be written.
+         * This may block even if output FD is non-blocking; it happens only if the output pipe's
+         * free space was overestimated or if output FD is not a pipe. */
+        if (ret != -EAGAIN && ret != -EINTR)
+            break;
+        ret = wait_writable(out_hdl);
+        if (ret < 0 && ret != -EINTR) {
+            /* output FD was closed for write (e.g. the pipe has no readers anymore), so there is
+             * nowhere to deliver the rest of the data to */
+            break;
+        }
+    }
+    if (copied_to_out == (size_t)x)
+        ret = 0;
+
+out_update:
+    if (in_seekable) {
+        if (off_in) {
+            if (copied_to_out)
+                *off_in = pos_in_start + copied_to_out;
+        } else {
+            if (copied_to_out)
+                in_hdl->pos = pos_in_start + copied_to_out;
+            maybe_unlock_pos_handle(in_hdl);
+        }
+    }
+
+out:
+    if (buf)
+        put_sendfile_buf(buf);
     put_handle(in_hdl);
     put_handle(out_hdl);
     return copied_to_out ? (long)copied_to_out : ret;
 }
 
+/* User pages are not gifted to the pipe (SPLICE_F_GIFT is ignored), so this is a writev() into the
+ * write end of a pipe, or a readv() from the read end. */
+long libos_syscall_vmsplice(int fd, struct iovec* vec, unsigned long vlen, unsigned int flags) {
+    if (flags & ~SPLICE_F_ALL)
+        return -EINVAL;
+
+    struct libos_handle* hdl = get_fd_handle(fd, NULL, NULL);
+    if (!hdl)
+        return -EBADF;
+
+    bool is_pipe = hdl->type == TYPE_PIPE;
+    bool is_write_end = hdl->acc_mode & MAY_WRITE;
+    put_handle(hdl);
+
+    if (!is_pipe)
+        return -EBADF;
+
+    return is_write_end ? libos_syscall_writev(fd, vec, vlen) : libos_syscall_readv(fd, vec, vlen);
+}
+
 long libos_syscall_chroot(const char* filename) {
     if (!is_user_string_readable(filename))
         return -EFAULT;
@@ -87,6 +87,21 @@ void* libos_syscall_mmap(void* addr, size_t length, int prot, int flags, int fd,
     if (!IS_ALLOC_ALIGNED(length))
         length = ALLOC_ALIGN_UP(length);
 
+    if ((flags & MAP_ANONYMOUS) && (flags & MAP_HUGETLB)) {
+        /* anonymous huge-page mappings are aligned to the huge-page size (both address and length),
+         * so that the PAL can back them with large pages (if it supports them) */
+        size_t huge_page_size = mmap_huge_page_size(flags);
+        if (!huge_page_size)
+            return (void*)-EINVAL;
+        if ((flags & (MAP_FIXED | MAP_FIXED_NOREPLACE))
+                && !IS_ALIGNED_PTR_POW2(addr, huge_page_size)) {
+            return (void*)-EINVAL;
+        }
+        if (length > SIZE_MAX - huge_page_size)
+            return (void*)-ENOMEM;
+        length = ALIGN_UP_POW2(length, huge_page_size);
+    }
+
     if (!length || !access_ok(addr, length))
         return (void*)-EINVAL;
 
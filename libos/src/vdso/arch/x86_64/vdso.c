@@ -6,6 +6,8 @@
  *                    Borys Popławski <borysp@invisiblethingslab.com>
  */
 
+#include "cpu.h"
+#include "libos_vdso.h"
 #include "linux_abi/time.h"
 #include "linux_abi/syscalls_nr_arch.h"
 #include "vdso.h"
@@ -24,17 +26,66 @@
 #define EXPORT_WEAK_SYMBOL(name) \
     __typeof__(__vdso_##name) name __attribute__((weak, alias("__vdso_" #name)))
 
+/* Hidden, so that it is accessed PC-relatively and doesn't need a relocation; the address is
+ * defined in vdso.lds */
+extern const struct vdso_vvar vdso_vvar_page __attribute__((visibility("hidden")));
+
+/* Computes the current time from the TSC, without leaving user mode. Returns false if PAL does not
+ * provide TSC-to-time conversion parameters; the caller must then fall back to a syscall. */
+static bool get_time_in_us(uint64_t* out_us) {
+    const struct pal_tsc_time_info* info = &vdso_vvar_page.tsc_time_info;
+    if (!info->mult)
+        return false;
+
+    uint64_t diff_tsc = get_tsc() - info->start_tsc;
+    uint64_t diff_us = (uint64_t)(((__uint128_t)diff_tsc * info->mult) >> info->shift);
+
+    uint64_t us = info->start_us + diff_us;
+    if (us < info->start_us)
+        return false;
+
+    *out_us = us;
+    return true;
+}
+
 int __vdso_clock_gettime(clockid_t clock, struct timespec* t) {
+    uint64_t us;
+    /* LibOS warns about (emulated) CPU-time clocks and validates the other args, so only the valid
+     * wall-clock cases are handled here */
+    if (t && clock >= 0 && clock < MAX_CLOCKS && clock != CLOCK_PROCESS_CPUTIME_ID
+            && clock != CLOCK_THREAD_CPUTIME_ID && get_time_in_us(&us)) {
+        t->tv_sec  = us / 1000000;
+        t->tv_nsec = (us % 1000000) * 1000;
+        return 0;
+    }
     return vdso_arch_syscall(__NR_clock_gettime, (long)clock, (long)t);
 }
 EXPORT_WEAK_SYMBOL(clock_gettime);
 
 int __vdso_gettimeofday(struct timeval* tv, struct timezone* tz) {
+    uint64_t us;
+    if (tv && get_time_in_us(&us)) {
+        tv->tv_sec  = us / 1000000;
+        tv->tv_usec = us % 1000000;
+        if (tz) {
+            /* not implemented in LibOS either, return zeros */
+            tz->tz_minuteswest = 0;
+            tz->tz_dsttime = 0;
+        }
+        return 0;
+    }
     return vdso_arch_syscall(__NR_gettimeofday, (long)tv, (long)tz);
 }
 EXPORT_WEAK_SYMBOL(gettimeofday);
 
 time_t __vdso_time(time_t* t) {
+    uint64_t us;
+    if (get_time_in_us(&us)) {
+        time_t sec = us / 1000000;
+        if (t)
+            *t = sec;
+        return sec;
+    }
     return vdso_arch_syscall(__NR_time, (long)t, 0);
 }
 EXPORT_WEAK_SYMBOL(time);
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Context-switch microbenchmark: two threads pinned to the same CPU pass a token to each other via
+ * futexes, so that each handoff is a context switch. This is done first with threads that use only
+ * general-purpose registers and then (if supported) with threads that keep a thread-unique pattern
+ * in YMM registers across each futex syscall and verify it once the syscall returns, which checks
+ * that extended FP state survives context switches and shows the cost of saving/restoring it.
+ * Prints the average cost of a single context switch; fails on errors and on corrupted YMM state,
+ * but not on slow switches, as timings depend on the environment.
+ */
+
+#define _GNU_SOURCE
+#include <cpuid.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "futex.h"
+
+#define ROUNDS 20000
+
+/* YMM8-YMM11 are loaded with the pattern; nothing else in this test touches them */
+#define YMM_REGS_CNT 4
+
+struct ymm_regs {
+    uint64_t qwords[YMM_REGS_CNT * 4];
+};
+
+static int g_turn;
+static bool g_use_avx;
+
+static uint64_t time_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        err(1, "clock_gettime");
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static bool avx_supported(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return false;
+
+    /* OS must have enabled SSE and AVX state in XCR0 */
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    return (xcr0_lo & 0x6) == 0x6;
+}
+
+static void fill_ymm_pattern(struct ymm_regs* regs, int me, size_t round) {
+    for (size_t i = 0; i < ARRAY_LEN(regs->qwords); i++)
+        regs->qwords[i] = (uint64_t)(me + 1) << 56 | (uint64_t)round << 8 | i;
+}
+
+/* Performs a raw syscall with YMM8-YMM11 loaded from `in` and stores these registers to `out` once
+ * the syscall returns, so that any context switch during the syscall must preserve them. */
+static long syscall_keeping_ymm(long nr, long arg1, long arg2, long arg3,
+                                const struct ymm_regs* in, struct ymm_regs* out) {
+    long ret;
+    register long arg4 __asm__("r10") = 0;
+    register long arg5 __asm__("r8") = 0;
+    register long arg6 __asm__("r9") = 0;
+    __asm__ volatile("vmovdqu 0x00(%[in]), %%ymm8\n"
+                     "vmovdqu 0x20(%[in]), %%ymm9\n"
+                     "vmovdqu 0x40(%[in]), %%ymm10\n"
+                     "vmovdqu 0x60(%[in]), %%ymm11\n"
+                     "syscall\n"
+                     "vmovdqu %%ymm8, 0x00(%[out])\n"
+                     "vmovdqu %%ymm9, 0x20(%[out])\n"
+                     "vmovdqu %%ymm10, 0x40(%[out])\n"
+                     "vmovdqu %%ymm11, 0x60(%[out])\n"
+                     : "=a"(ret)
+                     : "a"(nr), "D"(arg1), "S"(arg2), "d"(arg3), "r"(arg4), "r"(arg5), "r"(arg6),
+                       [in] "r"(in), [out] "r"(out)
+                     : "rcx", "r11", "memory", "xmm8", "xmm9", "xmm10", "xmm11");
+    return ret;
+}
+
+static long futex_op(int op, int val, int me, size_t round) {
+    if (!g_use_avx) {
+        long ret = syscall(SYS_futex, &g_turn, op, val, NULL, NULL, 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    struct ymm_regs pattern, regs;
+    fill_ymm_pattern(&pattern, me, round);
+    long ret = syscall_keeping_ymm(SYS_futex, (long)&g_turn, op, val, &pattern, &regs);
+    if (memcmp(&pattern, &regs, sizeof(regs))) {
+        for (size_t i = 0; i < ARRAY_LEN(regs.qwords); i++)
+            if (regs.qwords[i] != pattern.qwords[i])
+                errx(1, "thread %d, round %zu: YMM%zu qword %zu corrupted: expected %#lx, got %#lx",
+                     me, round, 8 + i / 4, i % 4, pattern.qwords[i], regs.qwords[i]);
+    }
+    return ret;
+}
+
+static void wait_turn(int me, size_t round) {
+    int turn;
+    while ((turn = __atomic_load_n(&g_turn, __ATOMIC_ACQUIRE)) != me) {
+        long ret = futex_op(FUTEX_WAIT_PRIVATE, turn, me, round);
+        if (ret < 0 && ret != -EAGAIN && ret != -EINTR)
+            errx(1, "futex wait failed: %ld", ret);
+    }
+}
+
+static void pass_turn(int me, size_t round) {
+    __atomic_store_n(&g_turn, !me, __ATOMIC_RELEASE);
+    long ret = futex_op(FUTEX_WAKE_PRIVATE, 1, me, round);
+    if (ret < 0)
+        errx(1, "futex wake failed: %ld", ret);
+}
+
+static void ping_pong(int me) {
+    for (size_t i = 0; i < ROUNDS; i++) {
+        wait_turn(me, i);
+        pass_turn(me, i);
+    }
+}
+
+static void pin_to_cpu0(pthread_t thread) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    int ret = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if (ret != 0)
+        errx(1, "pthread_setaffinity_np failed: %d", ret);
+}
+
+static void* peer_thread(void* arg) {
+    (void)arg;
+    ping_pong(/*me=*/1);
+    return NULL;
+}
+
+static void run_round(bool use_avx) {
+    pthread_t peer;
+
+    g_use_avx = use_avx;
+    __atomic_store_n(&g_turn, 0, __ATOMIC_RELEASE);
+
+    if (pthread_create(&peer, NULL, peer_thread, NULL) != 0)
+        errx(1, "pthread_create failed");
+    pin_to_cpu0(peer);
+
+    uint64_t start_ns = time_ns();
+    ping_pong(/*me=*/0);
+    if (pthread_join(peer, NULL) != 0)
+        errx(1, "pthread_join failed");
+    uint64_t elapsed_ns = time_ns() - start_ns;
+
+    printf("%s threads: %lu ns per context switch (%d switches)\n",
+           use_avx ? "AVX-using" : "integer-only", elapsed_ns / (2 * ROUNDS), 2 * ROUNDS);
+}
+
+int main(void) {
+    pin_to_cpu0(pthread_self());
+
+    run_round(/*use_avx=*/false);
+    if (avx_supported())
+        run_round(/*use_avx=*/true);
+    else
+        puts("AVX not supported, skipping AVX-using threads");
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * C10k-style epoll benchmark: registers many idle eventfds (up to ~10k, limited by RLIMIT_NOFILE)
+ * and a single active eventfd in one epoll instance, then repeatedly signals the active eventfd and
+ * waits for it via epoll_wait(). The cost of epoll_wait() should depend on the number of ready fds,
+ * not on the number of registered fds. Prints the average latency of a signal-and-wait round; fails
+ * only on errors or on wrong events, as timings depend on the environment.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_IDLE_FDS 10000
+#define ROUNDS       2000
+
+static int g_idle_fds[MAX_IDLE_FDS];
+
+static uint64_t time_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        err(1, "clock_gettime");
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void add_fd(int epfd, int fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+        err(1, "epoll_ctl(%d)", fd);
+}
+
+static void signal_and_wait(int epfd, int active_fd) {
+    uint64_t val = 1;
+    if (write(active_fd, &val, sizeof(val)) != sizeof(val))
+        err(1, "eventfd write");
+
+    struct epoll_event events[8];
+    int ret = epoll_wait(epfd, events, 8, /*timeout=*/-1);
+    if (ret < 0)
+        err(1, "epoll_wait");
+    if (ret != 1 || events[0].data.fd != active_fd || !(events[0].events & EPOLLIN))
+        errx(1, "epoll_wait returned %d events, expected only EPOLLIN on the active fd", ret);
+
+    if (read(active_fd, &val, sizeof(val)) != sizeof(val))
+        err(1, "eventfd read");
+}
+
+int main(void) {
+    /* leave some fds for the epoll instance, the active eventfd and stdio */
+    struct rlimit rlim = {.rlim_cur = MAX_IDLE_FDS + 100, .rlim_max = MAX_IDLE_FDS + 100};
+    if (setrlimit(RLIMIT_NOFILE, &rlim) < 0 && getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+        err(1, "getrlimit");
+    size_t idle_fds_cnt = MAX_IDLE_FDS;
+    if (rlim.rlim_cur < MAX_IDLE_FDS + 100)
+        idle_fds_cnt = rlim.rlim_cur > 200 ? rlim.rlim_cur - 100 : 100;
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        err(1, "epoll_create1");
+
+    int active_fd = eventfd(0, EFD_NONBLOCK);
+    if (active_fd < 0)
+        err(1, "eventfd");
+    add_fd(epfd, active_fd);
+
+    /* single registered fd, for comparison */
+    uint64_t start_ns = time_ns();
+    for (size_t i = 0; i < ROUNDS; i++)
+        signal_and_wait(epfd, active_fd);
+    printf("1 registered fd: %lu ns per epoll round\n", (time_ns() - start_ns) / ROUNDS);
+
+    for (size_t i = 0; i < idle_fds_cnt; i++) {
+        g_idle_fds[i] = eventfd(0, EFD_NONBLOCK);
+        if (g_idle_fds[i] < 0)
+            err(1, "eventfd (idle #%lu)", i);
+        add_fd(epfd, g_idle_fds[i]);
+    }
+
+    /* the first wait after registration may poll all fds, exclude it from measurements */
+    signal_and_wait(epfd, active_fd);
+
+    start_ns = time_ns();
+    for (size_t i = 0; i < ROUNDS; i++)
+        signal_and_wait(epfd, active_fd);
+    printf("%lu registered fds: %lu ns per epoll round\n", idle_fds_cnt + 1,
+           (time_ns() - start_ns) / ROUNDS);
+
+    for (size_t i = 0; i < idle_fds_cnt; i++)
+        if (close(g_idle_fds[i]) < 0)
+            err(1, "close");
+    if (close(active_fd) < 0 || close(epfd) < 0)
+        err(1, "close");
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Test anonymous MAP_HUGETLB mappings: they must be aligned to the huge-page size, and changing
+ * permissions of a part of such a mapping (which splits the large page in VM/TDX PALs) must keep
+ * the rest of the mapping intact.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define MAPPING_SIZE   (2 * HUGE_PAGE_SIZE)
+
+static void check_pattern(const char* ptr, size_t size, char c) {
+    for (size_t i = 0; i < size; i += 4096)
+        if (ptr[i] != c)
+            errx(1, "unexpected value at offset 0x%lx", i);
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size < 0)
+        err(1, "sysconf");
+
+    char* ptr = mmap(NULL, MAPPING_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (ptr == MAP_FAILED)
+        err(1, "mmap");
+    if ((uintptr_t)ptr % HUGE_PAGE_SIZE)
+        errx(1, "MAP_HUGETLB mapping %p is not aligned to huge-page size", ptr);
+
+    memset(ptr, 'a', MAPPING_SIZE);
+
+    /* make one page in the middle of the first huge page read-only, then writable again */
+    char* ro_page = ptr + HUGE_PAGE_SIZE / 2;
+    if (mprotect(ro_page, page_size, PROT_READ) < 0)
+        err(1, "mprotect(PROT_READ)");
+    check_pattern(ptr, MAPPING_SIZE, 'a');
+
+    memset(ptr, 'b', ro_page - ptr);
+    memset(ro_page + page_size, 'b', ptr + MAPPING_SIZE - (ro_page + page_size));
+
+    if (mprotect(ro_page, page_size, PROT_READ | PROT_WRITE) < 0)
+        err(1, "mprotect(PROT_READ | PROT_WRITE)");
+    memset(ro_page, 'b', page_size);
+    check_pattern(ptr, MAPPING_SIZE, 'b');
+
+    if (munmap(ptr, MAPPING_SIZE) < 0)
+        err(1, "munmap");
+
+    /* unaligned length is rounded up to the huge-page size */
+    ptr = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB,
+               -1, 0);
+    if (ptr == MAP_FAILED)
+        err(1, "mmap");
+    if ((uintptr_t)ptr % HUGE_PAGE_SIZE)
+        errx(1, "MAP_HUGETLB mapping %p is not aligned to huge-page size", ptr);
+    memset(ptr, 'c', HUGE_PAGE_SIZE);
+    check_pattern(ptr, HUGE_PAGE_SIZE, 'c');
+    if (munmap(ptr, HUGE_PAGE_SIZE) < 0)
+        err(1, "munmap");
+
+    /* unsupported huge-page size */
+    ptr = mmap(NULL, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | (25 << MAP_HUGE_SHIFT), -1, 0);
+    if (ptr != MAP_FAILED || errno != EINVAL)
+        errx(1, "mmap with unsupported huge-page size did not fail with EINVAL");
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * mmap/munmap stress benchmark with many VMAs: creates ~100k single-page VMAs separated by
+ * single-page holes (by unmapping every other page of a big mapping), then measures the latency of
+ * mmap() + munmap() of two-page regions, which never fit into any of those holes. Checks that each
+ * such region lies outside the fragmented mapping and is writable, and that an address-hinted mmap
+ * of a single page gets exactly the requested hole. Prints average latencies; fails on errors and
+ * on misplaced mappings, but not on slow calls, as timings depend on the environment.
+ *
+ * Note that natively this requires `vm.max_map_count` to be raised above the default (65530).
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define VMAS_COUNT 100000
+#define ITERATIONS 10000
+
+static uint64_t time_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        err(1, "clock_gettime");
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* writes a byte to every page of [addr, addr + size) and reads it back */
+static void check_writable(char* addr, size_t size, size_t page_size) {
+    for (size_t off = 0; off < size; off += page_size) {
+        *(volatile char*)(addr + off) = 0x42;
+        if (*(volatile char*)(addr + off) != 0x42)
+            errx(1, "write to %p did not stick", addr + off);
+    }
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size < 0)
+        err(1, "sysconf");
+
+    size_t region_size = 2UL * VMAS_COUNT * page_size;
+    char* region = mmap(NULL, region_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (region == MAP_FAILED)
+        err(1, "mmap of %lu bytes", region_size);
+
+    uint64_t start_ns = time_ns();
+    for (size_t i = 0; i < VMAS_COUNT; i++)
+        if (munmap(region + (2 * i + 1) * page_size, page_size) < 0)
+            err(1, "munmap of hole %lu", i);
+    uint64_t elapsed_ns = time_ns() - start_ns;
+    printf("fragmenting munmap: %lu ns per call (%d calls)\n", elapsed_ns / VMAS_COUNT, VMAS_COUNT);
+
+    uint64_t mmap_ns = 0;
+    uint64_t munmap_ns = 0;
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        start_ns = time_ns();
+        char* ptr = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+                         -1, 0);
+        if (ptr == MAP_FAILED)
+            err(1, "mmap");
+        mmap_ns += time_ns() - start_ns;
+
+        if (ptr < region + region_size && ptr + 2 * page_size > region)
+            errx(1, "mmap returned %p, which overlaps the fragmented region [%p, %p)", ptr, region,
+                 region + region_size);
+        check_writable(ptr, 2 * page_size, page_size);
+
+        start_ns = time_ns();
+        if (munmap(ptr, 2 * page_size) < 0)
+            err(1, "munmap");
+        munmap_ns += time_ns() - start_ns;
+    }
+    printf("with %d VMAs: mmap %lu ns, munmap %lu ns per call (%d calls)\n", VMAS_COUNT,
+           mmap_ns / ITERATIONS, munmap_ns / ITERATIONS, ITERATIONS);
+
+    /* the first, a middle and the last hole */
+    size_t holes[] = {0, VMAS_COUNT / 2, VMAS_COUNT - 1};
+    for (size_t i = 0; i < ARRAY_LEN(holes); i++) {
+        char* hole = region + (2 * holes[i] + 1) * page_size;
+        char* ptr = mmap(hole, page_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1,
+                         0);
+        if (ptr == MAP_FAILED)
+            err(1, "mmap of hole %zu", holes[i]);
+        if (ptr != hole)
+            errx(1, "mmap hinted at hole %zu (%p) returned %p", holes[i], hole, ptr);
+        check_writable(ptr, page_size, page_size);
+    }
+
+    if (munmap(region, region_size) < 0)
+        err(1, "munmap of the whole region");
+
+    puts("TEST OK");
+    return 0;
+}
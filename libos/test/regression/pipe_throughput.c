@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Pipe throughput benchmark: a writer thread pushes data through a pipe in big chunks while the
+ * main thread reads and verifies it, first with the default pipe size and then with a 1MB pipe (set
+ * via F_SETPIPE_SZ). A bigger pipe needs fewer wakeups of the reader and the writer. Also checks
+ * F_GETPIPE_SZ, shrinking of a pipe with unread data (must fail with EBUSY or keep the data), and
+ * moving data between pipes via vmsplice() and splice(). Prints the throughput; fails only on errors
+ * or on wrong data, as timings depend on the environment.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TOTAL_SIZE     (64 * 1024 * 1024)
+#define CHUNK_SIZE     (64 * 1024)
+#define BIG_PIPE_SIZE  (1024 * 1024)
+#define PATTERN_PERIOD 251 /* sent bytes repeat with this (prime) period, to verify them */
+
+/* holds the pattern, so that a chunk can be sent starting from any offset in the pattern */
+static char g_send_buf[CHUNK_SIZE + PATTERN_PERIOD];
+static char g_recv_buf[CHUNK_SIZE];
+
+static uint64_t time_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        err(1, "clock_gettime");
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void write_all(int fd, const char* buf, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0)
+            err(1, "write");
+        buf += n;
+        size -= n;
+    }
+}
+
+/* reads exactly `size` bytes and checks that they continue the pattern from `offset` */
+static void read_and_verify(int fd, size_t offset, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        size_t to_read = size - received < CHUNK_SIZE ? size - received : CHUNK_SIZE;
+        ssize_t n = read(fd, g_recv_buf, to_read);
+        if (n < 0)
+            err(1, "read");
+        if (n == 0)
+            errx(1, "unexpected EOF after %zu bytes", received);
+        for (ssize_t i = 0; i < n; i++)
+            if (g_recv_buf[i] != (char)((offset + received + i) % PATTERN_PERIOD))
+                errx(1, "read wrong byte at offset %zu", offset + received + i);
+        received += n;
+    }
+}
+
+static void* writer_thread(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    for (size_t sent = 0; sent < TOTAL_SIZE; sent += CHUNK_SIZE)
+        write_all(fd, g_send_buf + sent % PATTERN_PERIOD, CHUNK_SIZE);
+    return NULL;
+}
+
+static void run_throughput(int pipefds[2]) {
+    int pipe_size = fcntl(pipefds[0], F_GETPIPE_SZ);
+    if (pipe_size < 0)
+        err(1, "fcntl(F_GETPIPE_SZ)");
+
+    pthread_t thread;
+    uint64_t start_ns = time_ns();
+    if (pthread_create(&thread, NULL, writer_thread, (void*)(intptr_t)pipefds[1]) != 0)
+        errx(1, "pthread_create failed");
+
+    read_and_verify(pipefds[0], /*offset=*/0, TOTAL_SIZE);
+
+    if (pthread_join(thread, NULL) != 0)
+        errx(1, "pthread_join failed");
+    uint64_t elapsed_ns = time_ns() - start_ns;
+
+    /* bytes per microsecond is the same as MB per second */
+    printf("pipe size %d: %lu MB/s\n", pipe_size, TOTAL_SIZE / (elapsed_ns / 1000 ?: 1));
+}
+
+int main(void) {
+    setbuf(stdout, NULL);
+
+    for (size_t i = 0; i < sizeof(g_send_buf); i++)
+        g_send_buf[i] = (char)(i % PATTERN_PERIOD);
+
+    int pipefds[2];
+    if (pipe(pipefds) < 0)
+        err(1, "pipe");
+
+    run_throughput(pipefds);
+
+    int ret = fcntl(pipefds[1], F_SETPIPE_SZ, BIG_PIPE_SIZE);
+    if (ret < 0)
+        err(1, "fcntl(F_SETPIPE_SZ)");
+    if (ret < BIG_PIPE_SIZE)
+        errx(1, "fcntl(F_SETPIPE_SZ) returned %d, expected at least %d", ret, BIG_PIPE_SIZE);
+
+    run_throughput(pipefds);
+
+    /* shrinking below the size of unread data must fail (but Gramine may not manage the buffer of
+     * the pipe, e.g. if it's a host pipe, in which case the call succeeds); no data may be lost */
+    write_all(pipefds[1], g_send_buf, 3 * 4096);
+    ret = fcntl(pipefds[0], F_SETPIPE_SZ, 4096);
+    if (ret < 0 && errno != EBUSY)
+        err(1, "fcntl(F_SETPIPE_SZ) with unread data");
+    read_and_verify(pipefds[0], /*offset=*/0, 3 * 4096);
+
+    int pipefds2[2];
+    if (pipe(pipefds2) < 0)
+        err(1, "pipe");
+
+    struct iovec iov[2] = {
+        {.iov_base = g_send_buf, .iov_len = 1000},
+        {.iov_base = g_send_buf + 1000, .iov_len = 3000},
+    };
+    ssize_t n = vmsplice(pipefds[1], iov, 2, /*flags=*/0);
+    if (n < 0)
+        err(1, "vmsplice");
+    if (n != 4000)
+        errx(1, "vmsplice returned %zd, expected 4000", n);
+
+    size_t spliced = 0;
+    while (spliced < 4000) {
+        n = splice(pipefds[0], NULL, pipefds2[1], NULL, 4000 - spliced, /*flags=*/0);
+        if (n < 0)
+            err(1, "splice");
+        if (n == 0)
+            errx(1, "unexpected EOF in splice after %zu bytes", spliced);
+        spliced += n;
+    }
+    read_and_verify(pipefds2[0], /*offset=*/0, 4000);
+
+    if (close(pipefds[0]) < 0 || close(pipefds[1]) < 0 || close(pipefds2[0]) < 0
+            || close(pipefds2[1]) < 0)
+        err(1, "close");
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Many concurrent pollers, each blocked on its own handle: each thread blocks in poll() on the read
+ * end of its own pipe, and the main thread wakes up the threads one by one (in varying order) by
+ * writing a byte into their pipes and waiting for a reply on a separate pipe. Each wakeup must
+ * reach the thread polling this pipe (a lost wakeup makes the test time out), poll() must report
+ * exactly POLLIN, and after each reply no wakeup pipe may be reported as readable.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define THREADS_CNT 8 /* must fit into `sgx.max_threads` of the default manifest */
+#define ROUNDS      200
+
+static int g_wakeup_pipes[THREADS_CNT][2];
+static int g_reply_pipe[2];
+
+/* no wakeup pipe may have data: each byte is consumed by its poller before it replies */
+static void check_no_pending_wakeups(void) {
+    struct pollfd pfds[THREADS_CNT];
+    for (size_t i = 0; i < THREADS_CNT; i++)
+        pfds[i] = (struct pollfd){.fd = g_wakeup_pipes[i][0], .events = POLLIN};
+
+    int ret = poll(pfds, THREADS_CNT, /*timeout=*/0);
+    if (ret < 0)
+        err(1, "poll");
+    if (ret != 0)
+        errx(1, "poll reported %d readable wakeup pipes, expected none", ret);
+}
+
+static void* poller_thread(void* arg) {
+    size_t idx = (size_t)arg;
+    for (size_t i = 0; i < ROUNDS; i++) {
+        struct pollfd pfd = {.fd = g_wakeup_pipes[idx][0], .events = POLLIN};
+        int ret = poll(&pfd, 1, /*timeout=*/-1);
+        if (ret < 0)
+            err(1, "poll");
+        if (ret != 1 || pfd.revents != POLLIN)
+            errx(1, "poll returned %d (revents 0x%x), expected POLLIN", ret, pfd.revents);
+
+        char c;
+        if (read(g_wakeup_pipes[idx][0], &c, 1) != 1)
+            err(1, "read from wakeup pipe");
+        if (write(g_reply_pipe[1], &c, 1) != 1)
+            err(1, "write to reply pipe");
+    }
+    return NULL;
+}
+
+int main(void) {
+    if (pipe(g_reply_pipe) < 0)
+        err(1, "pipe");
+
+    pthread_t threads[THREADS_CNT];
+    for (size_t i = 0; i < THREADS_CNT; i++) {
+        if (pipe(g_wakeup_pipes[i]) < 0)
+            err(1, "pipe");
+        if (pthread_create(&threads[i], NULL, poller_thread, (void*)i) != 0)
+            errx(1, "pthread_create failed");
+    }
+
+    for (size_t i = 0; i < ROUNDS; i++) {
+        for (size_t k = 0; k < THREADS_CNT; k++) {
+            /* wake up the threads in ascending order in even rounds, descending in odd rounds */
+            size_t j = i % 2 ? THREADS_CNT - 1 - k : k;
+            char c = 'a' + j;
+            if (write(g_wakeup_pipes[j][1], &c, 1) != 1)
+                err(1, "write to wakeup pipe");
+
+            char reply;
+            if (read(g_reply_pipe[0], &reply, 1) != 1)
+                err(1, "read from reply pipe");
+            if (reply != c)
+                errx(1, "got reply '%c' instead of '%c'", reply, c);
+
+            check_no_pending_wakeups();
+        }
+    }
+
+    for (size_t i = 0; i < THREADS_CNT; i++)
+        if (pthread_join(threads[i], NULL) != 0)
+            errx(1, "pthread_join failed");
+
+    for (size_t i = 0; i < THREADS_CNT; i++)
+        if (close(g_wakeup_pipes[i][0]) < 0 || close(g_wakeup_pipes[i][1]) < 0)
+            err(1, "close");
+    if (close(g_reply_pipe[0]) < 0 || close(g_reply_pipe[1]) < 0)
+        err(1, "close");
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Threads that busy-wait via sched_yield() must all make progress: a group of threads (possibly
+ * more than vCPUs) advances in lockstep, each thread starting round `r` only after all threads
+ * finished round `r - 1`, and waits for the others by calling sched_yield() in a loop. If the
+ * scheduler ever keeps a runnable thread off the CPUs (e.g. stuck in the run queue of a busy vCPU),
+ * the whole group stops and the test times out. Also checks that every thread did exactly the
+ * expected amount of work.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ROUNDS      2000
+#define MAX_THREADS 8 /* must fit into `sgx.max_threads` of the default manifest */
+
+static size_t g_num_threads;
+static uint64_t g_finished[MAX_THREADS]; /* rounds finished by each thread, accessed atomically */
+static uint64_t g_work[MAX_THREADS];     /* written only by the owner thread */
+
+static uint64_t min_finished(void) {
+    uint64_t min = UINT64_MAX;
+    for (size_t i = 0; i < g_num_threads; i++) {
+        uint64_t finished = __atomic_load_n(&g_finished[i], __ATOMIC_ACQUIRE);
+        if (finished < min)
+            min = finished;
+    }
+    return min;
+}
+
+static void* lockstep_thread(void* arg) {
+    size_t idx = (size_t)arg;
+
+    for (uint64_t round = 0; round < ROUNDS; round++) {
+        while (min_finished() < round)
+            if (sched_yield() < 0)
+                err(1, "sched_yield");
+
+        g_work[idx]++;
+        __atomic_store_n(&g_finished[idx], round + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void run_group(size_t num_threads) {
+    pthread_t threads[MAX_THREADS];
+
+    g_num_threads = num_threads;
+    for (size_t i = 0; i < num_threads; i++) {
+        g_finished[i] = 0;
+        g_work[i] = 0;
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
+        if (pthread_create(&threads[i], NULL, lockstep_thread, (void*)i))
+            errx(1, "pthread_create failed");
+
+    for (size_t i = 0; i < num_threads; i++)
+        if (pthread_join(threads[i], NULL))
+            errx(1, "pthread_join failed");
+
+    for (size_t i = 0; i < num_threads; i++)
+        if (g_work[i] != ROUNDS)
+            errx(1, "thread %zu of %zu did %lu rounds instead of %d", i, num_threads, g_work[i],
+                 ROUNDS);
+}
+
+int main(void) {
+    for (size_t num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2)
+        run_group(num_threads);
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Latency of timeouts: measures how much nanosleep() and poll()/epoll_wait() timeouts overshoot the
+ * requested duration, first in a single thread and then with several threads doing timed waits
+ * concurrently (timeout-heavy workload). Fails if a timeout returns too early or if the average
+ * overshoot is not well below a 100ms timer tick, i.e. if timeouts are not armed at their exact
+ * deadlines. The bound is generous, as latencies depend on the environment; average and max
+ * overshoot are printed for reference.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ITERATIONS   200
+#define SLEEP_US     1000
+#define THREADS_CNT  8 /* must fit into `sgx.max_threads` of the default manifest */
+#define THREAD_ITERS 50
+
+#define MAX_AVG_OVERSHOOT_US 20000
+
+enum wait_kind {
+    WAIT_NANOSLEEP,
+    WAIT_POLL,
+    WAIT_EPOLL,
+};
+
+static const char* g_wait_kind_names[] = {"nanosleep", "poll", "epoll_wait"};
+
+struct latency_stats {
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t cnt;
+};
+
+static int g_pipe_fds[2];
+static int g_epfd;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        err(1, "clock_gettime");
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void timed_wait(enum wait_kind kind, struct latency_stats* stats) {
+    uint64_t start = now_us();
+    switch (kind) {
+        case WAIT_NANOSLEEP: {
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = SLEEP_US * 1000};
+            if (nanosleep(&ts, NULL) < 0)
+                err(1, "nanosleep");
+            break;
+        }
+        case WAIT_POLL: {
+            /* read end of a pipe that never gets data, so poll always times out */
+            struct pollfd pfd = {.fd = g_pipe_fds[0], .events = POLLIN};
+            int ret = poll(&pfd, 1, SLEEP_US / 1000);
+            if (ret != 0)
+                errx(1, "poll returned %d instead of timing out", ret);
+            break;
+        }
+        case WAIT_EPOLL: {
+            struct epoll_event event;
+            int ret = epoll_wait(g_epfd, &event, 1, SLEEP_US / 1000);
+            if (ret != 0)
+                errx(1, "epoll_wait returned %d instead of timing out", ret);
+            break;
+        }
+    }
+    uint64_t elapsed = now_us() - start;
+
+    /* allow some slack for clock granularity */
+    if (elapsed + 100 < SLEEP_US)
+        errx(1, "%s returned too early: after %luus", g_wait_kind_names[kind], elapsed);
+
+    uint64_t overshoot = elapsed > SLEEP_US ? elapsed - SLEEP_US : 0;
+    __atomic_add_fetch(&stats->sum_us, overshoot, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->cnt, 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&stats->max_us, __ATOMIC_RELAXED);
+    while (overshoot > max && !__atomic_compare_exchange_n(&stats->max_us, &max, overshoot,
+                                                           /*weak=*/true, __ATOMIC_RELAXED,
+                                                           __ATOMIC_RELAXED))
+        ;
+}
+
+static void check_stats(int threads_cnt, enum wait_kind kind, struct latency_stats* stats) {
+    uint64_t avg_us = stats->sum_us / stats->cnt;
+    printf("%d thread(s), %s(%dus): avg overshoot %luus, max overshoot %luus (%lu waits)\n",
+           threads_cnt, g_wait_kind_names[kind], SLEEP_US, avg_us, stats->max_us, stats->cnt);
+
+    if (avg_us > MAX_AVG_OVERSHOOT_US)
+        errx(1, "%s timeouts overshoot by %luus on average, expected at most %dus",
+             g_wait_kind_names[kind], avg_us, MAX_AVG_OVERSHOOT_US);
+}
+
+struct thread_args {
+    enum wait_kind kind;
+    struct latency_stats* stats;
+};
+
+static void* thread_func(void* arg) {
+    struct thread_args* args = arg;
+    for (size_t i = 0; i < THREAD_ITERS; i++)
+        timed_wait(args->kind, args->stats);
+    return NULL;
+}
+
+int main(void) {
+    if (pipe(g_pipe_fds) < 0)
+        err(1, "pipe");
+
+    g_epfd = epoll_create1(0);
+    if (g_epfd < 0)
+        err(1, "epoll_create1");
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = g_pipe_fds[0]};
+    if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_pipe_fds[0], &event) < 0)
+        err(1, "epoll_ctl");
+
+    for (enum wait_kind kind = WAIT_NANOSLEEP; kind <= WAIT_EPOLL; kind++) {
+        struct latency_stats stats = {0};
+        for (size_t i = 0; i < ITERATIONS; i++)
+            timed_wait(kind, &stats);
+        check_stats(1, kind, &stats);
+    }
+
+    for (enum wait_kind kind = WAIT_NANOSLEEP; kind <= WAIT_EPOLL; kind++) {
+        struct latency_stats stats = {0};
+        pthread_t threads[THREADS_CNT];
+        struct thread_args args = {.kind = kind, .stats = &stats};
+        for (size_t i = 0; i < THREADS_CNT; i++)
+            if (pthread_create(&threads[i], NULL, thread_func, &args) != 0)
+                errx(1, "pthread_create failed");
+        for (size_t i = 0; i < THREADS_CNT; i++)
+            if (pthread_join(threads[i], NULL) != 0)
+                errx(1, "pthread_join failed");
+        check_stats(THREADS_CNT, kind, &stats);
+    }
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Parallel stream sockets over localhost (in VM/TDX PALs, TCP sockets are emulated via
+ * virtio-vsock, whose interrupts and bottom halves may run on any vCPU): 1, 2 and then 4 streams,
+ * each with its own sender and receiver thread, push data at the same time. Each receiver checks
+ * that it got exactly the bytes sent on its stream, in order; a lost interrupt or notification
+ * makes the test time out.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define SRV_IP           "127.0.0.1"
+#define BYTES_PER_STREAM (8 * 1024 * 1024)
+#define MSG_SIZE         (64 * 1024)
+#define MAX_STREAMS      4 /* each stream has 2 threads, must fit into `sgx.max_threads` */
+
+static pthread_barrier_t g_barrier;
+static int g_listen_fd;
+static uint16_t g_port;
+static char g_send_buf[MSG_SIZE];
+
+static void barrier_wait(void) {
+    int ret = pthread_barrier_wait(&g_barrier);
+    if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
+        errx(1, "pthread_barrier_wait failed");
+}
+
+static void* receiver(void* arg) {
+    (void)arg;
+    char buf[MSG_SIZE];
+
+    int fd = CHECK(accept(g_listen_fd, NULL, NULL));
+    barrier_wait();
+
+    size_t total = 0;
+    while (true) {
+        ssize_t n = CHECK(recv(fd, buf, sizeof(buf), 0));
+        if (n == 0)
+            break;
+        for (ssize_t i = 0; i < n; i++)
+            if (buf[i] != (char)((total + i) % MSG_SIZE))
+                errx(1, "received wrong byte at offset %zu", total + i);
+        total += n;
+    }
+
+    if (total != BYTES_PER_STREAM)
+        errx(1, "received %zu bytes, expected %d", total, BYTES_PER_STREAM);
+
+    CHECK(close(fd));
+    return NULL;
+}
+
+static void* sender(void* arg) {
+    (void)arg;
+
+    int fd = CHECK(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_port = htons(g_port),
+    };
+    if (inet_pton(AF_INET, SRV_IP, &sa.sin_addr) != 1)
+        errx(1, "inet_pton failed");
+    CHECK(connect(fd, (void*)&sa, sizeof(sa)));
+    barrier_wait();
+
+    for (size_t sent = 0; sent < BYTES_PER_STREAM;) {
+        size_t offset = sent % MSG_SIZE;
+        ssize_t n = CHECK(send(fd, g_send_buf + offset, MSG_SIZE - offset, 0));
+        sent += n;
+    }
+
+    CHECK(close(fd));
+    return NULL;
+}
+
+static void run_round(size_t num_streams) {
+    pthread_t receivers[MAX_STREAMS];
+    pthread_t senders[MAX_STREAMS];
+
+    if (pthread_barrier_init(&g_barrier, NULL, 2 * num_streams + 1))
+        errx(1, "pthread_barrier_init failed");
+
+    for (size_t i = 0; i < num_streams; i++) {
+        if (pthread_create(&receivers[i], NULL, receiver, NULL))
+            errx(1, "pthread_create failed");
+        if (pthread_create(&senders[i], NULL, sender, NULL))
+            errx(1, "pthread_create failed");
+    }
+
+    /* all streams start sending only when all connections are established */
+    barrier_wait();
+
+    for (size_t i = 0; i < num_streams; i++) {
+        if (pthread_join(senders[i], NULL))
+            errx(1, "pthread_join failed");
+        if (pthread_join(receivers[i], NULL))
+            errx(1, "pthread_join failed");
+    }
+
+    if (pthread_barrier_destroy(&g_barrier))
+        errx(1, "pthread_barrier_destroy failed");
+}
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(g_send_buf); i++)
+        g_send_buf[i] = (char)i;
+
+    g_listen_fd = CHECK(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_port = 0,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    CHECK(bind(g_listen_fd, (void*)&sa, sizeof(sa)));
+    CHECK(listen(g_listen_fd, MAX_STREAMS));
+
+    socklen_t len = sizeof(sa);
+    CHECK(getsockname(g_listen_fd, (void*)&sa, &len));
+    g_port = ntohs(sa.sin_port);
+
+    for (size_t num_streams = 1; num_streams <= MAX_STREAMS; num_streams *= 2)
+        run_round(num_streams);
+
+    CHECK(close(g_listen_fd));
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Test for write readiness of a stream socket with a small send buffer (over localhost; in VM/TDX
+ * PALs, TCP sockets are emulated via virtio-vsock): after SO_SNDBUF is set, a non-blocking sender
+ * must eventually get EAGAIN (the peer doesn't read), after which poll() must not report POLLOUT.
+ * Once the peer reads all data, poll() must report POLLOUT again. Also verifies the sent data.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define SRV_IP         "127.0.0.1"
+#define SND_BUF_SIZE   (16 * 1024)
+#define CHUNK_SIZE     4096
+#define MAX_SENT_SIZE  (64 * 1024 * 1024) /* guards against a send buffer that is never full */
+#define PATTERN_PERIOD 251 /* sent bytes repeat with this (prime) period, to verify them */
+
+/* holds the pattern, so that a chunk can be sent starting from any offset in the pattern */
+static char g_send_buf[CHUNK_SIZE + PATTERN_PERIOD];
+static char g_recv_buf[CHUNK_SIZE];
+
+static short poll_revents(int fd, short events, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    int ret = CHECK(poll(&pfd, 1, timeout_ms));
+    return ret ? pfd.revents : 0;
+}
+
+int main(void) {
+    setbuf(stdout, NULL);
+
+    for (size_t i = 0; i < sizeof(g_send_buf); i++)
+        g_send_buf[i] = (char)(i % PATTERN_PERIOD);
+
+    int listen_fd = CHECK(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_port = 0,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    CHECK(bind(listen_fd, (void*)&sa, sizeof(sa)));
+    CHECK(listen(listen_fd, 5));
+
+    socklen_t len = sizeof(sa);
+    CHECK(getsockname(listen_fd, (void*)&sa, &len));
+    if (inet_pton(AF_INET, SRV_IP, &sa.sin_addr) != 1)
+        errx(1, "inet_pton failed");
+
+    int fd = CHECK(socket(AF_INET, SOCK_STREAM, 0));
+    int snd_buf_size = SND_BUF_SIZE;
+    CHECK(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &snd_buf_size, sizeof(snd_buf_size)));
+    CHECK(connect(fd, (void*)&sa, sizeof(sa)));
+    int peer_fd = CHECK(accept(listen_fd, NULL, NULL));
+
+    len = sizeof(snd_buf_size);
+    CHECK(getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &snd_buf_size, &len));
+    if (snd_buf_size < SND_BUF_SIZE)
+        errx(1, "getsockopt(SO_SNDBUF) returned %d, expected at least %d", snd_buf_size,
+             SND_BUF_SIZE);
+
+    if (!(poll_revents(fd, POLLOUT, /*timeout_ms=*/0) & POLLOUT))
+        errx(1, "fresh connection is not writable");
+
+    CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
+    size_t sent = 0;
+    while (sent < MAX_SENT_SIZE) {
+        ssize_t n = send(fd, g_send_buf + sent % PATTERN_PERIOD, CHUNK_SIZE, 0);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                err(1, "send");
+            break;
+        }
+        sent += n;
+    }
+    if (sent >= MAX_SENT_SIZE)
+        errx(1, "sent %zu bytes without EAGAIN, send buffer size is not respected", sent);
+    printf("sent %zu bytes before EAGAIN\n", sent);
+
+    if (poll_revents(fd, POLLOUT, /*timeout_ms=*/0) & POLLOUT)
+        errx(1, "connection with full send buffer is writable");
+
+    size_t received = 0;
+    while (received < sent) {
+        ssize_t n = CHECK(recv(peer_fd, g_recv_buf, sizeof(g_recv_buf), 0));
+        if (n == 0)
+            errx(1, "unexpected EOF after %zu bytes", received);
+        for (ssize_t i = 0; i < n; i++)
+            if (g_recv_buf[i] != (char)((received + i) % PATTERN_PERIOD))
+                errx(1, "received wrong byte at offset %zu", received + i);
+        received += n;
+    }
+
+    if (!(poll_revents(fd, POLLOUT, /*timeout_ms=*/10000) & POLLOUT))
+        errx(1, "connection is not writable after the peer read all data");
+
+    CHECK(close(peer_fd));
+    CHECK(close(fd));
+    CHECK(close(listen_fd));
+
+    puts("TEST OK");
+    return 0;
+}
@@ -696,6 +696,15 @@ class TC_30_Syscall(RegressionTestCase):
         stdout, _ = self.run_binary(['file_size'])
         self.assertIn('test completed successfully', stdout)
 
+    def test_031a_file_iops_scaling(self):
+        path = 'tmp/file_iops_scaling'
+        try:
+            stdout, _ = self.run_binary(['file_iops_scaling', path], timeout=120)
+        finally:
+            if os.path.exists(path):
+                os.remove(path)
+        self.assertIn('TEST OK', stdout)
+
     def test_032_large_file(self):
         try:
             stdout, _ = self.run_binary(['large_file'])
@@ -849,6 +858,10 @@ class TC_30_Syscall(RegressionTestCase):
         self.assertIn('Child process done', stdout)
         self.assertIn('Parent process done', stdout)
 
+    def test_052a_trusted_file_reread(self):
+        stdout, _ = self.run_binary(['trusted_file_reread'], timeout=60)
+        self.assertIn('TEST OK', stdout)
+
     @unittest.skipUnless(HAS_SGX, 'Sealed (protected) files are only available with SGX')
     def test_053_mmap_file_backed_protected(self):
         # create the protected file
@@ -884,6 +897,11 @@ class TC_30_Syscall(RegressionTestCase):
         stdout, _ = self.run_binary(['mmap_file_emulated', path])
         self.assertIn('TEST OK', stdout)
 
+    def test_055a_tmpfs_sparse(self):
+        path = '/mnt/tmpfs/test_sparse'
+        stdout, _ = self.run_binary(['tmpfs_sparse', path])
+        self.assertIn('TEST OK', stdout)
+
     def test_056_mmap_emulated_enc(self):
         path = 'tmp_enc/test_mmap'
         os.makedirs('tmp_enc', exist_ok=True)
@@ -914,6 +932,18 @@ class TC_30_Syscall(RegressionTestCase):
         stdout, _ = self.run_binary(['munmap'])
         self.assertIn('TEST OK', stdout)
 
+    def test_05B_mmap_hugetlb(self):
+        stdout, _ = self.run_binary(['mmap_hugetlb'])
+        self.assertIn('TEST OK', stdout)
+
+    def test_05C_mmap_many_vmas(self):
+        stdout, _ = self.run_binary(['mmap_many_vmas'], timeout=120)
+        self.assertIn('TEST OK', stdout)
+
+    def test_05D_user_ptr_check_concurrent(self):
+        stdout, _ = self.run_binary(['user_ptr_check_concurrent'], timeout=120)
+        self.assertIn('TEST OK', stdout)
+
     def test_060_sigaltstack(self):
         stdout, _ = self.run_binary(['sigaltstack'])
 
@@ -965,6 +995,19 @@ class TC_30_Syscall(RegressionTestCase):
         # Scheduling Syscalls Test
         self.assertIn('Test completed successfully', stdout)
 
+    def test_081_sched_yield_lockstep(self):
+        stdout, _ = self.run_binary(['sched_yield_lockstep'], timeout=60)
+        self.assertIn('TEST OK', stdout)
+
+    @unittest.skipUnless(ON_X86, 'x86-specific')
+    def test_082_context_switch(self):
+        stdout, _ = self.run_binary(['context_switch'], timeout=60)
+        self.assertIn('TEST OK', stdout)
+
+    def test_083_thread_stack_reuse(self):
+        stdout, _ = self.run_binary(['thread_stack_reuse'], timeout=60)
+        self.assertIn('TEST OK', stdout)
+
     def test_090_sighandler_reset(self):
         stdout, _ = self.run_binary(['sighandler_reset'])
         self.assertIn('Got signal %d' % signal.SIGCHLD, stdout)
@@ -1019,6 +1062,14 @@ class TC_30_Syscall(RegressionTestCase):
         stdout, _ = self.run_binary(['gettimeofday'])
         self.assertIn('TEST OK', stdout)
 
+    def test_104_sleep_latency(self):
+        stdout, _ = self.run_binary(['sleep_latency'], timeout=60)
+        self.assertIn('TEST OK', stdout)
+
+    def test_105_time_query_latency(self):
+        stdout, _ = self.run_binary(['time_query_latency'], timeout=60)
+        self.assertIn('TEST OK', stdout)
+
     def test_110_fcntl_lock(self):
         try:
             stdout, _ = self.run_binary(['fcntl_lock'])
@@ -1443,6 +1494,10 @@ class TC_80_Socket(RegressionTestCase):
         stdout, _ = self.run_binary(['epoll_epollet'])
         self.assertIn('TEST OK', stdout)
 
+    def test_012_epoll_c10k(self):
+        stdout, _ = self.run_binary(['epoll_c10k'], timeout=60)
+        self.assertIn('TEST OK', stdout)
+
     def test_020_poll(self):
         try:
             stdout, _ = self.run_binary(['poll'])
@@ -1461,6 +1516,10 @@ class TC_80_Socket(RegressionTestCase):
         self.assertIn('read on pipe: Hello from write end of pipe!', stdout)
         self.assertIn('the peer closed its end of the pipe', stdout)
 
+    def test_023_poll_many_waiters(self):
+        stdout, _ = self.run_binary(['poll_many_waiters'], timeout=60)
+        self.assertIn('TEST OK', stdout)
+
     def test_030_ppoll(self):
         stdout, _ = self.run_binary(['ppoll'])
         self.assertIn('ppoll(POLLOUT) returned 1 file descriptors', stdout)
@@ -1493,6 +1552,10 @@ class TC_80_Socket(RegressionTestCase):
         stdout, _ = self.run_binary(['pipe_ocloexec'])
         self.assertIn('TEST OK', stdout)
 
+    def test_093_pipe_throughput(self):
+        stdout, _ = self.run_binary(['pipe_throughput'], timeout=120)
+        self.assertIn('TEST OK', stdout)
+
     def test_095_mkfifo(self):
         try:
             stdout, _ = self.run_binary(['mkfifo'], timeout=60)
@@ -1518,6 +1581,18 @@ class TC_80_Socket(RegressionTestCase):
         stdout, _ = self.run_binary(['tcp_ancillary'])
         self.assertIn('TEST OK', stdout)
 
+    def test_302_socket_tcp_throughput(self):
+        stdout, _ = self.run_binary(['tcp_throughput'], timeout=120)
+        self.assertIn('TEST OK', stdout)
+
+    def test_303_socket_tcp_parallel_streams(self):
+        stdout, _ = self.run_binary(['tcp_parallel_streams'], timeout=120)
+        self.assertIn('TEST OK', stdout)
+
+    def test_304_socket_tcp_sndbuf_poll(self):
+        stdout, _ = self.run_binary(['tcp_sndbuf_poll'])
+        self.assertIn('TEST OK', stdout)
+
     # Two tests for a responsive peer: first connect() returns EINPROGRESS, then poll/epoll
     # immediately returns because the connection is quickly refused
     def test_305_socket_tcp_einprogress_responsive_poll(self):
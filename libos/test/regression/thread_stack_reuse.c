@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Thread stacks are recycled (thread-per-request servers): repeatedly spawns a batch of short-lived
+ * threads and reaps them, then does the same with a single thread at a time. While all threads of
+ * a batch are alive, each of them fills a buffer on its stack with its own tag and checks that the
+ * stacks of the other threads don't overlap with this buffer and that the buffer wasn't overwritten
+ * by them, i.e. a stack is never handed out twice or while its previous owner is still running.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ROUNDS       500
+#define BATCH_SIZE   8 /* must fit into `sgx.max_threads` of the default manifest */
+#define STACK_BUF_SZ (16 * 1024)
+
+static pthread_barrier_t g_barrier;
+static size_t g_batch_size;
+static uintptr_t g_stack_bufs[BATCH_SIZE]; /* address of the stack buffer of each live thread */
+
+static void barrier_wait(void) {
+    int ret = pthread_barrier_wait(&g_barrier);
+    if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
+        errx(1, "pthread_barrier_wait failed");
+}
+
+static void* thread_func(void* arg) {
+    uintptr_t tag = (uintptr_t)arg;
+    size_t idx = tag % BATCH_SIZE;
+    volatile char buf[STACK_BUF_SZ];
+
+    memset((char*)buf, (int)tag, sizeof(buf));
+    g_stack_bufs[idx] = (uintptr_t)buf;
+
+    /* all threads of the batch are alive and have filled their buffers */
+    barrier_wait();
+
+    for (size_t i = 0; i < g_batch_size; i++) {
+        if (i == idx)
+            continue;
+        if (g_stack_bufs[i] < (uintptr_t)buf + sizeof(buf)
+                && (uintptr_t)buf < g_stack_bufs[i] + sizeof(buf))
+            errx(1, "stack buffers of live threads %zu and %zu overlap", idx, i);
+    }
+    for (size_t i = 0; i < sizeof(buf); i++)
+        if (buf[i] != (char)tag)
+            errx(1, "stack buffer of thread %zu was overwritten at offset %zu", idx, i);
+
+    /* don't exit (and release the stack) before the others finished their checks */
+    barrier_wait();
+    return (void*)tag;
+}
+
+static void run_rounds(size_t batch_size) {
+    pthread_t threads[BATCH_SIZE];
+
+    g_batch_size = batch_size;
+    if (pthread_barrier_init(&g_barrier, NULL, batch_size))
+        errx(1, "pthread_barrier_init failed");
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < batch_size; i++) {
+            uintptr_t tag = round * BATCH_SIZE + i;
+            if (pthread_create(&threads[i], NULL, thread_func, (void*)tag))
+                errx(1, "pthread_create failed");
+        }
+
+        for (size_t i = 0; i < batch_size; i++) {
+            void* ret;
+            if (pthread_join(threads[i], &ret))
+                errx(1, "pthread_join failed");
+            if ((uintptr_t)ret != round * BATCH_SIZE + i)
+                errx(1, "thread %zu returned %lu", i, (uintptr_t)ret);
+        }
+    }
+
+    if (pthread_barrier_destroy(&g_barrier))
+        errx(1, "pthread_barrier_destroy failed");
+}
+
+int main(void) {
+    run_rounds(BATCH_SIZE);
+    run_rounds(1);
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Latency benchmark for time queries: measures the cost of clock_gettime(), gettimeofday() and
+ * time() as called via libc (which uses the vDSO, if available) and of clock_gettime() called as a
+ * raw syscall. Also checks that the time returned by both paths never goes backwards when they are
+ * interleaved. Prints ns per call; fails only on errors or inconsistent time, as timings depend on
+ * the environment.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ITERATIONS 1000000
+
+enum query_kind {
+    QUERY_CLOCK_GETTIME,
+    QUERY_GETTIMEOFDAY,
+    QUERY_TIME,
+    QUERY_CLOCK_GETTIME_SYSCALL,
+};
+
+static const char* g_query_kind_names[] = {"clock_gettime", "gettimeofday", "time",
+                                           "clock_gettime (raw syscall)"};
+
+static uint64_t timespec_to_ns(struct timespec* ts) {
+    return ts->tv_sec * 1000000000UL + ts->tv_nsec;
+}
+
+static uint64_t time_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        err(1, "clock_gettime");
+    return timespec_to_ns(&ts);
+}
+
+static void query_time(enum query_kind kind) {
+    switch (kind) {
+        case QUERY_CLOCK_GETTIME: {
+            struct timespec ts;
+            if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+                err(1, "clock_gettime");
+            break;
+        }
+        case QUERY_GETTIMEOFDAY: {
+            struct timeval tv;
+            if (gettimeofday(&tv, NULL) < 0)
+                err(1, "gettimeofday");
+            break;
+        }
+        case QUERY_TIME: {
+            if (time(NULL) == (time_t)-1)
+                err(1, "time");
+            break;
+        }
+        case QUERY_CLOCK_GETTIME_SYSCALL: {
+            struct timespec ts;
+            if (syscall(SYS_clock_gettime, CLOCK_REALTIME, &ts) < 0)
+                err(1, "clock_gettime syscall");
+            break;
+        }
+    }
+}
+
+static void check_consistency(void) {
+    uint64_t prev_ns = 0;
+    for (size_t i = 0; i < ITERATIONS / 10; i++) {
+        struct timespec ts;
+        if (i % 2 == 0) {
+            if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+                err(1, "clock_gettime");
+        } else {
+            if (syscall(SYS_clock_gettime, CLOCK_REALTIME, &ts) < 0)
+                err(1, "clock_gettime syscall");
+        }
+        uint64_t curr_ns = timespec_to_ns(&ts);
+        if (curr_ns < prev_ns)
+            errx(1, "time went backwards by %luns (iteration %zu)", prev_ns - curr_ns, i);
+        prev_ns = curr_ns;
+    }
+}
+
+int main(void) {
+    setbuf(stdout, NULL);
+
+    check_consistency();
+
+    for (enum query_kind kind = QUERY_CLOCK_GETTIME; kind <= QUERY_CLOCK_GETTIME_SYSCALL; kind++) {
+        uint64_t start_ns = time_ns();
+        for (size_t i = 0; i < ITERATIONS; i++)
+            query_time(kind);
+        uint64_t elapsed_ns = time_ns() - start_ns;
+
+        printf("%s: %lu ns per call (%d calls)\n", g_query_kind_names[kind],
+               elapsed_ns / ITERATIONS, ITERATIONS);
+    }
+
+    puts("TEST OK");
+    return 0;
+}
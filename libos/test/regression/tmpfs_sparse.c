@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Sparse files and appends on tmpfs (the path is given as argument). Writes a few bytes far beyond
+ * the end of an empty file (which must not allocate the whole gap), checks that the hole reads as
+ * zeros, appends many small chunks, shrinks and grows the file (the truncated part must read as
+ * zeros again), and maps a sparse region with MAP_SHARED: data written through the mapping must be
+ * visible via read() after msync().
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define FAR_OFFSET     (8UL * 1024 * 1024 * 1024)
+#define APPEND_CHUNK   100
+#define APPEND_COUNT   10000
+#define MAP_FILE_SIZE  (1024 * 1024)
+#define MAP_DATA_OFF   (MAP_FILE_SIZE / 2 + 123)
+
+static char g_buf[64 * 1024];
+
+static void pread_exact(int fd, void* buf, size_t size, off_t offset) {
+    ssize_t n = pread(fd, buf, size, offset);
+    if (n < 0)
+        err(1, "pread");
+    if ((size_t)n != size)
+        errx(1, "pread at %ld: got %zd bytes instead of %zu", (long)offset, n, size);
+}
+
+static void pwrite_exact(int fd, const void* buf, size_t size, off_t offset) {
+    ssize_t n = pwrite(fd, buf, size, offset);
+    if (n < 0)
+        err(1, "pwrite");
+    if ((size_t)n != size)
+        errx(1, "pwrite at %ld: wrote %zd bytes instead of %zu", (long)offset, n, size);
+}
+
+static void check_zeros(int fd, off_t offset, size_t size) {
+    while (size > 0) {
+        size_t chunk = size < sizeof(g_buf) ? size : sizeof(g_buf);
+        pread_exact(fd, g_buf, chunk, offset);
+        for (size_t i = 0; i < chunk; i++)
+            if (g_buf[i] != 0)
+                errx(1, "non-zero byte at offset %ld", (long)(offset + i));
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+static void test_far_write(int fd) {
+    pwrite_exact(fd, "sparse", 6, FAR_OFFSET);
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size != (off_t)(FAR_OFFSET + 6))
+        errx(1, "wrong size after far write: %ld", (long)size);
+
+    check_zeros(fd, 0, sizeof(g_buf));
+    check_zeros(fd, FAR_OFFSET - sizeof(g_buf), sizeof(g_buf));
+
+    char data[6];
+    pread_exact(fd, data, sizeof(data), FAR_OFFSET);
+    if (memcmp(data, "sparse", sizeof(data)))
+        errx(1, "wrong data after far write");
+
+    if (ftruncate(fd, 0) < 0)
+        err(1, "ftruncate");
+}
+
+static void test_appends(int fd) {
+    char chunk[APPEND_CHUNK];
+    for (size_t i = 0; i < APPEND_COUNT; i++) {
+        memset(chunk, 'a' + i % 26, sizeof(chunk));
+        pwrite_exact(fd, chunk, sizeof(chunk), i * APPEND_CHUNK);
+    }
+
+    for (size_t i = 0; i < APPEND_COUNT; i++) {
+        pread_exact(fd, chunk, sizeof(chunk), i * APPEND_CHUNK);
+        for (size_t j = 0; j < sizeof(chunk); j++)
+            if (chunk[j] != (char)('a' + i % 26))
+                errx(1, "wrong data in appended chunk %zu", i);
+    }
+
+    /* shrink to the middle of a page and grow back: the cut part must read as zeros */
+    off_t cut = APPEND_COUNT * APPEND_CHUNK / 2 + 7;
+    if (ftruncate(fd, cut) < 0)
+        err(1, "ftruncate");
+    if (ftruncate(fd, APPEND_COUNT * APPEND_CHUNK) < 0)
+        err(1, "ftruncate");
+    check_zeros(fd, cut, APPEND_COUNT * APPEND_CHUNK - cut);
+
+    if (ftruncate(fd, 0) < 0)
+        err(1, "ftruncate");
+}
+
+static void test_mmap(int fd) {
+    if (ftruncate(fd, MAP_FILE_SIZE) < 0)
+        err(1, "ftruncate");
+    pwrite_exact(fd, "data", 4, MAP_DATA_OFF);
+
+    char* addr = mmap(NULL, MAP_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        err(1, "mmap");
+
+    for (size_t i = 0; i < MAP_FILE_SIZE; i++) {
+        if (i >= MAP_DATA_OFF && i < MAP_DATA_OFF + 4) {
+            if (addr[i] != "data"[i - MAP_DATA_OFF])
+                errx(1, "wrong data in mapping at offset %zu", i);
+        } else if (addr[i] != 0) {
+            errx(1, "non-zero byte in mapping at offset %zu", i);
+        }
+    }
+
+    memcpy(addr + 10, "mapped", 6);
+    if (msync(addr, MAP_FILE_SIZE, MS_SYNC) < 0)
+        err(1, "msync");
+    if (munmap(addr, MAP_FILE_SIZE) < 0)
+        err(1, "munmap");
+
+    char data[6];
+    pread_exact(fd, data, sizeof(data), 10);
+    if (memcmp(data, "mapped", sizeof(data)))
+        errx(1, "data written via mapping not visible via read()");
+    check_zeros(fd, 16, MAP_DATA_OFF - 16);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2)
+        errx(1, "Usage: %s <path>", argv[0]);
+
+    int fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        err(1, "open");
+
+    test_far_write(fd);
+    test_appends(fd);
+    test_mmap(fd);
+
+    if (close(fd) < 0)
+        err(1, "close");
+    if (unlink(argv[1]) < 0)
+        err(1, "unlink");
+
+    puts("TEST OK");
+    return 0;
+}
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * Benchmark for repeated accesses to a trusted file (the test binary itself, which is trusted in
+ * the manifest): the file is read many times via small unaligned pread() calls and mapped many
+ * times, which re-verifies the same file chunks over and over unless verified chunks are cached.
+ * Contents are compared against a single whole-file read. Prints the time per pass; fails only on
+ * errors or on mismatching contents, as timings depend on the environment.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS     20
+#define SMALL_READ 1000
+
+static uint64_t time_us(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        err(1, "clock_gettime");
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void read_exactly(int fd, char* buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t ret = pread(fd, buf + done, size - done, offset + done);
+        if (ret < 0)
+            err(1, "pread");
+        if (ret == 0)
+            errx(1, "unexpected EOF at offset %lu", offset + done);
+        done += ret;
+    }
+}
+
+int main(int argc, char** argv) {
+    int fd = open(argv[0], O_RDONLY);
+    if (fd < 0)
+        err(1, "open(%s)", argv[0]);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        err(1, "fstat");
+    size_t size = st.st_size;
+
+    char* expected = malloc(size);
+    char* buf = malloc(SMALL_READ);
+    if (!expected || !buf)
+        errx(1, "out of memory");
+    read_exactly(fd, expected, size, 0);
+
+    uint64_t start_us = time_us();
+    for (size_t i = 0; i < ROUNDS; i++) {
+        for (size_t offset = 0; offset < size; offset += SMALL_READ) {
+            size_t read_size = size - offset < SMALL_READ ? size - offset : SMALL_READ;
+            read_exactly(fd, buf, read_size, offset);
+            if (memcmp(buf, expected + offset, read_size))
+                errx(1, "pread: contents mismatch at offset %lu", offset);
+        }
+    }
+    printf("small preads: %lu us per pass over %lu bytes\n", (time_us() - start_us) / ROUNDS,
+           size);
+
+    start_us = time_us();
+    for (size_t i = 0; i < ROUNDS; i++) {
+        char* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            err(1, "mmap");
+        if (memcmp(addr, expected, size))
+            errx(1, "mmap: contents mismatch");
+        if (munmap(addr, size) < 0)
+            err(1, "munmap");
+    }
+    printf("mmaps: %lu us per pass over %lu bytes\n", (time_us() - start_us) / ROUNDS, size);
+
+    free(buf);
+    free(expected);
+    if (close(fd) < 0)
+        err(1, "close");
+
+    puts("TEST OK");
+    return 0;
+}
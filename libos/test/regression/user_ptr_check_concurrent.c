@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/* Copyright (C) 2023 Intel Corporation */
+
+/*
+ * User-pointer checks (VMA lookups) racing with VMA tree modifications: reader threads call uname()
+ * in a loop, which does nothing but validate the user buffer and copy a static structure, while
+ * another thread keeps mapping, splitting (via mprotect) and unmapping regions. The readers'
+ * buffers are never touched by the other thread, so uname() must always succeed on a writable
+ * buffer (also if it spans two adjacent mappings) and always fail with EFAULT on a read-only one,
+ * no matter how the tree is rebalanced meanwhile.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#define READERS_CNT      8 /* must fit into `sgx.max_threads` of the default manifest */
+#define MIN_CALLS        10000
+#define MUTATOR_ROUNDS   2000
+#define MUTATOR_PAGES    16
+
+static size_t g_page_size;
+static struct utsname* g_writable_buf; /* spans two adjacent writable mappings */
+static struct utsname* g_readonly_buf;
+static bool g_mutator_done;
+
+static void* reader_thread(void* arg) {
+    (void)arg;
+
+    for (size_t i = 0; i < MIN_CALLS || !__atomic_load_n(&g_mutator_done, __ATOMIC_ACQUIRE); i++) {
+        if (uname(g_writable_buf) < 0)
+            err(1, "uname on a writable buffer");
+
+        errno = 0;
+        if (uname(g_readonly_buf) == 0 || errno != EFAULT)
+            errx(1, "uname on a read-only buffer didn't fail with EFAULT (errno %d)", errno);
+    }
+    return NULL;
+}
+
+static void* mutator_thread(void* arg) {
+    (void)arg;
+
+    for (size_t i = 0; i < MUTATOR_ROUNDS; i++) {
+        size_t size = MUTATOR_PAGES * g_page_size;
+        char* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            err(1, "mmap");
+
+        /* split the mapping into one VMA per page */
+        for (size_t j = 1; j < MUTATOR_PAGES; j += 2)
+            if (mprotect(addr + j * g_page_size, g_page_size, PROT_READ) < 0)
+                err(1, "mprotect");
+
+        if (munmap(addr, size) < 0)
+            err(1, "munmap");
+    }
+
+    __atomic_store_n(&g_mutator_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int main(void) {
+    g_page_size = sysconf(_SC_PAGESIZE);
+
+    /* writable buffer crosses the boundary of two VMAs (with different protections, so that they
+     * are not merged) */
+    char* addr = mmap(NULL, 3 * g_page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        err(1, "mmap");
+    if (mprotect(addr + g_page_size, g_page_size, PROT_READ | PROT_WRITE | PROT_EXEC) < 0)
+        err(1, "mprotect");
+    g_writable_buf = (struct utsname*)(addr + g_page_size - sizeof(struct utsname) / 2);
+
+    char* ro_addr = mmap(NULL, g_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ro_addr == MAP_FAILED)
+        err(1, "mmap");
+    g_readonly_buf = (struct utsname*)ro_addr;
+
+    pthread_t readers[READERS_CNT];
+    pthread_t mutator;
+    for (size_t i = 0; i < READERS_CNT; i++)
+        if (pthread_create(&readers[i], NULL, reader_thread, NULL))
+            errx(1, "pthread_create failed");
+    if (pthread_create(&mutator, NULL, mutator_thread, NULL))
+        errx(1, "pthread_create failed");
+
+    for (size_t i = 0; i < READERS_CNT; i++)
+        if (pthread_join(readers[i], NULL))
+            errx(1, "pthread_join failed");
+    if (pthread_join(mutator, NULL))
+        errx(1, "pthread_join failed");
+
+    if (munmap(addr, 3 * g_page_size) < 0 || munmap(ro_addr, g_page_size) < 0)
+        err(1, "munmap");
+
+    puts("TEST OK");
+    return 0;
+}
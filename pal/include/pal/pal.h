@@ -125,6 +125,21 @@ struct pal_dns_host_conf {
     char hostname[PAL_HOSTNAME_MAX];
 };
 
+/*!
+ * \brief Parameters for computing the current time (in microseconds) directly from the TSC.
+ *
+ * Time is `start_us + (((RDTSC - start_tsc) * mult) >> shift)`, where the multiplication is done in
+ * 128 bits. Filled only by PALs that use the raw TSC as their time source (VM and TDX); `mult` is
+ * zero in other PALs. The values do not change after PAL initialization. Used by the LibOS vDSO to
+ * serve time queries without leaving user mode.
+ */
+struct pal_tsc_time_info {
+    uint64_t start_tsc;
+    uint64_t start_us;
+    uint64_t mult;
+    uint32_t shift;
+};
+
 /* Part of PAL state which is shared between all PALs and accessible (read-only) by the binary
  * started by PAL (usually our LibOS). */
 struct pal_public_state {
@@ -161,6 +176,11 @@ struct pal_public_state {
      */
     uint64_t vm_user_rip_offset;
 
+    /*
+     * Time
+     */
+    struct pal_tsc_time_info tsc_time_info; /*!< for time queries without PAL calls, see above */
+
     /*
      * Host information
      */
@@ -490,6 +510,11 @@ typedef struct _PAL_STREAM_ATTR {
             bool tcp_nodelay;
             bool ipv6_v6only;
         } socket;
+        struct {
+            /* capacity of the pipe buffer in bytes; 0 if it is managed by the host (set requests
+             * with 0 or on such pipes are ignored) */
+            size_t buf_size;
+        } pipe;
     };
 } PAL_STREAM_ATTR;
 
@@ -832,6 +857,28 @@ typedef uint32_t pal_wait_flags_t; /* bitfield */
 int PalStreamsWaitEvents(size_t count, PAL_HANDLE* handle_array, pal_wait_flags_t* events,
                          pal_wait_flags_t* ret_events, uint64_t* timeout_us);
 
+typedef void (*pal_stream_notify_cb_t)(void* arg);
+
+/*!
+ * \brief Install a readiness callback on a stream handle.
+ *
+ * \param handle    Stream handle (pipe, socket, eventfd).
+ * \param callback  Callback to install, or `NULL` to uninstall the current one.
+ * \param arg       Argument passed to \p callback.
+ *
+ * \returns 0 on success, negative error code on failure (`-PAL_ERROR_NOTSUPPORT` if this PAL or
+ *          this type of handle cannot report readiness changes).
+ *
+ * After a successful call, \p callback is invoked each time the events reported for \p handle by
+ * #PalStreamsWaitEvents may have changed (data arrived, buffer space freed, the peer closed, etc.),
+ * so that the caller needs to poll only the handles that were notified. The callback may be invoked
+ * from any thread (including PAL-internal ones) and with PAL-internal locks held, so it must not
+ * block; the only PAL call it may make is a write to a non-blocking pipe that has no callback
+ * installed. After uninstalling returns, the previous callback is not running and will not be
+ * invoked anymore. A handle has at most one callback.
+ */
+int PalStreamSetNotify(PAL_HANDLE handle, pal_stream_notify_cb_t callback, void* arg);
+
 /*!
  * \brief Close and deallocate a PAL handle.
  */
@@ -89,6 +89,10 @@ struct handle_ops {
 
     /* 'rename' is used to change name of a stream, or reset its share option */
     int (*rename)(PAL_HANDLE handle, const char* type, const char* uri);
+
+    /* 'setnotify' is used by PalStreamSetNotify. It installs (or uninstalls) a readiness callback
+     * on a stream handle */
+    int (*setnotify)(PAL_HANDLE handle, pal_stream_notify_cb_t callback, void* arg);
 };
 
 extern const struct handle_ops* g_pal_handle_ops[];
@@ -46,6 +46,8 @@ struct A {
     struct avl_tree_node node;
     int64_t key;
     bool freed;
+    /* augmented data: number of nodes in the subtree rooted at this node */
+    size_t subtree_size;
 };
 
 static struct A* node2struct(struct avl_tree_node* node) {
@@ -60,9 +62,18 @@ static bool cmp_gen(void* x, struct avl_tree_node* y) {
     return *(int64_t*)x <= node2struct(y)->key;
 }
 
+static size_t node_subtree_size(struct avl_tree_node* node) {
+    return node ? node2struct(node)->subtree_size : 0;
+}
+
+static void update(struct avl_tree_node* node) {
+    node2struct(node)->subtree_size = node_subtree_size(node->left) + 1
+                                      + node_subtree_size(node->right);
+}
+
 #define ELEMENTS_COUNT 0x1000
 #define RAND_DEL_COUNT 0x100
-static struct avl_tree tree = {.root = NULL, .cmp = cmp};
+static struct avl_tree tree = {.root = NULL, .cmp = cmp, .update = update};
 static struct A t[ELEMENTS_COUNT];
 
 __attribute__((unused)) static void debug_print(struct avl_tree_node* node) {
@@ -85,12 +96,36 @@ static size_t get_tree_size(struct avl_tree_node* node) {
     return get_tree_size(node->left) + 1 + get_tree_size(node->right);
 }
 
+/* Checks that augmented data of every node in the subtree is up to date. Sets `*size` to the number
+ * of nodes in the subtree. */
+static bool is_augmented_data_valid(struct avl_tree_node* node, size_t* size) {
+    if (!node) {
+        *size = 0;
+        return true;
+    }
+
+    size_t left_size;
+    size_t right_size;
+    if (!is_augmented_data_valid(node->left, &left_size)
+            || !is_augmented_data_valid(node->right, &right_size)) {
+        return false;
+    }
+
+    *size = left_size + 1 + right_size;
+    return node2struct(node)->subtree_size == *size;
+}
+
+static bool is_tree_valid(void) {
+    size_t size;
+    return debug_avl_tree_is_balanced(&tree) && is_augmented_data_valid(tree.root, &size);
+}
+
 static void try_node_swap(struct avl_tree_node* node, struct avl_tree_node* swap_node) {
     avl_tree_swap_node(&tree, node, swap_node);
     node->left   = (void*)1;
     node->right  = (void*)2;
     node->parent = (void*)3;
-    if (!debug_avl_tree_is_balanced(&tree)) {
+    if (!is_tree_valid()) {
         EXIT_UNBALANCED();
     }
     size_t size = get_tree_size(tree.root);
@@ -103,7 +138,7 @@ static void try_node_swap(struct avl_tree_node* node, struct avl_tree_node* swap
     swap_node->left   = (void*)1;
     swap_node->right  = (void*)2;
     swap_node->parent = (void*)3;
-    if (!debug_avl_tree_is_balanced(&tree)) {
+    if (!is_tree_valid()) {
         EXIT_UNBALANCED();
     }
     size = get_tree_size(tree.root);
@@ -120,7 +155,7 @@ static void do_test(int32_t (*get_num)(void)) {
         t[i].key   = get_num();
         t[i].freed = false;
         avl_tree_insert(&tree, &t[i].node);
-        if (!debug_avl_tree_is_balanced(&tree)) {
+        if (!is_tree_valid()) {
             EXIT_UNBALANCED();
         }
     }
@@ -198,7 +233,7 @@ static void do_test(int32_t (*get_num)(void)) {
     /* get_num returns int32_t, but tmp.key is a int64_t, so this cannot overflow. */
     struct A tmp = {.key = val + 100};
     avl_tree_insert(&tree, &tmp.node);
-    if (!debug_avl_tree_is_balanced(&tree)) {
+    if (!is_tree_valid()) {
         EXIT_UNBALANCED();
     }
 
@@ -223,7 +258,7 @@ static void do_test(int32_t (*get_num)(void)) {
     }
 
     avl_tree_delete(&tree, &tmp.node);
-    if (!debug_avl_tree_is_balanced(&tree)) {
+    if (!is_tree_valid()) {
         EXIT_UNBALANCED();
     }
 
@@ -234,7 +269,7 @@ static void do_test(int32_t (*get_num)(void)) {
             t[r].freed = true;
             avl_tree_delete(&tree, &t[r].node);
             i--;
-            if (!debug_avl_tree_is_balanced(&tree)) {
+            if (!is_tree_valid()) {
                 EXIT_UNBALANCED();
             }
         }
@@ -243,7 +278,7 @@ static void do_test(int32_t (*get_num)(void)) {
         if (!t[i].freed) {
             avl_tree_delete(&tree, &t[i].node);
             t[i].freed = true;
-            if (!debug_avl_tree_is_balanced(&tree)) {
+            if (!is_tree_valid()) {
                 EXIT_UNBALANCED();
             }
         }
@@ -261,7 +296,7 @@ static void test_ordering(void) {
     for (i = ELEMENTS_COUNT - 1; i >= 0; i--) {
         t[i].key = i / (ELEMENTS_COUNT / DIFF_ELEMENTS);
         avl_tree_insert(&tree, &t[i].node);
-        if (!debug_avl_tree_is_balanced(&tree)) {
+        if (!is_tree_valid()) {
             EXIT_UNBALANCED();
         }
     }
@@ -281,7 +316,7 @@ static void test_ordering(void) {
 
     for (i = 0; i < ELEMENTS_COUNT; i++) {
         avl_tree_delete(&tree, &t[i].node);
-        if (!debug_avl_tree_is_balanced(&tree)) {
+        if (!is_tree_valid()) {
             EXIT_UNBALANCED();
         }
     }
@@ -481,6 +481,9 @@ static int pipe_attrquerybyhdl(PAL_HANDLE handle, PAL_STREAM_ATTR* attr) {
     attr->handle_type  = handle->hdr.type;
     attr->nonblocking  = handle->pipe.nonblocking;
 
+    /* pipes are host UNIX domain sockets, their buffer sizes are managed by the host */
+    attr->pipe.buf_size = 0;
+
     /* get number of bytes available for reading (doesn't make sense for "listening" pipes) */
     attr->pending_size = 0;
     if (handle->hdr.type != PAL_TYPE_PIPESRV) {
@@ -58,6 +58,7 @@ static int memory_mark_pages_shared(uint64_t addr, size_t size) {
 
         mark_addr += PAGE_SIZE;
     }
+    memory_pagetables_sync(addr, size);
     return 0;
 }
 
@@ -122,43 +123,6 @@ static int add_preloaded_range(uintptr_t addr, size_t size, const char* comment)
     return pal_add_initial_range(addr, size, /*pal_prot=*/0, comment);
 }
 
-static void prot_none_memory(void) {
-    extern struct pal_initial_mem_range g_initial_mem_ranges[];
-
-    uint64_t cur_mem_range_idx = 0;
-    uintptr_t addr = (uintptr_t)g_pal_public_state.memory_address_end;
-    while (true) {
-        if (!addr)
-            return;
-        addr -= PAGE_SIZE;
-
-        while (cur_mem_range_idx < g_pal_public_state.initial_mem_ranges_len
-                && addr < g_initial_mem_ranges[cur_mem_range_idx].start) {
-            /* skip too-high mem ranges; we rely on mem ranges to be sorted in desc order */
-            cur_mem_range_idx++;
-        }
-
-        while (cur_mem_range_idx < g_pal_public_state.initial_mem_ranges_len
-                && addr >= g_initial_mem_ranges[cur_mem_range_idx].start
-                && addr <  g_initial_mem_ranges[cur_mem_range_idx].end) {
-            /* jump over a mem range; we rely on mem ranges to be sorted in desc order */
-            addr = g_initial_mem_ranges[cur_mem_range_idx].start;
-            if (!addr)
-                return;
-            addr -= PAGE_SIZE;
-            cur_mem_range_idx++;
-        }
-
-        if (addr < (uintptr_t)g_pal_public_state.memory_address_start)
-            return;
-
-        int ret = memory_protect((void*)addr, PAGE_SIZE, /*read=*/false, /*write=*/false,
-                                 /*execute=*/false);
-        if (ret < 0)
-            BUG();
-    }
-}
-
 /* note that manifest_size is the *file* size, i.e. it is the length of the `manifest` C string */
 static int tdx_extend_rtmr2_with_manifest(const char* manifest, size_t manifest_size) {
     __attribute__((aligned(64))) uint8_t rtmr2_buffer[48] = {0};
@@ -206,6 +170,7 @@ noreturn void pal_start_c(void* hob_addr, void* this_addr) {
 
     int ret;
 
+    uint64_t boot_start_tsc = get_tsc();
     set_dummy_gs_base();
 
     /* initialize alloc_align as early as possible, a lot of PAL APIs depend on this being set */
@@ -255,20 +220,28 @@ noreturn void pal_start_c(void* hob_addr, void* this_addr) {
     if (ret < 0)
         INIT_FAIL("Failed to initialize page tables");
 
+    boot_phases_start(boot_start_tsc);
+
     ret = memory_preload_ranges((e820_table_entry*)e820_hob->E820Table, e820_table_size,
                                 &add_preloaded_range);
     if (ret < 0)
         INIT_FAIL("Failed to initialize preloaded ranges");
 
-    /* memory_pagetables_init() marked all pages as RWX, now is good time to revert to NONE. */
+    /* memory_pagetables_init() marked all pages as RWX, must revert them to NONE. This is done
+     * later, on all CPUs, see memory_boot_init_finish(). Memory is not zeroed out: TD-Shim accepted
+     * all private memory, and accepted pages are zeroed out by the TDX module. */
     /* FIXME: whole PAL binary is RWX because memory_pagetables_init() marked everything as RWX and
-     *        prot_none_memory() does *not* modify perms for PAL binary memory pages since it is
-     *        part of "preloaded ranges" */
-    prot_none_memory();
+     *        memory_boot_init_prepare() does *not* modify perms for PAL binary memory pages since
+     *        it is part of "preloaded ranges" */
+    ret = memory_boot_init_prepare(g_pal_public_state.memory_address_start,
+                                   g_pal_public_state.memory_address_end, /*zero_memory=*/false);
+    if (ret < 0)
+        INIT_FAIL("Failed to prepare boot-time memory initialization");
 
     ret = shared_memory_init(gpa_width);
     if (ret < 0)
         INIT_FAIL("Failed to initialize shared TDX memory");
+    boot_phase_done("memory map, page tables and shared memory");
 
     call_init_array();
 
@@ -298,6 +271,7 @@ noreturn void pal_start_c(void* hob_addr, void* this_addr) {
     ret = syscalls_init();
     if (ret < 0)
         INIT_FAIL("Failed to initialize system call handling");
+    boot_phase_done("timers, devices and CPU features");
 
     /* learn number of CPUs and current CPU's index (we do it here and not at beginning of function
      * because otherwise ASan-enabled build fails on tdx_tdcall_vp_info() for complicated
@@ -333,6 +307,10 @@ noreturn void pal_start_c(void* hob_addr, void* this_addr) {
     ret = init_multicore(num_cpus, hob_addr);
     if (ret < 0)
         INIT_FAIL("Failed to initialize multicore (BSP CPU couldn't init AP CPUs)");
+    boot_phase_done("multicore");
+
+    memory_boot_init_finish(/*lazy=*/lazy_mem_init_requested());
+    boot_phase_done("memory protection");
 
     if (!g_console)
         INIT_FAIL("Failed to initialize virtio-console driver");
@@ -360,6 +338,7 @@ noreturn void pal_start_c(void* hob_addr, void* this_addr) {
     ret = virtio_fs_fuse_init();
     if (ret < 0)
         INIT_FAIL("Failed FUSE_INIT request of virtio-fs driver");
+    boot_phase_done("VMM inputs and virtio-fs");
 
     ret = _PalThreadCreate(&g_first_thread_handle, pal_start_continue, g_cmdline);
     if (ret < 0)
@@ -450,10 +429,20 @@ noreturn int pal_start_continue(void* cmdline_) {
     g_pal_public_state.vm_user_rip_offset = offsetof(struct pal_tcb_vm,
                                                      kernel_thread.context.user_rip);
 
+    get_tsc_time_info(&g_pal_public_state.tsc_time_info);
+
     ret = pal_common_get_topo_info(&g_pal_public_state.topo_info);
     if (ret < 0)
         INIT_FAIL("Failed to get topology information: %s", pal_strerror(ret));
 
+    ret = pal_common_irq_affinity_init();
+    if (ret < 0)
+        INIT_FAIL("Failed to steer device interrupts to vCPUs: %s", pal_strerror(ret));
+
+    ret = pal_common_thread_stack_cache_init();
+    if (ret < 0)
+        INIT_FAIL("Failed to configure the thread-stack pool: %s", pal_strerror(ret));
+
     ret = init_file_check_policy();
     if (ret < 0)
         INIT_FAIL("Failed to load the file check policy: %s", pal_strerror(ret));
@@ -469,6 +458,6 @@ noreturn int pal_start_continue(void* cmdline_) {
     g_use_trusted_files = true;
 
     pal_main(/*instance_id=*/0, /*parent_process=*/NULL, g_first_thread_handle, argv + 1, envp,
-             /*post_callback=*/NULL);
+             /*post_callback=*/boot_phases_print);
     __builtin_unreachable();
 }
@@ -7,12 +7,19 @@
 
 #include "api.h"
 #include "pal.h"
+#include "pal_common.h"
 #include "pal_error.h"
 #include "pal_internal.h"
 
 #include "kernel_interrupts.h"
+#include "kernel_memory.h"
+#include "kernel_sched.h"
 
 noreturn void _PalProcessExit(int exitcode) {
+    pal_common_print_poll_stats();
+    sched_print_idle_stats();
+    tlb_print_stats();
+    memory_print_shared_stats();
     log_always("[ VM exited with code %d ]", exitcode);
     triple_fault();
 }
@@ -440,3 +440,12 @@ int vm_virtualization_exception(struct isr_regs* regs) {
 
     return 0;
 }
+
+void vm_cpu_halt(void) {
+    /* HLT instruction results in #VE in Intel TDX, so ask the host directly. Interrupts stay
+     * disabled during the TDVMCALL but we report them as unblocked: the host doesn't halt the vCPU
+     * (or resumes it) if an interrupt is pending, and this interrupt is served right after STI.
+     * Failure is ignored: the host may refuse to halt the vCPU, we then simply return to idle loop */
+    (void)tdx_vmcall_instr_hlt(/*interrupt_blocked=*/false);
+    __asm__ volatile("sti" ::: "memory");
+}
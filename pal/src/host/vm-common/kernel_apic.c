@@ -77,7 +77,7 @@ void lapic_enable(void) {
 
 /* note that LAPIC timer is out of scope of e.g. Intel TDX, as TDX doesn't virtualize timer MSRs; in
  * other words, we must consider timer operations as insecure */
-int lapic_timer_init(void) {
+int lapic_timer_init(uint32_t cpu_id) {
     assert(g_tsc_mhz);
 
     uint32_t words[CPUID_WORD_NUM];
@@ -91,15 +91,14 @@ int lapic_timer_init(void) {
     vm_shared_wrmsr(MSR_INSECURE_IA32_LAPIC_LVT_TIMER, 32 | 0x40000);
 
     /* arm the timer for the first time */
-    uint64_t future_tsc = get_tsc() + LAPIC_TIMER_PERIOD_US * g_tsc_mhz;
-    vm_shared_wrmsr(MSR_INSECURE_IA32_TSC_DEADLINE, future_tsc);
+    timer_start(cpu_id);
     return 0;
 }
 
-void lapic_timer_rearm(void) {
-    uint64_t future_tsc = get_tsc() + LAPIC_TIMER_PERIOD_US * g_tsc_mhz;
-    vm_shared_wrmsr(MSR_INSECURE_IA32_TSC_DEADLINE, future_tsc);
-    lapic_signal_interrupt_complete();
+/* one-shot: the timer interrupt fires once TSC reaches `deadline_tsc` (immediately if it already
+ * passed); the timer is re-armed in the timer interrupt handler, see kernel_time.c */
+void lapic_timer_set_deadline(uint64_t deadline_tsc) {
+    vm_shared_wrmsr(MSR_INSECURE_IA32_TSC_DEADLINE, deadline_tsc);
 }
 
 void lapic_signal_interrupt_complete(void) {
@@ -107,6 +106,14 @@ void lapic_signal_interrupt_complete(void) {
     wrmsr(MSR_IA32_LAPIC_EOI, 0);
 }
 
+/* fixed-delivery IPI to a single CPU; note that ICR is controlled by the untrusted host in case of
+ * Intel TDX, so the IPI may be dropped or duplicated and receivers must tolerate this */
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    /* x2APIC: destination APIC ID in bits 63:32, physical destination mode */
+    uint64_t icr_ipi_request = ((uint64_t)apic_id << 32) + vector;
+    vm_shared_wrmsr(MSR_INSECURE_IA32_LAPIC_ICR, icr_ipi_request);
+}
+
 int apic_init(void) {
     /* IOAPIC initialization */
     int ret = memory_mark_pages_strong_uncacheable(IOAPIC_ADDR, IOAPIC_SIZE, /*mark=*/true);
@@ -122,5 +129,5 @@ int apic_init(void) {
      * x2APIC mode, so no need to check or modify the IA32_APIC_BASE MSR */
     lapic_enable();
 
-    return lapic_timer_init();
+    return lapic_timer_init(/*cpu_id=*/0);
 }
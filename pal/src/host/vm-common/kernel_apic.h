@@ -5,6 +5,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 /* We rely on the hypervisor to put the IOAPIC at predefined 0xFEC00000, 16KB memory region. Note
  * that this memory region should be UC (strong uncacheable), so we mark the corresponding page
  * tables as UC -- by setting bit PCD in a corresponding page-table entry. */
@@ -27,8 +29,9 @@
 #define MSR_INSECURE_IA32_TSC_DEADLINE 0x000006E0
 
 void lapic_enable(void);
-int lapic_timer_init(void);
-void lapic_timer_rearm(void);
+int lapic_timer_init(uint32_t cpu_id);
+void lapic_timer_set_deadline(uint64_t deadline_tsc);
 void lapic_signal_interrupt_complete(void);
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
 
 int apic_init(void);
@@ -7,9 +7,10 @@
 
 #include <stdint.h>
 
-/* underlying virtio-fs driver operates only on limited amount of data (VIRTIO_FS_SHARED_BUF_SIZE),
- * so file-related functions must not exceed this limit when calling into the driver */
-#define FILE_CHUNK_SIZE (16 * 1024UL)
+/* underlying virtio-fs driver splits big reads/writes into several pipelined FUSE requests, but
+ * still bounces all data through shared memory; file-related functions don't pass more than this
+ * amount of data in one call into the driver */
+#define FILE_CHUNK_SIZE (4 * 1024 * 1024UL)
 
 #define PATH_MAX      512
 #define MAX_READLINKS 32
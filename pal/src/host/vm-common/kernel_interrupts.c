@@ -7,6 +7,7 @@
  * Notes on multi-core synchronization:
  *   - processing different interrupt numbers in isr_c() requires different sync techniques, see
  *     comments in that func for more details
+ *   - TLB shootdowns use per-vCPU request slots and atomics, see struct invalidate_tlb_request
  *   - all other funcs are used only at init, no sync required
  */
 
@@ -51,7 +52,11 @@ extern void isr_19(void);
 extern void isr_20(void);
 extern void isr_32(void);
 extern void isr_33(void);
+extern void isr_34(void);
 extern void isr_64(void);
+extern void isr_65(void);
+extern void isr_66(void);
+extern void isr_67(void);
 extern void isr_spurious(void);
 
 /* can be accessed without atomics as there is only one CPU (BSP) that modifies it (at boot time),
@@ -60,22 +65,75 @@ bool g_interrupts_enabled = false;
 
 static struct idt_gate* g_idt = NULL; /* IDT with 256 partially filled gates, see *.S */
 
-/* A single "invalidate TLB" structure used when page table entries (PTEs) are updated by one vCPU.
- * The vCPU populates this structure with mem region to invalidate, invalidates this region itself,
- * sets `num_responses = 1` and sends an "invalidate TLB" IPI to other vCPUs via the LAPIC ICR.
- * We have a single object protected by a single lock, so if two vCPUs must update PTEs, there is a
- * performance hit of doing the two operations one after another. Also note that the whole
- * "invalidate TLB" IPI protocol must be secure against missing/spurious/extra IPIs, as ICR is
- * controlled by the untrusted host. */
-struct invalidate_tlb_request_t {
-    void* addr;
-    size_t size;
-    uint32_t num_responses; /* must be accessed atomically in interrupt handler of each vCPU */
-    bool in_progress;       /* must be accessed atomically in interrupt handler of each vCPU */
+/*
+ * "Invalidate TLB" requests (TLB shootdowns), used when page table entries (PTEs) are downgraded by
+ * one vCPU and stale TLB entries on other vCPUs must be invalidated (see tlb_batch_flush()).
+ *
+ * Each vCPU has its own request slot, so shootdowns initiated by different vCPUs run in parallel.
+ * The initiator publishes its batch of ranges and the bitmask of target vCPUs, sends "invalidate
+ * TLB" IPIs only to these targets and waits until each target cleared its bit in the bitmask. On
+ * each IPI, a target scans all slots and serves every request that has its bit set, so coalesced
+ * IPIs from different initiators are fine. The protocol must be secure against missing/spurious/
+ * extra IPIs, as ICR is controlled by the untrusted host: spurious and extra IPIs find no bits set
+ * and are ignored, missing IPIs only stall the initiator.
+ *
+ * vCPUs that run their idle thread are "lazy": they do not touch app memory, so they are not
+ * interrupted; instead they are marked "stale" and flush their whole TLB when switching to any
+ * other thread (see tlb_set_lazy()). Idle threads leave lazy mode while helping with idle work,
+ * which may access app memory (see sched_idle_work_help()).
+ */
+struct invalidate_tlb_request {
+    const struct tlb_batch* batch;            /* valid while any bit in `pending` is set */
+    unsigned long pending[MAX_NUM_CPU_LONGS]; /* targets yet to invalidate, accessed atomically */
 };
 
-static struct invalidate_tlb_request_t g_invalidate_tlb_request;
-static spinlock_t g_invalidate_tlb_request_lock = INIT_SPINLOCK_UNLOCKED;
+static struct invalidate_tlb_request g_invalidate_tlb_requests[MAX_NUM_CPUS];
+
+static struct tlb_shootdown_stats g_tlb_stats; /* all fields are updated atomically */
+
+static void stat_inc(uint64_t* counter, uint64_t value) {
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static void invalidate_tlb_full(void) {
+    /* reloading CR3 invalidates all non-global TLB entries (we don't use global pages) */
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+static void invalidate_tlb_batch(const struct tlb_batch* batch) {
+    if (batch->full_flush) {
+        invalidate_tlb_full();
+        return;
+    }
+    for (size_t i = 0; i < batch->ranges_cnt; i++)
+        for (uint64_t addr = batch->ranges[i].addr;
+                addr < batch->ranges[i].addr + batch->ranges[i].size; addr += PAGE_SIZE)
+            invlpg(addr);
+}
+
+/* called in the "invalidate TLB" IPI handler: serve all requests that target this vCPU */
+static void serve_invalidate_tlb_requests(void) {
+    uint32_t cpu_id = get_per_cpu_data()->cpu_id;
+    size_t idx = cpu_id / BITS_IN_TYPE(unsigned long);
+    unsigned long bit = 1UL << (cpu_id % BITS_IN_TYPE(unsigned long));
+
+    for (uint32_t i = 0; i < g_num_cpus; i++) {
+        struct invalidate_tlb_request* request = &g_invalidate_tlb_requests[i];
+        if (!(__atomic_load_n(&request->pending[idx], __ATOMIC_ACQUIRE) & bit))
+            continue;
+
+        const struct tlb_batch* batch = __atomic_load_n(&request->batch, __ATOMIC_ACQUIRE);
+        if (!batch) {
+            /* now this is weird -- some vCPU targeted us but didn't publish its batch */
+            log_error("Panic: `invalidate TLB` IPI received, but state is inconsistent");
+            triple_fault();
+        }
+        invalidate_tlb_batch(batch);
+        __atomic_and_fetch(&request->pending[idx], ~bit, __ATOMIC_ACQ_REL);
+    }
+}
 
 void isr_c(struct isr_regs* regs) {
     int ret;
@@ -90,6 +148,15 @@ void isr_c(struct isr_regs* regs) {
             uint64_t faulted_addr;
             __asm__ volatile("mov %%cr2, %%rax" : "=a"(faulted_addr));
 
+            /* in lazy mode, free memory may still be in a pending boot-time chunk: give it its
+             * final (no) permissions before looking at the PTE, see memory_boot_init_range() */
+            memory_boot_init_range(faulted_addr & ~0xFFFUL, PAGE_SIZE);
+
+            if (tlb_fault_is_spurious(faulted_addr, regs->error_code)) {
+                /* stale TLB entry (PTE was already upgraded), the access will be retried */
+                break;
+            }
+
             ret = pal_common_perform_memfault_handling(faulted_addr, regs);
             if (ret == 0) {
                 /* LibOS successfully handled the memory fault */
@@ -118,13 +185,11 @@ void isr_c(struct isr_regs* regs) {
                 triple_fault();
             }
             break;
-        case 32:
-            if (get_per_cpu_data()->cpu_id == 0) {
-                /* only CPU0 handles timeouts and alarms */
-                notify_about_timeouts_uninterruptable();
-            }
-            lapic_timer_rearm();
-            if (regs->cs != kernel_cs) {
+        case 32: ;
+            /* scheduling tick of this CPU and/or expired timeouts (any CPU may handle them) */
+            bool preempt = timer_interrupt_uninterruptable();
+            lapic_signal_interrupt_complete();
+            if (preempt && regs->cs != kernel_cs) {
                 /* only reschedule if timer interrupt occurs while in userland (i.e., we use
                  * preemptive userland scheduling but cooperative kernel scheduling); note that we
                  * don't enable/disable interrupts via RFLAGS' IF because it will happen
@@ -132,36 +197,14 @@ void isr_c(struct isr_regs* regs) {
                 sched_thread_uninterruptable(regs);
             }
             break;
-        case 33: ;
-            /* "invalidate TLB" IPI -- may be spurious/extra, check for this */
-            if (get_per_cpu_data()->invalidate_tlb_ipi_received) {
-                /* ignore extra IPI (most probably there is a malicious host) */
-                break;
-            }
-            bool in_progress = __atomic_load_n(&g_invalidate_tlb_request.in_progress,
-                                               __ATOMIC_ACQUIRE);
-            if (!in_progress) {
-                /* ignore spurious IPI (most probably there is a malicious host) */
-                break;
-            }
-            uint32_t old_num_responses = __atomic_load_n(&g_invalidate_tlb_request.num_responses,
-                                                         __ATOMIC_ACQUIRE);
-            if (!old_num_responses) {
-                /* now this is weird -- some vCPU started the protocol but num of responses is 0 */
-                log_error("Panic: `invalidate TLB` IPI received, but state is inconsistent");
-                triple_fault();
-            }
-
-            void* addr  = __atomic_load_n(&g_invalidate_tlb_request.addr, __ATOMIC_ACQUIRE);
-            size_t size = __atomic_load_n(&g_invalidate_tlb_request.size, __ATOMIC_ACQUIRE);
-            uint64_t mark_addr = (uint64_t)addr;
-            while (mark_addr < (uint64_t)addr + size) {
-                invlpg(mark_addr);
-                mark_addr += PAGE_SIZE;
-            }
-
-            get_per_cpu_data()->invalidate_tlb_ipi_received = 1;
-            __atomic_fetch_add(&g_invalidate_tlb_request.num_responses, 1, __ATOMIC_ACQ_REL);
+        case 33:
+            /* "invalidate TLB" IPI -- may be spurious/extra, serve only requests targeting us */
+            serve_invalidate_tlb_requests();
+            lapic_signal_interrupt_complete();
+            break;
+        case IPI_VECTOR_RESCHEDULE:
+            /* "reschedule" IPI -- its only purpose is to end HLT of the idle thread, which then
+             * picks up new runnable threads; may be spurious/extra, this is harmless */
             lapic_signal_interrupt_complete();
             break;
         case 64:
@@ -176,6 +219,31 @@ void isr_c(struct isr_regs* regs) {
             if (ret < 0)
                 triple_fault();
             lapic_signal_interrupt_complete();
+            if (__atomic_load_n(&g_console_trigger_bottomhalf, __ATOMIC_ACQUIRE)
+                    || __atomic_load_n(&g_vsock_rx_trigger_bottomhalf, __ATOMIC_ACQUIRE)
+                    || __atomic_load_n(&g_vsock_tx_trigger_bottomhalf, __ATOMIC_ACQUIRE)) {
+                /* devices without MSI-X: bottom halves run on CPU0, same as below */
+                thread_bottomhalves_kick();
+                if (regs->cs != kernel_cs)
+                    sched_thread_uninterruptable(regs);
+            }
+            break;
+        case MSIX_VECTOR_CONSOLE_RQ:
+        case MSIX_VECTOR_VSOCK_RQ:
+        case MSIX_VECTOR_VSOCK_TQ:
+            /* MSI-X interrupts may arrive on any CPU (see `tdx.irq_affinity` manifest option); the
+             * ISR only sets the device trigger, and the bottomhalves thread of this CPU does the
+             * real work -- right away if the interrupt arrived in userland */
+            if (regs->int_number == MSIX_VECTOR_CONSOLE_RQ)
+                virtio_console_rq_isr();
+            else if (regs->int_number == MSIX_VECTOR_VSOCK_RQ)
+                virtio_vsock_rq_isr();
+            else
+                virtio_vsock_tq_isr();
+            lapic_signal_interrupt_complete();
+            thread_bottomhalves_kick();
+            if (regs->cs != kernel_cs)
+                sched_thread_uninterruptable(regs);
             break;
         default:
             log_error("Panic: unhandled exception (vector nr. %lu)", regs->int_number);
@@ -184,58 +252,204 @@ void isr_c(struct isr_regs* regs) {
     }
 }
 
-int send_invalidate_tlb_ipi_and_wait(void* addr, size_t size, bool invalidate_on_this_cpu) {
-    assert(IS_ALIGNED_PTR(addr, PAGE_SIZE) && IS_ALIGNED(size, PAGE_SIZE));
+void tlb_batch_add(struct tlb_batch* batch, uint64_t addr, size_t size) {
+    assert(IS_ALIGNED(addr, PAGE_SIZE) && IS_ALIGNED(size, PAGE_SIZE));
 
-    int ret;
+    if (!size || batch->full_flush)
+        return;
 
-    if (invalidate_on_this_cpu) {
-        uint64_t mark_addr = (uint64_t)addr;
-        while (mark_addr < (uint64_t)addr + size) {
-            invlpg(mark_addr);
-            mark_addr += PAGE_SIZE;
+    batch->pages_cnt += size / PAGE_SIZE;
+    if (batch->pages_cnt > TLB_FLUSH_FULL_THRESHOLD) {
+        /* too many pages: a full flush is cheaper than page-by-page invalidation */
+        batch->full_flush = true;
+        return;
+    }
+
+    if (batch->ranges_cnt) {
+        struct tlb_range* last = &batch->ranges[batch->ranges_cnt - 1];
+        if (last->addr + last->size == addr) {
+            last->size += size;
+            return;
         }
     }
 
+    if (batch->ranges_cnt == TLB_BATCH_MAX_RANGES) {
+        batch->full_flush = true;
+        return;
+    }
+    batch->ranges[batch->ranges_cnt].addr = addr;
+    batch->ranges[batch->ranges_cnt].size = size;
+    batch->ranges_cnt++;
+}
+
+/* Invalidate TLB entries of the batch only on this vCPU */
+void tlb_batch_flush_local(const struct tlb_batch* batch) {
+    if (!batch->ranges_cnt && !batch->full_flush)
+        return;
+
+    invalidate_tlb_batch(batch);
+    if (batch->full_flush)
+        stat_inc(&g_tlb_stats.num_full_flushes, 1);
+}
+
+/* Invalidate TLB entries of the batch on this vCPU and on all other vCPUs that may have cached
+ * them; returns only after all these vCPUs invalidated their TLBs */
+int tlb_batch_flush(struct tlb_batch* batch) {
+    if (!batch->ranges_cnt && !batch->full_flush)
+        return 0;
+
+    invalidate_tlb_batch(batch);
+
+    stat_inc(&g_tlb_stats.num_flushes, 1);
+    if (batch->full_flush)
+        stat_inc(&g_tlb_stats.num_full_flushes, 1);
+
     if (!g_interrupts_enabled) {
         /* this func may be called from bootstrap code, before interrupts are truly enabled */
         return 0;
     }
 
-    spinlock_lock(&g_invalidate_tlb_request_lock);
-
-    if (g_invalidate_tlb_request.in_progress || g_invalidate_tlb_request.num_responses) {
-        /* sanity check that a previous "invalidate TLB" protocol run is finished */
-        ret = -PAL_ERROR_DENIED;
-        goto out;
+    uint32_t this_cpu_id = get_per_cpu_data()->cpu_id;
+    struct invalidate_tlb_request* request = &g_invalidate_tlb_requests[this_cpu_id];
+    if (request->batch) {
+        /* sanity check that a previous "invalidate TLB" protocol run of this vCPU is finished */
+        return -PAL_ERROR_DENIED;
     }
 
+    unsigned long targets[MAX_NUM_CPU_LONGS] = {0};
+    uint32_t targets_cnt = 0;
+    uint32_t lazy_cnt = 0;
     for (uint32_t i = 0; i < g_num_cpus; i++) {
-        /* reset the "IPI received" flag on each vCPU */
-        g_per_cpu_data[i].invalidate_tlb_ipi_received = 0;
+        if (i == this_cpu_id)
+            continue;
+        struct per_cpu_data* per_cpu_data = &g_per_cpu_data[i];
+        if (__atomic_load_n(&per_cpu_data->tlb_lazy, __ATOMIC_SEQ_CST)) {
+            /* mark the idle vCPU stale, then re-check that it didn't leave lazy mode meanwhile
+             * (it clears `tlb_lazy` before consuming `tlb_stale`, see tlb_set_lazy()) */
+            __atomic_store_n(&per_cpu_data->tlb_stale, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&per_cpu_data->tlb_lazy, __ATOMIC_SEQ_CST)) {
+                lazy_cnt++;
+                continue;
+            }
+        }
+        targets[i / BITS_IN_TYPE(unsigned long)] |= 1UL << (i % BITS_IN_TYPE(unsigned long));
+        targets_cnt++;
+    }
+    stat_inc(&g_tlb_stats.num_lazy_skips, lazy_cnt);
+
+    if (!targets_cnt) {
+        stat_inc(&g_tlb_stats.num_local_only, 1);
+        return 0;
+    }
+
+    __atomic_store_n(&request->batch, batch, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < MAX_NUM_CPU_LONGS; i++)
+        __atomic_store_n(&request->pending[i], targets[i], __ATOMIC_RELEASE);
+
+    if (targets_cnt == g_num_cpus - 1) {
+        /* all other vCPUs are targets, a single broadcast IPI is cheaper (ICR writes exit to the
+         * host) */
+        uint64_t icr_ipi_request = (/*destination=all_excluding_self*/3 << 18) + /*vector=*/33;
+        vm_shared_wrmsr(MSR_INSECURE_IA32_LAPIC_ICR, icr_ipi_request);
+        stat_inc(&g_tlb_stats.num_ipis, targets_cnt);
+    } else {
+        for (uint32_t i = 0; i < g_num_cpus; i++) {
+            if (!(targets[i / BITS_IN_TYPE(unsigned long)]
+                    & (1UL << (i % BITS_IN_TYPE(unsigned long)))))
+                continue;
+            /* x2APIC: destination APIC ID in bits 63:32, physical destination mode */
+            uint64_t icr_ipi_request = ((uint64_t)g_per_cpu_data[i].apic_id << 32) + /*vector=*/33;
+            vm_shared_wrmsr(MSR_INSECURE_IA32_LAPIC_ICR, icr_ipi_request);
+        }
+        stat_inc(&g_tlb_stats.num_ipis, targets_cnt);
+    }
+
+    for (size_t i = 0; i < MAX_NUM_CPU_LONGS; i++) {
+        while (__atomic_load_n(&request->pending[i], __ATOMIC_ACQUIRE)) {
+            /* waiting for target vCPUs to invalidate their TLBs and acknowledge */
+            CPU_RELAX();
+        }
+    }
+
+    __atomic_store_n(&request->batch, NULL, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Called by the scheduler on each thread switch, with `lazy = true` iff switching to the idle
+ * thread of this vCPU; also called by the idle thread around idle work */
+void tlb_set_lazy(bool lazy) {
+    struct per_cpu_data* per_cpu_data = get_per_cpu_data();
+    if (lazy) {
+        __atomic_store_n(&per_cpu_data->tlb_lazy, 1, __ATOMIC_SEQ_CST);
+        return;
     }
 
-    g_invalidate_tlb_request.in_progress = true;
-    g_invalidate_tlb_request.addr = addr;
-    g_invalidate_tlb_request.size = size;
-    g_invalidate_tlb_request.num_responses = 1; /* this vCPU already invalidated */
+    if (!per_cpu_data->tlb_lazy)
+        return;
 
-    uint64_t icr_ipi_request = (/*destination=all_excluding_self*/3 << 18) + /*vector=*/33;
-    vm_shared_wrmsr(MSR_INSECURE_IA32_LAPIC_ICR, icr_ipi_request);
+    __atomic_store_n(&per_cpu_data->tlb_lazy, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&per_cpu_data->tlb_stale, 0, __ATOMIC_SEQ_CST)) {
+        /* some shootdowns skipped this vCPU while it was idle, catch up */
+        invalidate_tlb_full();
+        stat_inc(&g_tlb_stats.num_lazy_full_flushes, 1);
+    }
+}
 
-    while (__atomic_load_n(&g_invalidate_tlb_request.num_responses, __ATOMIC_ACQUIRE)
-            != g_num_cpus) {
-        /* waiting for other vCPUs to invalidate their TLBs and acknowledge */
-        CPU_RELAX();
+/* A #PF may be caused by a stale TLB entry, if the PTE was upgraded (e.g. made writable) on another
+ * vCPU: such upgrades are not shot down, see memory_mark_pages_on(). Returns true if the PTE allows
+ * the faulting access; the stale TLB entry is then invalidated and the access can be retried. */
+bool tlb_fault_is_spurious(uint64_t faulted_addr, uint64_t error_code) {
+    if (!g_pml4_table_base || (error_code & (1UL << 3))) {
+        /* page tables are not yet set up or reserved bit is set in some entry -- not spurious */
+        return false;
     }
 
-    g_invalidate_tlb_request.num_responses = 0;
-    g_invalidate_tlb_request.in_progress = false;
-    ret = 0;
+    uint64_t* pte_addr;
+    if (memory_find_page_table_entry(faulted_addr & ~0xFFFUL, &pte_addr) < 0)
+        return false;
+
+    /* error code: bit 1 = write access, bit 2 = usermode access, bit 4 = instruction fetch; note
+     * that kernel-mode writes ignore the W bit of PTEs, as CR0.WP is not set */
+    uint64_t pte = __atomic_load_n(pte_addr, __ATOMIC_RELAXED);
+    if (!(pte & 1UL))
+        return false;
+    if ((error_code & (1UL << 1)) && (error_code & (1UL << 2)) && !(pte & (1UL << 1)))
+        return false;
+    if ((error_code & (1UL << 2)) && !(pte & (1UL << 2)))
+        return false;
+    if ((error_code & (1UL << 4)) && (pte & (1UL << 63)))
+        return false;
+
+    invlpg(faulted_addr);
+    stat_inc(&g_tlb_stats.num_spurious_faults, 1);
+    return true;
+}
 
-out:
-    spinlock_unlock(&g_invalidate_tlb_request_lock);
-    return ret;
+void tlb_get_stats(struct tlb_shootdown_stats* out_stats) {
+    out_stats->num_flushes           = __atomic_load_n(&g_tlb_stats.num_flushes, __ATOMIC_RELAXED);
+    out_stats->num_full_flushes      = __atomic_load_n(&g_tlb_stats.num_full_flushes,
+                                                       __ATOMIC_RELAXED);
+    out_stats->num_local_only        = __atomic_load_n(&g_tlb_stats.num_local_only,
+                                                       __ATOMIC_RELAXED);
+    out_stats->num_ipis              = __atomic_load_n(&g_tlb_stats.num_ipis, __ATOMIC_RELAXED);
+    out_stats->num_lazy_skips        = __atomic_load_n(&g_tlb_stats.num_lazy_skips,
+                                                       __ATOMIC_RELAXED);
+    out_stats->num_lazy_full_flushes = __atomic_load_n(&g_tlb_stats.num_lazy_full_flushes,
+                                                       __ATOMIC_RELAXED);
+    out_stats->num_spurious_faults   = __atomic_load_n(&g_tlb_stats.num_spurious_faults,
+                                                       __ATOMIC_RELAXED);
+}
+
+void tlb_print_stats(void) {
+    struct tlb_shootdown_stats stats;
+    tlb_get_stats(&stats);
+    if (!stats.num_flushes)
+        return;
+
+    log_debug("TLB shootdowns: %lu flushes (%lu full, %lu local-only), %lu IPIs, %lu skipped on "
+              "idle vCPUs, %lu full flushes on leaving idle, %lu spurious faults",
+              stats.num_flushes, stats.num_full_flushes, stats.num_local_only, stats.num_ipis,
+              stats.num_lazy_skips, stats.num_lazy_full_flushes, stats.num_spurious_faults);
 }
 
 static int idt_gate_set(uint8_t isr_number, void* isr_addr) {
@@ -387,6 +601,10 @@ static int idt_init(void) {
     if (ret < 0)
         return -PAL_ERROR_BADADDR;
 
+    ret = idt_gate_set(IPI_VECTOR_RESCHEDULE, &isr_34);
+    if (ret < 0)
+        return -PAL_ERROR_BADADDR;
+
     ret = idt_gate_set(39, &isr_spurious);
     if (ret < 0)
         return -PAL_ERROR_BADADDR;
@@ -395,6 +613,18 @@ static int idt_init(void) {
     if (ret < 0)
         return -PAL_ERROR_BADADDR;
 
+    ret = idt_gate_set(MSIX_VECTOR_CONSOLE_RQ, &isr_65);
+    if (ret < 0)
+        return -PAL_ERROR_BADADDR;
+
+    ret = idt_gate_set(MSIX_VECTOR_VSOCK_RQ, &isr_66);
+    if (ret < 0)
+        return -PAL_ERROR_BADADDR;
+
+    ret = idt_gate_set(MSIX_VECTOR_VSOCK_TQ, &isr_67);
+    if (ret < 0)
+        return -PAL_ERROR_BADADDR;
+
     return 0;
 }
 
@@ -6,11 +6,22 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "cpu.h"
 #include "spinlock.h"
 
+/* MSI-X vectors of virtio queues; each queue gets its own vector, so that it can be steered to any
+ * vCPU and so that the ISR knows the queue without reading the device ISR status register */
+#define MSIX_VECTOR_CONSOLE_RQ 65
+#define MSIX_VECTOR_VSOCK_RQ   66
+#define MSIX_VECTOR_VSOCK_TQ   67
+
+/* IPI that wakes up a halted idle vCPU which got new runnable threads, see sched_idle_halt() */
+#define IPI_VECTOR_RESCHEDULE 34
+
 #define INTERRUPT_STACK_SIZE      0x4000
 #define INTERRUPT_XSAVE_AREA_SIZE 0x4000 /* 16KB, should be enough for current XSAVE areas */
 
@@ -119,5 +130,41 @@ extern bool g_interrupts_enabled;
 int pal_common_perform_memfault_handling(uint64_t faulted_addr, struct isr_regs* regs);
 
 void isr_c(struct isr_regs* regs);
-int send_invalidate_tlb_ipi_and_wait(void* addr, size_t size, bool invalidate_on_this_cpu);
+
+/* Batch of page ranges whose TLB entries must be invalidated on all vCPUs, filled via
+ * tlb_batch_add() and flushed once via tlb_batch_flush(); falls back to a full TLB flush when there
+ * are too many ranges or pages */
+#define TLB_BATCH_MAX_RANGES     8
+#define TLB_FLUSH_FULL_THRESHOLD 64 /* in pages; above this, CR3 reload is cheaper than invlpg */
+
+struct tlb_range {
+    uint64_t addr;
+    size_t size;
+};
+
+struct tlb_batch {
+    size_t ranges_cnt;
+    size_t pages_cnt;
+    bool full_flush;
+    struct tlb_range ranges[TLB_BATCH_MAX_RANGES];
+};
+
+/* statistics of TLB shootdowns, for diagnostics and benchmarking */
+struct tlb_shootdown_stats {
+    uint64_t num_flushes;           /* batches flushed (on this vCPU and maybe others) */
+    uint64_t num_full_flushes;      /* batches flushed via full TLB flush instead of invlpg */
+    uint64_t num_local_only;        /* batches that required no IPIs */
+    uint64_t num_ipis;              /* "invalidate TLB" IPIs sent */
+    uint64_t num_lazy_skips;        /* IPIs not sent because target vCPU was idle */
+    uint64_t num_lazy_full_flushes; /* full TLB flushes done by vCPUs on leaving idle */
+    uint64_t num_spurious_faults;   /* #PFs caused by stale TLB entries of upgraded PTEs */
+};
+
+void tlb_batch_add(struct tlb_batch* batch, uint64_t addr, size_t size);
+void tlb_batch_flush_local(const struct tlb_batch* batch);
+int tlb_batch_flush(struct tlb_batch* batch);
+void tlb_set_lazy(bool lazy);
+bool tlb_fault_is_spurious(uint64_t faulted_addr, uint64_t error_code);
+void tlb_get_stats(struct tlb_shootdown_stats* out_stats);
+void tlb_print_stats(void);
 int interrupts_init(void);
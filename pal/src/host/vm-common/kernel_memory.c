@@ -5,10 +5,14 @@
  * Memory helpers.
  *
  * Notes on multi-core synchronization:
- *   - memory_get_shared_region()/memory_free_shared_region() are used on init, no sync required
+ *   - memory_get_shared_region()/memory_free_shared_region() may be used at any time by drivers on
+ *     any CPU (but not in interrupt context), sync via shared-memory lock
  *   - g_pml4_table_base, page tables, Address Sanitizer are set on init, no sync required
- *   - memory_alloc(), memory_protect() and memory_free() rely on LibOS synchronization and thus do
- *     not require additional PAL-level sync
+ *   - memory_alloc(), memory_protect() and memory_free() rely on LibOS synchronization for their
+ *     ranges; PTE updates are additionally serialized via page-tables lock, because PDEs and PDPEs
+ *     are derived from all PTEs of a 2MB/1GB region, which may span unrelated ranges
+ *   - boot-time initialization of free memory runs on all CPUs, sync via atomic per-chunk states
+ *     (see memory_boot_init_range())
  *   - all other funcs are used only at init, no sync required
  */
 
@@ -16,12 +20,16 @@
 
 #include "api.h"
 #include "asan.h"
+#include "cpu.h"
 #include "pal_error.h"
+#include "pal_internal.h"
+#include "spinlock.h"
 
 #include "kernel_debug.h"
 #include "kernel_interrupts.h"
 #include "kernel_memory.h"
 #include "kernel_multicore.h"
+#include "kernel_sched.h"
 #include "kernel_virtio.h"
 
 static_assert(PAGE_SIZE == 4096, "unexpected PAGE_SIZE (expected 4K)");
@@ -29,100 +37,503 @@ static_assert(PAGE_SIZE == 4096, "unexpected PAGE_SIZE (expected 4K)");
 /* Beginning of the page table hierarchy */
 uint64_t g_pml4_table_base = 0;
 
+/*
+ * Page tables are laid out contiguously by pagetables_init(): first all PT pages (one per 2MB of
+ * memory), then all PD pages (one per 1GB of memory), then the PDP page and the PML4 page. All of
+ * them are preallocated, so a large page can be split at any time without allocating memory.
+ *
+ * The 4KB-level PTEs are authoritative and are always kept up to date, even for memory that is
+ * currently mapped via a 2MB or 1GB large page. PDEs and PDPEs are derived from them in
+ * pagetables_sync_large_pages(): an aligned region whose pages are all present and have identical
+ * flags is mapped via a large page, any other region is mapped via the next-level table.
+ */
+#define PTE_ADDR_MASK    0x00000ffffffff000UL       /* bits 12:43, no TDX "shared" bit */
+#define PTE_PRESENT      (1UL << 0)
+#define PTE_LARGE        (1UL << 7)                 /* PS bit in PDEs and PDPEs */
+#define PTE_IGNORED_BITS ((1UL << 5) | (1UL << 6))  /* accessed and dirty bits, set by hardware */
+#define PTE_TREE_FLAGS   0x7UL                      /* mid-tree entries: present, RW, ring-3 */
+
+#define LARGE_PAGE_2M_SIZE (2UL * 1024 * 1024)
+#define LARGE_PAGE_1G_SIZE (1UL * 1024 * 1024 * 1024)
+
+/* protects PTEs during their update and the subsequent pagetables_sync_large_pages() */
+static spinlock_t g_page_tables_lock = INIT_SPINLOCK_UNLOCKED;
+
+static uint64_t g_page_tables_base     = 0;
+static uint64_t g_page_dir_tables_base = 0;
+static uint64_t g_pdp_table_base       = 0;
+static size_t g_page_tables_memory_size = 0; /* covered range [0x0, g_page_tables_memory_size) */
+static bool g_large_pages_1g_supported  = false;
+
 /* Address Sanitizer shadow memory (physical memory range) */
 static uint64_t g_asan_shadow_phys_start = 0;
 static uint64_t g_asan_shadow_phys_end   = 0;
 
-void* memory_get_shared_region(size_t size) {
-	/* trivial shared memory management: allocations in the shared-memory range
-	 * [SHARED_MEM_ADDR, SHARED_MEM_ADDR + SHARED_MEM_SIZE) are ever increasing */
-	static void* g_shared_heap_pos = (void*)SHARED_MEM_ADDR;
+/*
+ * Allocator for the shared-memory range [SHARED_MEM_ADDR, SHARED_MEM_ADDR + SHARED_MEM_SIZE).
+ *
+ * Allocations bigger than SHARED_SLAB_MAX_SIZE are served by a buddy allocator with page
+ * granularity: blocks of 2^order pages, with order up to SHARED_BUDDY_MAX_ORDER. Such allocations
+ * are always page-aligned. Smaller allocations (virtqueue rings, event-suppression words, small
+ * bounce buffers) are served from slab pages, with power-of-two size classes from
+ * SHARED_SLAB_MIN_SIZE to SHARED_SLAB_MAX_SIZE; each slab page holds objects of one size class.
+ * Slab pages are given back to the buddy allocator as soon as they become empty.
+ *
+ * All allocator metadata is kept in private memory, because the host may modify shared memory at
+ * will. Metadata is allocated on first use.
+ */
+#define SHARED_MEM_PAGES       (SHARED_MEM_SIZE / PAGE_SIZE)
+#define SHARED_BUDDY_MAX_ORDER 12 /* 16MB blocks */
+#define SHARED_SLAB_MIN_SHIFT  6  /* 64B */
+#define SHARED_SLAB_MAX_SHIFT  11 /* 2KB */
+#define SHARED_SLAB_MIN_SIZE   (1UL << SHARED_SLAB_MIN_SHIFT)
+#define SHARED_SLAB_MAX_SIZE   (1UL << SHARED_SLAB_MAX_SHIFT)
+#define SHARED_SLAB_CLASSES    (SHARED_SLAB_MAX_SHIFT - SHARED_SLAB_MIN_SHIFT + 1)
+#define SHARED_PAGE_NONE       UINT16_MAX
+
+static_assert(SHARED_MEM_PAGES < SHARED_PAGE_NONE, "shared page indices must fit into uint16_t");
+static_assert(PAGE_SIZE / SHARED_SLAB_MIN_SIZE <= 64, "slab bitmap must fit into uint64_t");
+
+enum {
+    SHARED_PAGE_TAIL = 0,  /* not a head of any block (part of a bigger block) */
+    SHARED_PAGE_FREE,      /* head of a free buddy block */
+    SHARED_PAGE_ALLOCATED, /* head of an allocated buddy block */
+    SHARED_PAGE_SLAB,      /* page split into objects of one size class */
+};
+
+struct shared_page {
+    uint16_t next;       /* link in buddy free list (FREE) or in slab partial list (SLAB) */
+    uint16_t prev;
+    uint8_t  state;
+    uint8_t  order;      /* for FREE and ALLOCATED pages */
+    uint8_t  slab_class; /* for SLAB pages */
+    uint64_t free_objs;  /* for SLAB pages: bitmap of free objects */
+};
+
+static struct shared_page* g_shared_pages = NULL;
+static uint16_t g_buddy_free_lists[SHARED_BUDDY_MAX_ORDER + 1];
+static uint16_t g_slab_partial_lists[SHARED_SLAB_CLASSES]; /* slab pages with free objects */
+static struct shared_memory_stats g_shared_mem_stats;
+static spinlock_t g_shared_mem_lock = INIT_SPINLOCK_UNLOCKED;
+
+static void page_list_add(uint16_t* head, uint16_t idx) {
+    struct shared_page* page = &g_shared_pages[idx];
+    page->prev = SHARED_PAGE_NONE;
+    page->next = *head;
+    if (*head != SHARED_PAGE_NONE)
+        g_shared_pages[*head].prev = idx;
+    *head = idx;
+}
+
+static void page_list_del(uint16_t* head, uint16_t idx) {
+    struct shared_page* page = &g_shared_pages[idx];
+    if (page->prev != SHARED_PAGE_NONE)
+        g_shared_pages[page->prev].next = page->next;
+    else
+        *head = page->next;
+    if (page->next != SHARED_PAGE_NONE)
+        g_shared_pages[page->next].prev = page->prev;
+    page->next = SHARED_PAGE_NONE;
+    page->prev = SHARED_PAGE_NONE;
+}
+
+static void buddy_add_free_block(uint16_t idx, uint8_t order) {
+    g_shared_pages[idx].state = SHARED_PAGE_FREE;
+    g_shared_pages[idx].order = order;
+    page_list_add(&g_buddy_free_lists[order], idx);
+}
+
+static int shared_mem_init(void) {
+    assert(spinlock_is_locked(&g_shared_mem_lock));
+
+    /* zeroed memory marks all pages as SHARED_PAGE_TAIL */
+    g_shared_pages = calloc(SHARED_MEM_PAGES, sizeof(*g_shared_pages));
+    if (!g_shared_pages)
+        return -PAL_ERROR_NOMEM;
+
+    for (size_t i = 0; i < ARRAY_SIZE(g_buddy_free_lists); i++)
+        g_buddy_free_lists[i] = SHARED_PAGE_NONE;
+    for (size_t i = 0; i < ARRAY_SIZE(g_slab_partial_lists); i++)
+        g_slab_partial_lists[i] = SHARED_PAGE_NONE;
+
+    /* the range is not a power-of-two number of pages, so cover it with the biggest blocks that
+     * fit (each block is aligned on its size, relative to the start of the range) */
+    size_t idx = 0;
+    while (idx < SHARED_MEM_PAGES) {
+        uint8_t order = SHARED_BUDDY_MAX_ORDER;
+        while (!IS_ALIGNED(idx, 1UL << order) || idx + (1UL << order) > SHARED_MEM_PAGES)
+            order--;
+        buddy_add_free_block(idx, order);
+        idx += 1UL << order;
+    }
+
+    g_shared_mem_stats.total_size = SHARED_MEM_SIZE;
+    return 0;
+}
+
+static int buddy_alloc(uint8_t order, uint16_t* out_idx) {
+    uint8_t curr_order = order;
+    while (curr_order <= SHARED_BUDDY_MAX_ORDER
+            && g_buddy_free_lists[curr_order] == SHARED_PAGE_NONE)
+        curr_order++;
+    if (curr_order > SHARED_BUDDY_MAX_ORDER)
+        return -PAL_ERROR_NOMEM;
+
+    uint16_t idx = g_buddy_free_lists[curr_order];
+    page_list_del(&g_buddy_free_lists[curr_order], idx);
+
+    /* split the found block, giving back the upper halves */
+    while (curr_order > order) {
+        curr_order--;
+        buddy_add_free_block(idx + (1U << curr_order), curr_order);
+    }
+
+    g_shared_pages[idx].state = SHARED_PAGE_ALLOCATED;
+    g_shared_pages[idx].order = order;
+    *out_idx = idx;
+    return 0;
+}
+
+static void buddy_free(uint16_t idx, uint8_t order) {
+    /* coalesce with free buddies as long as possible */
+    while (order < SHARED_BUDDY_MAX_ORDER) {
+        size_t buddy_idx = idx ^ (1U << order);
+        if (buddy_idx >= SHARED_MEM_PAGES)
+            break;
+
+        struct shared_page* buddy = &g_shared_pages[buddy_idx];
+        if (buddy->state != SHARED_PAGE_FREE || buddy->order != order)
+            break;
+
+        page_list_del(&g_buddy_free_lists[order], buddy_idx);
+        buddy->state = SHARED_PAGE_TAIL;
+        g_shared_pages[idx].state = SHARED_PAGE_TAIL;
+        idx = MIN(idx, buddy_idx);
+        order++;
+    }
+    buddy_add_free_block(idx, order);
+}
+
+static void* slab_alloc(uint8_t slab_class) {
+    size_t obj_shift = SHARED_SLAB_MIN_SHIFT + slab_class;
+
+    uint16_t idx = g_slab_partial_lists[slab_class];
+    if (idx == SHARED_PAGE_NONE) {
+        if (buddy_alloc(/*order=*/0, &idx) < 0)
+            return NULL;
+
+        size_t objs_cnt = PAGE_SIZE >> obj_shift;
+        struct shared_page* page = &g_shared_pages[idx];
+        page->state      = SHARED_PAGE_SLAB;
+        page->slab_class = slab_class;
+        page->free_objs  = objs_cnt == 64 ? UINT64_MAX : (1UL << objs_cnt) - 1;
+        page_list_add(&g_slab_partial_lists[slab_class], idx);
+    }
+
+    struct shared_page* page = &g_shared_pages[idx];
+    size_t obj = __builtin_ctzl(page->free_objs);
+    page->free_objs &= ~(1UL << obj);
+    if (!page->free_objs)
+        page_list_del(&g_slab_partial_lists[slab_class], idx);
+
+    return (void*)(SHARED_MEM_ADDR + idx * PAGE_SIZE + (obj << obj_shift));
+}
+
+static int slab_free(uint16_t idx, uint8_t slab_class, size_t offset_in_page) {
+    size_t obj_shift = SHARED_SLAB_MIN_SHIFT + slab_class;
+    size_t objs_cnt  = PAGE_SIZE >> obj_shift;
+    uint64_t all_free_objs = objs_cnt == 64 ? UINT64_MAX : (1UL << objs_cnt) - 1;
+
+    struct shared_page* page = &g_shared_pages[idx];
+    if (page->state != SHARED_PAGE_SLAB || page->slab_class != slab_class)
+        return -PAL_ERROR_INVAL;
+    if (!IS_ALIGNED(offset_in_page, 1UL << obj_shift))
+        return -PAL_ERROR_INVAL;
+
+    uint64_t obj_bit = 1UL << (offset_in_page >> obj_shift);
+    if (page->free_objs & obj_bit) {
+        /* double free */
+        return -PAL_ERROR_INVAL;
+    }
+
+    if (!page->free_objs)
+        page_list_add(&g_slab_partial_lists[slab_class], idx);
+    page->free_objs |= obj_bit;
 
+    if (page->free_objs == all_free_objs) {
+        page_list_del(&g_slab_partial_lists[slab_class], idx);
+        buddy_free(idx, /*order=*/0);
+    }
+    return 0;
+}
+
+/* returns the number of bytes actually reserved for an allocation of `size` bytes, and the slab
+ * class or buddy order that serves it; returns 0 if the allocation is too big */
+static size_t shared_mem_size_class(size_t size, bool* out_is_slab, uint8_t* out_class_or_order) {
+    assert(size);
+
+    if (size <= SHARED_SLAB_MAX_SIZE) {
+        uint8_t shift = size <= SHARED_SLAB_MIN_SIZE ? SHARED_SLAB_MIN_SHIFT
+                                                     : 64 - __builtin_clzl(size - 1);
+        *out_is_slab = true;
+        *out_class_or_order = shift - SHARED_SLAB_MIN_SHIFT;
+        return 1UL << shift;
+    }
+
+    size_t pages = UDIV_ROUND_UP(size, PAGE_SIZE);
+    uint8_t order = pages == 1 ? 0 : 64 - __builtin_clzl(pages - 1);
+    if (order > SHARED_BUDDY_MAX_ORDER)
+        return 0;
+
+    *out_is_slab = false;
+    *out_class_or_order = order;
+    return PAGE_SIZE << order;
+}
+
+void* memory_get_shared_region(size_t size) {
     if (!size)
         return NULL;
 
-#ifdef ASAN
-    size_t original_size = size;
-#endif
-    size = ALIGN_UP(size, PAGE_SIZE);
+    void* ret = NULL;
+    spinlock_lock(&g_shared_mem_lock);
 
-    assert((uintptr_t)g_shared_heap_pos >= SHARED_MEM_ADDR);
-    assert(access_ok(g_shared_heap_pos, size));
-    if ((uintptr_t)g_shared_heap_pos + size > SHARED_MEM_ADDR + SHARED_MEM_SIZE)
-        return NULL;
+    if (!g_shared_pages && shared_mem_init() < 0)
+        goto out;
+
+    bool is_slab;
+    uint8_t class_or_order;
+    size_t reserved_size = shared_mem_size_class(size, &is_slab, &class_or_order);
+    if (!reserved_size)
+        goto out;
+
+    if (is_slab) {
+        ret = slab_alloc(class_or_order);
+    } else {
+        uint16_t idx;
+        if (buddy_alloc(class_or_order, &idx) == 0)
+            ret = (void*)(SHARED_MEM_ADDR + idx * PAGE_SIZE);
+    }
+
+    if (ret) {
+        g_shared_mem_stats.used_size += reserved_size;
+        g_shared_mem_stats.requested_size += size;
+        g_shared_mem_stats.peak_used_size = MAX(g_shared_mem_stats.peak_used_size,
+                                                g_shared_mem_stats.used_size);
+        g_shared_mem_stats.num_allocs++;
+    }
+out:
+    if (!ret)
+        g_shared_mem_stats.num_failed_allocs++;
+    spinlock_unlock(&g_shared_mem_lock);
 
-    void* ret = g_shared_heap_pos;
-    g_shared_heap_pos = (char*)g_shared_heap_pos + size;
 #ifdef ASAN
-    asan_unpoison_region((uintptr_t)ret, original_size);
+    if (ret)
+        asan_unpoison_region((uintptr_t)ret, size);
 #endif
     return ret;
 }
 
 int memory_free_shared_region(void* addr, size_t size) {
-    /* dummy; we never free shared regions for simplicity */
-    __UNUSED(addr);
-    __UNUSED(size);
+    if (!addr)
+        return 0;
+
+    uintptr_t offset = (uintptr_t)addr - SHARED_MEM_ADDR;
+    if ((uintptr_t)addr < SHARED_MEM_ADDR || offset >= SHARED_MEM_SIZE || !size)
+        return -PAL_ERROR_INVAL;
+
+    int ret;
+    spinlock_lock(&g_shared_mem_lock);
+
+    if (!g_shared_pages) {
+        ret = -PAL_ERROR_INVAL;
+        goto out;
+    }
+
+    bool is_slab;
+    uint8_t class_or_order;
+    size_t reserved_size = shared_mem_size_class(size, &is_slab, &class_or_order);
+    if (!reserved_size) {
+        ret = -PAL_ERROR_INVAL;
+        goto out;
+    }
+
+    uint16_t idx = offset / PAGE_SIZE;
+    if (is_slab) {
+        ret = slab_free(idx, class_or_order, offset % PAGE_SIZE);
+        if (ret < 0)
+            goto out;
+    } else {
+        struct shared_page* page = &g_shared_pages[idx];
+        if (!IS_ALIGNED(offset, PAGE_SIZE) || page->state != SHARED_PAGE_ALLOCATED
+                || page->order != class_or_order) {
+            ret = -PAL_ERROR_INVAL;
+            goto out;
+        }
+        buddy_free(idx, class_or_order);
+    }
+
+    g_shared_mem_stats.used_size -= reserved_size;
+    g_shared_mem_stats.requested_size -= size;
+    g_shared_mem_stats.num_frees++;
+    ret = 0;
+out:
+    spinlock_unlock(&g_shared_mem_lock);
 #ifdef ASAN
-    asan_poison_region((uintptr_t)addr, size, ASAN_POISON_USER);
+    if (ret == 0)
+        asan_poison_region((uintptr_t)addr, size, ASAN_POISON_USER);
 #endif
-    return 0;
+    return ret;
 }
 
-__attribute_no_sanitize_address
-int memory_find_page_table_entry(uint64_t addr, uint64_t** out_pte_addr) {
-    assert(g_pml4_table_base);
-    uint64_t* pml4_table = (uint64_t*)g_pml4_table_base;
-
-    /* the mask covers bits 12:43 which covers the address space [0, 16TB); note that we do not
-     * cover up to 12:51 because bit 47 or 51 can be specially used (e.g. "shared" bit in TDX) */
-    const uint64_t page_table_entry_addr_mask = 0x00000ffffffff000UL;
+void memory_get_shared_stats(struct shared_memory_stats* out_stats) {
+    spinlock_lock(&g_shared_mem_lock);
+    *out_stats = g_shared_mem_stats;
+    spinlock_unlock(&g_shared_mem_lock);
+}
 
-    /* there is a single entry in the PML4 table, see also memory_pagetables_init();
-     * in this entry, bits 12:51 contain the address of the PDPT table */
-    uint64_t* pdpt_table = (uint64_t*)(pml4_table[0] & page_table_entry_addr_mask);
+void memory_print_shared_stats(void) {
+    struct shared_memory_stats stats;
+    memory_get_shared_stats(&stats);
+    if (!stats.num_allocs)
+        return;
 
-    /* each PDPT table entry covers 1GB of memory, starting from addr 0x00 */
-    size_t pdpt_table_idx = addr / 1024 / 1024 / 1024;
-    uint64_t* pd_table = (uint64_t*)(pdpt_table[pdpt_table_idx] & page_table_entry_addr_mask);
+    log_debug("Shared memory: %lu allocs, %lu frees, %lu failed allocs, %lu/%lu bytes used "
+              "(%lu requested), peak %lu bytes", stats.num_allocs, stats.num_frees,
+              stats.num_failed_allocs, stats.used_size, stats.total_size, stats.requested_size,
+              stats.peak_used_size);
+}
 
-    /* each PD table entry covers 2MB of memory in the 1GB memory region determined via PDPT table
-     * entry (recall that there are 512 PD entries in one PD table) */
-    size_t pd_table_idx = (addr / 1024 / 1024 / 2) % 512;
-    uint64_t* pt_table = (uint64_t*)(pd_table[pd_table_idx] & page_table_entry_addr_mask);
+__attribute_no_sanitize_address
+int memory_find_page_table_entry(uint64_t addr, uint64_t** out_pte_addr) {
+    assert(g_pml4_table_base && g_page_tables_base);
 
-    /* each PT table entry covers 4KB of memory in the 2MB memory region determined via PD table
-     * entry (recall that there are 512 PD entries in one PT table) */
-    size_t pt_table_idx = (addr / 1024 / 4) % 512;
+    /* PT pages are contiguous, so the 4KB-level PTE is found directly, without walking the tree
+     * (the tree may map this address via a large page, see pagetables_sync_large_pages()) */
+    if (addr >= g_page_tables_memory_size)
+        return -PAL_ERROR_INVAL;
+    uint64_t* pte = (uint64_t*)g_page_tables_base + addr / PAGE_SIZE;
 
     /* sanity check: must arrive at the same page address as in `addr` */
-    uint64_t page_addr = pt_table[pt_table_idx] & page_table_entry_addr_mask;
-    if ((addr & page_table_entry_addr_mask) != page_addr)
+    uint64_t page_addr = *pte & PTE_ADDR_MASK;
+    if ((addr & PTE_ADDR_MASK) != page_addr)
         return -PAL_ERROR_INVAL;
 
-    *out_pte_addr = &pt_table[pt_table_idx];
+    *out_pte_addr = pte;
     return 0;
 }
 
+/* checks that all 512 entries of the table map the same (aligned) region with identical flags, each
+ * entry must have `required_bits` set; returns these common flags in `out_flags` */
+__attribute_no_sanitize_address
+static bool table_entries_are_uniform(uint64_t* entries, uint64_t required_bits,
+                                      uint64_t* out_flags) {
+    uint64_t flags = entries[0] & ~PTE_ADDR_MASK & ~PTE_IGNORED_BITS;
+    if ((flags & required_bits) != required_bits)
+        return false;
+
+    for (size_t i = 1; i < 512; i++)
+        if ((entries[i] & ~PTE_ADDR_MASK & ~PTE_IGNORED_BITS) != flags)
+            return false;
+
+    *out_flags = flags;
+    return true;
+}
+
+/* Re-derives the PDEs and PDPEs covering [addr, addr + size) from the PTEs. A large page is created
+ * only for a region fully covered by the range (the caller updated all its PTEs) and is split back
+ * into the next-level table if only a part of it is covered. The caller is responsible for TLB
+ * invalidation of the range; note that invlpg of any address inside a large page invalidates the
+ * whole large page, so invalidating the range is always enough. Returns true if the mapping size
+ * changed for some region (a large page was created or split): other vCPUs may still cache
+ * translations of the old size, so the range must be shot down on all vCPUs. */
+__attribute_no_sanitize_address
+static bool pagetables_sync_large_pages(uint64_t addr, size_t size) {
+    assert(spinlock_is_locked(&g_page_tables_lock));
+    assert(addr + size <= g_page_tables_memory_size);
+
+    bool size_changed = false;
+
+    uint64_t* pd_entries  = (uint64_t*)g_page_dir_tables_base;
+    uint64_t* pdp_entries = (uint64_t*)g_pdp_table_base;
+
+    uint64_t end = addr + size;
+    for (uint64_t region = ALIGN_DOWN(addr, LARGE_PAGE_2M_SIZE); region < end;
+            region += LARGE_PAGE_2M_SIZE) {
+        uint64_t pt_table = g_page_tables_base + (region / LARGE_PAGE_2M_SIZE) * PAGE_SIZE;
+
+        uint64_t flags;
+        uint64_t entry = pt_table + PTE_TREE_FLAGS;
+        if (addr <= region && region + LARGE_PAGE_2M_SIZE <= end
+                && table_entries_are_uniform((uint64_t*)pt_table, PTE_PRESENT, &flags)) {
+            /* PTE bit 7 is PAT which we never set, so PTE flags are valid PDE flags */
+            entry = region + flags + PTE_LARGE;
+        }
+        uint64_t old_entry = __atomic_exchange_n(&pd_entries[region / LARGE_PAGE_2M_SIZE], entry,
+                                                 __ATOMIC_RELAXED);
+        size_changed |= (old_entry ^ entry) & PTE_LARGE;
+    }
+
+    for (uint64_t region = ALIGN_DOWN(addr, LARGE_PAGE_1G_SIZE); region < end;
+            region += LARGE_PAGE_1G_SIZE) {
+        uint64_t pd_table = g_page_dir_tables_base + (region / LARGE_PAGE_1G_SIZE) * PAGE_SIZE;
+
+        uint64_t flags;
+        uint64_t entry = pd_table + PTE_TREE_FLAGS;
+        if (g_large_pages_1g_supported && addr <= region && region + LARGE_PAGE_1G_SIZE <= end
+                && table_entries_are_uniform((uint64_t*)pd_table, PTE_PRESENT | PTE_LARGE,
+                                             &flags)) {
+            entry = region + flags;
+        }
+        uint64_t old_entry = __atomic_exchange_n(&pdp_entries[region / LARGE_PAGE_1G_SIZE], entry,
+                                                 __ATOMIC_RELAXED);
+        size_changed |= (old_entry ^ entry) & PTE_LARGE;
+    }
+    return size_changed;
+}
+
+/* used only at init, before other vCPUs are started, so a local TLB invalidation is enough */
+__attribute_no_sanitize_address
+void memory_pagetables_sync(uint64_t addr, size_t size) {
+    spinlock_lock(&g_page_tables_lock);
+    pagetables_sync_large_pages(addr, size);
+    spinlock_unlock(&g_page_tables_lock);
+}
+
 __attribute_no_sanitize_address
 int memory_mark_pages_off(uint64_t addr, size_t size) {
+    spinlock_lock(&g_page_tables_lock);
     for (uint64_t mark_addr = addr; mark_addr < addr + size; mark_addr += PAGE_SIZE) {
         uint64_t* pte_addr;
         int ret = memory_find_page_table_entry(mark_addr, &pte_addr);
-        if (ret < 0)
+        if (ret < 0) {
+            spinlock_unlock(&g_page_tables_lock);
             return ret;
+        }
         *pte_addr &= ~1UL;
     }
-    return send_invalidate_tlb_ipi_and_wait((void*)addr, size, /*invalidate_on_this_cpu=*/true);
+    pagetables_sync_large_pages(addr, size);
+    spinlock_unlock(&g_page_tables_lock);
+
+    struct tlb_batch batch = {0};
+    tlb_batch_add(&batch, addr, size);
+    return tlb_batch_flush(&batch);
 }
 
 __attribute_no_sanitize_address
 int memory_mark_pages_on(uint64_t addr, size_t size, bool write, bool execute, bool usermode) {
+    /* only downgraded PTEs (some permission removed) must be shot down on other vCPUs; a stale TLB
+     * entry of an upgraded PTE results in at most one spurious #PF, see tlb_fault_is_spurious() */
+    struct tlb_batch batch = {0};
+    struct tlb_batch local_batch = {0};
+
+    spinlock_lock(&g_page_tables_lock);
     for (uint64_t mark_addr = addr; mark_addr < addr + size; mark_addr += PAGE_SIZE) {
         uint64_t* pte_addr;
         int ret = memory_find_page_table_entry(mark_addr, &pte_addr);
-        if (ret < 0)
+        if (ret < 0) {
+            spinlock_unlock(&g_page_tables_lock);
             return ret;
+        }
 
         uint64_t bits = 1UL; /* present bit is always set, since page is at least readable */
         if (write)
@@ -131,25 +542,52 @@ int memory_mark_pages_on(uint64_t addr, size_t size, bool write, bool execute, b
             bits |= 1UL << 2;
         if (!execute)
             bits |= 1UL << 63; /* NX/XD bit */
-        *pte_addr = (*pte_addr & ~((1UL << 63) + 7UL)) | bits;
+
+        uint64_t old_pte = *pte_addr;
+        *pte_addr = (old_pte & ~((1UL << 63) + 7UL)) | bits;
+
+        bool downgraded = (old_pte & 1UL) && ((old_pte & 6UL & ~bits)
+                                              || (!(old_pte & (1UL << 63)) && !execute));
+        if (downgraded)
+            tlb_batch_add(&batch, mark_addr, PAGE_SIZE);
+        else
+            tlb_batch_add(&local_batch, mark_addr, PAGE_SIZE);
     }
-    return send_invalidate_tlb_ipi_and_wait((void*)addr, size, /*invalidate_on_this_cpu=*/true);
+    bool size_changed = pagetables_sync_large_pages(addr, size);
+    spinlock_unlock(&g_page_tables_lock);
+
+    if (size_changed) {
+        /* other vCPUs may cache the old large page or the small pages now covered by a new large
+         * page, these must be shot down even if no permission was removed */
+        tlb_batch_add(&batch, addr, size);
+    } else {
+        tlb_batch_flush_local(&local_batch);
+    }
+    return tlb_batch_flush(&batch);
 }
 
 __attribute_no_sanitize_address
 int memory_mark_pages_strong_uncacheable(uint64_t addr, size_t size, bool mark) {
+    spinlock_lock(&g_page_tables_lock);
     for (uint64_t mark_addr = addr; mark_addr < addr + size; mark_addr += PAGE_SIZE) {
         uint64_t* pte_addr;
         int ret = memory_find_page_table_entry(mark_addr, &pte_addr);
-        if (ret < 0)
+        if (ret < 0) {
+            spinlock_unlock(&g_page_tables_lock);
             return ret;
+        }
 
         if (mark)
             *pte_addr |= 1UL << 4; /* PCD = Page-level cache disable */
         else
             *pte_addr &= ~(1UL << 4);
     }
-    return send_invalidate_tlb_ipi_and_wait((void*)addr, size, /*invalidate_on_this_cpu=*/true);
+    pagetables_sync_large_pages(addr, size);
+    spinlock_unlock(&g_page_tables_lock);
+
+    struct tlb_batch batch = {0};
+    tlb_batch_add(&batch, addr, size);
+    return tlb_batch_flush(&batch);
 }
 
 /*
@@ -295,7 +733,8 @@ static int asan_init(void* memory_address_end, uint64_t page_tables_addr, size_t
 }
 
 /* sets up the new page tables hierarchy (with 4KB pages) to cover memory range [0x0, memory_size);
- * page tables have 1:1 virtual-to-physical address translation */
+ * page tables have 1:1 virtual-to-physical address translation; large pages are created later, on
+ * permission changes, see pagetables_sync_large_pages() */
 __attribute_no_sanitize_address
 static int pagetables_init(size_t memory_size, uint64_t page_tables_addr, size_t page_tables_size,
                            size_t* out_total_tables_cnt, uint64_t* out_pml4_table_base) {
@@ -364,6 +803,13 @@ static int pagetables_init(size_t memory_size, uint64_t page_tables_addr, size_t
 
     __asm__ volatile("mov %%rax, %%cr3" : : "a"(pml4_table_base));
 
+    /* remember the layout for memory_find_page_table_entry(); when called for the final page
+     * tables, overwrites the layout of the temporary ones */
+    g_page_tables_base        = page_tables_base;
+    g_page_dir_tables_base    = page_dir_tables_base;
+    g_pdp_table_base          = pdp_table_base;
+    g_page_tables_memory_size = memory_size;
+
     if (out_total_tables_cnt)
         *out_total_tables_cnt = total_tables_cnt;
     if (out_pml4_table_base)
@@ -425,6 +871,10 @@ int memory_pagetables_init(void* memory_address_end, bool current_page_tables_co
     if (ret < 0)
         return ret;
 
+    uint32_t words[CPUID_WORD_NUM];
+    cpuid(EXT_SIGNATURE_AND_FEATURES_LEAF, 0, words);
+    g_large_pages_1g_supported = !!(words[CPUID_WORD_EDX] & (1U << 26)); /* Page1GB feature */
+
     g_pml4_table_base = pml4_table_base;
     return 0;
 }
@@ -598,6 +1048,245 @@ int memory_init(e820_table_entry* e820_entries, size_t e820_entries_size,
     return 0;
 }
 
+/*
+ * Boot-time initialization of free memory. After boot, all memory pages not belonging to initial
+ * (PAL) ranges must be zeroed out (in VM case, as common hypervisors like QEMU/KVM don't guarantee
+ * it) and must have no permissions (memory_pagetables_init() marked all pages as RWX). Doing this
+ * for all RAM on the BSP before anything else takes seconds on large VMs, so instead memory is split
+ * into 2MB chunks that are initialized:
+ *   - on demand, before memory_alloc(), memory_protect() or memory_free() touch a pending chunk, and
+ *     in the #PF handler (a pending chunk's pages are still mapped, but only for ring 0),
+ *   - in parallel by the BSP and all idle APs, in memory_boot_init_finish(), unless lazy mode was
+ *     requested by the VMM, in which case chunks are only initialized on demand.
+ *
+ * Free memory is determined once, from a snapshot of initial ranges taken in
+ * memory_boot_init_prepare(); ranges added later are allocated via memory_alloc() and thus their
+ * chunks are initialized before use.
+ *
+ * A chunk goes from PENDING to BUSY (via CAS, by the vCPU that initializes it) to DONE; vCPUs that
+ * need a BUSY chunk spin until it is DONE. The owner never waits for other vCPUs, as it only
+ * invalidates its own TLB: pending pages are never accessed by the app (they are not usermode) nor
+ * by the kernel (they are free), so stale TLB entries on other vCPUs are harmless and are flushed on
+ * the next downgrade of these pages anyway. Kernel code is not preempted, so a BUSY chunk is always
+ * being actively initialized.
+ */
+#define BOOT_MEM_MAX_CHUNKS  ((64UL * 1024 * 1024 * 1024) / LARGE_PAGE_2M_SIZE) /* up to 64GB */
+#define BOOT_MEM_MAX_RANGES  0x100
+
+enum {
+    BOOT_MEM_CHUNK_DONE = 0, /* zero, so that chunks beyond `g_boot_mem_chunks_cnt` are done */
+    BOOT_MEM_CHUNK_PENDING,
+    BOOT_MEM_CHUNK_BUSY,
+};
+
+struct boot_mem_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+/* initial ranges at the time of memory_boot_init_prepare(), sorted in ascending order */
+static struct boot_mem_range g_boot_mem_reserved[BOOT_MEM_MAX_RANGES];
+static size_t g_boot_mem_reserved_cnt = 0;
+
+static uint64_t g_boot_mem_start = 0;
+static uint64_t g_boot_mem_end   = 0;
+static bool g_boot_mem_zero = false;
+
+static uint8_t g_boot_mem_chunks[BOOT_MEM_MAX_CHUNKS];
+static size_t g_boot_mem_chunks_cnt = 0;
+static size_t g_boot_mem_pending_cnt = 0; /* PENDING and BUSY chunks, accessed atomically */
+static size_t g_boot_mem_next_chunk  = 0; /* cursor of parallel initialization, accessed atomically */
+static bool g_boot_mem_parallel = false;  /* parallel initialization is running, accessed atomically */
+
+/*
+ * Chunks are often initialized from contexts where shootdowns are impossible (the #PF handler runs
+ * with interrupts disabled, so waiting for other vCPUs' acks could deadlock), thus chunk init only
+ * flushes the local TLB. If it split a large page that other vCPUs may still cache, it requests a
+ * global flush, which is done later by boot_mem_flush_tlbs() before any memory is handed out.
+ * Counters are accessed atomically; "done" is the "requested" value seen by the last started flush.
+ */
+static uint64_t g_boot_mem_flush_requested = 0;
+static uint64_t g_boot_mem_flush_done = 0;
+
+__attribute_no_sanitize_address
+static bool boot_mem_init_free_range(uint64_t addr, uint64_t end, struct tlb_batch* batch) {
+    addr = ALIGN_UP(addr, PAGE_SIZE);
+    end  = ALIGN_DOWN(end, PAGE_SIZE);
+    if (addr >= end)
+        return false;
+
+    if (g_boot_mem_zero)
+        _real_memset((void*)addr, 0, end - addr);
+
+    spinlock_lock(&g_page_tables_lock);
+    for (uint64_t page = addr; page < end; page += PAGE_SIZE) {
+        uint64_t* pte_addr;
+        if (memory_find_page_table_entry(page, &pte_addr) < 0)
+            BUG();
+        *pte_addr &= ~1UL;
+    }
+    bool size_changed = pagetables_sync_large_pages(addr, end - addr);
+    spinlock_unlock(&g_page_tables_lock);
+
+    tlb_batch_add(batch, addr, end - addr);
+    return size_changed;
+}
+
+__attribute_no_sanitize_address
+static void boot_mem_init_chunk(size_t chunk_idx) {
+    uint64_t start = MAX(chunk_idx * LARGE_PAGE_2M_SIZE, g_boot_mem_start);
+    uint64_t end   = MIN((chunk_idx + 1) * LARGE_PAGE_2M_SIZE, g_boot_mem_end);
+
+    struct tlb_batch batch = {0};
+    bool size_changed = false;
+    uint64_t addr = start;
+    for (size_t i = 0; i < g_boot_mem_reserved_cnt && addr < end; i++) {
+        struct boot_mem_range* reserved = &g_boot_mem_reserved[i];
+        if (reserved->end <= addr)
+            continue;
+        if (reserved->start > addr)
+            size_changed |= boot_mem_init_free_range(addr, MIN(reserved->start, end), &batch);
+        addr = MAX(addr, reserved->end);
+    }
+    if (addr < end)
+        size_changed |= boot_mem_init_free_range(addr, end, &batch);
+
+    tlb_batch_flush_local(&batch);
+
+    /* free pages were never accessed, but other vCPUs may cache the large page that covered them
+     * together with reserved memory; the chunk is marked DONE only after this request */
+    if (size_changed)
+        __atomic_add_fetch(&g_boot_mem_flush_requested, 1, __ATOMIC_RELEASE);
+}
+
+/* Performs the global TLB flush requested by chunk init (if any); must not be called with
+ * interrupts disabled */
+static int boot_mem_flush_tlbs(void) {
+    uint64_t requested = __atomic_load_n(&g_boot_mem_flush_requested, __ATOMIC_ACQUIRE);
+    uint64_t done = __atomic_load_n(&g_boot_mem_flush_done, __ATOMIC_ACQUIRE);
+    if (done >= requested)
+        return 0;
+
+    struct tlb_batch batch = {.full_flush = true};
+    int ret = tlb_batch_flush(&batch);
+    if (ret < 0)
+        return ret;
+
+    while (done < requested) {
+        if (__atomic_compare_exchange_n(&g_boot_mem_flush_done, &done, requested, /*weak=*/false,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            break;
+    }
+    return 0;
+}
+
+/* returns true if this vCPU initialized the chunk, false if the chunk was not pending */
+static bool boot_mem_try_init_chunk(size_t chunk_idx) {
+    uint8_t expected = BOOT_MEM_CHUNK_PENDING;
+    if (!__atomic_compare_exchange_n(&g_boot_mem_chunks[chunk_idx], &expected,
+                                     BOOT_MEM_CHUNK_BUSY, /*weak=*/false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return false;
+
+    boot_mem_init_chunk(chunk_idx);
+    __atomic_store_n(&g_boot_mem_chunks[chunk_idx], BOOT_MEM_CHUNK_DONE, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&g_boot_mem_pending_cnt, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* makes sure that all chunks overlapping [addr, addr + size) are initialized */
+void memory_boot_init_range(uint64_t addr, size_t size) {
+    if (!__atomic_load_n(&g_boot_mem_pending_cnt, __ATOMIC_ACQUIRE))
+        return;
+
+    size_t first_chunk = addr / LARGE_PAGE_2M_SIZE;
+    size_t end_chunk = MIN(UDIV_ROUND_UP(addr + size, LARGE_PAGE_2M_SIZE), g_boot_mem_chunks_cnt);
+    for (size_t i = first_chunk; i < end_chunk; i++) {
+        if (boot_mem_try_init_chunk(i))
+            continue;
+        while (__atomic_load_n(&g_boot_mem_chunks[i], __ATOMIC_ACQUIRE) != BOOT_MEM_CHUNK_DONE) {
+            /* another vCPU is initializing this chunk right now */
+            CPU_RELAX();
+        }
+    }
+}
+
+/* must be called on the BSP right after memory_preload_ranges() and after adding all other initial
+ * ranges that are present at boot (e.g. the PAL binary) */
+int memory_boot_init_prepare(void* memory_address_start, void* memory_address_end,
+                             bool zero_memory) {
+    if (g_pal_public_state.initial_mem_ranges_len > BOOT_MEM_MAX_RANGES)
+        return -PAL_ERROR_NOMEM;
+
+    size_t chunks_cnt = UDIV_ROUND_UP((uint64_t)memory_address_end, LARGE_PAGE_2M_SIZE);
+    if (chunks_cnt > BOOT_MEM_MAX_CHUNKS)
+        return -PAL_ERROR_NOMEM;
+
+    /* initial ranges are sorted in descending order, we store them in ascending order; note that
+     * E820-reserved ranges may overlap with hard-coded ones, boot_mem_init_chunk() handles this */
+    size_t cnt = g_pal_public_state.initial_mem_ranges_len;
+    for (size_t i = 0; i < cnt; i++) {
+        struct pal_initial_mem_range* range = &g_pal_public_state.initial_mem_ranges[cnt - 1 - i];
+        struct boot_mem_range new_range = {.start = range->start, .end = range->end};
+
+        /* insertion sort by start address, as descending-order ranges may overlap */
+        size_t j = i;
+        while (j > 0 && g_boot_mem_reserved[j - 1].start > new_range.start) {
+            g_boot_mem_reserved[j] = g_boot_mem_reserved[j - 1];
+            j--;
+        }
+        g_boot_mem_reserved[j] = new_range;
+    }
+    g_boot_mem_reserved_cnt = cnt;
+
+    g_boot_mem_start = (uint64_t)memory_address_start;
+    g_boot_mem_end   = (uint64_t)memory_address_end;
+    g_boot_mem_zero  = zero_memory;
+
+    size_t first_chunk = g_boot_mem_start / LARGE_PAGE_2M_SIZE;
+    for (size_t i = first_chunk; i < chunks_cnt; i++)
+        g_boot_mem_chunks[i] = BOOT_MEM_CHUNK_PENDING;
+    g_boot_mem_chunks_cnt = chunks_cnt;
+    g_boot_mem_next_chunk = first_chunk;
+    __atomic_store_n(&g_boot_mem_pending_cnt, chunks_cnt - first_chunk, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* called by idle threads: joins the parallel initialization if it is running */
+void memory_boot_init_help(void) {
+    if (!__atomic_load_n(&g_boot_mem_parallel, __ATOMIC_ACQUIRE))
+        return;
+
+    while (true) {
+        size_t chunk_idx = __atomic_fetch_add(&g_boot_mem_next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk_idx >= g_boot_mem_chunks_cnt)
+            break;
+        /* the chunk may have been already initialized on demand */
+        boot_mem_try_init_chunk(chunk_idx);
+    }
+}
+
+/* must be called on the BSP after init_multicore(): unless `lazy`, initializes all pending chunks
+ * using all vCPUs and waits for completion */
+void memory_boot_init_finish(bool lazy) {
+    if (lazy)
+        return;
+
+    __atomic_store_n(&g_boot_mem_parallel, true, __ATOMIC_RELEASE);
+    sched_kick_idle_cpus();
+
+    memory_boot_init_help();
+    while (__atomic_load_n(&g_boot_mem_pending_cnt, __ATOMIC_ACQUIRE)) {
+        /* waiting for APs to finish their last chunks */
+        CPU_RELAX();
+    }
+
+    __atomic_store_n(&g_boot_mem_parallel, false, __ATOMIC_RELEASE);
+
+    if (boot_mem_flush_tlbs() < 0)
+        BUG();
+}
+
 int memory_alloc(void* addr, size_t size, bool read, bool write, bool execute) {
     if ((uintptr_t)addr < SHARED_MEM_ADDR + SHARED_MEM_SIZE &&
             SHARED_MEM_ADDR < (uintptr_t)addr + size) {
@@ -605,6 +1294,11 @@ int memory_alloc(void* addr, size_t size, bool read, bool write, bool execute) {
         return -PAL_ERROR_DENIED;
     }
 
+    memory_boot_init_range((uint64_t)addr, size);
+    int ret = boot_mem_flush_tlbs();
+    if (ret < 0)
+        return ret;
+
     if (!read && !write && !execute) {
         memory_mark_pages_off((uint64_t)addr, size);
 #ifdef ASAN
@@ -616,7 +1310,7 @@ int memory_alloc(void* addr, size_t size, bool read, bool write, bool execute) {
     /* we rely on CR0.WP == 0 (Write Protect disabled), which allows to write even into read-only
      * pages in ring 0 (otherwise for read-only allocs, we would need to call below function twice:
      * once with W permission, and after memset-to-zero again, without W permission) */
-    int ret = memory_mark_pages_on((uint64_t)addr, size, write, execute, /*usermode=*/true);
+    ret = memory_mark_pages_on((uint64_t)addr, size, write, execute, /*usermode=*/true);
     if (ret < 0)
         return ret;
 
@@ -634,6 +1328,11 @@ int memory_protect(void* addr, size_t size, bool read, bool write, bool execute)
         return -PAL_ERROR_DENIED;
     }
 
+    memory_boot_init_range((uint64_t)addr, size);
+    int ret = boot_mem_flush_tlbs();
+    if (ret < 0)
+        return ret;
+
     if (!read && !write && !execute) {
 #ifdef ASAN
         asan_poison_region((uintptr_t)addr, size, ASAN_POISON_USER);
@@ -655,6 +1354,11 @@ int memory_free(void* addr, size_t size) {
         return -PAL_ERROR_DENIED;
     }
 
+    memory_boot_init_range((uint64_t)addr, size);
+    int ret = boot_mem_flush_tlbs();
+    if (ret < 0)
+        return ret;
+
 #ifdef ASAN
     asan_poison_region((uintptr_t)addr, size, ASAN_POISON_USER);
 #endif
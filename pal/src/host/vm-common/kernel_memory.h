@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define PAGE_TABLES_ADDR 0x20000000UL          /* page tables occupy [512MB, 658MB) */
@@ -33,19 +34,44 @@ typedef struct {
 
 extern uint64_t g_pml4_table_base;
 
+/* usage statistics of the shared-memory range; "used" sizes are rounded up to slab size classes
+ * and buddy block sizes, "requested" sizes are as passed by callers */
+struct shared_memory_stats {
+    size_t total_size;
+    size_t used_size;
+    size_t peak_used_size;
+    size_t requested_size;
+    uint64_t num_allocs;
+    uint64_t num_frees;
+    uint64_t num_failed_allocs;
+};
+
+/* `size` passed to memory_free_shared_region() must be the same as during allocation */
 void* memory_get_shared_region(size_t size);
 int memory_free_shared_region(void* addr, size_t size);
+void memory_get_shared_stats(struct shared_memory_stats* out_stats);
+void memory_print_shared_stats(void);
 
 int memory_find_page_table_entry(uint64_t addr, uint64_t** out_pte_addr);
 int memory_mark_pages_on(uint64_t addr, size_t size, bool write, bool execute, bool usermode);
 int memory_mark_pages_off(uint64_t addr, size_t size);
 int memory_mark_pages_strong_uncacheable(uint64_t addr, size_t size, bool mark);
+/* must be called after PTEs returned by memory_find_page_table_entry() were modified directly */
+void memory_pagetables_sync(uint64_t addr, size_t size);
 
 int memory_pagetables_init(void* memory_address_end, bool current_page_tables_cover_1gb);
 int memory_preload_ranges(e820_table_entry* e820_entries, size_t e820_entries_size,
                           int (*callback)(uintptr_t addr, size_t size, const char* comment));
 int memory_tighten_permissions(void);
 
+/* boot-time initialization of free memory (zeroing if `zero_memory` and revoking all permissions),
+ * done in 2MB chunks either in parallel on all CPUs or lazily on demand */
+int memory_boot_init_prepare(void* memory_address_start, void* memory_address_end,
+                             bool zero_memory);
+void memory_boot_init_finish(bool lazy);
+void memory_boot_init_help(void);
+void memory_boot_init_range(uint64_t addr, size_t size);
+
 int memory_alloc(void* addr, size_t size, bool read, bool write, bool execute);
 int memory_protect(void* addr, size_t size, bool read, bool write, bool execute);
 int memory_free(void* addr, size_t size);
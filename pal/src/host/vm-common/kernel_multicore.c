@@ -67,19 +67,26 @@ int init_multicore_prepare(uint32_t num_cpus) {
         if (ret < 0)
             goto out;
 
+        thread->cpu_id = i;
         g_per_cpu_data[i].idle_thread = thread;
+
+        /* each CPU handles device interrupts steered to it (via MSI-X) in its own bottomhalves
+         * thread; CPU0 additionally handles all legacy (IOAPIC-routed) device interrupts */
+        ret = thread_helper_create(thread_bottomhalves_run, &thread);
+        if (ret < 0)
+            goto out;
+
+        thread->cpu_id = i;
+        g_per_cpu_data[i].bottomhalves_thread = thread;
+
         g_per_cpu_data[i].interrupt_stack = per_cpu_interrupt_stack + i * INTERRUPT_STACK_SIZE;
         g_per_cpu_data[i].interrupt_xsave_area = per_cpu_interrupt_xsave_area
                                                      + i * INTERRUPT_XSAVE_AREA_SIZE;
         g_per_cpu_data[i].scheduling_stack = per_cpu_scheduling_stack + i * SCHEDULING_STACK_SIZE;
     }
 
-    /* only CPU0 has a bottomhalves thread currently (i.e. CPU0 handles all incoming events) */
-    ret = thread_helper_create(thread_bottomhalves_run, &g_per_cpu_data[0].bottomhalves_thread);
-    if (ret < 0)
-        goto out;
-
     g_per_cpu_data[0].cpu_id = 0;
+    g_per_cpu_data[0].apic_id = (uint32_t)rdmsr(MSR_IA32_LAPIC_ID);
     wrmsr(MSR_IA32_GS_KERNEL_BASE, (uint64_t)&g_per_cpu_data[0]);
 
     g_num_cpus = num_cpus;
@@ -290,10 +297,11 @@ noreturn void pal_start_ap_c(uint32_t cpu_idx) {
 
     assert(g_per_cpu_data && cpu_idx >= 1);
     g_per_cpu_data[cpu_idx].cpu_id = cpu_idx;
+    g_per_cpu_data[cpu_idx].apic_id = (uint32_t)rdmsr(MSR_IA32_LAPIC_ID);
     wrmsr(MSR_IA32_GS_KERNEL_BASE, (uint64_t)&g_per_cpu_data[cpu_idx]);
 
     lapic_enable();
-    lapic_timer_init();
+    lapic_timer_init(cpu_idx);
     syscalls_init();
     interrupts_init();
 
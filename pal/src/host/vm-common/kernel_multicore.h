@@ -35,17 +35,20 @@ struct mp_wakeup_mailbox {
 
 struct per_cpu_data {
     uint32_t cpu_id;               /* 0 .. num_cpus-1 */
-    uint32_t apic_id_unused;       /* currently unused, left here for padding */
+    uint32_t apic_id;              /* x2APIC ID, used as destination of steered MSI-X interrupts */
     void*    interrupt_stack;      /* start address of the stack used for interrupts */
     void*    interrupt_xsave_area; /* start address of the XSAVE save area used for interrupts */
 
     void* scheduling_stack;        /* temporary stack used in save_context_and_restore_next() */
 
     struct thread* idle_thread;         /* each CPU has its own idle thread */
-    struct thread* bottomhalves_thread; /* only CPU0 has a bottomhalves thread currently */
+    struct thread* bottomhalves_thread; /* each CPU has its own bottomhalves thread */
 
-    uint8_t invalidate_tlb_ipi_received; /* to protect against extra "invalidate TLB" interrupts */
-    uint8_t reserved[15];
+    uint8_t tlb_lazy;             /* CPU runs idle thread, "invalidate TLB" IPIs may be skipped */
+    uint8_t tlb_stale;            /* some IPIs were skipped, full TLB flush on leaving idle */
+    uint8_t bottomhalves_pending; /* set by ISRs on this CPU, cleared by bottomhalves thread */
+    uint8_t idle_halted;          /* CPU halts in idle thread, needs "reschedule" IPI for new work */
+    uint8_t reserved[12];
 } __attribute__((packed));
 static_assert(sizeof(struct per_cpu_data) == 64, "incorrect struct size");
 
@@ -12,6 +12,8 @@
  *
  * Notes on multi-core synchronization:
  *   - all PCI operations happen only on init, no sync required
+ *   - MSI-X routes are registered on init and re-steered only during PAL init (before any app
+ *     thread starts), no sync required
  */
 
 #include <stddef.h>
@@ -21,13 +23,27 @@
 #include "pal_error.h"
 #include "pal_internal.h"
 
+#include "kernel_multicore.h"
 #include "kernel_pci.h"
 #include "kernel_virtio.h"
 
+/* we use at most 1 vector for console RX and 2 vectors for vsock RX/TX */
+#define PCI_MSIX_MAX_ROUTES 4
+
 static uintptr_t g_console_pci_bars[6];
 static uintptr_t g_fs_pci_bars[6];
 static uintptr_t g_vsock_pci_bars[6];
 
+static struct pci_msix g_console_msix;
+static struct pci_msix g_vsock_msix;
+
+/* MSI-X table entries in use, to find the entry by its vector when steering the vector */
+static struct {
+    struct pci_msix_entry* entry;
+    uint8_t vector;
+} g_msix_routes[PCI_MSIX_MAX_ROUTES];
+static size_t g_msix_routes_cnt = 0;
+
 static uint8_t bar_id_to_pci_addr(uint8_t bar_id) {
     assert(bar_id < 6);
     switch (bar_id) {
@@ -57,8 +73,8 @@ static void* pci_malloc(size_t size) {
     return (void*)ptr_addr;
 }
 
-static void* pci_bar_malloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc) {
-    assert(bar_id < 5);
+static void* pci_bar_malloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc, bool bar_64bit) {
+    assert(bar_id < (bar_64bit ? 5 : 6));
     uint8_t bar_pci_addr = bar_id_to_pci_addr(bar_id);
 
     pci_config_writel(bdf, bar_pci_addr, 0xFFFFFFFF);
@@ -71,47 +87,51 @@ static void* pci_bar_malloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc) {
         return NULL;
 
     pci_config_writel(bdf, bar_pci_addr, ((uint64_t)ptr & 0xFFFFFFFF) | (bar_desc & 0xF));
-    pci_config_writel(bdf, bar_pci_addr + 4, (uint64_t)ptr >> 32);
+    if (bar_64bit)
+        pci_config_writel(bdf, bar_pci_addr + 4, (uint64_t)ptr >> 32);
 
     return ptr;
 }
 
-static int pci_console_bar_alloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc) {
-    assert(bar_id < 5);
+static int pci_console_bar_alloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc, bool bar_64bit) {
+    assert(bar_id < (bar_64bit ? 5 : 6));
     assert(!g_console_pci_bars[bar_id]);
 
-    void* ptr = pci_bar_malloc(bdf, bar_id, bar_desc);
+    void* ptr = pci_bar_malloc(bdf, bar_id, bar_desc, bar_64bit);
     if (!ptr)
         return -PAL_ERROR_NOMEM;
 
-    g_console_pci_bars[bar_id]     = (uintptr_t)ptr;
-    g_console_pci_bars[bar_id + 1] = (uintptr_t)ptr; /* just to make it non-NULL */
+    g_console_pci_bars[bar_id] = (uintptr_t)ptr;
+    if (bar_64bit)
+        g_console_pci_bars[bar_id + 1] = (uintptr_t)ptr; /* just to make it non-NULL */
     return 0;
 }
 
-static int pci_fs_bar_alloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc) {
-    assert(bar_id < 5);
+static int pci_fs_bar_alloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc, bool bar_64bit) {
+    assert(bar_id < (bar_64bit ? 5 : 6));
     assert(!g_fs_pci_bars[bar_id]);
 
-    void* ptr = pci_bar_malloc(bdf, bar_id, bar_desc);
+    void* ptr = pci_bar_malloc(bdf, bar_id, bar_desc, bar_64bit);
     if (!ptr)
         return -PAL_ERROR_NOMEM;
 
-    g_fs_pci_bars[bar_id]     = (uintptr_t)ptr;
-    g_fs_pci_bars[bar_id + 1] = (uintptr_t)ptr; /* just to make it non-NULL */
+    g_fs_pci_bars[bar_id] = (uintptr_t)ptr;
+    if (bar_64bit)
+        g_fs_pci_bars[bar_id + 1] = (uintptr_t)ptr; /* just to make it non-NULL */
     return 0;
 }
 
-static int pci_vsock_bar_alloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc) {
-    assert(bar_id < 5);
+static int pci_vsock_bar_alloc(uint32_t bdf, uint8_t bar_id, uint32_t bar_desc, bool bar_64bit) {
+    assert(bar_id < (bar_64bit ? 5 : 6));
     assert(!g_vsock_pci_bars[bar_id]);
 
-    void* ptr = pci_bar_malloc(bdf, bar_id, bar_desc);
+    void* ptr = pci_bar_malloc(bdf, bar_id, bar_desc, bar_64bit);
     if (!ptr)
         return -PAL_ERROR_NOMEM;
 
-    g_vsock_pci_bars[bar_id]     = (uintptr_t)ptr;
-    g_vsock_pci_bars[bar_id + 1] = (uintptr_t)ptr; /* just to make it non-NULL */
+    g_vsock_pci_bars[bar_id] = (uintptr_t)ptr;
+    if (bar_64bit)
+        g_vsock_pci_bars[bar_id + 1] = (uintptr_t)ptr; /* just to make it non-NULL */
     return 0;
 }
 
@@ -146,13 +166,16 @@ static int pci_bar_init_once(uint32_t bdf, uint16_t device_id, uint8_t bar_id) {
         return -PAL_ERROR_NOTSUPPORT;
     }
 
+    /* virtio structures live in 64-bit memory BARs; QEMU puts the MSI-X table into a separate
+     * 32-bit memory BAR, which is fine as our PCI MMIO range is below 4GB anyway */
     uint32_t bar_type = (bar_desc & 0x6) >> 1;
-    if (bar_type != 0x2) {
-        /* currently we support only 64-bit memory-based BARs */
+    if (bar_type != 0x2 && bar_type != 0x0) {
+        /* currently we support only 32-bit and 64-bit memory-based BARs */
         return -PAL_ERROR_NOTSUPPORT;
     }
+    bool bar_64bit = bar_type == 0x2;
 
-    if (bar_id > 4) {
+    if (bar_64bit && bar_id > 4) {
         /* 64-bit addresses consume 2 BARs, so bar_id cannot be larger than 4 at this point */
         return -PAL_ERROR_DENIED;
     }
@@ -160,16 +183,113 @@ static int pci_bar_init_once(uint32_t bdf, uint16_t device_id, uint8_t bar_id) {
     switch (device_id) {
         case PCI_DEVICE_ID_CONSOLE_LEGACY:
         case PCI_DEVICE_ID_CONSOLE:
-            return pci_console_bar_alloc(bdf, bar_id, bar_desc);
+            return pci_console_bar_alloc(bdf, bar_id, bar_desc, bar_64bit);
         case PCI_DEVICE_ID_FS:
-            return pci_fs_bar_alloc(bdf, bar_id, bar_desc);
+            return pci_fs_bar_alloc(bdf, bar_id, bar_desc, bar_64bit);
         case PCI_DEVICE_ID_VSOCK:
-            return pci_vsock_bar_alloc(bdf, bar_id, bar_desc);
+            return pci_vsock_bar_alloc(bdf, bar_id, bar_desc, bar_64bit);
+    }
+
+    return -PAL_ERROR_NOTSUPPORT;
+}
+
+static void pci_msix_entry_program(struct pci_msix_entry* entry, uint32_t apic_id,
+                                   uint8_t vector) {
+    /* mask the entry while updating it, so that the device never sees a half-written message;
+     * an interrupt raised in between is held pending by the device and delivered on unmask */
+    uint32_t vector_ctrl = vm_mmio_readl(&entry->vector_ctrl);
+    vm_mmio_writel(&entry->vector_ctrl, vector_ctrl | PCI_MSIX_ENTRY_CTRL_MASKED);
+
+    /* physical destination mode, fixed delivery mode, edge-triggered */
+    vm_mmio_writel(&entry->msg_addr_low, MSI_ADDR_BASE | MSI_ADDR_DEST_ID(apic_id));
+    vm_mmio_writel(&entry->msg_addr_high, 0);
+    vm_mmio_writel(&entry->msg_data, vector);
+
+    vm_mmio_writel(&entry->vector_ctrl, vector_ctrl & ~PCI_MSIX_ENTRY_CTRL_MASKED);
+}
+
+/* Register MSI-X table entry `entry` as the source of `vector`; the entry stays masked until the
+ * vector is steered to a CPU via pci_msix_steer_vector() (PCI init happens before the APIC is
+ * switched to x2APIC mode, so APIC IDs are not known yet). An interrupt raised in between is held
+ * pending by the device and delivered on unmask. */
+int pci_msix_set_vector(struct pci_msix* msix, uint16_t entry, uint8_t vector) {
+    if (entry >= msix->table_size)
+        return -PAL_ERROR_INVAL;
+
+    if (g_msix_routes_cnt == PCI_MSIX_MAX_ROUTES)
+        return -PAL_ERROR_NOMEM;
+
+    for (size_t i = 0; i < g_msix_routes_cnt; i++)
+        if (g_msix_routes[i].vector == vector)
+            return -PAL_ERROR_INVAL;
+
+    g_msix_routes[g_msix_routes_cnt].entry  = &msix->table[entry];
+    g_msix_routes[g_msix_routes_cnt].vector = vector;
+    g_msix_routes_cnt++;
+    return 0;
+}
+
+/* Deliver interrupts with `vector` to CPU `cpu_id` from now on */
+int pci_msix_steer_vector(uint8_t vector, uint32_t cpu_id) {
+    if (cpu_id >= g_num_cpus)
+        return -PAL_ERROR_INVAL;
+
+    uint32_t apic_id = g_per_cpu_data[cpu_id].apic_id;
+    if (apic_id > 0xFF) {
+        /* MSI message address has only 8 bits for destination ID (no interrupt remapping) */
+        return -PAL_ERROR_NOTSUPPORT;
+    }
+
+    for (size_t i = 0; i < g_msix_routes_cnt; i++) {
+        if (g_msix_routes[i].vector == vector) {
+            pci_msix_entry_program(g_msix_routes[i].entry, apic_id, vector);
+            return 0;
+        }
     }
 
+    /* no such vector, e.g. the device is absent or doesn't support MSI-X */
     return -PAL_ERROR_NOTSUPPORT;
 }
 
+/* Locate the MSI-X table of the device (via its MSI-X capability) and enable MSI-X with all table
+ * entries masked; device drivers later unmask the entries they use via pci_msix_set_vector() */
+static int pci_msix_init(uint32_t bdf, uint16_t device_id, uint8_t cap_pointer,
+                         struct pci_msix* msix) {
+    uint16_t msg_ctrl = pci_config_readw(bdf, cap_pointer + PCI_MSIX_MSG_CTRL);
+    uint32_t table    = pci_config_readl(bdf, cap_pointer + PCI_MSIX_TABLE);
+
+    uint16_t table_size  = (msg_ctrl & PCI_MSIX_MSG_CTRL_TABLE_SIZE) + 1;
+    uint8_t bar_id       = table & PCI_MSIX_TABLE_BIR;
+    uint32_t bar_offset  = table & ~PCI_MSIX_TABLE_BIR;
+
+    if (bar_id > 5) {
+        /* BIR may have values 0x0 to 0x5, any other value is reserved */
+        return -PAL_ERROR_DENIED;
+    }
+
+    int ret = pci_bar_init_once(bdf, device_id, bar_id);
+    if (ret < 0)
+        return ret;
+
+    uintptr_t table_addr = pci_bar_addr(device_id, bar_id) + bar_offset;
+    if (!(PCI_MMIO_START_ADDR <= table_addr &&
+            table_addr + table_size * sizeof(struct pci_msix_entry) < PCI_MMIO_END_ADDR)) {
+        /* incorrect or malicious MSI-X table location */
+        return -PAL_ERROR_DENIED;
+    }
+
+    msix->table      = (struct pci_msix_entry*)table_addr;
+    msix->table_size = table_size;
+
+    for (uint16_t i = 0; i < table_size; i++)
+        vm_mmio_writel(&msix->table[i].vector_ctrl, PCI_MSIX_ENTRY_CTRL_MASKED);
+
+    /* from now on the device signals interrupts only via MSI-X messages (not via legacy INTx) */
+    msg_ctrl &= ~PCI_MSIX_MSG_CTRL_FUNC_MASK;
+    pci_config_writew(bdf, cap_pointer + PCI_MSIX_MSG_CTRL, msg_ctrl | PCI_MSIX_MSG_CTRL_ENABLE);
+    return 0;
+}
+
 static int pci_dev_init(uint32_t bdf, uint16_t device_id) {
     int ret;
 
@@ -180,6 +300,11 @@ static int pci_dev_init(uint32_t bdf, uint16_t device_id) {
     uint32_t* interrupt_status_reg = NULL;
     void* device_config            = NULL;
 
+    /* MSI-X capability, used only by console and vsock (virtio-fs stays on the legacy INTx
+     * interrupt, which is processed on CPU0 in interrupt context) */
+    uint8_t msix_cap_pointer = 0;
+    struct pci_msix* msix    = NULL;
+
     /* Capabilities Pointer only used if bit 4 of the Status reg is set to 1 */
     uint16_t status = pci_config_readw(bdf, PCI_STATUS);
     if (!(status & (1 << 4)))
@@ -201,7 +326,10 @@ static int pci_dev_init(uint32_t bdf, uint16_t device_id) {
         uint8_t cap_vndr = pci_config_readb(bdf, cap_pointer);
         uint8_t cap_next = pci_config_readb(bdf, cap_pointer + 1);
 
-        if (cap_vndr != /*PCI_CAP_ID_VNDR=*/0x09) {
+        if (cap_vndr == PCI_CAP_ID_MSIX)
+            msix_cap_pointer = cap_pointer;
+
+        if (cap_vndr != PCI_CAP_ID_VNDR) {
             cap_pointer = cap_next;
             continue;
         }
@@ -303,6 +431,29 @@ static int pci_dev_init(uint32_t bdf, uint16_t device_id) {
     uint16_t command_reg = pci_config_readw(bdf, PCI_COMMAND);
     pci_config_writew(bdf, PCI_COMMAND, command_reg | 0x3); /* enable Memory and I/O spaces */
 
+    if (msix_cap_pointer) {
+        uint16_t msix_table_size = (pci_config_readw(bdf, msix_cap_pointer + PCI_MSIX_MSG_CTRL)
+                                    & PCI_MSIX_MSG_CTRL_TABLE_SIZE) + 1;
+        switch (device_id) {
+            case PCI_DEVICE_ID_CONSOLE_LEGACY:
+            case PCI_DEVICE_ID_CONSOLE:
+                /* one vector for RX queue */
+                if (msix_table_size >= 1)
+                    msix = &g_console_msix;
+                break;
+            case PCI_DEVICE_ID_VSOCK:
+                /* separate vectors for RX and TX queues */
+                if (msix_table_size >= 2)
+                    msix = &g_vsock_msix;
+                break;
+        }
+        if (msix) {
+            ret = pci_msix_init(bdf, device_id, msix_cap_pointer, msix);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
     vm_mmio_writeb(&regs->device_status, 0); /* reset */
 
     vm_mmio_writeb(&regs->device_status,
@@ -315,13 +466,13 @@ static int pci_dev_init(uint32_t bdf, uint16_t device_id) {
         case PCI_DEVICE_ID_CONSOLE_LEGACY:
         case PCI_DEVICE_ID_CONSOLE:
             return virtio_console_init(regs, device_config, notify_off_addr, notify_off_multiplier,
-                                       interrupt_status_reg);
+                                       interrupt_status_reg, msix);
         case PCI_DEVICE_ID_FS:
             return virtio_fs_init(regs, device_config, notify_off_addr, notify_off_multiplier,
                                   interrupt_status_reg);
         case PCI_DEVICE_ID_VSOCK:
             return virtio_vsock_init(regs, device_config, notify_off_addr, notify_off_multiplier,
-                                     interrupt_status_reg);
+                                     interrupt_status_reg, msix);
         default:
             return -PAL_ERROR_NOTSUPPORT;
     }
@@ -65,6 +65,38 @@
 #define VIRTIO_PCI_CAP_SHARED_MEMORY_CFG 8
 #define VIRTIO_PCI_CAP_VENDOR_CFG        9
 
+/* PCI capability IDs */
+#define PCI_CAP_ID_VNDR 0x09
+#define PCI_CAP_ID_MSIX 0x11
+
+/* MSI-X capability: Message Control register and Table Offset/BIR register (offsets from the
+ * start of the capability), see PCI Local Bus Spec 3.0, Section 6.8.2 */
+#define PCI_MSIX_MSG_CTRL            0x02
+#define PCI_MSIX_TABLE               0x04
+#define PCI_MSIX_MSG_CTRL_TABLE_SIZE 0x07FF
+#define PCI_MSIX_MSG_CTRL_FUNC_MASK  (1 << 14)
+#define PCI_MSIX_MSG_CTRL_ENABLE     (1 << 15)
+#define PCI_MSIX_TABLE_BIR           0x7
+
+#define PCI_MSIX_ENTRY_CTRL_MASKED 0x1
+
+/* MSI message address: physical destination mode, destination APIC ID in bits 19:12 */
+#define MSI_ADDR_BASE         0xFEE00000U
+#define MSI_ADDR_DEST_ID(id)  (((uint32_t)(id) & 0xFF) << 12)
+
+struct pci_msix_entry {
+    uint32_t msg_addr_low;
+    uint32_t msg_addr_high;
+    uint32_t msg_data;
+    uint32_t vector_ctrl;
+};
+
+/* MSI-X table of a PCI device; `table` points into the device's MMIO BAR */
+struct pci_msix {
+    struct pci_msix_entry* table;
+    uint16_t table_size;
+};
+
 static inline void pci_config_writel(uint16_t bdf, uint32_t addr, uint32_t val) {
     vm_portio_writel(PCI_CONFIG_SPACE_ADDR_IO_PORT, 0x80000000 | (bdf << 8) | (addr & 0xfc));
     vm_portio_writel(PCI_CONFIG_SPACE_DATA_IO_PORT, val);
@@ -96,3 +128,6 @@ static inline uint8_t pci_config_readb(uint16_t bdf, uint32_t addr) {
 }
 
 int pci_init(void);
+
+int pci_msix_set_vector(struct pci_msix* msix, uint16_t entry, uint8_t vector);
+int pci_msix_steer_vector(uint8_t vector, uint32_t cpu_id);
@@ -2,8 +2,35 @@
 /* Copyright (C) 2023 Intel Corporation */
 
 /*
- * Trivial round-robin Single Queue Multiprocessor Scheduler (SQMS) implementation. Takes into
- * account CPU affinity.
+ * Round-robin Multi-Queue Multiprocessor Scheduler (MQMS) implementation with work stealing. Takes
+ * into account CPU affinity.
+ *
+ * Each CPU has its own run queue with runnable threads; the currently running thread and blocked
+ * threads are not in any run queue. A thread is owned by the run queue of `thread->cpu_id` (the CPU
+ * on which the thread last ran or on which it was placed at creation). A CPU picks the next thread
+ * from its own run queue; if there is none that is allowed to run on this CPU, it steals a thread
+ * from another CPU's run queue.
+ *
+ * Notes on multi-core synchronization:
+ *   - threads blocked on a futex word are kept in the wait queue of the hash bucket of this futex
+ *     word; each bucket is guarded by its own lock, so wakeups on unrelated futex words do not
+ *     contend and cost O(number of waiters in the bucket)
+ *   - each run queue is guarded by its own lock; the lock of the current CPU's run queue is held
+ *     during the whole context switch and is released only in save_context_and_restore_next(),
+ *     after the context of the previous thread is saved
+ *   - lock order is futex-bucket lock -> run-queue lock; a CPU that holds its own run-queue lock
+ *     may only try-lock run queues of other CPUs (for stealing), so there are no lock cycles
+ *   - a woken-up thread is always enqueued into the run queue of `thread->cpu_id`; this guarantees
+ *     that a thread that is still being switched out on that CPU is not picked up by anyone until
+ *     its context is fully saved (because that CPU holds its run-queue lock until then)
+ *   - `thread->cpu_id` changes only when the thread is stolen, under both run-queue locks
+ *   - `thread->cpu_mask` is modified only under the lock of the run queue of `thread->cpu_id`
+ *   - an idle CPU halts until the next interrupt; whoever gives it new work (enqueues a thread into
+ *     its run queue or asks idle CPUs to steal) sends it a "reschedule" IPI, see sched_idle_halt()
+ *   - poll wait queues live in the polled objects and are protected by the objects' locks, so an
+ *     event wakes only the pollers of this object; lock order is object lock -> futex-bucket lock
+ *   - idle work (at most one at a time) is published via CAS; the publisher waits for all idle
+ *     threads that may have seen it to leave before retracting it, see sched_idle_work_publish()
  */
 
 #include <stdint.h>
@@ -12,11 +39,14 @@
 #include "cpu.h"
 #include "pal_error.h"
 
+#include "kernel_apic.h"
 #include "kernel_interrupts.h"
 #include "kernel_multicore.h"
 #include "kernel_sched.h"
 #include "kernel_thread.h"
+#include "kernel_time.h"
 #include "kernel_xsave.h"
+#include "vm_callbacks.h"
 
 /* below functions are located in kernel_events.S */
 noreturn void isr_iret_to_userland(void);
@@ -25,18 +55,49 @@ int save_context_and_restore_next(uint64_t curr_gs_base, uint64_t next_gs_base,
                                   uint32_t* critical_section_lock_to_unlock,
                                   void* scheduling_stack);
 
-static LISTP_TYPE(thread) g_thread_list = LISTP_INIT;
+#define FUTEX_HASH_BUCKETS_NUM 256
+static_assert((FUTEX_HASH_BUCKETS_NUM & (FUTEX_HASH_BUCKETS_NUM - 1)) == 0, "must be a power of 2");
 
-/*
- * Guards operations on g_thread_list. This lock should be acquired in two ways:
+/* Wait queue of threads blocked on futex words that hash into this bucket. The bucket lock should
+ * be acquired in two ways:
  *   - if used in interrupt-handler context, must call spinlock_lock()
  *   - if used in normal (interruptible) context, must call spinlock_lock_disable_irq()
  */
-static spinlock_t g_thread_list_lock = INIT_SPINLOCK_UNLOCKED;
+struct futex_bucket {
+    spinlock_t lock;
+    LISTP_TYPE(thread) waiters; /* in FIFO order */
+} __attribute__((aligned(64)));
+
+static struct futex_bucket g_futex_buckets[FUTEX_HASH_BUCKETS_NUM];
+
+/* Per-CPU run queue; aligned to cache line to avoid false sharing between CPUs. Run-queue locks
+ * follow the same IRQ-disabling rules as futex-bucket locks. */
+struct run_queue {
+    spinlock_t lock;
+    LISTP_TYPE(thread) threads; /* runnable threads, in round-robin order */
+    uint32_t num_threads;       /* num of threads in queue; read without lock for load estimation */
+    uint32_t num_misplaced;     /* num of queued threads not allowed to run on this CPU */
+} __attribute__((aligned(64)));
+
+static struct run_queue g_run_queues[MAX_NUM_CPUS];
+
+/* total number of queued threads that are not allowed to run on the CPU of their run queue (e.g.
+ * after their CPU affinity changed); when non-zero, CPUs try to pull such threads on each reschedule
+ * to prevent them from starving */
+static uint32_t g_num_misplaced_threads = 0;
 
 /* Atomic variable used to kick sched_thread() into action (instead of waiting for some time) */
 bool g_kick_sched_thread = false;
 
+/* Idle statistics of each CPU; updated only by this CPU (except `kick_tsc`, which is set by the CPU
+ * that sends the "reschedule" IPI), so fields are read racily by sched_get_idle_stats() */
+struct idle_stats {
+    struct sched_idle_stats stats;
+    uint64_t kick_tsc; /* when the last "reschedule" IPI to this CPU was sent */
+} __attribute__((aligned(64)));
+
+static struct idle_stats g_idle_stats[MAX_NUM_CPUS];
+
 static uint64_t get_rflags(void) {
     uint64_t result;
     __asm__ volatile("pushfq; pop %0" : "=r"(result) : : "cc");
@@ -51,7 +112,8 @@ static void save_userland_context(struct thread* curr_thread, struct isr_regs* u
      * modifies it, and so we can just rely that curr_thread->context.user_fsbase is not affected
      * during these context save/restore */
 
-    memcpy(curr_thread->context.fpregs, userland_regs->fpregs, g_xsave_size);
+    /* copies only the FP state components that the thread actually uses */
+    xsave_area_copy(curr_thread->context.fpregs, userland_regs->fpregs);
 
     curr_thread->context.r8  = userland_regs->r8;
     curr_thread->context.r9  = userland_regs->r9;
@@ -80,52 +142,245 @@ static void save_userland_context(struct thread* curr_thread, struct isr_regs* u
     curr_thread->context.rflags = get_rflags();
 }
 
-static struct thread* find_next_thread(struct thread* curr_thread) {
-    assert(spinlock_is_locked(&g_thread_list_lock));
+static struct futex_bucket* futex_bucket_get(int* futex_word) {
+    /* futex words are at least 4B-aligned, drop low bits and mix the rest (Fibonacci hashing) */
+    uint64_t hash = ((uintptr_t)futex_word >> 2) * 0x9E3779B97F4A7C15UL;
+    return &g_futex_buckets[hash >> (64 - __builtin_ctz(FUTEX_HASH_BUCKETS_NUM))];
+}
+
+static bool thread_allowed_on_cpu(struct thread* thread, uint32_t cpu_id) {
+    size_t cpu_mask_idx = cpu_id / BITS_IN_TYPE(unsigned long);
+    unsigned long cpu_mask_bit = 1UL << (cpu_id % BITS_IN_TYPE(unsigned long));
+    return !!(thread->cpu_mask[cpu_mask_idx] & cpu_mask_bit);
+}
+
+static uint32_t run_queue_cpu_id(struct run_queue* rq) {
+    return (uint32_t)(rq - g_run_queues);
+}
+
+static void run_queue_add(struct run_queue* rq, struct thread* thread) {
+    assert(spinlock_is_locked(&rq->lock));
+    assert(!thread->is_helper);
 
-    if (curr_thread && !curr_thread->is_helper) {
-        /* move currently executing thread to the back of the list for round robin scheding */
-        LISTP_DEL(curr_thread, &g_thread_list, list);
-        LISTP_ADD_TAIL(curr_thread, &g_thread_list, list);
+    LISTP_ADD_TAIL(thread, &rq->threads, rq_list);
+    __atomic_store_n(&rq->num_threads, rq->num_threads + 1, __ATOMIC_RELAXED);
+
+    if (!thread_allowed_on_cpu(thread, run_queue_cpu_id(rq))) {
+        __atomic_store_n(&rq->num_misplaced, rq->num_misplaced + 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&g_num_misplaced_threads, 1, __ATOMIC_RELAXED);
     }
+}
 
-    uint32_t cpu_id = get_per_cpu_data()->cpu_id;
-    struct thread* next_thread = NULL;
+static void run_queue_del(struct run_queue* rq, struct thread* thread) {
+    assert(spinlock_is_locked(&rq->lock));
+
+    LISTP_DEL_INIT(thread, &rq->threads, rq_list);
+    __atomic_store_n(&rq->num_threads, rq->num_threads - 1, __ATOMIC_RELAXED);
+
+    if (!thread_allowed_on_cpu(thread, run_queue_cpu_id(rq))) {
+        __atomic_store_n(&rq->num_misplaced, rq->num_misplaced - 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&g_num_misplaced_threads, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static bool thread_in_run_queue(struct thread* thread) {
+    return !LIST_EMPTY(thread, rq_list);
+}
+
+/* returns the first queued thread allowed to run on `cpu_id`; if `only_misplaced`, then only
+ * threads that are not allowed to run on the CPU of this run queue are considered */
+static struct thread* run_queue_find(struct run_queue* rq, uint32_t cpu_id, bool only_misplaced) {
+    assert(spinlock_is_locked(&rq->lock));
 
     struct thread* thread;
-    LISTP_FOR_EACH_ENTRY(thread, &g_thread_list, list) {
-        if (thread->state != THREAD_RUNNABLE)
+    LISTP_FOR_EACH_ENTRY(thread, &rq->threads, rq_list) {
+        assert(thread->state == THREAD_RUNNABLE);
+        if (only_misplaced && thread_allowed_on_cpu(thread, run_queue_cpu_id(rq)))
             continue;
+        if (thread_allowed_on_cpu(thread, cpu_id))
+            return thread;
+    }
+    return NULL;
+}
 
-        size_t cpu_mask_idx = cpu_id / BITS_IN_TYPE(unsigned long);
-        unsigned long cpu_mask_bit = 1UL << (cpu_id % BITS_IN_TYPE(unsigned long));
-        if (!(thread->cpu_mask[cpu_mask_idx] & cpu_mask_bit))
+/* Steals a runnable thread from run queues of other CPUs; the caller holds its own run-queue lock
+ * so we only try-lock other run queues to avoid deadlocks (if a run queue is contended, we simply
+ * skip it). */
+static struct thread* steal_thread(struct run_queue* this_rq, bool only_misplaced) {
+    assert(spinlock_is_locked(&this_rq->lock));
+
+    uint32_t cpu_id = run_queue_cpu_id(this_rq);
+    for (uint32_t i = 1; i < g_num_cpus; i++) {
+        struct run_queue* rq = &g_run_queues[(cpu_id + i) % g_num_cpus];
+
+        if (!__atomic_load_n(&rq->num_threads, __ATOMIC_RELAXED))
+            continue;
+        if (only_misplaced && !__atomic_load_n(&rq->num_misplaced, __ATOMIC_RELAXED))
+            continue;
+        if (!spinlock_lock_timeout(&rq->lock, /*iterations=*/0))
             continue;
 
-        if (!next_thread) {
-            /* found first runnable thread, mark it as to-be-run next */
-            next_thread = thread;
-        } else {
-            /* found second runnable thread, kick some other CPU to schedule that thread */
-            __atomic_store_n(&g_kick_sched_thread, true, __ATOMIC_RELEASE);
-            break;
+        struct thread* thread = run_queue_find(rq, cpu_id, only_misplaced);
+        if (thread) {
+            run_queue_del(rq, thread);
+            __atomic_store_n(&thread->cpu_id, cpu_id, __ATOMIC_RELEASE);
+        }
+        spinlock_unlock(&rq->lock);
+
+        if (thread)
+            return thread;
+    }
+    return NULL;
+}
+
+/* Wakes up CPU `cpu_id` if it is halted in its idle thread; must be called after the new work for
+ * this CPU was published. Only the first of concurrent kickers sends the IPI. */
+static void sched_kick_cpu(uint32_t cpu_id) {
+    struct per_cpu_data* per_cpu_data = &g_per_cpu_data[cpu_id];
+
+    /* pairs with the store of `idle_halted` in sched_idle_halt(): the new work (published e.g. by
+     * the run-queue unlock) must be visible before we check the flag, or the wakeup may be lost */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&per_cpu_data->idle_halted, __ATOMIC_RELAXED))
+        return;
+    if (!__atomic_exchange_n(&per_cpu_data->idle_halted, 0, __ATOMIC_SEQ_CST))
+        return;
+
+    __atomic_store_n(&g_idle_stats[cpu_id].kick_tsc, get_tsc(), __ATOMIC_RELAXED);
+    lapic_send_ipi(per_cpu_data->apic_id, IPI_VECTOR_RESCHEDULE);
+}
+
+/* Wakes up one halted idle CPU on which `thread` is allowed to run (any halted CPU if `thread` is
+ * NULL), so that it steals runnable threads from busy CPUs */
+static void sched_kick_idle_cpu(struct thread* thread) {
+    __atomic_store_n(&g_kick_sched_thread, true, __ATOMIC_RELEASE);
+    /* pairs with the store of `idle_halted` in sched_idle_halt(), see also sched_kick_cpu() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    uint32_t this_cpu_id = get_per_cpu_data()->cpu_id;
+    for (uint32_t i = 1; i < g_num_cpus; i++) {
+        uint32_t cpu_id = (this_cpu_id + i) % g_num_cpus;
+        if (thread && !thread_allowed_on_cpu(thread, cpu_id))
+            continue;
+        if (__atomic_load_n(&g_per_cpu_data[cpu_id].idle_halted, __ATOMIC_RELAXED)) {
+            sched_kick_cpu(cpu_id);
+            return;
         }
     }
+}
+
+/* Wakes up all halted idle CPUs, e.g. to let them help with some global work; must be called after
+ * this work was published */
+void sched_kick_idle_cpus(void) {
+    uint32_t this_cpu_id = get_per_cpu_data()->cpu_id;
+    for (uint32_t cpu_id = 0; cpu_id < g_num_cpus; cpu_id++)
+        if (cpu_id != this_cpu_id)
+            sched_kick_cpu(cpu_id);
+}
+
+/*
+ * Idle work: a kernel thread that has some CPU-heavy, splittable work (e.g. hashing of a big file
+ * region) publishes it, and idle CPUs help with it from their idle threads instead of halting. The
+ * publisher must also work on it itself, as there may be no idle CPUs at all. `help()` must return
+ * when there is nothing left to take (it must not wait for more work to appear).
+ */
+static struct sched_idle_work* g_idle_work = NULL;
+static uint32_t g_idle_work_helpers = 0; /* idle threads that may be inside `g_idle_work->help()` */
+
+/* returns false if another idle work is currently published; then the caller does all the work */
+bool sched_idle_work_publish(struct sched_idle_work* work) {
+    struct sched_idle_work* expected = NULL;
+    if (!__atomic_compare_exchange_n(&g_idle_work, &expected, work, /*weak=*/false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return false;
+    sched_kick_idle_cpus();
+    return true;
+}
+
+/* after this returns, no idle thread accesses `work` anymore */
+void sched_idle_work_retract(struct sched_idle_work* work) {
+    assert(__atomic_load_n(&g_idle_work, __ATOMIC_RELAXED) == work);
+    __UNUSED(work);
+
+    /* pairs with the helper-count increment in sched_idle_work_help(): either the helper sees NULL
+     * or we see the helper */
+    __atomic_store_n(&g_idle_work, NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&g_idle_work_helpers, __ATOMIC_SEQ_CST))
+        CPU_RELAX();
+}
+
+/* called by idle threads: joins the published idle work, if any */
+void sched_idle_work_help(void) {
+    if (!__atomic_load_n(&g_idle_work, __ATOMIC_RELAXED))
+        return;
+
+    /* the work may access app memory (e.g. hash the app's buffer), so this CPU must not skip TLB
+     * shootdowns while helping: leave lazy mode, flushing the TLB if some shootdowns were skipped */
+    tlb_set_lazy(false);
+
+    __atomic_add_fetch(&g_idle_work_helpers, 1, __ATOMIC_SEQ_CST);
+    struct sched_idle_work* work = __atomic_load_n(&g_idle_work, __ATOMIC_SEQ_CST);
+    if (work)
+        work->help(work->arg);
+    __atomic_sub_fetch(&g_idle_work_helpers, 1, __ATOMIC_RELEASE);
+
+    tlb_set_lazy(true);
+}
+
+static struct thread* find_next_thread(struct run_queue* rq, struct thread* curr_thread) {
+    assert(spinlock_is_locked(&rq->lock));
 
-    if (!next_thread && cpu_id == 0) {
-        /* CPU0 must periodically handle incoming events (network packets, stdin) */
-        assert(get_per_cpu_data()->bottomhalves_thread);
-        assert(get_per_cpu_data()->bottomhalves_thread->state != THREAD_BLOCKED);
-        next_thread = get_per_cpu_data()->bottomhalves_thread;
+    if (curr_thread && !curr_thread->is_helper && curr_thread->state == THREAD_RUNNING) {
+        /* move currently executing thread to the back of the queue for round robin scheding */
+        curr_thread->state = THREAD_RUNNABLE;
+        run_queue_add(rq, curr_thread);
+    }
+
+    struct per_cpu_data* per_cpu_data = get_per_cpu_data();
+    if (__atomic_load_n(&per_cpu_data->bottomhalves_pending, __ATOMIC_ACQUIRE)) {
+        /* device interrupts were delivered to this CPU, handle them before any app thread */
+        assert(per_cpu_data->bottomhalves_thread);
+        assert(per_cpu_data->bottomhalves_thread->state != THREAD_BLOCKED);
+        return per_cpu_data->bottomhalves_thread;
+    }
+
+    uint32_t cpu_id = run_queue_cpu_id(rq);
+    struct thread* next_thread = NULL;
+
+    if (__atomic_load_n(&g_num_misplaced_threads, __ATOMIC_RELAXED)) {
+        /* some threads sit on CPUs they are not allowed to run on, pull one if it fits this CPU */
+        next_thread = steal_thread(rq, /*only_misplaced=*/true);
+    }
+
+    if (!next_thread) {
+        next_thread = run_queue_find(rq, cpu_id, /*only_misplaced=*/false);
+        if (next_thread)
+            run_queue_del(rq, next_thread);
     }
 
     if (!next_thread) {
-        /* absolutely no tasks to do */
-        assert(get_per_cpu_data()->idle_thread);
-        assert(get_per_cpu_data()->idle_thread->state != THREAD_BLOCKED);
-        next_thread = get_per_cpu_data()->idle_thread;
+        /* nothing to run locally, try to help other (overloaded) CPUs */
+        next_thread = steal_thread(rq, /*only_misplaced=*/false);
     }
 
+    if (next_thread) {
+        if (rq->num_threads) {
+            /* more runnable threads are waiting in this queue, kick idle CPUs to steal them */
+            sched_kick_idle_cpu(/*thread=*/NULL);
+        }
+        return next_thread;
+    }
+
+    /* absolutely no tasks to do */
+    assert(per_cpu_data->idle_thread);
+    assert(per_cpu_data->idle_thread->state != THREAD_BLOCKED);
+    return per_cpu_data->idle_thread;
+}
+
+static struct thread* pick_next_thread(struct run_queue* rq, struct thread* curr_thread) {
+    struct thread* next_thread = find_next_thread(rq, curr_thread);
+    /* the idle thread never touches app memory, so TLB shootdowns may skip this CPU meanwhile */
+    tlb_set_lazy(next_thread == get_per_cpu_data()->idle_thread);
     return next_thread;
 }
 
@@ -133,15 +388,17 @@ void sched_thread_uninterruptable(struct isr_regs* userland_regs) {
     uint64_t curr_gs_base = replace_with_null_if_dummy_gs_base(rdmsr(MSR_IA32_GS_BASE));
     struct thread* curr_thread = curr_gs_base ? get_thread_ptr(curr_gs_base) : NULL;
 
-    spinlock_lock(&g_thread_list_lock); /* will be unlocked during save_context */
-    struct thread* next_thread = find_next_thread(curr_thread);
+    struct run_queue* rq = &g_run_queues[get_per_cpu_data()->cpu_id];
+
+    spinlock_lock(&rq->lock); /* will be unlocked during save_context */
+    struct thread* next_thread = pick_next_thread(rq, curr_thread);
     if (curr_thread && curr_thread->state == THREAD_RUNNING)
         curr_thread->state = THREAD_RUNNABLE;
     next_thread->state = THREAD_RUNNING;
 
     if (next_thread == curr_thread) {
         /* re-scheduled the same thread, no need to save/restore context */
-        spinlock_unlock(&g_thread_list_lock);
+        spinlock_unlock(&rq->lock);
         return;
     }
 
@@ -156,7 +413,7 @@ void sched_thread_uninterruptable(struct isr_regs* userland_regs) {
 
     uint64_t next_gs_base = (uint64_t)get_gs_base(next_thread);
     save_context_and_restore_next(/*curr_gs_base=*/0x0, next_gs_base, /*lock_to_unlock=*/NULL,
-                                  /*clear_child_tid=*/NULL, &g_thread_list_lock.lock,
+                                  /*clear_child_tid=*/NULL, &rq->lock.lock,
                                   /*scheduling_stack=*/NULL);
 }
 
@@ -164,15 +421,17 @@ void sched_thread(uint32_t* lock_to_unlock, int* clear_child_tid) {
     uint64_t curr_gs_base = replace_with_null_if_dummy_gs_base(rdmsr(MSR_IA32_GS_BASE));
     struct thread* curr_thread = curr_gs_base ? get_thread_ptr(curr_gs_base) : NULL;
 
-    spinlock_lock_disable_irq(&g_thread_list_lock); /* will be unlocked during save_context */
-    struct thread* next_thread = find_next_thread(curr_thread);
+    struct run_queue* rq = &g_run_queues[get_per_cpu_data()->cpu_id];
+
+    spinlock_lock_disable_irq(&rq->lock); /* will be unlocked during save_context */
+    struct thread* next_thread = pick_next_thread(rq, curr_thread);
     if (curr_thread && curr_thread->state == THREAD_RUNNING)
         curr_thread->state = THREAD_RUNNABLE;
     next_thread->state = THREAD_RUNNING;
 
     if (next_thread == curr_thread) {
         /* re-scheduled the same thread, no need to save/restore context */
-        spinlock_unlock_enable_irq(&g_thread_list_lock);
+        spinlock_unlock_enable_irq(&rq->lock);
         return;
     }
 
@@ -181,25 +440,29 @@ void sched_thread(uint32_t* lock_to_unlock, int* clear_child_tid) {
 
     uint64_t next_gs_base = (uint64_t)get_gs_base(next_thread);
     save_context_and_restore_next(curr_gs_base, next_gs_base, lock_to_unlock, clear_child_tid,
-                                  &g_thread_list_lock.lock, get_per_cpu_data()->scheduling_stack);
+                                  &rq->lock.lock, get_per_cpu_data()->scheduling_stack);
 }
 
-void sched_thread_wait(int* futex_word, spinlock_t* lock) {
-    assert(spinlock_is_locked(lock));
-    assert(lock != &g_thread_list_lock);
-
-    /* this order of locks is required to guarantee that we won't miss any wakeup on this futex word
-     * (recall that each wakeup grabs g_thread_list_lock) */
-    spinlock_lock_disable_irq(&g_thread_list_lock); /* will be unlocked during save_context */
-    spinlock_unlock(lock);
+/* block the current thread on `futex_word`; must be called with `bucket` locked and interrupts
+ * disabled, returns (with interrupts enabled) only after the thread was unblocked via wakeup */
+static void sched_thread_block(struct futex_bucket* bucket, int* futex_word) {
+    assert(spinlock_is_locked(&bucket->lock));
 
     uint64_t curr_gs_base = rdmsr(MSR_IA32_GS_BASE);
     struct thread* curr_thread = get_thread_ptr(curr_gs_base);
 
     curr_thread->state      = THREAD_BLOCKED;
     curr_thread->blocked_on = futex_word;
+    LISTP_ADD_TAIL(curr_thread, &bucket->waiters, wait_list);
 
-    struct thread* next_thread = find_next_thread(curr_thread);
+    /* grab the run-queue lock before releasing the bucket lock: a concurrent wakeup will enqueue
+     * this thread into this run queue only after we finished saving its context */
+    struct run_queue* rq = &g_run_queues[get_per_cpu_data()->cpu_id];
+    assert(curr_thread->cpu_id == run_queue_cpu_id(rq));
+    spinlock_lock(&rq->lock); /* will be unlocked during save_context */
+    spinlock_unlock(&bucket->lock);
+
+    struct thread* next_thread = pick_next_thread(rq, curr_thread);
     next_thread->state = THREAD_RUNNING;
 
     assert(next_thread != curr_thread);
@@ -208,72 +471,307 @@ void sched_thread_wait(int* futex_word, spinlock_t* lock) {
 
     uint64_t next_gs_base = (uint64_t)get_gs_base(next_thread);
     save_context_and_restore_next(curr_gs_base, next_gs_base, /*lock_to_unlock=*/NULL,
-                                  /*clear_child_tid=*/NULL, &g_thread_list_lock.lock,
+                                  /*clear_child_tid=*/NULL, &rq->lock.lock,
                                   get_per_cpu_data()->scheduling_stack);
+}
+
+void sched_thread_wait(int* futex_word, spinlock_t* lock) {
+    assert(spinlock_is_locked(lock));
+
+    struct futex_bucket* bucket = futex_bucket_get(futex_word);
+    assert(lock != &bucket->lock);
+
+    /* this order of locks is required to guarantee that we won't miss any wakeup on this futex word
+     * (recall that each wakeup grabs the bucket lock) */
+    spinlock_lock_disable_irq(&bucket->lock);
+    spinlock_unlock(lock);
+
+    sched_thread_block(bucket, futex_word);
 
     /* now this thread is scheduled back, it means that it was unblocked via wakeup */
     spinlock_lock(lock);
 }
 
-static void sched_thread_wakeup_common(int* futex_word) {
-    assert(spinlock_is_locked(&g_thread_list_lock));
+bool sched_thread_futex_wait(int* futex_word, int val) {
+    struct futex_bucket* bucket = futex_bucket_get(futex_word);
+
+    /* the futex word is re-checked under the bucket lock, so a concurrent "update word, then wake
+     * up" sequence (e.g. from an interrupt handler) is either observed here or wakes us up */
+    spinlock_lock_disable_irq(&bucket->lock);
+    if (__atomic_load_n(futex_word, __ATOMIC_ACQUIRE) != val) {
+        spinlock_unlock_enable_irq(&bucket->lock);
+        return false;
+    }
+
+    sched_thread_block(bucket, futex_word);
+    return true;
+}
+
+static void sched_thread_make_runnable(struct thread* thread) {
+    /* the blocked thread's `cpu_id` cannot change (it is not in any run queue, so cannot be stolen),
+     * and the run-queue lock is held by that CPU until the thread's context is fully saved */
+    uint32_t cpu_id = thread->cpu_id;
+    struct run_queue* rq = &g_run_queues[cpu_id];
+    spinlock_lock(&rq->lock);
+    thread->state      = THREAD_RUNNABLE;
+    thread->blocked_on = NULL;
+    run_queue_add(rq, thread);
+    spinlock_unlock(&rq->lock);
 
-    bool found = false;
+    sched_kick_cpu(cpu_id);
+}
+
+static size_t sched_thread_wakeup_common(struct futex_bucket* bucket, int* futex_word,
+                                         size_t max_threads) {
+    assert(spinlock_is_locked(&bucket->lock));
+
+    size_t woken = 0;
     struct thread* thread;
-    LISTP_FOR_EACH_ENTRY(thread, &g_thread_list, list) {
-        if (thread->state == THREAD_BLOCKED) {
-            /* TODO: add loop of iterating through epoll/select futexes as perf optimization */
-            if (thread->blocked_on == futex_word) {
-                thread->state      = THREAD_RUNNABLE;
-                thread->blocked_on = NULL;
-                found = true;
-            }
-        }
+    struct thread* tmp;
+    LISTP_FOR_EACH_ENTRY_SAFE(thread, tmp, &bucket->waiters, wait_list) {
+        if (woken == max_threads)
+            break;
+        /* different futex words may hash into the same bucket */
+        if (thread->blocked_on != futex_word)
+            continue;
+
+        assert(thread->state == THREAD_BLOCKED);
+        LISTP_DEL_INIT(thread, &bucket->waiters, wait_list);
+        sched_thread_make_runnable(thread);
+        woken++;
     }
 
-    if (found)
+    if (woken)
         __atomic_store_n(&g_kick_sched_thread, true, __ATOMIC_RELEASE);
+    return woken;
 }
 
 void sched_thread_wakeup_uninterruptable(int* futex_word) {
-    spinlock_lock(&g_thread_list_lock);
-    sched_thread_wakeup_common(futex_word);
-    spinlock_unlock(&g_thread_list_lock);
+    struct futex_bucket* bucket = futex_bucket_get(futex_word);
+    spinlock_lock(&bucket->lock);
+    sched_thread_wakeup_common(bucket, futex_word, SCHED_WAKEUP_ALL);
+    spinlock_unlock(&bucket->lock);
+}
+
+size_t sched_thread_wakeup_n(int* futex_word, size_t max_threads) {
+    struct futex_bucket* bucket = futex_bucket_get(futex_word);
+    spinlock_lock_disable_irq(&bucket->lock);
+    size_t woken = sched_thread_wakeup_common(bucket, futex_word, max_threads);
+    spinlock_unlock_enable_irq(&bucket->lock);
+    return woken;
 }
 
 void sched_thread_wakeup(int* futex_word) {
-    spinlock_lock_disable_irq(&g_thread_list_lock);
-    sched_thread_wakeup_common(futex_word);
-    spinlock_unlock_enable_irq(&g_thread_list_lock);
+    (void)sched_thread_wakeup_n(futex_word, SCHED_WAKEUP_ALL);
+}
+
+void sched_poll_enqueue(struct sched_poll_entry* entry, LISTP_TYPE(sched_poll_entry)* queue,
+                        spinlock_t* lock) {
+    assert(spinlock_is_locked(lock));
+    assert(!entry->queue || entry->queue == queue);
+
+    entry->queue = queue;
+    entry->lock  = lock;
+    if (LIST_EMPTY(entry, list))
+        LISTP_ADD_TAIL(entry, queue, list);
+}
+
+void sched_poll_dequeue(struct sched_poll_entry* entry) {
+    if (!entry->queue)
+        return;
+
+    /* must take the lock even if the entry looks dequeued: a concurrent sched_poll_wakeup() may
+     * still be waking up our waiter, and the waiter may go out of scope right after we return */
+    spinlock_lock(entry->lock);
+    if (!LIST_EMPTY(entry, list))
+        LISTP_DEL_INIT(entry, entry->queue, list);
+    spinlock_unlock(entry->lock);
+
+    entry->queue = NULL;
+    entry->lock  = NULL;
+}
+
+size_t sched_poll_wakeup(LISTP_TYPE(sched_poll_entry)* queue, uint32_t events) {
+    size_t woken = 0;
+    struct sched_poll_entry* entry;
+    struct sched_poll_entry* tmp;
+    LISTP_FOR_EACH_ENTRY_SAFE(entry, tmp, queue, list) {
+        if (!(entry->events & events))
+            continue;
+
+        LISTP_DEL_INIT(entry, queue, list);
+        /* a waiter may be enqueued on several objects, only the first wakeup has to do the work */
+        struct sched_poll_waiter* waiter = entry->waiter;
+        if (!__atomic_exchange_n(&waiter->futex, 1, __ATOMIC_ACQ_REL)) {
+            sched_thread_wakeup(&waiter->futex);
+            woken++;
+        }
+    }
+    return woken;
+}
+
+/* places a new thread on the least loaded allowed CPU; ties are broken by rotating the start CPU
+ * so that bursts of thread creation spread across all CPUs */
+static uint32_t select_cpu_for_new_thread(struct thread* thread) {
+    static uint32_t next_start_cpu = 0;
+    uint32_t start_cpu = __atomic_fetch_add(&next_start_cpu, 1, __ATOMIC_RELAXED) % g_num_cpus;
+
+    uint32_t best_cpu  = start_cpu;
+    uint32_t best_load = UINT32_MAX;
+    for (uint32_t i = 0; i < g_num_cpus; i++) {
+        uint32_t cpu_id = (start_cpu + i) % g_num_cpus;
+        if (!thread_allowed_on_cpu(thread, cpu_id))
+            continue;
+
+        uint32_t load = __atomic_load_n(&g_run_queues[cpu_id].num_threads, __ATOMIC_RELAXED);
+        if (load < best_load) {
+            best_cpu  = cpu_id;
+            best_load = load;
+            if (!load)
+                break;
+        }
+    }
+    return best_cpu;
 }
 
 void sched_thread_add(struct thread* thread) {
-    spinlock_lock_disable_irq(&g_thread_list_lock);
-    LISTP_ADD_TAIL(thread, &g_thread_list, list);
-    spinlock_unlock_enable_irq(&g_thread_list_lock);
+    assert(g_num_cpus >= 1 && g_num_cpus <= MAX_NUM_CPUS);
+    assert(thread->state == THREAD_RUNNABLE);
+
+    /* the new thread never ran, so it is safe to put it into any run queue */
+    thread->cpu_id = select_cpu_for_new_thread(thread);
+    uint32_t cpu_id = thread->cpu_id;
+    struct run_queue* rq = &g_run_queues[cpu_id];
+    spinlock_lock_disable_irq(&rq->lock);
+    run_queue_add(rq, thread);
+    spinlock_unlock_enable_irq(&rq->lock);
+
+    __atomic_store_n(&g_kick_sched_thread, true, __ATOMIC_RELEASE);
+    sched_kick_cpu(cpu_id);
 }
 
 void sched_thread_remove(struct thread* thread) {
-    spinlock_lock_disable_irq(&g_thread_list_lock);
-    LISTP_DEL(thread, &g_thread_list, list);
+    /* only the currently running thread removes itself, so it is neither in any run queue nor in
+     * any futex wait queue, and no other CPU can access its state */
+    assert(thread->state == THREAD_RUNNING);
+    assert(!thread_in_run_queue(thread) && LIST_EMPTY(thread, wait_list));
     thread->state = THREAD_STOPPED;
     thread->blocked_on = NULL;
-    spinlock_unlock_enable_irq(&g_thread_list_lock);
 }
 
 void sched_thread_set_cpu_affinity(struct thread* thread, unsigned long* cpu_mask,
                                    size_t cpu_mask_len) {
     assert(g_num_cpus >= 1 && g_num_cpus <= MAX_NUM_CPUS);
 
-    spinlock_lock_disable_irq(&g_thread_list_lock);
-    memset(thread->cpu_mask, 0, MAX_NUM_CPU_LONGS * 8);
+    unsigned long new_cpu_mask[MAX_NUM_CPU_LONGS] = {0};
     for (size_t i = 0; i < g_num_cpus; i++) {
         size_t cpu_mask_idx = i / BITS_IN_TYPE(*cpu_mask);
         if (cpu_mask_idx >= cpu_mask_len)
             break;
         if (cpu_mask[cpu_mask_idx] & (1UL << (i % BITS_IN_TYPE(*cpu_mask)))) {
-            thread->cpu_mask[cpu_mask_idx] |= 1UL << (i % BITS_IN_TYPE(*cpu_mask));
+            new_cpu_mask[cpu_mask_idx] |= 1UL << (i % BITS_IN_TYPE(*cpu_mask));
         }
     }
-    spinlock_unlock_enable_irq(&g_thread_list_lock);
+
+    struct run_queue* rq;
+    while (true) {
+        /* thread may be stolen by another CPU concurrently, so re-check after taking the lock */
+        uint32_t cpu_id = __atomic_load_n(&thread->cpu_id, __ATOMIC_ACQUIRE);
+        rq = &g_run_queues[cpu_id];
+        spinlock_lock_disable_irq(&rq->lock);
+        if (__atomic_load_n(&thread->cpu_id, __ATOMIC_ACQUIRE) == cpu_id)
+            break;
+        spinlock_unlock_enable_irq(&rq->lock);
+    }
+
+    /* re-add the queued thread so that its "misplaced" accounting is updated; a running or blocked
+     * thread is accounted when it is enqueued next time */
+    bool queued = thread_in_run_queue(thread);
+    if (queued)
+        run_queue_del(rq, thread);
+    memcpy(thread->cpu_mask, new_cpu_mask, sizeof(thread->cpu_mask));
+    if (queued)
+        run_queue_add(rq, thread);
+
+    spinlock_unlock_enable_irq(&rq->lock);
+
+    /* if the thread became misplaced, some idle CPU from its new mask must pull it */
+    sched_kick_idle_cpu(thread);
+}
+
+/*
+ * Called in the idle thread: halts the current CPU until the next interrupt, unless there is already
+ * some work for this CPU. Lost wakeups are prevented as follows: this CPU first publishes its
+ * `idle_halted` flag and then checks for work, whereas kickers first publish work and then check
+ * the flag (with full memory barriers in between on both sides), so at least one side sees the
+ * other. The check and the halt happen with interrupts disabled, so a "reschedule" IPI that arrives
+ * in between is not served before the halt but instead ends it.
+ *
+ * The "reschedule" IPI is sent via the host-controlled ICR in case of Intel TDX, so it may be
+ * dropped; then the CPU stays halted until its next timer interrupt (at most a scheduling tick).
+ */
+void sched_idle_halt(void) {
+    struct per_cpu_data* per_cpu_data = get_per_cpu_data();
+    uint32_t cpu_id = per_cpu_data->cpu_id;
+    struct run_queue* rq = &g_run_queues[cpu_id];
+    struct sched_idle_stats* stats = &g_idle_stats[cpu_id].stats;
+
+    if (!g_interrupts_enabled) {
+        /* other CPUs are still initializing and cannot be woken up by IPIs, fall back to polling */
+        delay(IDLE_THREAD_PERIOD_US, &g_kick_sched_thread);
+        __atomic_store_n(&g_kick_sched_thread, false, __ATOMIC_RELEASE);
+        return;
+    }
+
+    cli();
+    __atomic_store_n(&per_cpu_data->idle_halted, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&g_kick_sched_thread, false, __ATOMIC_ACQ_REL)
+            || __atomic_load_n(&rq->num_threads, __ATOMIC_RELAXED)
+            || __atomic_load_n(&per_cpu_data->bottomhalves_pending, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&per_cpu_data->idle_halted, 0, __ATOMIC_RELAXED);
+        sti();
+        return;
+    }
+
+    uint64_t halt_tsc = get_tsc();
+    vm_cpu_halt(); /* returns with interrupts enabled, after the waking interrupt was served */
+    uint64_t wakeup_tsc = get_tsc();
+
+    /* we may be woken up by some other interrupt, then nobody reset our flag */
+    __atomic_store_n(&per_cpu_data->idle_halted, 0, __ATOMIC_RELAXED);
+
+    stats->num_halts++;
+    stats->halted_tsc += wakeup_tsc - halt_tsc;
+
+    /* the kick timestamp may be stale (e.g. if we were woken up by another interrupt right before
+     * the "reschedule" IPI was sent), so account only the kicks that happened during this halt */
+    uint64_t kick_tsc = __atomic_exchange_n(&g_idle_stats[cpu_id].kick_tsc, 0, __ATOMIC_RELAXED);
+    if (kick_tsc >= halt_tsc && kick_tsc <= wakeup_tsc) {
+        uint64_t latency_tsc = wakeup_tsc - kick_tsc;
+        stats->num_ipi_wakeups++;
+        stats->wakeup_latency_tsc_sum += latency_tsc;
+        stats->wakeup_latency_tsc_max = MAX(stats->wakeup_latency_tsc_max, latency_tsc);
+    }
+}
+
+void sched_get_idle_stats(uint32_t cpu_id, struct sched_idle_stats* out_stats) {
+    assert(cpu_id < g_num_cpus);
+    *out_stats = g_idle_stats[cpu_id].stats;
+}
+
+void sched_print_idle_stats(void) {
+    for (uint32_t cpu_id = 0; cpu_id < g_num_cpus; cpu_id++) {
+        struct sched_idle_stats stats;
+        sched_get_idle_stats(cpu_id, &stats);
+        if (!stats.num_halts)
+            continue;
+
+        log_debug("vCPU %u idle: %lu halts, %lu TSC cycles halted, %lu IPI wakeups (avg latency "
+                  "%lu, max %lu TSC cycles)", cpu_id, stats.num_halts, stats.halted_tsc,
+                  stats.num_ipi_wakeups,
+                  stats.num_ipi_wakeups ? stats.wakeup_latency_tsc_sum / stats.num_ipi_wakeups : 0,
+                  stats.wakeup_latency_tsc_max);
+    }
 }
@@ -2,13 +2,15 @@
 /* Copyright (C) 2023 Intel Corporation */
 
 /*
- * Declarations for scheduling and context switching. Also takes care of CPU affinity.
+ * Declarations for scheduling and context switching (per-CPU run queues with work stealing). Also
+ * takes care of CPU affinity.
  */
 
 #pragma once
 
 #include <stdint.h>
 
+#include "list.h"
 #include "spinlock.h"
 
 #include "kernel_interrupts.h"
@@ -28,8 +30,6 @@ static_assert(MAX_NUM_CPUS % BITS_IN_TYPE(unsigned long) == 0, "");
 
 extern bool g_kick_sched_thread;
 
-extern int g_streams_waiting_events_futex;
-
 /* the four helper functions are implemented in pal_common_threading.c which knows about the
  * relationship between the TCB (which is pointed to by GS base reg) and the thread struct */
 struct thread* get_thread_ptr(uintptr_t curr_gs_base);
@@ -40,8 +40,72 @@ uintptr_t replace_with_null_if_dummy_gs_base(uintptr_t gs_base);
 void sched_thread_uninterruptable(struct isr_regs* userland_regs);
 void sched_thread(uint32_t* lock_to_unlock, int* clear_child_tid);
 void sched_thread_wait(int* futex_word, spinlock_t* lock);
+/* blocks only if `*futex_word == val` (checked atomically w.r.t. wakeups), can be used without any
+ * caller-side lock; returns false if the thread didn't block */
+bool sched_thread_futex_wait(int* futex_word, int val);
+#define SCHED_WAKEUP_ALL SIZE_MAX
+
+/* wakeups on a futex word wake all threads blocked on it (`sched_thread_wakeup_n()` wakes at most
+ * `max_threads` threads in FIFO order and returns the number of woken threads) */
 void sched_thread_wakeup_uninterruptable(int* futex_word);
 void sched_thread_wakeup(int* futex_word);
+size_t sched_thread_wakeup_n(int* futex_word, size_t max_threads);
+
+/*
+ * Poll wait queues: a thread that waits for events on several objects (see PalStreamsWaitEvents)
+ * arms a single poll waiter and enqueues one poll entry per object into this object's wait queue;
+ * an event on the object wakes up only the waiters enqueued on it (and interested in the event). A
+ * wait queue is protected by the lock of its object; an entry stays enqueued until it is woken up
+ * or dequeued via sched_poll_dequeue().
+ */
+struct sched_poll_waiter {
+    int futex; /* 0 while armed, set to 1 by the first wakeup (or by the timeout) */
+};
+
+DEFINE_LIST(sched_poll_entry);
+struct sched_poll_entry {
+    LIST_TYPE(sched_poll_entry) list;
+    struct sched_poll_waiter* waiter;
+    uint32_t events;                     /* events of interest (PAL_WAIT_* flags) */
+    LISTP_TYPE(sched_poll_entry)* queue; /* queue this entry was last enqueued into */
+    spinlock_t* lock;                    /* lock that protects `queue` */
+};
+DEFINE_LISTP(sched_poll_entry);
+
+/* must be called with `lock` held; does nothing if the entry is still enqueued */
+void sched_poll_enqueue(struct sched_poll_entry* entry, LISTP_TYPE(sched_poll_entry)* queue,
+                        spinlock_t* lock);
+/* must be called without the entry's lock held; does nothing if the entry was never enqueued */
+void sched_poll_dequeue(struct sched_poll_entry* entry);
+#define SCHED_POLL_ALL_EVENTS UINT32_MAX
+
+/* must be called with the lock of `queue` held; removes all entries interested in `events` from the
+ * queue and wakes up their waiters, returns the number of woken waiters */
+size_t sched_poll_wakeup(LISTP_TYPE(sched_poll_entry)* queue, uint32_t events);
+
+/* per-CPU idle statistics, time is in TSC cycles */
+struct sched_idle_stats {
+    uint64_t num_halts;              /* times the idle thread halted this CPU */
+    uint64_t halted_tsc;             /* total time spent halted (idle residency) */
+    uint64_t num_ipi_wakeups;        /* halts ended by a "reschedule" IPI from another CPU */
+    uint64_t wakeup_latency_tsc_sum; /* from sending a "reschedule" IPI to resuming this CPU */
+    uint64_t wakeup_latency_tsc_max;
+};
+
+void sched_idle_halt(void);
+void sched_kick_idle_cpus(void);
+
+/* work that idle CPUs help with, see sched_idle_work_publish() */
+struct sched_idle_work {
+    void (*help)(void* arg);
+    void* arg;
+};
+
+bool sched_idle_work_publish(struct sched_idle_work* work);
+void sched_idle_work_retract(struct sched_idle_work* work);
+void sched_idle_work_help(void);
+void sched_get_idle_stats(uint32_t cpu_id, struct sched_idle_stats* out_stats);
+void sched_print_idle_stats(void);
 
 void sched_thread_add(struct thread* thread);
 void sched_thread_remove(struct thread* thread);
@@ -2,15 +2,19 @@
 /* Copyright (C) 2023 Intel Corporation */
 
 /*
- * Helpers for threads: currently the only one is for re-using thread stacks.
+ * Helpers for threads: currently the only one is for re-using thread stacks (per-CPU caches and
+ * a global free list with a retention cap).
  *
  * Also implements idle and bottomhalves thread loops.
  *
  * Notes on multi-core synchronization:
  *   - thread_get_stack_and_fpregs() and thread_free_stack_and_die() sync via thread-stack lock
+ *     (global free list) or touch only the current CPU's data (per-CPU stack caches)
  *   - thread_setup() and thread_helper_create() are thread-safe, operate on args and locally
  *     allocated vars, no sync required
- *    - thread_idle_run() doesn't use any global state
+ *    - thread_idle_run() doesn't use any global state, halting syncs via atomics (see
+ *      sched_idle_halt()), boot-time memory initialization syncs via atomics (see
+ *      memory_boot_init_range()), idle work syncs via atomics (see sched_idle_work_publish())
  *    - thread_bottomhalves_run() uses atomics and locks, see this func for details
  */
 
@@ -18,11 +22,14 @@
 
 #include "api.h"
 #include "asan.h"
+#include "pal_error.h"
+#include "pal_internal.h"
 #include "spinlock.h"
 
+#include "kernel_memory.h"
+#include "kernel_multicore.h"
 #include "kernel_sched.h"
 #include "kernel_thread.h"
-#include "kernel_time.h"
 #include "kernel_virtio.h"
 #include "kernel_xsave.h"
 
@@ -30,100 +37,162 @@
 noreturn void pal_common_thread_exit(int* clear_child_tid);
 noreturn void thread_main_wrapper(void* callback_args, void* callback, void* terminate_func);
 
-/* We cannot just use malloc/free to allocate/free thread stacks because thread-exit routine needs
- * to execute on the stack and thus can't execute free (it would execute with no stack after such
- * call). Thus, we resort to recycling thread stacks (and fpregs memory regions allocated together
- * with the stack) allocated by previous threads and not used anymore. This still leaks memory but
- * at least it is bounded by the max number of simultaneously executing threads. */
-struct thread_stack_map_t {
-    void* stack;
-    bool  used;
+/* We cannot just free the stack of a terminating thread because the thread-exit routine needs to
+ * execute on the stack (and the TCB of the thread lives in it) until the thread switches away.
+ * Thus, we recycle thread stacks (and fpregs memory regions allocated together with the stack):
+ *
+ *   - each CPU caches a few stacks of threads that terminated on it; such a stack may be reused
+ *     only by a thread running on the same CPU, i.e. after the terminating thread switched away,
+ *     so no locking is needed (kernel code is not preempted, and ISRs do not touch the cache),
+ *   - other stacks go to a global free list, protected by the thread-stack lock; the terminating
+ *     thread releases the lock only after switching away,
+ *   - stacks in the global list above `g_max_cached_thread_stacks` are returned to the system on
+ *     the next stack allocation (the terminating thread cannot do it itself, as freeing memory
+ *     calls into LibOS bookkeeping).
+ *
+ * Getting and putting a stack are O(1). Free stacks are linked through a header at the bottom of
+ * the stack. Each allocation looks like this (the guard page has no permissions, so that a stack
+ * overflow faults instead of silently corrupting adjacent memory):
+ *
+ *   | guard page | stack (THREAD_STACK_SIZE) | alt stack (ALT_STACK_SIZE) | fpregs (XSAVE) |
+ */
+#define THREAD_STACK_GUARD_SIZE     PAGE_SIZE
+#define THREAD_STACK_CPU_CACHE_SIZE 4
+
+struct free_thread_stack {
+    struct free_thread_stack* next;
 };
 
-static struct thread_stack_map_t* g_thread_stack_map = NULL;
-static size_t g_thread_stack_num  = 0;
-static size_t g_thread_stack_size = 0;
-static spinlock_t g_thread_stack_lock = INIT_SPINLOCK_UNLOCKED;
+struct thread_stack_cpu_cache {
+    void* stacks[THREAD_STACK_CPU_CACHE_SIZE];
+    size_t count;
+} __attribute__((aligned(64)));
 
-int thread_get_stack_and_fpregs(void** out_stack, void** out_fpregs) {
-    int ret;
-    void* stack_base = NULL;
+static struct thread_stack_cpu_cache g_thread_stack_cpu_caches[MAX_NUM_CPUS];
+static struct free_thread_stack* g_free_thread_stacks = NULL;
+static size_t g_free_thread_stacks_cnt = 0;
+static size_t g_max_cached_thread_stacks = DEFAULT_MAX_CACHED_THREAD_STACKS;
+static spinlock_t g_thread_stack_lock = INIT_SPINLOCK_UNLOCKED;
 
-    /* we allocate both the stack and the fpregs (XSAVE) memory region in one go; note that
-     * fpregs may be allocated not at VM_XSAVE_ALIGN boundary, so need to add a margin for that */
+static size_t thread_stack_alloc_size(void) {
+    /* fpregs may be allocated not at VM_XSAVE_ALIGN boundary, so need to add a margin for that */
     assert(g_xsave_size);
-    size_t stack_and_fpregs_size = THREAD_STACK_SIZE + ALT_STACK_SIZE + g_xsave_size
-                                                     + VM_XSAVE_ALIGN;
+    return ALLOC_ALIGN_UP(THREAD_STACK_GUARD_SIZE + THREAD_STACK_SIZE + ALT_STACK_SIZE
+                          + g_xsave_size + VM_XSAVE_ALIGN);
+}
 
-    spinlock_lock(&g_thread_stack_lock);
-    for (size_t i = 0; i < g_thread_stack_num; i++) {
-        if (!g_thread_stack_map[i].used) {
-            /* found allocated and unused stack + fpregs -- use it */
-            g_thread_stack_map[i].used = true;
-            stack_base = g_thread_stack_map[i].stack;
-            ret = 0;
-            goto out;
-        }
+static int thread_stack_alloc(void** out_stack) {
+    size_t size = thread_stack_alloc_size();
+
+    void* addr;
+    int ret = pal_internal_memory_alloc(size, &addr);
+    if (ret < 0)
+        return ret;
+
+    ret = memory_protect(addr, THREAD_STACK_GUARD_SIZE, /*read=*/false, /*write=*/false,
+                         /*execute=*/false);
+    if (ret < 0) {
+        (void)pal_internal_memory_free(addr, size);
+        return ret;
     }
 
-    if (g_thread_stack_num == g_thread_stack_size) {
-        /* realloc g_thread_stack_map to accommodate more objects (includes the very first time) */
-        g_thread_stack_size += 8;
-        struct thread_stack_map_t* tmp = malloc(g_thread_stack_size * sizeof(*tmp));
-        if (!tmp) {
-            ret = -PAL_ERROR_NOMEM;
-            goto out;
-        }
+    *out_stack = addr + THREAD_STACK_GUARD_SIZE;
+    return 0;
+}
+
+static void thread_stack_release(void* stack) {
+    int ret = pal_internal_memory_free(stack - THREAD_STACK_GUARD_SIZE, thread_stack_alloc_size());
+    if (ret < 0)
+        log_warning("Failed to release a thread stack: %s", pal_strerror(ret));
+}
+
+static void thread_stacks_trim(void) {
+    struct free_thread_stack* to_release = NULL;
+
+    spinlock_lock(&g_thread_stack_lock);
+    while (g_free_thread_stacks_cnt > g_max_cached_thread_stacks) {
+        struct free_thread_stack* entry = g_free_thread_stacks;
+        g_free_thread_stacks = entry->next;
+        g_free_thread_stacks_cnt--;
 
-        memcpy(tmp, g_thread_stack_map, g_thread_stack_num * sizeof(*tmp));
-        free(g_thread_stack_map);
-        g_thread_stack_map = tmp;
+        entry->next = to_release;
+        to_release = entry;
     }
+    spinlock_unlock(&g_thread_stack_lock);
 
-    stack_base = malloc(stack_and_fpregs_size);
-    if (!stack_base) {
-        ret = -PAL_ERROR_NOMEM;
-        goto out;
+    while (to_release) {
+        struct free_thread_stack* next = to_release->next;
+        thread_stack_release(to_release);
+        to_release = next;
     }
+}
 
-    g_thread_stack_map[g_thread_stack_num].stack = stack_base;
-    g_thread_stack_map[g_thread_stack_num].used  = true;
-    g_thread_stack_num++;
+void thread_set_max_cached_stacks(size_t max_cached_stacks) {
+    __atomic_store_n(&g_max_cached_thread_stacks, max_cached_stacks, __ATOMIC_RELAXED);
+}
 
-    ret = 0;
+int thread_get_stack_and_fpregs(void** out_stack, void** out_fpregs) {
+    void* stack = NULL;
+
+    struct thread_stack_cpu_cache* cache = &g_thread_stack_cpu_caches[get_per_cpu_data()->cpu_id];
+    if (cache->count) {
+        stack = cache->stacks[--cache->count];
+    } else {
+        spinlock_lock(&g_thread_stack_lock);
+        struct free_thread_stack* entry = g_free_thread_stacks;
+        if (entry) {
+            g_free_thread_stacks = entry->next;
+            g_free_thread_stacks_cnt--;
+            stack = entry;
+        }
+        spinlock_unlock(&g_thread_stack_lock);
+    }
+
+    if (__atomic_load_n(&g_free_thread_stacks_cnt, __ATOMIC_RELAXED)
+            > __atomic_load_n(&g_max_cached_thread_stacks, __ATOMIC_RELAXED)) {
+        thread_stacks_trim();
+    }
+
+    if (!stack) {
+        int ret = thread_stack_alloc(&stack);
+        if (ret < 0)
+            return ret;
+    }
 
-out:
-    if (ret == 0) {
-        assert(stack_base);
 #ifdef ASAN
-        asan_unpoison_region((uintptr_t)stack_base, stack_and_fpregs_size);
+    asan_unpoison_region((uintptr_t)stack, thread_stack_alloc_size() - THREAD_STACK_GUARD_SIZE);
 #endif
-        *out_stack  = stack_base;
-        *out_fpregs = stack_base + THREAD_STACK_SIZE + ALT_STACK_SIZE;
-    }
-    spinlock_unlock(&g_thread_stack_lock);
-    return ret;
+
+    *out_stack  = stack;
+    *out_fpregs = stack + THREAD_STACK_SIZE + ALT_STACK_SIZE;
+    return 0;
 }
 
 noreturn void thread_free_stack_and_die(void* thread_stack, int* clear_child_tid) {
-    /* we do not free thread stack (and fpregs memory region allocated with it) but instead mark it
-     * as recycled, see thread_get_stack_and_fpregs() */
-    spinlock_lock(&g_thread_stack_lock);
-    for (size_t i = 0; i < g_thread_stack_num; i++) {
-        if (g_thread_stack_map[i].stack == thread_stack) {
-            g_thread_stack_map[i].used = false;
-            break;
-        }
+    uint32_t* lock_to_unlock = NULL;
+
+    struct thread_stack_cpu_cache* cache = &g_thread_stack_cpu_caches[get_per_cpu_data()->cpu_id];
+    if (cache->count < THREAD_STACK_CPU_CACHE_SIZE) {
+        cache->stacks[cache->count++] = thread_stack;
+    } else {
+        struct free_thread_stack* entry = thread_stack;
+
+        spinlock_lock(&g_thread_stack_lock);
+        entry->next = g_free_thread_stacks;
+        g_free_thread_stacks = entry;
+        g_free_thread_stacks_cnt++;
+
+        /* we might still be using the stack we just put on the list until we enter the asm mode,
+         * so we do not unlock now but rather when another thread is scheduled */
+        lock_to_unlock = &g_thread_stack_lock.lock;
     }
 
     /* we do not ASan-unpoison the current stack at this point because we call into `sched_thread()`
      * which in turn calls into other functions, i.e. the stack will be used extensively there;
      * instead we ASan-unpoison this stack when it is re-used, see thread_get_stack_and_fpregs() */
 
-    /* we might still be using the stack we just marked as unused until we enter the asm mode,
-     * so we do not unlock now but rather when another thread is scheduled */
     set_dummy_gs_base();
-    sched_thread(&g_thread_stack_lock.lock, clear_child_tid);
+    sched_thread(lock_to_unlock, clear_child_tid);
     __builtin_unreachable();
 }
 
@@ -188,32 +257,51 @@ int thread_helper_create(int (*callback)(void*), struct thread** out_thread) {
 }
 
 /* Idle thread (aka idle process) that runs when all other threads are blocked; can happen e.g. when
- * other threads wait on timer interrupt or external-event interrupt */
+ * other threads wait on timer interrupt or external-event interrupt. It halts the CPU until some
+ * interrupt arrives: a "reschedule" IPI when another CPU gave this CPU new work, a timer interrupt
+ * or a device interrupt. */
 noreturn int thread_idle_run(void* args) {
     __UNUSED(args);
 
     while (true) {
-        delay(IDLE_THREAD_PERIOD_US, &g_kick_sched_thread);
-        __atomic_store_n(&g_kick_sched_thread, false, __ATOMIC_RELEASE);
+        /* idle CPUs join parallel boot-time memory initialization, see memory_boot_init_finish() */
+        memory_boot_init_help();
+        /* idle CPUs also help with runtime work published by other threads */
+        sched_idle_work_help();
+        sched_idle_halt();
         sched_thread(/*lock_to_unlock=*/NULL, /*clear_child_tid=*/NULL);
     }
 
     __builtin_unreachable();
 }
 
-/* Thread that performs heavy tasks triggered on IRQs in normal context; runs only on CPU0 */
+/* Called in interrupt context: makes the bottomhalves thread of the current CPU run at the next
+ * scheduling point (which is right after the ISR if the interrupt arrived in userland) */
+void thread_bottomhalves_kick(void) {
+    __atomic_store_n(&get_per_cpu_data()->bottomhalves_pending, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_kick_sched_thread, true, __ATOMIC_RELEASE);
+}
+
+/* Thread that performs heavy tasks triggered on IRQs in normal context; each CPU has one, and it
+ * runs when an ISR on this CPU kicked it. Device triggers are global, so whichever CPU gets to the
+ * bottom half first processes it (bottom halves are serialized via device locks). */
 noreturn int thread_bottomhalves_run(void* args) {
     __UNUSED(args);
 
     while (true) {
-        bool vsock_trigger = !!__atomic_exchange_n(&g_vsock_trigger_bottomhalf, false,
-                                                   __ATOMIC_ACQ_REL);
+        /* clear before consuming triggers, so that a concurrent ISR re-kicks this thread */
+        __atomic_store_n(&get_per_cpu_data()->bottomhalves_pending, 0, __ATOMIC_RELEASE);
+
+        bool vsock_rx_trigger = !!__atomic_exchange_n(&g_vsock_rx_trigger_bottomhalf, false,
+                                                      __ATOMIC_ACQ_REL);
+        bool vsock_tx_trigger = !!__atomic_exchange_n(&g_vsock_tx_trigger_bottomhalf, false,
+                                                      __ATOMIC_ACQ_REL);
         bool console_trigger = !!__atomic_exchange_n(&g_console_trigger_bottomhalf, false,
                                                      __ATOMIC_ACQ_REL);
 
         /* FIXME: triple fault on errors? */
-        if (vsock_trigger)
-            (void)virtio_vsock_bottomhalf();
+        if (vsock_rx_trigger || vsock_tx_trigger)
+            (void)virtio_vsock_bottomhalf(vsock_rx_trigger, vsock_tx_trigger);
         if (console_trigger)
             (void)virtio_console_bottomhalf();
 
@@ -19,6 +19,9 @@
 #define THREAD_STACK_SIZE (PAGE_SIZE * 16) /* 64KB user stack */
 #define ALT_STACK_SIZE    (PAGE_SIZE * 2)  /* 8KB signal stack */
 
+/* max number of free thread stacks kept in the global pool (per-CPU caches hold a few more) */
+#define DEFAULT_MAX_CACHED_THREAD_STACKS 64
+
 enum thread_state {
     THREAD_STOPPED,
     THREAD_RUNNABLE,
@@ -68,9 +71,11 @@ struct thread_irq_pseudo_stack {
 
 DEFINE_LIST(thread);
 struct thread {
-    LIST_TYPE(thread) list;
+    LIST_TYPE(thread) wait_list; /* node in the futex wait queue (only if blocked) */
+    LIST_TYPE(thread) rq_list;   /* node in the run queue of `cpu_id` (only if runnable, queued) */
     enum thread_state state;
     uint32_t thread_id; /* for debugging purposes */
+    uint32_t cpu_id;    /* CPU whose run queue owns this thread (CPU on which it last ran) */
     int* blocked_on;
     bool is_helper; /* is it an idle or bottomhalves thread */
 
@@ -97,6 +102,7 @@ DEFINE_LISTP(thread);
 
 int thread_get_stack_and_fpregs(void** out_stack, void** out_fpregs);
 noreturn void thread_free_stack_and_die(void* thread_stack, int* clear_child_tid);
+void thread_set_max_cached_stacks(size_t max_cached_stacks);
 
 void thread_setup(struct thread* thread, void* fpregs, void* stack, int (*callback)(void*),
                   const void* param);
@@ -104,3 +110,4 @@ int thread_helper_create(int (*callback)(void*), struct thread** out_thread);
 
 noreturn int thread_idle_run(void* args);
 noreturn int thread_bottomhalves_run(void* args);
+void thread_bottomhalves_kick(void);
@@ -5,46 +5,91 @@
  * Functions for getting time (in us) and setting/triggering timeouts.
  *
  * Notes on multi-core synchronization:
- *   - Timeout operations happen on different CPUs in both normal and interrupt-handling contexts,
- *     sync via timeouts lock
+ *   - Timeout operations and timer (re-)arming happen on different CPUs in both normal and
+ *     interrupt-handling contexts, sync via timeouts lock
  *   - get_time_in_us()/delay() are thread-safe, don't use global mutable state, no sync required
+ *   - TSC-to-time conversion parameters are set once in time_init() (before other CPUs and the app
+ *     start), and are read-only afterwards; the same parameters are exported to the LibOS vDSO
+ *   - boot-phase timing is recorded and printed only by the BSP at init, no sync required
  */
 
 #include <stdint.h>
 
 #include "api.h"
-#include "list.h"
+#include "pal.h"
 #include "pal_error.h"
 #include "spinlock.h"
 
+#include "kernel_apic.h"
+#include "kernel_multicore.h"
 #include "kernel_sched.h"
 #include "kernel_time.h"
 #include "kernel_vmm_inputs.h"
 
-DEFINE_LIST(pending_timeout);
+/* Pending timeouts are kept in a binary min-heap ordered by deadline, so that the earliest timeout
+ * is found in O(1) and timeouts are added/removed in O(log n). Timeout objects are preallocated;
+ * free objects are kept in a singly linked list. When the pool is exhausted, timeout objects are
+ * malloc'd (and freed on deregistration), and the heap array is grown. */
+#define TIMEOUTS_POOL_SIZE  4096
+#define TIMEOUT_NOT_PENDING UINT32_MAX
+
 struct pending_timeout {
     uint64_t timeout_absolute_us;
     int* futex;
-    LIST_TYPE(pending_timeout) list;
+    bool set_futex;                    /* store 1 into `*futex` before waking up its waiters */
+    bool from_pool;                    /* false if malloc'd because the pool was exhausted */
+    uint32_t heap_idx;                 /* TIMEOUT_NOT_PENDING if triggered or not registered */
+    struct pending_timeout* next_free; /* valid only while in the free list */
 };
-DEFINE_LISTP(pending_timeout);
 
-/* List of pending timeouts; wait-with-timeout events add themselves to this list, and
- * notify_about_timeouts_uninterruptable() callback for timer interrupt walks through this list */
-static LISTP_TYPE(pending_timeout) g_pending_timeouts_list = LISTP_INIT;
-static spinlock_t g_pending_timeouts_list_lock = INIT_SPINLOCK_UNLOCKED;
+static struct pending_timeout g_timeouts_pool[TIMEOUTS_POOL_SIZE];
+static struct pending_timeout* g_timeouts_free_list = NULL;
+static bool g_timeouts_pool_initialized = false;
+
+static struct pending_timeout* g_timeouts_heap_initial[TIMEOUTS_POOL_SIZE];
+static struct pending_timeout** g_timeouts_heap = g_timeouts_heap_initial;
+static uint32_t g_timeouts_heap_capacity = TIMEOUTS_POOL_SIZE;
+static uint32_t g_timeouts_heap_size = 0;
+
+/*
+ * The LAPIC timer of each CPU is programmed in TSC-deadline mode to the earliest of (1) the next
+ * scheduling tick of this CPU and (2) the earliest pending timeout, if this CPU is the "owner" of
+ * timeouts. There is a single owner at any time: it is the CPU that registered the earliest timeout
+ * last (if it had to re-arm its timer for it), initially CPU0. Thus timeouts fire with TSC
+ * precision instead of at the next scheduling tick, and only one CPU gets timer interrupts for
+ * them. Any CPU that gets a timer interrupt processes all expired timeouts.
+ */
+static uint32_t g_timeouts_owner_cpu = 0;
+static uint64_t g_next_tick_tsc[MAX_NUM_CPUS];      /* next scheduling tick of each CPU */
+static uint64_t g_armed_deadline_tsc[MAX_NUM_CPUS]; /* currently programmed TSC deadline */
+
+/* protects all of the above; timeouts are used by the interrupt handler, so all normal-context
+ * users must temporarily disable interrupts to avoid deadlock */
+static spinlock_t g_timeouts_lock = INIT_SPINLOCK_UNLOCKED;
+
+/* TSC ticks are converted to us with a multiplication and a shift instead of a division by
+ * `g_tsc_mhz`: `us = (tsc * g_tsc_to_us_mult) >> TSC_TO_US_SHIFT`, with a 128-bit product. With the
+ * shift of 64, the result is the upper half of the product, and the multiplier is so precise that
+ * the result is off by at most 1us from the exact division. The LibOS vDSO uses the same formula
+ * (see get_tsc_time_info()), so time queries with and without syscalls are consistent. */
+#define TSC_TO_US_SHIFT 64
 
 static uint64_t g_start_tsc = 0;
 static uint64_t g_start_us  = 0;
+static uint64_t g_tsc_to_us_mult = 0;
 
 extern uint64_t g_tsc_mhz;
 
+static uint64_t tsc_to_us(uint64_t tsc) {
+    return (uint64_t)(((__uint128_t)tsc * g_tsc_to_us_mult) >> TSC_TO_US_SHIFT);
+}
+
 /* may return overflow error, but we hope this never happens in real runs */
 int get_time_in_us(uint64_t* out_us) {
-    assert(g_tsc_mhz);
+    assert(g_tsc_to_us_mult);
 
     uint64_t diff_tsc = get_tsc() - g_start_tsc;
-    uint64_t diff_us = diff_tsc / g_tsc_mhz;
+    uint64_t diff_us = tsc_to_us(diff_tsc);
 
     uint64_t us = g_start_us + diff_us;
     if (us < g_start_us)
@@ -67,77 +112,315 @@ int delay(uint64_t delay_us, bool* continue_gate) {
     return 0;
 }
 
-int register_timeout(uint64_t timeout_absolute_us, int* futex, void** timeout_out) {
+/* Boot-phase timing breakdown: the BSP records the TSC at the end of each boot phase (TSC frequency
+ * is not yet known in early phases, so conversion to us is done only when printing) */
+#define MAX_BOOT_PHASES 16
+
+struct boot_phase {
+    const char* name;
+    uint64_t end_tsc;
+};
+
+static struct boot_phase g_boot_phases[MAX_BOOT_PHASES];
+static size_t g_boot_phases_cnt = 0;
+static uint64_t g_boot_start_tsc = 0;
+
+void boot_phases_start(uint64_t start_tsc) {
+    g_boot_start_tsc = start_tsc;
+}
+
+void boot_phase_done(const char* name) {
+    if (g_boot_phases_cnt == MAX_BOOT_PHASES)
+        return;
+    g_boot_phases[g_boot_phases_cnt].name = name;
+    g_boot_phases[g_boot_phases_cnt].end_tsc = get_tsc();
+    g_boot_phases_cnt++;
+}
+
+void boot_phases_print(void) {
+    assert(g_tsc_mhz);
+    if (!g_boot_phases_cnt)
+        return;
+
+    uint64_t total_tsc = g_boot_phases[g_boot_phases_cnt - 1].end_tsc - g_boot_start_tsc;
+    log_debug("Boot-phase timing breakdown (total %lu us):", total_tsc / g_tsc_mhz);
+
+    uint64_t prev_tsc = g_boot_start_tsc;
+    for (size_t i = 0; i < g_boot_phases_cnt; i++) {
+        log_debug("    %s: %lu us", g_boot_phases[i].name,
+                  (g_boot_phases[i].end_tsc - prev_tsc) / g_tsc_mhz);
+        prev_tsc = g_boot_phases[i].end_tsc;
+    }
+}
+
+static uint64_t time_us_to_tsc(uint64_t time_us) {
+    if (time_us <= g_start_us)
+        return g_start_tsc;
+    uint64_t diff_us = time_us - g_start_us;
+    if (diff_us > (UINT64_MAX - g_start_tsc) / g_tsc_mhz)
+        return UINT64_MAX;
+    return g_start_tsc + diff_us * g_tsc_mhz;
+}
+
+static void heap_set(uint32_t idx, struct pending_timeout* timeout) {
+    g_timeouts_heap[idx] = timeout;
+    timeout->heap_idx = idx;
+}
+
+static void heap_sift_up(uint32_t idx) {
+    struct pending_timeout* timeout = g_timeouts_heap[idx];
+    while (idx > 0) {
+        uint32_t parent = (idx - 1) / 2;
+        if (g_timeouts_heap[parent]->timeout_absolute_us <= timeout->timeout_absolute_us)
+            break;
+        heap_set(idx, g_timeouts_heap[parent]);
+        idx = parent;
+    }
+    heap_set(idx, timeout);
+}
+
+static void heap_sift_down(uint32_t idx) {
+    struct pending_timeout* timeout = g_timeouts_heap[idx];
+    while (true) {
+        uint32_t child = idx * 2 + 1;
+        if (child >= g_timeouts_heap_size)
+            break;
+        if (child + 1 < g_timeouts_heap_size && g_timeouts_heap[child + 1]->timeout_absolute_us
+                                                    < g_timeouts_heap[child]->timeout_absolute_us)
+            child++;
+        if (timeout->timeout_absolute_us <= g_timeouts_heap[child]->timeout_absolute_us)
+            break;
+        heap_set(idx, g_timeouts_heap[child]);
+        idx = child;
+    }
+    heap_set(idx, timeout);
+}
+
+static void heap_remove(struct pending_timeout* timeout) {
+    assert(spinlock_is_locked(&g_timeouts_lock));
+
+    uint32_t idx = timeout->heap_idx;
+    assert(idx < g_timeouts_heap_size && g_timeouts_heap[idx] == timeout);
+    timeout->heap_idx = TIMEOUT_NOT_PENDING;
+
+    g_timeouts_heap_size--;
+    if (idx == g_timeouts_heap_size)
+        return;
+
+    /* move the last element into the hole and restore the heap property in either direction */
+    struct pending_timeout* moved = g_timeouts_heap[g_timeouts_heap_size];
+    heap_set(idx, moved);
+    heap_sift_up(idx);
+    heap_sift_down(moved->heap_idx);
+}
+
+/* programs the LAPIC timer of the current CPU; must be called with timeouts lock held (and thus
+ * with interrupts disabled) */
+static void timer_arm(uint32_t cpu_id, uint64_t deadline_tsc) {
+    assert(spinlock_is_locked(&g_timeouts_lock));
+    g_armed_deadline_tsc[cpu_id] = deadline_tsc;
+    lapic_timer_set_deadline(deadline_tsc);
+}
+
+/* arms the next timer interrupt of the current CPU: the next scheduling tick and, if this CPU is
+ * the owner of timeouts, the earliest pending timeout */
+static void timer_rearm(uint32_t cpu_id) {
+    uint64_t deadline_tsc = g_next_tick_tsc[cpu_id];
+    if (cpu_id == g_timeouts_owner_cpu && g_timeouts_heap_size) {
+        uint64_t timeout_tsc = time_us_to_tsc(g_timeouts_heap[0]->timeout_absolute_us);
+        deadline_tsc = MIN(deadline_tsc, timeout_tsc);
+    }
+    timer_arm(cpu_id, deadline_tsc);
+}
+
+static int register_timeout_common(uint64_t timeout_absolute_us, int* futex, bool set_futex,
+                                   void** timeout_out) {
     if (!timeout_out)
         return -PAL_ERROR_INVAL;
 
-    struct pending_timeout* timeout = malloc(sizeof(*timeout));
-    if (!timeout)
-        return -PAL_ERROR_NOMEM;
-
     assert(futex);
+
+    struct pending_timeout* allocated_timeout = NULL;
+    struct pending_timeout** allocated_heap = NULL;
+    uint32_t allocated_heap_capacity = 0;
+
+    spinlock_lock_disable_irq(&g_timeouts_lock);
+
+    /* slow path: the pool or the heap array is exhausted; allocate outside of the timeouts lock (as
+     * malloc may take other locks) and re-check, as other CPUs may have changed things meanwhile */
+    while (true) {
+        bool need_timeout = !g_timeouts_free_list && !allocated_timeout;
+        bool need_heap = g_timeouts_heap_size == g_timeouts_heap_capacity
+                         && allocated_heap_capacity <= g_timeouts_heap_capacity;
+        if (!need_timeout && !need_heap)
+            break;
+
+        uint32_t heap_capacity = g_timeouts_heap_capacity;
+        spinlock_unlock_enable_irq(&g_timeouts_lock);
+
+        if (need_timeout) {
+            allocated_timeout = malloc(sizeof(*allocated_timeout));
+            if (!allocated_timeout)
+                goto out_nomem;
+        }
+        if (need_heap) {
+            free(allocated_heap);
+            allocated_heap_capacity = 0;
+            if (heap_capacity > UINT32_MAX / 2)
+                goto out_nomem;
+            allocated_heap = malloc(heap_capacity * 2 * sizeof(*allocated_heap));
+            if (!allocated_heap)
+                goto out_nomem;
+            allocated_heap_capacity = heap_capacity * 2;
+        }
+
+        spinlock_lock_disable_irq(&g_timeouts_lock);
+    }
+
+    struct pending_timeout** old_heap = NULL;
+    if (g_timeouts_heap_size == g_timeouts_heap_capacity) {
+        memcpy(allocated_heap, g_timeouts_heap, g_timeouts_heap_size * sizeof(*g_timeouts_heap));
+        if (g_timeouts_heap != g_timeouts_heap_initial)
+            old_heap = g_timeouts_heap;
+        g_timeouts_heap = allocated_heap;
+        g_timeouts_heap_capacity = allocated_heap_capacity;
+        allocated_heap = NULL;
+    }
+
+    struct pending_timeout* timeout = g_timeouts_free_list;
+    if (timeout) {
+        g_timeouts_free_list = timeout->next_free;
+    } else {
+        timeout = allocated_timeout;
+        timeout->from_pool = false;
+        allocated_timeout = NULL;
+    }
+
     timeout->timeout_absolute_us = timeout_absolute_us;
     timeout->futex = futex;
+    timeout->set_futex = set_futex;
+    timeout->next_free = NULL;
 
-    /* g_pending_timeouts_list is used by interrupt-handler's
-     * notify_about_timeouts_uninterruptable(); temporarily disable interrupts to avoid deadlock */
-    spinlock_lock_disable_irq(&g_pending_timeouts_list_lock);
-    LISTP_ADD(timeout, &g_pending_timeouts_list, list);
-    spinlock_unlock_enable_irq(&g_pending_timeouts_list_lock);
+    heap_set(g_timeouts_heap_size, timeout);
+    g_timeouts_heap_size++;
+    heap_sift_up(timeout->heap_idx);
+
+    if (timeout->heap_idx == 0) {
+        /* new earliest timeout; if the current owner's timer fires too late, take over ownership
+         * and arm the timer of this CPU (recall that we can only program the LAPIC of this CPU) */
+        uint64_t timeout_tsc = time_us_to_tsc(timeout_absolute_us);
+        if (timeout_tsc < g_armed_deadline_tsc[g_timeouts_owner_cpu]) {
+            uint32_t cpu_id = get_per_cpu_data()->cpu_id;
+            g_timeouts_owner_cpu = cpu_id;
+            if (timeout_tsc < g_armed_deadline_tsc[cpu_id])
+                timer_arm(cpu_id, timeout_tsc);
+        }
+    }
+
+    spinlock_unlock_enable_irq(&g_timeouts_lock);
+
+    /* allocations not needed anymore (e.g. another CPU returned a timeout to the pool meanwhile) */
+    free(allocated_timeout);
+    free(allocated_heap);
+    free(old_heap);
 
     *timeout_out = (void*)timeout;
     return 0;
+
+out_nomem:
+    free(allocated_timeout);
+    free(allocated_heap);
+    return -PAL_ERROR_NOMEM;
+}
+
+int register_timeout(uint64_t timeout_absolute_us, int* futex, void** timeout_out) {
+    return register_timeout_common(timeout_absolute_us, futex, /*set_futex=*/false, timeout_out);
+}
+
+int register_timeout_set_futex(uint64_t timeout_absolute_us, int* futex, void** timeout_out) {
+    return register_timeout_common(timeout_absolute_us, futex, /*set_futex=*/true, timeout_out);
 }
 
 void deregister_timeout(void* _timeout) {
     struct pending_timeout* timeout = (struct pending_timeout*)_timeout;
 
-    /* g_pending_timeouts_list is used by interrupt-handler's
-     * notify_about_timeouts_uninterruptable(); temporarily disable interrupts to avoid deadlock */
-    spinlock_lock_disable_irq(&g_pending_timeouts_list_lock);
-    struct pending_timeout* list_timeout;
-    struct pending_timeout* tmp;
-    LISTP_FOR_EACH_ENTRY_SAFE(list_timeout, tmp, &g_pending_timeouts_list, list) {
-        if (list_timeout == timeout) {
-            LISTP_DEL(timeout, &g_pending_timeouts_list, list);
-        }
+    /* if this was the earliest timeout, the armed timer interrupt will find nothing to do and will
+     * re-arm the timer for the next timeout, so no need to re-program the timer here */
+    spinlock_lock_disable_irq(&g_timeouts_lock);
+    if (timeout->heap_idx != TIMEOUT_NOT_PENDING)
+        heap_remove(timeout);
+    bool from_pool = timeout->from_pool;
+    if (from_pool) {
+        timeout->next_free = g_timeouts_free_list;
+        g_timeouts_free_list = timeout;
     }
-    spinlock_unlock_enable_irq(&g_pending_timeouts_list_lock);
+    spinlock_unlock_enable_irq(&g_timeouts_lock);
 
-    free(timeout);
+    if (!from_pool)
+        free(timeout);
 }
 
-int notify_about_timeouts_uninterruptable(void) {
-    int ret;
+bool timer_interrupt_uninterruptable(void) {
+    uint64_t curr_tsc = get_tsc();
+    uint32_t cpu_id = get_per_cpu_data()->cpu_id;
+    size_t triggered_cnt = 0;
+
     uint64_t curr_time_us;
+    int ret = get_time_in_us(&curr_time_us);
+
+    /* even though we are in non-interruptable ISR context, still need to grab the timeouts lock
+     * because normal-context threads on other CPUs may call register/deregister_timeout() */
+    spinlock_lock(&g_timeouts_lock);
+    while (ret == 0 && g_timeouts_heap_size
+            && g_timeouts_heap[0]->timeout_absolute_us <= curr_time_us) {
+        struct pending_timeout* timeout = g_timeouts_heap[0];
+        if (timeout->set_futex)
+            __atomic_store_n(timeout->futex, 1, __ATOMIC_RELEASE);
+        sched_thread_wakeup_uninterruptable(timeout->futex);
+        heap_remove(timeout);
+        triggered_cnt++;
+    }
+
+    bool tick = curr_tsc >= g_next_tick_tsc[cpu_id];
+    if (tick)
+        g_next_tick_tsc[cpu_id] = curr_tsc + LAPIC_TIMER_PERIOD_US * g_tsc_mhz;
+    timer_rearm(cpu_id);
+    spinlock_unlock(&g_timeouts_lock);
 
-    ret = get_time_in_us(&curr_time_us);
-    if (ret < 0)
-        return ret;
-
-    /* even though we are in non-interruptable ISR context on CPU0, still need to grab
-     * g_pending_timeouts_list_lock because normal-context threads on other CPUs may call
-     * register_timeout() and deregister_timeout() */
-    spinlock_lock(&g_pending_timeouts_list_lock);
-    struct pending_timeout* timeout;
-    struct pending_timeout* tmp;
-    LISTP_FOR_EACH_ENTRY_SAFE(timeout, tmp, &g_pending_timeouts_list, list) {
-        if (timeout->timeout_absolute_us <= curr_time_us) {
-            sched_thread_wakeup_uninterruptable(timeout->futex);
-            LISTP_DEL(timeout, &g_pending_timeouts_list, list);
+    /* reschedule on each tick, and also when some thread was woken up by a timeout (so that it
+     * does not wait for the next tick in case this CPU runs a busy thread) */
+    return tick || triggered_cnt;
+}
+
+void timer_start(uint32_t cpu_id) {
+    spinlock_lock_disable_irq(&g_timeouts_lock);
+    if (!g_timeouts_pool_initialized) {
+        for (size_t i = 0; i < TIMEOUTS_POOL_SIZE; i++) {
+            g_timeouts_pool[i].heap_idx  = TIMEOUT_NOT_PENDING;
+            g_timeouts_pool[i].from_pool = true;
+            g_timeouts_pool[i].next_free = g_timeouts_free_list;
+            g_timeouts_free_list = &g_timeouts_pool[i];
         }
+        g_timeouts_pool_initialized = true;
     }
-    /* to prevent lost wakeups on generic g_streams_waiting_events_futex (e.g., when a thread was
-     * already running when the wakeup on this futex triggered), need to periodically kick it */
-    sched_thread_wakeup_uninterruptable(&g_streams_waiting_events_futex);
-    spinlock_unlock(&g_pending_timeouts_list_lock);
-    return 0;
+    g_next_tick_tsc[cpu_id] = get_tsc() + LAPIC_TIMER_PERIOD_US * g_tsc_mhz;
+    timer_rearm(cpu_id);
+    spinlock_unlock_enable_irq(&g_timeouts_lock);
+}
+
+void get_tsc_time_info(struct pal_tsc_time_info* out_info) {
+    out_info->start_tsc = g_start_tsc;
+    out_info->start_us  = g_start_us;
+    out_info->mult      = g_tsc_to_us_mult;
+    out_info->shift     = TSC_TO_US_SHIFT;
 }
 
 int time_init(void) {
     assert(g_tsc_mhz);
     char unixtime_s[TIME_S_STR_MAX];
 
+    /* floor((2^64 - 1) / mhz) instead of 2^64 / mhz, to avoid a 128-bit division */
+    g_tsc_to_us_mult = UINT64_MAX / g_tsc_mhz;
     g_start_tsc = get_tsc();
 
     /* Get the UNIX time value on startup from the VMM using "FW CFG" feature of QEMU. Note that
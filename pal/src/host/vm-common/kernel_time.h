@@ -5,8 +5,10 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+/* scheduling tick; timeouts don't depend on it, as the LAPIC timer is also armed for them */
 #define LAPIC_TIMER_PERIOD_US (100 * 1000) /* 100 ms, same as default SCHED_RR interval in Linux */
 #define IDLE_THREAD_PERIOD_US (10 * 1000)  /* 10 ms, chosen experimentally */
 
@@ -18,11 +20,29 @@ int delay(uint64_t delay_us, bool* continue_gate);
 
 /* `timeout_out` is an opaque object to be used in `deregister_timeout()`. It is the responsibility
  * of the caller to remove the timeout (even if the timeout was already triggered by
- * `notify_about_timeouts_uninterruptable`). */
+ * `timer_interrupt_uninterruptable`). */
 int register_timeout(uint64_t timeout_absolute_us, int* futex, void** timeout_out);
+/* same as above, but the triggered timeout also stores 1 into `*futex` before the wakeup, so that it
+ * is not lost if the waiter did not block yet (for use with sched_thread_futex_wait(futex, 0)) */
+int register_timeout_set_futex(uint64_t timeout_absolute_us, int* futex, void** timeout_out);
 void deregister_timeout(void* timeout);
 
 int remove_timeouts_on_futex(int* futex);
-int notify_about_timeouts_uninterruptable(void);
+
+/* called on LAPIC timer interrupt: triggers expired timeouts and re-arms the timer of this CPU;
+ * returns true if the current thread should be preempted */
+bool timer_interrupt_uninterruptable(void);
+/* arms the first timer interrupt of this CPU, must be called on each CPU after LAPIC timer init;
+ * `cpu_id` is passed explicitly as per-CPU data may be not yet set up on the BSP */
+void timer_start(uint32_t cpu_id);
+
+struct pal_tsc_time_info;
 
 int time_init(void);
+/* exports TSC-to-time conversion parameters, must be called after time_init() */
+void get_tsc_time_info(struct pal_tsc_time_info* out_info);
+
+/* boot phases are recorded on the BSP during boot and printed once logging is configured */
+void boot_phases_start(uint64_t start_tsc);
+void boot_phase_done(const char* name);
+void boot_phases_print(void);
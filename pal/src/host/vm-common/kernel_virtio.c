@@ -9,7 +9,7 @@
  *   - virtq_alloc_desc(), virtq_is_desc_free(), virtq_free_desc() on a particular queue must be
  *     protected by a corresponding lock:
  *      - for g_console->tq, it is g_console_transmit_lock
- *      - for g_fs->requests, it is g_fs_lock
+ *      - for g_fs->request_queues[i].vq, it is the lock of this request queue
  *      - for g_vsock->tq, it is g_vsock_transmit_lock
  *
  * Reference: https://docs.oasis-open.org/virtio/virtio/v1.1/csprd01/virtio-v1.1-csprd01.pdf
@@ -31,27 +31,23 @@ int virtq_create(uint16_t queue_size, struct virtqueue** out_virtq) {
         return -PAL_ERROR_NOMEM;
     memset(virtq, 0, sizeof(*virtq));
 
-    void* events = memory_get_shared_region(sizeof(uint16_t) + sizeof(uint16_t));
-    if (!events) {
-        free(virtq);
-        return -PAL_ERROR_NOMEM;
-    }
-
     virtq->next_free_desc = malloc(queue_size * sizeof(uint16_t));
     if (!virtq->next_free_desc)
         goto fail;
 
-    virtq->used_event  = (uint16_t*)events;
-    virtq->avail_event = (uint16_t*)((char*)events + sizeof(uint16_t));
-
+    /* avail and used rings are followed by used_event and avail_event fields respectively */
     virtq->desc  = memory_get_shared_region(queue_size * sizeof(struct virtq_desc));
     virtq->avail = memory_get_shared_region(sizeof(struct virtq_avail) +
-                                                queue_size * sizeof(uint16_t));
+                                                (queue_size + 1) * sizeof(uint16_t));
     virtq->used  = memory_get_shared_region(sizeof(struct virtq_used) +
-                                                queue_size * sizeof(struct virtq_used_elem));
+                                                queue_size * sizeof(struct virtq_used_elem) +
+                                                sizeof(uint16_t));
     if (!virtq->desc || !virtq->avail || !virtq->used)
         goto fail;
 
+    virtq->used_event  = &virtq->avail->ring[queue_size];
+    virtq->avail_event = (uint16_t*)&virtq->used->ring[queue_size];
+
     virtq->queue_size = queue_size;
     virtq->seen_used  = 0;
     virtq->free_desc  = 0;
@@ -88,12 +84,11 @@ int virtq_free(struct virtqueue* virtq, uint16_t queue_size) {
     if (!virtq)
         return 0;
 
-    memory_free_shared_region(virtq->used_event, sizeof(uint16_t) + sizeof(uint16_t));
     memory_free_shared_region(virtq->desc, queue_size * sizeof(struct virtq_desc));
     memory_free_shared_region(virtq->avail, sizeof(struct virtq_avail) +
-                                  queue_size * sizeof(uint16_t));
+                                  (queue_size + 1) * sizeof(uint16_t));
     memory_free_shared_region(virtq->used, sizeof(struct virtq_used) +
-                                  queue_size * sizeof(struct virtq_used_elem));
+                                  queue_size * sizeof(struct virtq_used_elem) + sizeof(uint16_t));
     free(virtq->next_free_desc);
     free(virtq);
     return 0;
@@ -138,7 +133,11 @@ void virtq_free_desc(struct virtqueue* virtq, uint16_t desc_idx) {
     virtq->next_free_desc[desc_idx] = old_free_desc_head;
 }
 
-int virtq_add_to_device(struct virtio_pci_regs* regs, struct virtqueue* virtq, uint16_t queue_sel) {
+/* `msix_entry` is the MSI-X table entry (already programmed via pci_msix_set_vector()) that raises
+ * interrupts of this queue, or VIRTIO_MSI_NO_VECTOR; it is assigned before the queue is enabled, as
+ * required by Section 4.1.5.1.3 of VIRTIO 1.1 Spec */
+int virtq_add_to_device(struct virtio_pci_regs* regs, struct virtqueue* virtq, uint16_t queue_sel,
+                        uint16_t msix_entry) {
     vm_mmio_writew(&regs->queue_select, queue_sel);
 
     uint16_t queue_available_hint = vm_mmio_readw(&regs->queue_size);
@@ -158,6 +157,60 @@ int virtq_add_to_device(struct virtio_pci_regs* regs, struct virtqueue* virtq, u
     vm_mmio_writel(&regs->queue_device_low,  (uint32_t)((uintptr_t)virtq->used));
     vm_mmio_writel(&regs->queue_device_high, (uint32_t)((uintptr_t)virtq->used >> 32));
 
+    vm_mmio_writew(&regs->queue_msix_vector, msix_entry);
+    if (msix_entry != VIRTIO_MSI_NO_VECTOR
+            && vm_mmio_readw(&regs->queue_msix_vector) == VIRTIO_MSI_NO_VECTOR) {
+        /* device failed to map the queue to this MSI-X entry */
+        return -PAL_ERROR_DENIED;
+    }
+
     vm_mmio_writew(&regs->queue_enable, 1);
     return 0;
 }
+
+/* Must be called after the driver published new available entries (updated `avail->idx`), with
+ * `old_avail_idx` being the value of `avail->idx` before the batch was added. Returns true if the
+ * device asked to be notified about this batch (see Section 2.6.7.2 of VIRTIO 1.1 Spec). */
+bool virtq_need_notify(struct virtqueue* virtq, uint16_t old_avail_idx) {
+    /* new avail idx must be visible to the device before we read its notification hints */
+    MB();
+
+    if (!virtq->event_idx) {
+        uint16_t host_device_used_flags = vm_shared_readw(&virtq->used->flags);
+        return !(host_device_used_flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    /* same as vring_need_event() in Linux: notify iff `avail_event` lies in the newly added range
+     * [old_avail_idx, new_avail_idx); works also in cases of int wrap */
+    uint16_t new_avail_idx = virtq->cached_avail_idx;
+    uint16_t avail_event = vm_shared_readw(virtq->avail_event);
+    return (uint16_t)(new_avail_idx - avail_event - 1) < (uint16_t)(new_avail_idx - old_avail_idx);
+}
+
+/* Asks the device to not interrupt the driver upon consuming buffers. This is only a hint, the
+ * device may still send interrupts. */
+void virtq_disable_interrupts(struct virtqueue* virtq) {
+    if (!virtq->event_idx) {
+        vm_shared_writew(&virtq->avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT);
+        return;
+    }
+
+    /* the device interrupts only when its used idx passes `used_event`; the device can never get
+     * more than queue_size entries ahead of `seen_used`, so the half-way point of the 16-bit index
+     * space is never reached (the caller must re-disable after consuming used entries) */
+    vm_shared_writew(virtq->used_event, (uint16_t)(virtq->seen_used + 0x8000));
+}
+
+/* Asks the device to interrupt the driver after it has consumed `delay + 1` more buffers (counting
+ * from `seen_used`); without VIRTIO_F_EVENT_IDX, the device interrupts on every consumed buffer.
+ * The caller must re-check the used ring after this call, to not miss buffers that were consumed
+ * while interrupts were disabled. */
+void virtq_enable_interrupts(struct virtqueue* virtq, uint16_t delay) {
+    if (!virtq->event_idx) {
+        vm_shared_writew(&virtq->avail->flags, 0);
+    } else {
+        vm_shared_writew(virtq->used_event, (uint16_t)(virtq->seen_used + delay));
+    }
+    /* new used_event/flags must be visible to the device before the caller re-reads used idx */
+    MB();
+}
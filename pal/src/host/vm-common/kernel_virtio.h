@@ -18,6 +18,9 @@
 
 /* --------------------------------------- Common ---------------------------------------------- */
 
+/* possible virtio_pci_regs::driver_feature flags, for driver_feature_select=0 */
+#define VIRTIO_F_EVENT_IDX 29 /* feature bit 29, used_event/avail_event notification suppression */
+
 /* possible virtio_pci_regs::driver_feature flags, for driver_feature_select=1 */
 #define VIRTIO_F_VERSION_1 0 /* feature bit 32, required by QEMU, see the link below: */
                              /* www.mail-archive.com/osv-dev@googlegroups.com/msg06088.html */
@@ -36,6 +39,11 @@
 #define VIRTIO_INTERRUPT_STATUS_CONFIG   2   /* configuration of device changed */
 #define VIRTIO_INTERRUPT_STATUS_MASK (VIRTIO_INTERRUPT_STATUS_USED | VIRTIO_INTERRUPT_STATUS_CONFIG)
 
+/* value of virtio_pci_regs::config_msix_vector/queue_msix_vector for "no MSI-X interrupts" */
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+struct pci_msix; /* see kernel_pci.h */
+
 /* See Section 4.1.4.3 of VIRTIO 1.1 Spec */
 struct virtio_pci_regs {
     /* About the whole device. */
@@ -111,7 +119,11 @@ struct virtqueue {
     uint16_t cached_avail_idx;
     uint16_t* next_free_desc;
 
-    /* statically allocated in shared memory, accesses via vm_shared_writex() */
+    bool event_idx; /* VIRTIO_F_EVENT_IDX was negotiated for the device of this queue */
+
+    /* statically allocated in shared memory, accesses via vm_shared_writex(); `used_event` is the
+     * trailing element of the available ring and `avail_event` of the used ring, as the spec
+     * requires */
     struct virtq_desc* desc;
     struct virtq_avail* avail;
     struct virtq_used* used;
@@ -125,7 +137,11 @@ int virtq_alloc_desc(struct virtqueue* virtq, void* addr, uint32_t len, uint16_t
                      uint16_t* out_desc_idx);
 bool virtq_is_desc_free(struct virtqueue* virtq, uint16_t desc_idx);
 void virtq_free_desc(struct virtqueue* virtq, uint16_t desc_idx);
-int virtq_add_to_device(struct virtio_pci_regs* regs, struct virtqueue* virtq, uint16_t queue_sel);
+int virtq_add_to_device(struct virtio_pci_regs* regs, struct virtqueue* virtq, uint16_t queue_sel,
+                        uint16_t msix_entry);
+bool virtq_need_notify(struct virtqueue* virtq, uint16_t old_avail_idx);
+void virtq_disable_interrupts(struct virtqueue* virtq);
+void virtq_enable_interrupts(struct virtqueue* virtq, uint16_t delay);
 
 /* ----------------------------------- virtio-console ------------------------------------------ */
 /* See Section 5.3 of VIRTIO 1.1 Spec */
@@ -144,17 +160,19 @@ struct virtio_console_config {
  * Notes on multi-core synchronization:
  *   - rq_buf_pos used in RX handling and virtio_console_read(), sync via receive-side lock
  *   - rq_buf is set at init, no sync required
- *   - rq_notify_addr is set at init and used by CPU0-tied bottomhalves thread, no sync required
+ *   - rq_notify_addr is set at init and used during RX, sync via receive-side lock
  *   - shared_tq_buf_pos used in virtio_console_nprint(), sync via transmit-side lock
  *   - tq_notify_addr is set at init, used in virtio_console_nprint(), sync via transmit-side lock
  *   - shared_rq_buf is set at init, no sync required
  *   - shared_tq_buf is set at init, no sync required
- *   - rq is used by CPU0 interrupt handler and CPU0-tied bottomhalves thread, no sync required
+ *   - rq is used during RX, sync via receive-side lock; the interrupt handler (on the CPU the RX
+ *     vector is steered to) only peeks at the used index, a stale value is benign
  *   - tq is used in virtio_console_nprint(), sync via transmit-side lock
  *   - control_rq and control_tq are unused
  *   - pci_regs is used only at init, no sync required
  *   - pci_config is unused
  *   - interrupt_status_reg is used by CPU0 interrupt handler, no sync required
+ *   - msix is set at init, no sync required
  */
 struct virtio_console {
     /* in private memory */
@@ -177,9 +195,12 @@ struct virtio_console {
     struct virtio_pci_regs* pci_regs;         /* PCI BAR device control regs */
     struct virtio_console_config* pci_config; /* PCI BAR config space */
     uint32_t* interrupt_status_reg;           /* PCI BAR interrupt: used buffer/conf change */
+
+    bool msix; /* RX interrupts arrive via MSI-X vector MSIX_VECTOR_CONSOLE_RQ, not via INTx */
 };
 
 int virtio_console_isr(void);
+void virtio_console_rq_isr(void);
 int virtio_console_bottomhalf(void);
 int64_t virtio_console_read(char* buffer, size_t size);
 int virtio_console_nprint(const char* s, size_t size);
@@ -187,7 +208,7 @@ int virtio_console_print(const char* s);
 int virtio_console_printf(const char* fmt, ...);
 int virtio_console_init(struct virtio_pci_regs* pci_regs, struct virtio_console_config* pci_config,
                         uint64_t notify_off_addr, uint32_t notify_off_multiplier,
-                        uint32_t* interrupt_status_reg);
+                        uint32_t* interrupt_status_reg, struct pci_msix* msix);
 
 extern struct virtio_console* g_console;
 extern bool g_console_trigger_bottomhalf;
@@ -200,7 +221,7 @@ void thread_wakeup_console(void);
 
 struct virtio_fs_config {
     uint8_t  tag[36];            /* name associated with FS in UTF-8 (padded with NUL bytes) */
-    uint32_t num_request_queues; /* number of request virtqueues, currently 1 (more helps perf) */
+    uint32_t num_request_queues; /* number of request virtqueues (more helps perf) */
     uint32_t notify_buf_size;    /* currently no FUSE notify msgs support, this field is unused */
 };
 
@@ -232,28 +253,60 @@ struct virtio_fs_config {
  * See examples in kernel_virtio_fs.c.
  */
 
+/* Number of request virtqueues is chosen as min(this value, what the device advertises) */
+#define VIRTIO_FS_MAX_REQUEST_QUEUES 8U
+
+/*
+ * Notes on multi-core synchronization:
+ *   - queue_sel and notify_addr are set at init, no sync required
+ *   - free_slots, num_slot_waiters and free_slots_futex are used when submitting and completing
+ *     requests, sync via queue lock
+ *   - req_states: an entry is set to "in flight" in submit_request() under queue lock and
+ *     transitions to "done" in the CPU0 interrupt handler, sync via atomics
+ *   - req_written_sizes: an entry is written by the CPU0 interrupt handler before the corresponding
+ *     request transitions to "done", sync via atomics on req_states
+ *   - shared_buf is set at init, each slot is owned by the request that reserved it
+ *   - vq descriptors and avail ring are used when submitting and completing requests, sync via
+ *     queue lock
+ *   - vq used ring (and seen_used) is used only by CPU0 interrupt handler (or by the single boot
+ *     thread before interrupts are enabled), no sync required
+ */
+struct virtio_fs_request_queue {
+    /* in private memory */
+    spinlock_t lock;
+    uint16_t queue_sel;          /* virtqueue index on the device (hiprio queue is 0) */
+    uint16_t* notify_addr;       /* calculated MMIO notify addr for this queue */
+    uint32_t free_slots;         /* bitmap of free request slots in shared_buf */
+    uint32_t num_slot_waiters;
+    int free_slots_futex;        /* threads sleep on this when all slots are busy */
+    int* req_states;             /* head desc idx -> state of request (futex word for its waiter) */
+    uint32_t* req_written_sizes; /* head desc idx -> bytes written by device (untrusted) */
+
+    /* statically allocated in shared memory, accesses via vm_shared_writex() */
+    char* shared_buf;            /* split into slots where FUSE requests/responses are copied to */
+    struct virtqueue* vq;
+};
+
 /*
  * Notes on multi-core synchronization:
- *   - requests_notify_addr is set at init and used in virtio_fs_exec_request(), sync via lock
- *   - initialized is set at init, no sync required
- *   - shared_buf is set at init, no sync required
+ *   - initialized and max_write are set at init, no sync required
+ *   - num_request_queues and request_queues are set at init, each queue has its own lock (see
+ *     above)
  *   - hiprio and notify are unused
- *   - requests is used by CPU0 interrupt handler and in virtio_fs_exec_request(), sync via lock
  *   - pci_regs is used only at init, no sync required
- *   - pci_config is unused
+ *   - pci_config is used only at init, no sync required
  *   - interrupt_status_reg is used by CPU0 interrupt handler, no sync required
  */
 struct virtio_fs {
     /* in private memory */
-    uint16_t* requests_notify_addr; /* calculated MMIO notify addr for requests queue */
-
     bool initialized;
+    uint32_t max_write;         /* max size of data in one FUSE_WRITE, as negotiated in FUSE_INIT */
+    uint32_t num_request_queues;
+    struct virtio_fs_request_queue* request_queues; /* for normal FUSE requests/responses */
 
     /* statically allocated in shared memory, accesses via vm_shared_writex() */
-    char* shared_buf;           /* internal buf where FUSE requests/responses are copied to */
     struct virtqueue* hiprio;   /* only FUSE_{INTERRUPT,FORGET,BATCH_FORGET} go here */
     struct virtqueue* notify;   /* for incoming notifications, currently not used */
-    struct virtqueue* requests; /* single queue for normal FUSE requests/responses */
 
     /* VMM-allocated in MMIO memory, accesses via vm_mmio_writex() */
     struct virtio_pci_regs* pci_regs;    /* PCI BAR device control regs */
@@ -276,6 +329,12 @@ int virtio_fs_fuse_rename(uint64_t old_dir_nodeid, const char* old_filename,
 
 int virtio_fs_fuse_read(uint64_t nodeid, uint64_t fh, uint64_t size, uint64_t offset,
                         char* out_buf, uint64_t* out_size);
+/* same as virtio_fs_fuse_read(), but calls `progress` each time the first `done_size` bytes of
+ * `out_buf` are filled, while the rest of the read is still in flight */
+typedef void (*virtio_fs_progress_cb_t)(void* arg, uint64_t done_size);
+int virtio_fs_fuse_read_progress(uint64_t nodeid, uint64_t fh, uint64_t size, uint64_t offset,
+                                 char* out_buf, virtio_fs_progress_cb_t progress,
+                                 void* progress_arg, uint64_t* out_size);
 int virtio_fs_fuse_write(uint64_t nodeid, uint64_t fh, const char* buf, uint64_t size,
                          uint64_t offset, uint64_t* out_size);
 int virtio_fs_fuse_flush(uint64_t nodeid, uint64_t fh);
@@ -309,20 +368,22 @@ struct virtio_vsock_config {
 
 /*
  * Notes on multi-core synchronization:
- *   - rq_notify_addr is set at init and used by CPU0-tied bottomhalves thread, no sync required
+ *   - rq_notify_addr is set at init and used during RX, sync via receive-side lock
  *   - tq_notify_addr is set at init and used in copy_into_tq(), sync via transmit-side lock
  *   - host_cid is set at init, no sync required
  *   - guest_cid is set at init, no sync required
- *   - conns_size, conns, conns_by_host_port used in many places, sync via connections lock
+ *   - conns_size, conns, conns_free_hint, conns_by_ports, max_port used in many places, sync via
+ *     connections lock (held only for short table operations; each connection has its own lock)
  *   - pending_tq_control_packets and co. used during TX, sync via transmit-side lock
  *   - shared_rq_buf is set at init and used during RX, sync via receive-side lock
- *   - shared_tq_buf is set at init and used in copy_into_tq(), sync via transmit-side lock
+ *   - shared_tq_buf is set at init and used in tq_add_packet(), sync via transmit-side lock
  *   - rq is used during RX, sync via receive-side lock
- *   - tq is used in copy_into_tq() and cleanup_tq(), sync via transmit-side lock
+ *   - tq is used in tq_add_packet(), tq_publish() and cleanup_tq(), sync via transmit-side lock
  *   - eq is unused
  *   - pci_regs is used only at init, no sync required
  *   - pci_config is used only at init, no sync required
  *   - interrupt_status_reg is used by CPU0 interrupt handler, no sync required
+ *   - msix is set at init, no sync required
  */
 struct virtio_vsock {
     /* in private memory */
@@ -334,7 +395,14 @@ struct virtio_vsock {
 
     uint32_t conns_size;                    /* size of dynamic array */
     struct virtio_vsock_connection** conns; /* dynamic array: fd -> connection */
-    struct virtio_vsock_connection* conns_by_host_port; /* hash table: host port -> connection */
+    uint32_t conns_free_hint;               /* no free slots in conns below this index */
+    struct virtio_vsock_connection* conns_by_ports; /* hash table: (host, guest port) -> conn */
+    uint64_t max_port;                      /* largest guest port in use, see pick_new_port() */
+
+    /* per TX descriptor: connection that sent the RW packet in it (NULL for control packets), and
+     * connections whose send buffers were drained and must be notified; under "transmit" lock */
+    struct virtio_vsock_tq_owner* tq_owners;
+    LISTP_TYPE(virtio_vsock_connection) tq_wakeup_conns;
 
     struct virtio_vsock_packet** pending_tq_control_packets;
     uint32_t pending_tq_control_packets_cnt;
@@ -351,6 +419,8 @@ struct virtio_vsock {
     struct virtio_pci_regs* pci_regs;       /* PCI BAR device control regs */
     struct virtio_vsock_config* pci_config; /* PCI BAR config space */
     uint32_t* interrupt_status_reg;         /* PCI BAR interrupt: used buffer/conf change */
+
+    bool msix; /* RX/TX interrupts arrive via separate MSI-X vectors, not via INTx */
 };
 
 int virtio_vsock_socket(int domain, int type, int protocol);
@@ -362,17 +432,27 @@ int virtio_vsock_connect(int sockfd, const void* addr, size_t addrlen, uint64_t
 int virtio_vsock_shutdown(int sockfd, enum virtio_vsock_shutdown shutdown);
 int virtio_vsock_close(int sockfd, uint64_t timeout_us);
 long virtio_vsock_peek(int sockfd);
-long virtio_vsock_read(int sockfd, void* buf, size_t count);
+long virtio_vsock_readv(int sockfd, struct iovec* iov, size_t iov_len);
 long virtio_vsock_write(int sockfd, const void* buf, size_t count);
 int virtio_vsock_getsockname(int sockfd, const void* addr, size_t* addrlen);
 int virtio_vsock_set_socket_options(int sockfd, bool ipv6_v6only, bool reuseport);
+int virtio_vsock_set_notify(int sockfd, void (*notify)(void* arg), void* arg);
+int virtio_vsock_set_send_buf_size(int sockfd, size_t size);
+/* returns the ready events of the connection among `events` (PAL_WAIT_ERROR is always reported);
+ * if none are ready and `entry` is not NULL, atomically enqueues it into the connection's wait
+ * queue, which must be paired with virtio_vsock_poll_dequeue() */
+int virtio_vsock_poll(int sockfd, uint32_t events, struct sched_poll_entry* entry,
+                      uint32_t* out_events);
+void virtio_vsock_poll_dequeue(struct sched_poll_entry* entry);
 
 int virtio_vsock_isr(void);
-int virtio_vsock_bottomhalf(void);
-bool virtio_vsock_can_write(void);
+void virtio_vsock_rq_isr(void);
+void virtio_vsock_tq_isr(void);
+int virtio_vsock_bottomhalf(bool rx, bool tx);
 int virtio_vsock_init(struct virtio_pci_regs* pci_regs, struct virtio_vsock_config* pci_config,
                       uint64_t notify_off_addr, uint32_t notify_off_multiplier,
-                      uint32_t* interrupt_status_reg);
+                      uint32_t* interrupt_status_reg, struct pci_msix* msix);
 
 extern struct virtio_vsock* g_vsock;
-extern bool g_vsock_trigger_bottomhalf;
+extern bool g_vsock_rx_trigger_bottomhalf;
+extern bool g_vsock_tx_trigger_bottomhalf;
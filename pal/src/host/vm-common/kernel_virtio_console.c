@@ -12,6 +12,7 @@
 
 #include "kernel_apic.h"
 #include "kernel_debug.h"
+#include "kernel_interrupts.h"
 #include "kernel_memory.h"
 #include "kernel_pci.h"
 #include "kernel_time.h"
@@ -35,7 +36,7 @@ static spinlock_t g_console_transmit_lock = INIT_SPINLOCK_UNLOCKED;
 
 /* interrupt handler (interrupt service routine), called by generic handler `isr_c()` */
 int virtio_console_isr(void) {
-    if (!g_console)
+    if (!g_console || g_console->msix)
         return 0;
 
     uint32_t interrupt_status = vm_mmio_readl(g_console->interrupt_status_reg);
@@ -45,12 +46,8 @@ int virtio_console_isr(void) {
     }
 
     if (interrupt_status & VIRTIO_INTERRUPT_STATUS_USED) {
-        /* real work is done in the bottomhalf called in normal context, see below */
-        uint16_t host_used_idx = vm_shared_readw(&g_console->rq->used->idx);
-        if (host_used_idx != g_console->rq->seen_used) {
-            /* we only care about the RX queue, so only kick bottomhalf when received input */
-            __atomic_store_n(&g_console_trigger_bottomhalf, true, __ATOMIC_RELEASE);
-        }
+        /* we only care about the RX queue, so only kick bottomhalf when received input */
+        virtio_console_rq_isr();
     }
 
     if (interrupt_status & VIRTIO_INTERRUPT_STATUS_CONFIG) {
@@ -60,6 +57,18 @@ int virtio_console_isr(void) {
     return 0;
 }
 
+/* RX part of the interrupt handler; called directly by `isr_c()` for the MSI-X vector of RX queue
+ * (on whatever CPU this vector is steered to) */
+void virtio_console_rq_isr(void) {
+    if (!g_console)
+        return;
+
+    /* real work is done in the bottomhalf called in normal context, see below */
+    uint16_t host_used_idx = vm_shared_readw(&g_console->rq->used->idx);
+    if (host_used_idx != g_console->rq->seen_used)
+        __atomic_store_n(&g_console_trigger_bottomhalf, true, __ATOMIC_RELEASE);
+}
+
 static int handle_rq(uint16_t host_used_idx, bool* out_received) {
     assert(spinlock_is_locked(&g_console_receive_lock));
 
@@ -490,7 +499,7 @@ static int virtio_console_free(struct virtio_console* console) {
 
 int virtio_console_init(struct virtio_pci_regs* pci_regs, struct virtio_console_config* pci_config,
                         uint64_t notify_off_addr, uint32_t notify_off_multiplier,
-                        uint32_t* interrupt_status_reg) {
+                        uint32_t* interrupt_status_reg, struct pci_msix* msix) {
     int ret;
     uint8_t status;
 
@@ -517,19 +526,30 @@ int virtio_console_init(struct virtio_pci_regs* pci_regs, struct virtio_console_
         goto fail;
     }
 
-    ret = virtq_add_to_device(pci_regs, console->rq, /*queue_sel=*/0);
+    if (msix) {
+        /* only the RX queue gets an MSI-X vector (TX is cleaned up on demand, config changes and
+         * control queues are not used), so that stdin processing can be steered to any vCPU */
+        vm_mmio_writew(&pci_regs->config_msix_vector, VIRTIO_MSI_NO_VECTOR);
+        ret = pci_msix_set_vector(msix, /*entry=*/0, MSIX_VECTOR_CONSOLE_RQ);
+        if (ret < 0)
+            goto fail;
+        console->msix = true;
+    }
+
+    ret = virtq_add_to_device(pci_regs, console->rq, /*queue_sel=*/0,
+                              console->msix ? 0 : VIRTIO_MSI_NO_VECTOR);
     if (ret < 0)
         goto fail;
 
-    ret = virtq_add_to_device(pci_regs, console->tq, /*queue_sel=*/1);
+    ret = virtq_add_to_device(pci_regs, console->tq, /*queue_sel=*/1, VIRTIO_MSI_NO_VECTOR);
     if (ret < 0)
         goto fail;
 
-    ret = virtq_add_to_device(pci_regs, console->control_rq, /*queue_sel=*/2);
+    ret = virtq_add_to_device(pci_regs, console->control_rq, /*queue_sel=*/2, VIRTIO_MSI_NO_VECTOR);
     if (ret < 0)
         goto fail;
 
-    ret = virtq_add_to_device(pci_regs, console->control_tq, /*queue_sel=*/3);
+    ret = virtq_add_to_device(pci_regs, console->control_tq, /*queue_sel=*/3, VIRTIO_MSI_NO_VECTOR);
     if (ret < 0)
         goto fail;
 
@@ -42,8 +42,11 @@
 #include "external/fuse_kernel.h"
 
 #include "kernel_apic.h"
+#include "kernel_interrupts.h"
 #include "kernel_memory.h"
+#include "kernel_multicore.h"
 #include "kernel_pci.h"
+#include "kernel_sched.h"
 #include "kernel_virtio.h"
 #include "kernel_vmm_inputs.h"
 #include "vm_callbacks.h"
@@ -51,26 +54,40 @@
 #define VIRTIO_FS_QUEUE_SIZE 128
 #define VIRTIO_FS_HIPRIO_QUEUE_SIZE 16
 
-#define VIRTIO_FS_SHARED_BUF_SIZE (1024 * 1024)
+/* each request queue has its own shared buffer, split into equally sized slots: the slots form a
+ * pool of reusable shared buffers, one slot holds all in/out buffers of one in-flight FUSE request;
+ * big reads and writes are split into several FUSE requests, each carrying at most
+ * VIRTIO_FS_IO_CHUNK_SIZE bytes of data, see virtio_fs_fuse_io() */
+#define VIRTIO_FS_SHARED_BUF_SIZE (2 * 1024 * 1024)
+#define VIRTIO_FS_SLOTS_PER_QUEUE 16
+#define VIRTIO_FS_SLOT_SIZE (VIRTIO_FS_SHARED_BUF_SIZE / VIRTIO_FS_SLOTS_PER_QUEUE)
+#define VIRTIO_FS_IO_CHUNK_SIZE (VIRTIO_FS_SLOT_SIZE - PAGE_SIZE) /* leave space for FUSE headers */
+
+/* max number of FUSE requests that a single big read/write keeps in flight */
+#define VIRTIO_FS_IO_MAX_INFLIGHT 8
+
+static_assert(VIRTIO_FS_SLOTS_PER_QUEUE <= BITS_IN_TYPE(uint32_t), "free_slots bitmap too small");
+/* no FUSE request has more than 5 descriptors, so in-flight requests never exhaust the queue */
+static_assert(VIRTIO_FS_SLOTS_PER_QUEUE * 5 <= VIRTIO_FS_QUEUE_SIZE, "request queue too small");
+
+/* states of a request, indexed by the head descriptor of the request's chain */
+#define VIRTIO_FS_REQ_IDLE     0
+#define VIRTIO_FS_REQ_INFLIGHT 1
+#define VIRTIO_FS_REQ_DONE     2
 
 struct virtio_fs* g_fs = NULL;
 
 /*
- * Coarse-grained lock to sync all FS operations on multi-core systems, see kernel_virtio.h.
- *
- * Multi-core support is unscalable: there is a single lock that effectively serializes all FS
- * operations. Moreover, once an FS operation is started, there will be no progress until it
- * finishes (i.e. until the device populates the responses). There are two scalability bottlenecks:
- *   - All threads that perform FS operations are serialized on a single lock.
- *   - Each thread spins on `requests->used->idx` until the device signals that it's done.
+ * Multi-core support: there are several request virtqueues, each protected by its own lock, and a
+ * thread submits its FS operation into the queue picked by its current CPU. Each queue can have up
+ * to VIRTIO_FS_SLOTS_PER_QUEUE requests in flight. The queue lock is held only to reserve a slot
+ * and descriptors and to publish the request; the request's state (indexed by the head descriptor
+ * of the chain) is then flipped to "done" by the CPU0 interrupt handler, which also wakes up the
+ * thread sleeping on this state word.
  *
- * To make the FS implementation scalable, we could (1) allocate as many request virtqueues as there
- * are CPUs, and (2) put threads to sleep instead of spinning on `requests->used->idx`.
- *
- * For now we assume that FS operations are sufficiently rare and typically single-threaded, so we
- * don't optimize for scalability.
+ * Before interrupts are enabled in the system (early boot, only one thread), the interrupt handler
+ * ignores request queues and the submitting thread polls the used ring itself.
  */
-static spinlock_t g_fs_lock = INIT_SPINLOCK_UNLOCKED;
 
 struct virtio_fs_desc {
     void*    addr;
@@ -80,43 +97,142 @@ struct virtio_fs_desc {
     uint16_t idx;       /* assigned desc index during allocation */
 };
 
+/* submitted (in-flight) request, see submit_request() and wait_request() */
+struct virtio_fs_request {
+    struct virtio_fs_request_queue* queue;
+    struct virtio_fs_desc* descs;
+    size_t count;
+    uint32_t slot;
+    uint16_t head_idx;
+};
+
+/* mark requests completed by the device as done; called by CPU0 interrupt handler (or by the single
+ * boot thread before interrupts are enabled, in which case there is nobody to wake up) */
+static int process_used(struct virtio_fs_request_queue* queue, bool wakeup) {
+    struct virtqueue* vq = queue->vq;
+    uint16_t host_used_idx = vm_shared_readw(&vq->used->idx);
+
+    if (host_used_idx - vq->seen_used > vq->queue_size) {
+        /* malicious (impossible) value reported by the host; note that this check works also in
+         * cases of int wrap */
+        return -PAL_ERROR_DENIED;
+    }
+
+    while (host_used_idx != vq->seen_used) {
+        uint16_t used_idx = vq->seen_used % vq->queue_size;
+        uint16_t desc_idx = (uint16_t)vm_shared_readl(&vq->used->ring[used_idx].id);
+
+        if (desc_idx >= vq->queue_size) {
+            /* malicious (out of bounds) descriptor index */
+            return -PAL_ERROR_DENIED;
+        }
+
+        /* must be stored before the state transitions to "done", see wait_request() */
+        queue->req_written_sizes[desc_idx] = vm_shared_readl(&vq->used->ring[used_idx].len);
+
+        int expected = VIRTIO_FS_REQ_INFLIGHT;
+        if (!__atomic_compare_exchange_n(&queue->req_states[desc_idx], &expected,
+                                         VIRTIO_FS_REQ_DONE, /*weak=*/false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            /* malicious descriptor index: not a head of an in-flight request */
+            return -PAL_ERROR_DENIED;
+        }
+
+        if (wakeup)
+            sched_thread_wakeup_uninterruptable(&queue->req_states[desc_idx]);
+
+        vq->seen_used++;
+    }
+
+    return 0;
+}
+
 /* interrupt handler (interrupt service routine), called by generic handler `isr_c()` */
 int virtio_fs_isr(void) {
     if (!g_fs)
         return 0;
 
-    /* this interrupt handler is dummy, because our FS implementation uses busy poll */
+    uint32_t interrupt_status = vm_mmio_readl(g_fs->interrupt_status_reg);
+    if (!WITHIN_MASK(interrupt_status, VIRTIO_INTERRUPT_STATUS_MASK)) {
+        log_error("Panic: ISR status register has reserved bits set (0x%x)", interrupt_status);
+        triple_fault();
+    }
+
+    if (!g_interrupts_enabled) {
+        /* early boot, requests are polled by the submitting thread, see virtio_fs_exec_request() */
+        return 0;
+    }
+
+    if (interrupt_status & VIRTIO_INTERRUPT_STATUS_USED) {
+        for (uint32_t i = 0; i < g_fs->num_request_queues; i++) {
+            int ret = process_used(&g_fs->request_queues[i], /*wakeup=*/true);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    if (interrupt_status & VIRTIO_INTERRUPT_STATUS_CONFIG) {
+        /* we don't currently care about changes in device config, so noop */
+    }
+
     return 0;
 }
 
-/* execute a single virtio-fs FUSE request to completion: copy relevant contents to shared memory,
- * submit `count` chained descriptors, kick the device, wait until the device processed the request
- * and then copy contents from device's shared memory to secure memory */
-static int virtio_fs_exec_request(size_t count, struct virtio_fs_desc* descs) {
+static struct virtio_fs_request_queue* pick_request_queue(void) {
+    /* the thread may migrate to another CPU later, it doesn't matter for correctness */
+    return &g_fs->request_queues[get_per_cpu_data()->cpu_id % g_fs->num_request_queues];
+}
+
+/* returns -PAL_ERROR_TRYAGAIN if all slots are busy and `may_block` is false; note that a thread
+ * must never block on a slot while holding other slots, otherwise threads may deadlock */
+static int reserve_slot(struct virtio_fs_request_queue* queue, bool may_block,
+                        uint32_t* out_slot) {
+    assert(spinlock_is_locked(&queue->lock));
+
+    while (!queue->free_slots) {
+        if (!may_block)
+            return -PAL_ERROR_TRYAGAIN;
+        /* only possible with many threads, i.e. when interrupts are already enabled */
+        assert(g_interrupts_enabled);
+        queue->num_slot_waiters++;
+        sched_thread_wait(&queue->free_slots_futex, &queue->lock);
+        queue->num_slot_waiters--;
+    }
+
+    uint32_t slot = __builtin_ctz(queue->free_slots);
+    queue->free_slots &= ~(1U << slot);
+    *out_slot = slot;
+    return 0;
+}
+
+static void release_slot(struct virtio_fs_request_queue* queue, uint32_t slot) {
+    assert(spinlock_is_locked(&queue->lock));
+
+    queue->free_slots |= 1U << slot;
+    if (queue->num_slot_waiters)
+        sched_thread_wakeup_n(&queue->free_slots_futex, /*max_threads=*/1);
+}
+
+/* check that the request is allowed and fits into one slot, and set the total size of "in" part */
+static int prepare_request(size_t count, struct virtio_fs_desc* descs) {
     /* no FUSE request has less that 3 descriptors (at least fuse_in, data_in, fuse_out) */
     assert(count >= 3);
 
-    int ret;
     struct fuse_in_header* hdr_in = descs[0].addr;
 
-    spinlock_lock(&g_fs_lock);
-
     for (size_t i = 0; i < count; i++) {
         /* reset for sanity */
         descs[i].allocated = false;
     }
 
-    /* sanity check: FS requests can be issued only after a (single) FUSE_INIT request */
+    /* sanity check: FS requests can be issued only after a (single) FUSE_INIT request; recall that
+     * FUSE_INIT is issued at boot, when there is only one thread */
     if (hdr_in->opcode == FUSE_INIT) {
-        if (g_fs->initialized) {
-            ret = -PAL_ERROR_DENIED;
-            goto out;
-        }
+        if (g_fs->initialized)
+            return -PAL_ERROR_DENIED;
     } else {
-        if (!g_fs->initialized) {
-            ret = -PAL_ERROR_DENIED;
-            goto out;
-        }
+        if (!g_fs->initialized)
+            return -PAL_ERROR_DENIED;
     }
 
     size_t total_in_size  = 0;
@@ -128,77 +244,163 @@ static int virtio_fs_exec_request(size_t count, struct virtio_fs_desc* descs) {
             total_out_size += descs[i].size;
     }
 
-    if (total_in_size + total_out_size > VIRTIO_FS_SHARED_BUF_SIZE) {
-        /* FS request doesn't fit into shared buffer, cannot send it */
-        ret = -PAL_ERROR_NOMEM;
-        goto out;
+    if (total_in_size + total_out_size > VIRTIO_FS_SLOT_SIZE) {
+        /* FS request doesn't fit into a slot of shared buffer, cannot send it */
+        return -PAL_ERROR_NOMEM;
     }
 
     hdr_in->len = total_in_size;
+    return 0;
+}
 
-    char* shared_buf_addr = g_fs->shared_buf;
+/* copy "in" contents of the request to shared memory, submit `count` chained descriptors and kick
+ * the device; doesn't wait for the device to process the request, see wait_request() */
+static int submit_request(struct virtio_fs_request_queue* queue, size_t count,
+                          struct virtio_fs_desc* descs, bool may_block,
+                          struct virtio_fs_request* out_req) {
+    int ret;
+    struct virtqueue* vq = queue->vq;
+
+    uint32_t slot;
+    spinlock_lock(&queue->lock);
+    ret = reserve_slot(queue, may_block, &slot);
+    spinlock_unlock(&queue->lock);
+    if (ret < 0)
+        return ret;
+
+    /* the slot is exclusively ours, so fill it without holding the lock; note that we don't zero
+     * out the parts of the slot to be written by the device, see wait_request() */
+    char* slot_addr = queue->shared_buf + slot * VIRTIO_FS_SLOT_SIZE;
+    char* shared_buf_addr = slot_addr;
     for (size_t i = 0; i < count; i++) {
-        uint16_t flags = i == count - 1 ? 0 : VIRTQ_DESC_F_NEXT;
         if (descs[i].in) {
             /* write to untrusted shared memory, safe */
-			vm_shared_memcpy(shared_buf_addr, descs[i].addr, descs[i].size);
-        } else {
-            /* zero out in untrusted shared memory and mark desc as to-be-written by device */
-            vm_shared_memset(shared_buf_addr, 0, descs[i].size);
+            vm_shared_memcpy(shared_buf_addr, descs[i].addr, descs[i].size);
+        }
+        shared_buf_addr += descs[i].size;
+    }
+
+    spinlock_lock(&queue->lock);
+
+    shared_buf_addr = slot_addr;
+    for (size_t i = 0; i < count; i++) {
+        uint16_t flags = i == count - 1 ? 0 : VIRTQ_DESC_F_NEXT;
+        if (!descs[i].in) {
+            /* mark desc as to-be-written by device */
             flags |= VIRTQ_DESC_F_WRITE;
         }
 
-        ret = virtq_alloc_desc(g_fs->requests, shared_buf_addr, descs[i].size, flags,
-                               &descs[i].idx);
+        ret = virtq_alloc_desc(vq, shared_buf_addr, descs[i].size, flags, &descs[i].idx);
         if (ret < 0)
-            goto out;
+            goto fail;
 
         descs[i].allocated = true;
         shared_buf_addr += descs[i].size;
     }
 
     for (size_t i = 0; i < count - 1; i++) {
-        vm_shared_writew(&g_fs->requests->desc[descs[i].idx].next, descs[i + 1].idx);
+        vm_shared_writew(&vq->desc[descs[i].idx].next, descs[i + 1].idx);
     }
-    vm_shared_writew(&g_fs->requests->desc[descs[count - 1].idx].next, 0);
+    vm_shared_writew(&vq->desc[descs[count - 1].idx].next, 0);
+
+    uint16_t head_idx = descs[0].idx;
+    assert(__atomic_load_n(&queue->req_states[head_idx], __ATOMIC_ACQUIRE) == VIRTIO_FS_REQ_IDLE);
+    __atomic_store_n(&queue->req_states[head_idx], VIRTIO_FS_REQ_INFLIGHT, __ATOMIC_RELEASE);
 
-    uint16_t avail_idx = g_fs->requests->cached_avail_idx;
-    g_fs->requests->cached_avail_idx++;
+    uint16_t avail_idx = vq->cached_avail_idx;
+    vq->cached_avail_idx++;
 
-    vm_shared_writew(&g_fs->requests->avail->ring[avail_idx % g_fs->requests->queue_size],
-                     descs[0].idx);
-    vm_shared_writew(&g_fs->requests->avail->idx, g_fs->requests->cached_avail_idx);
+    vm_shared_writew(&vq->avail->ring[avail_idx % vq->queue_size], head_idx);
+    vm_shared_writew(&vq->avail->idx, vq->cached_avail_idx);
+
+    uint16_t host_device_used_flags = vm_shared_readw(&vq->used->flags);
+    spinlock_unlock(&queue->lock);
 
-    uint16_t host_device_used_flags = vm_shared_readw(&g_fs->requests->used->flags);
     if (!(host_device_used_flags & VIRTQ_USED_F_NO_NOTIFY))
-        vm_mmio_writew(g_fs->requests_notify_addr, /*queue_sel=*/1);
+        vm_mmio_writew(queue->notify_addr, queue->queue_sel);
+
+    *out_req = (struct virtio_fs_request){
+        .queue    = queue,
+        .descs    = descs,
+        .count    = count,
+        .slot     = slot,
+        .head_idx = head_idx,
+    };
+    return 0;
 
-    while (true) {
-        uint16_t host_used_idx = vm_shared_readw(&g_fs->requests->used->idx);
-        if (host_used_idx == g_fs->requests->cached_avail_idx)
-            break;
+fail:
+    for (size_t i = 0; i < count; i++) {
+        if (descs[i].allocated)
+            virtq_free_desc(vq, descs[i].idx);
+    }
+    release_slot(queue, slot);
+    spinlock_unlock(&queue->lock);
+    return ret;
+}
 
-        /* FIXME: simply spinning until the VMM processes the request; maybe use MWAIT?  */
-        CPU_RELAX();
+/* wait until the device processed the submitted request, then copy contents from device's shared
+ * memory to secure memory and release the request's resources */
+static int wait_request(struct virtio_fs_request* req) {
+    int ret;
+    struct virtio_fs_request_queue* queue = req->queue;
+    int* req_state = &queue->req_states[req->head_idx];
+
+    if (!g_interrupts_enabled) {
+        /* early boot: the interrupt handler doesn't process request queues, poll the device */
+        while (__atomic_load_n(req_state, __ATOMIC_ACQUIRE) != VIRTIO_FS_REQ_DONE) {
+            ret = process_used(queue, /*wakeup=*/false);
+            if (ret < 0) {
+                /* malicious host; don't reuse the slot and descriptors of this request */
+                return ret;
+            }
+            CPU_RELAX();
+        }
+    } else {
+        while (__atomic_load_n(req_state, __ATOMIC_ACQUIRE) != VIRTIO_FS_REQ_DONE) {
+            /* woken up by virtio_fs_isr(); spurious wakeups are possible, thus the loop */
+            (void)sched_thread_futex_wait(req_state, VIRTIO_FS_REQ_INFLIGHT);
+        }
     }
 
-    shared_buf_addr = g_fs->shared_buf;
-    for (size_t i = 0; i < count; i++) {
-        if (!descs[i].in) {
+    /* copy only as many bytes as the device reported to have written (this value is untrusted but
+     * it is bounded by sizes of "out" descs); the rest of "out" buffers is left untouched, so the
+     * callers must verify the lengths reported in FUSE out headers */
+    uint32_t written_size = queue->req_written_sizes[req->head_idx];
+    char* shared_buf_addr = queue->shared_buf + req->slot * VIRTIO_FS_SLOT_SIZE;
+    for (size_t i = 0; i < req->count; i++) {
+        struct virtio_fs_desc* desc = &req->descs[i];
+        if (!desc->in && written_size) {
             /* copy from untrusted shared memory, these contents should be verified */
-            vm_shared_memcpy(descs[i].addr, shared_buf_addr, descs[i].size);
+            size_t copy_size = MIN(desc->size, written_size);
+            vm_shared_memcpy(desc->addr, shared_buf_addr, copy_size);
+            written_size -= copy_size;
         }
-        shared_buf_addr += descs[i].size;
+        shared_buf_addr += desc->size;
     }
 
-    ret = 0;
-out:
-    for (size_t i = 0; i < count; i++) {
-        if (descs[i].allocated)
-            virtq_free_desc(g_fs->requests, descs[i].idx);
+    spinlock_lock(&queue->lock);
+    __atomic_store_n(req_state, VIRTIO_FS_REQ_IDLE, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < req->count; i++) {
+        if (req->descs[i].allocated)
+            virtq_free_desc(queue->vq, req->descs[i].idx);
     }
-    spinlock_unlock(&g_fs_lock);
-    return ret;
+    release_slot(queue, req->slot);
+    spinlock_unlock(&queue->lock);
+    return 0;
+}
+
+/* execute a single virtio-fs FUSE request to completion (sleeping until the device processed it) */
+static int virtio_fs_exec_request(size_t count, struct virtio_fs_desc* descs) {
+    int ret = prepare_request(count, descs);
+    if (ret < 0)
+        return ret;
+
+    struct virtio_fs_request req;
+    ret = submit_request(pick_request_queue(), count, descs, /*may_block=*/true, &req);
+    if (ret < 0)
+        return ret;
+
+    return wait_request(&req);
 }
 
 int virtio_fs_fuse_init(void) {
@@ -233,7 +435,10 @@ int virtio_fs_fuse_init(void) {
         return -PAL_ERROR_DENIED;
     }
 
-    /* NOTE: no fields in `fuse_init_out` (like `max_readahead`, `flags`) seem to be interesting */
+    /* NOTE: other fields in `fuse_init_out` (like `max_readahead`, `flags`) seem to be
+     *       uninteresting; `max_write` is untrusted but only affects performance */
+    g_fs->max_write = init_out.max_write ? MIN(init_out.max_write, (uint32_t)VIRTIO_FS_IO_CHUNK_SIZE)
+                                         : (uint32_t)VIRTIO_FS_IO_CHUNK_SIZE;
     g_fs->initialized = true;
     return 0;
 }
@@ -467,79 +672,208 @@ int virtio_fs_fuse_rename(uint64_t old_dir_nodeid, const char* old_filename,
     return 0;
 }
 
-int virtio_fs_fuse_read(uint64_t nodeid, uint64_t fh, uint64_t size, uint64_t offset,
-                        char* out_buf, uint64_t* out_size) {
-    int ret;
-
-    /* NOTE: we don't use any read flags (currently the only one is FUSE_READ_LOCKOWNER) */
-    struct fuse_in_header  hdr_in  = { .opcode = FUSE_READ, .nodeid = nodeid };
-    struct fuse_read_in    read_in = { .fh = fh, .offset = offset, .size = size };
-    struct fuse_out_header hdr_out = {0};
-
-    struct virtio_fs_desc descs[] = {
-        { .addr = &hdr_in,  .size = sizeof(hdr_in),  .in = true },
-        { .addr = &read_in, .size = sizeof(read_in), .in = true },
-        { .addr = &hdr_out, .size = sizeof(hdr_out), .in = false },
-        { .addr = out_buf,  .size = size,            .in = false },
+/* state of one FUSE_READ/FUSE_WRITE request of a (possibly big) read/write */
+struct virtio_fs_io_chunk {
+    struct fuse_in_header hdr_in;
+    union {
+        struct fuse_read_in  read_in;
+        struct fuse_write_in write_in;
     };
+    struct fuse_out_header hdr_out;
+    struct fuse_write_out  write_out;
+    struct virtio_fs_desc  descs[5];
+    struct virtio_fs_request req;
+    uint64_t size;
+};
 
-    ret = virtio_fs_exec_request(/*count=*/4, descs);
-    if (ret < 0)
-        goto fail;
-    if (hdr_out.error < 0) {
-        ret = unix_to_pal_error(hdr_out.error);
-        goto fail;
+/* verify the reply to a FUSE_READ/FUSE_WRITE request and return the number of read/written bytes */
+static int finish_io_chunk(bool is_write, struct virtio_fs_io_chunk* chunk, uint64_t* out_size) {
+    if (chunk->hdr_out.error < 0)
+        return unix_to_pal_error(chunk->hdr_out.error);
+
+    if (is_write) {
+        /* verify possibly-malicious `write_out.size` */
+        if (chunk->write_out.size > chunk->size)
+            return -PAL_ERROR_DENIED;
+        *out_size = chunk->write_out.size;
+        return 0;
     }
 
     /* verify possibly-malicious `hdr_out.len` (recall that `hdr_out->len` returns the *total* size
      * of the host's reply, including the header) */
-    if (hdr_out.len < sizeof(hdr_out) || hdr_out.len > sizeof(hdr_out) + size) {
-        ret = -PAL_ERROR_DENIED;
-        goto fail;
-    }
-
-    /* out_buf was already populated during `virtio_fs_exec_request()` */
-    *out_size = hdr_out.len - sizeof(hdr_out);
+    if (chunk->hdr_out.len < sizeof(chunk->hdr_out)
+            || chunk->hdr_out.len > sizeof(chunk->hdr_out) + chunk->size)
+        return -PAL_ERROR_DENIED;
+    *out_size = chunk->hdr_out.len - sizeof(chunk->hdr_out);
     return 0;
-fail:
-    /* erase out_buf, so that no malicious data is transmitted into private memory; this may worsen
-     * performance but the hope is that read failures don't happen often in benign cases */
-    memset(out_buf, 0, size);
-    return ret;
 }
 
-int virtio_fs_fuse_write(uint64_t nodeid, uint64_t fh, const char* buf, uint64_t size,
-                         uint64_t offset, uint64_t* out_size) {
+/*
+ * Read or write `size` bytes at `offset`: the operation is split into FUSE requests of at most
+ * VIRTIO_FS_IO_CHUNK_SIZE bytes each, and up to VIRTIO_FS_IO_MAX_INFLIGHT of them are kept in
+ * flight together (the device processes them in parallel, while we copy data of already completed
+ * requests). Completed requests are consumed in order; the operation stops at the first failed or
+ * short request, and the number of bytes read/written before it is returned. If `progress` is
+ * given, it is called after each consumed request, so that the caller can process the data at the
+ * start of `buf` while the following requests are still in flight.
+ */
+static int virtio_fs_fuse_io(bool is_write, uint64_t nodeid, uint64_t fh, char* buf, uint64_t size,
+                             uint64_t offset, virtio_fs_progress_cb_t progress, void* progress_arg,
+                             uint64_t* out_size) {
     int ret;
 
-    /* NOTE: we don't use any write flags (search FUSE_WRITE_* for available flags) */
-    struct fuse_in_header  hdr_in    = { .opcode = FUSE_WRITE, .nodeid = nodeid };
-    struct fuse_write_in   write_in  = { .fh = fh, .offset = offset, .size = size };
-    struct fuse_out_header hdr_out   = {0};
-    struct fuse_write_out  write_out = {0};
+    struct virtio_fs_io_chunk* chunks = malloc(VIRTIO_FS_IO_MAX_INFLIGHT * sizeof(*chunks));
+    if (!chunks)
+        return -PAL_ERROR_NOMEM;
 
-    struct virtio_fs_desc descs[] = {
-        { .addr = &hdr_in,    .size = sizeof(hdr_in),    .in = true },
-        { .addr = &write_in,  .size = sizeof(write_in),  .in = true },
-        { .addr = (void*)buf, .size = size,              .in = true },
-        { .addr = &hdr_out,   .size = sizeof(hdr_out),   .in = false },
-        { .addr = &write_out, .size = sizeof(write_out), .in = false },
-    };
+    uint64_t chunk_max_size = is_write ? g_fs->max_write : VIRTIO_FS_IO_CHUNK_SIZE;
+    struct virtio_fs_request_queue* queue = pick_request_queue();
 
-    ret = virtio_fs_exec_request(/*count=*/5, descs);
-    if (ret < 0)
-        return ret;
-    if (hdr_out.error < 0)
-        return unix_to_pal_error(hdr_out.error);
+    size_t oldest = 0;          /* index of the oldest in-flight chunk in `chunks` ring */
+    size_t inflight = 0;
+    uint64_t submitted_size = 0;
+    uint64_t completed_size = 0;
+    bool stop = false;
+    int error = 0;
 
-    /* verify possibly-malicious `write_out.size` */
-    if (write_out.size > size)
-        return -PAL_ERROR_DENIED;
+    while (true) {
+        while (!stop && submitted_size < size && inflight < VIRTIO_FS_IO_MAX_INFLIGHT) {
+            struct virtio_fs_io_chunk* chunk = &chunks[(oldest + inflight)
+                                                       % VIRTIO_FS_IO_MAX_INFLIGHT];
+            char* chunk_buf = buf + submitted_size;
+            uint64_t chunk_offset = offset + submitted_size;
+            chunk->size = MIN(size - submitted_size, chunk_max_size);
+
+            /* NOTE: we don't use any read/write flags (search FUSE_READ_* and FUSE_WRITE_*) */
+            chunk->hdr_in  = (struct fuse_in_header){ .opcode = is_write ? FUSE_WRITE : FUSE_READ,
+                                                      .nodeid = nodeid };
+            chunk->hdr_out = (struct fuse_out_header){0};
+            chunk->write_out = (struct fuse_write_out){0};
+
+            size_t count;
+            if (is_write) {
+                chunk->write_in = (struct fuse_write_in){ .fh = fh, .offset = chunk_offset,
+                                                          .size = chunk->size };
+                chunk->descs[0] = (struct virtio_fs_desc){ .addr = &chunk->hdr_in,
+                                                           .size = sizeof(chunk->hdr_in),
+                                                           .in = true };
+                chunk->descs[1] = (struct virtio_fs_desc){ .addr = &chunk->write_in,
+                                                           .size = sizeof(chunk->write_in),
+                                                           .in = true };
+                chunk->descs[2] = (struct virtio_fs_desc){ .addr = chunk_buf,
+                                                           .size = chunk->size, .in = true };
+                chunk->descs[3] = (struct virtio_fs_desc){ .addr = &chunk->hdr_out,
+                                                           .size = sizeof(chunk->hdr_out),
+                                                           .in = false };
+                chunk->descs[4] = (struct virtio_fs_desc){ .addr = &chunk->write_out,
+                                                           .size = sizeof(chunk->write_out),
+                                                           .in = false };
+                count = 5;
+            } else {
+                chunk->read_in = (struct fuse_read_in){ .fh = fh, .offset = chunk_offset,
+                                                        .size = chunk->size };
+                chunk->descs[0] = (struct virtio_fs_desc){ .addr = &chunk->hdr_in,
+                                                           .size = sizeof(chunk->hdr_in),
+                                                           .in = true };
+                chunk->descs[1] = (struct virtio_fs_desc){ .addr = &chunk->read_in,
+                                                           .size = sizeof(chunk->read_in),
+                                                           .in = true };
+                chunk->descs[2] = (struct virtio_fs_desc){ .addr = &chunk->hdr_out,
+                                                           .size = sizeof(chunk->hdr_out),
+                                                           .in = false };
+                chunk->descs[3] = (struct virtio_fs_desc){ .addr = chunk_buf,
+                                                           .size = chunk->size, .in = false };
+                count = 4;
+            }
+
+            ret = prepare_request(count, chunk->descs);
+            if (ret < 0) {
+                error = ret;
+                stop = true;
+                break;
+            }
+
+            /* block on a free slot only if we don't hold any other slots (to avoid deadlocks) */
+            ret = submit_request(queue, count, chunk->descs, /*may_block=*/inflight == 0,
+                                 &chunk->req);
+            if (ret == -PAL_ERROR_TRYAGAIN)
+                break;
+            if (ret < 0) {
+                error = ret;
+                stop = true;
+                break;
+            }
+
+            submitted_size += chunk->size;
+            inflight++;
+        }
 
-    *out_size = write_out.size;
+        if (!inflight)
+            break;
+
+        struct virtio_fs_io_chunk* chunk = &chunks[oldest];
+        oldest = (oldest + 1) % VIRTIO_FS_IO_MAX_INFLIGHT;
+        inflight--;
+
+        ret = wait_request(&chunk->req);
+        if (stop) {
+            /* already failed or hit a short read/write, simply drain remaining requests */
+            continue;
+        }
+
+        uint64_t chunk_done_size = 0;
+        if (ret == 0)
+            ret = finish_io_chunk(is_write, chunk, &chunk_done_size);
+        if (ret < 0) {
+            error = ret;
+            stop = true;
+            continue;
+        }
+
+        completed_size += chunk_done_size;
+        if (chunk_done_size < chunk->size) {
+            /* EOF or partial write, the following requests (if any) must not be taken into account */
+            stop = true;
+        }
+        if (progress && chunk_done_size)
+            progress(progress_arg, completed_size);
+    }
+
+    free(chunks);
+
+    if (!is_write && completed_size < submitted_size) {
+        /* erase the rest of buf, so that no malicious data is transmitted into private memory; this
+         * may worsen performance but the hope is that read failures don't happen often in benign
+         * cases */
+        memset(buf + completed_size, 0, submitted_size - completed_size);
+    }
+
+    if (!completed_size && error)
+        return error;
+
+    *out_size = completed_size;
     return 0;
 }
 
+int virtio_fs_fuse_read(uint64_t nodeid, uint64_t fh, uint64_t size, uint64_t offset,
+                        char* out_buf, uint64_t* out_size) {
+    return virtio_fs_fuse_io(/*is_write=*/false, nodeid, fh, out_buf, size, offset,
+                             /*progress=*/NULL, /*progress_arg=*/NULL, out_size);
+}
+
+int virtio_fs_fuse_read_progress(uint64_t nodeid, uint64_t fh, uint64_t size, uint64_t offset,
+                                 char* out_buf, virtio_fs_progress_cb_t progress,
+                                 void* progress_arg, uint64_t* out_size) {
+    return virtio_fs_fuse_io(/*is_write=*/false, nodeid, fh, out_buf, size, offset, progress,
+                             progress_arg, out_size);
+}
+
+int virtio_fs_fuse_write(uint64_t nodeid, uint64_t fh, const char* buf, uint64_t size,
+                         uint64_t offset, uint64_t* out_size) {
+    return virtio_fs_fuse_io(/*is_write=*/true, nodeid, fh, (char*)buf, size, offset,
+                             /*progress=*/NULL, /*progress_arg=*/NULL, out_size);
+}
+
 int virtio_fs_fuse_flush(uint64_t nodeid, uint64_t fh) {
     int ret;
 
@@ -815,71 +1149,88 @@ static int virtio_fs_negotiate_features(struct virtio_fs* fs) {
     return 0;
 }
 
-static int virtio_fs_alloc(struct virtio_fs** out_fs) {
+static void virtio_fs_free(struct virtio_fs* fs) {
+    virtq_free(fs->hiprio, VIRTIO_FS_HIPRIO_QUEUE_SIZE);
+    /* notify is currently not used; if used later, needs to be freed */
+    for (uint32_t i = 0; i < fs->num_request_queues; i++) {
+        struct virtio_fs_request_queue* queue = &fs->request_queues[i];
+        if (queue->shared_buf)
+            memory_free_shared_region(queue->shared_buf, VIRTIO_FS_SHARED_BUF_SIZE);
+        virtq_free(queue->vq, VIRTIO_FS_QUEUE_SIZE);
+        free(queue->req_states);
+        free(queue->req_written_sizes);
+    }
+    free(fs->request_queues);
+    free(fs);
+}
+
+static int virtio_fs_alloc(uint32_t num_request_queues, struct virtio_fs** out_fs) {
     int ret;
-    struct virtio_fs* fs = NULL;
-    char* shared_buf = NULL;
-    struct virtqueue* hiprio = NULL;
-    struct virtqueue* notify = NULL; /* currently not used */
-    struct virtqueue* requests = NULL;
 
-    fs = malloc(sizeof(*fs));
+    struct virtio_fs* fs = calloc(1, sizeof(*fs));
     if (!fs)
         return -PAL_ERROR_NOMEM;
-    memset(fs, 0, sizeof(*fs)); /* for sanity */
 
-    shared_buf = memory_get_shared_region(VIRTIO_FS_SHARED_BUF_SIZE);
-    if (!shared_buf) {
+    fs->request_queues = calloc(num_request_queues, sizeof(*fs->request_queues));
+    if (!fs->request_queues) {
         ret = -PAL_ERROR_NOMEM;
         goto fail;
     }
+    fs->num_request_queues = num_request_queues;
 
-    ret = virtq_create(VIRTIO_FS_HIPRIO_QUEUE_SIZE, &hiprio);
-    if (ret < 0)
-        goto fail;
-
-    ret = virtq_create(VIRTIO_FS_QUEUE_SIZE, &requests);
+    ret = virtq_create(VIRTIO_FS_HIPRIO_QUEUE_SIZE, &fs->hiprio);
     if (ret < 0)
         goto fail;
+    vm_shared_writew(&fs->hiprio->avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT); /* for sanity */
+
+    for (uint32_t i = 0; i < num_request_queues; i++) {
+        struct virtio_fs_request_queue* queue = &fs->request_queues[i];
+        spinlock_init(&queue->lock);
+        queue->queue_sel  = i + 1;
+        queue->free_slots = (uint32_t)((1UL << VIRTIO_FS_SLOTS_PER_QUEUE) - 1);
+
+        queue->req_states = calloc(VIRTIO_FS_QUEUE_SIZE, sizeof(*queue->req_states));
+        queue->req_written_sizes = calloc(VIRTIO_FS_QUEUE_SIZE, sizeof(*queue->req_written_sizes));
+        if (!queue->req_states || !queue->req_written_sizes) {
+            ret = -PAL_ERROR_NOMEM;
+            goto fail;
+        }
 
-    /* instruct the host to NOT send interrupts on `requests` queue upon consuming messages; we
-     * perform poll instead of waiting for an interrupt, see `virtio_fs_exec_request()` */
-    vm_shared_writew(&requests->avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT);
-    vm_shared_writew(&hiprio->avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT); /* for sanity */
+        queue->shared_buf = memory_get_shared_region(VIRTIO_FS_SHARED_BUF_SIZE);
+        if (!queue->shared_buf) {
+            ret = -PAL_ERROR_NOMEM;
+            goto fail;
+        }
 
-    fs->shared_buf = shared_buf;
-    fs->hiprio   = hiprio;
-    fs->notify   = notify;
-    fs->requests = requests;
+        /* note that interrupts are enabled on request queues: callers sleep until the interrupt
+         * handler marks their requests as done, see virtio_fs_exec_request() */
+        ret = virtq_create(VIRTIO_FS_QUEUE_SIZE, &queue->vq);
+        if (ret < 0)
+            goto fail;
+    }
 
     *out_fs = fs;
     return 0;
 fail:
-    memory_free_shared_region(shared_buf, VIRTIO_FS_SHARED_BUF_SIZE);
-    virtq_free(hiprio, VIRTIO_FS_HIPRIO_QUEUE_SIZE);
-    /* notify is currently not used; if used later, needs to be freed */
-    virtq_free(requests, VIRTIO_FS_QUEUE_SIZE);
-    free(fs);
+    virtio_fs_free(fs);
     return ret;
 }
 
-static int virtio_fs_free(struct virtio_fs* fs) {
-    memory_free_shared_region(fs->shared_buf, VIRTIO_FS_SHARED_BUF_SIZE);
-    virtq_free(fs->hiprio, VIRTIO_FS_HIPRIO_QUEUE_SIZE);
-    /* notify is currently not used; if used later, needs to be freed */
-    virtq_free(fs->requests, VIRTIO_FS_QUEUE_SIZE);
-    free(fs);
-    return 0;
-}
-
 int virtio_fs_init(struct virtio_pci_regs* pci_regs, struct virtio_fs_config* pci_config,
                    uint64_t notify_off_addr, uint32_t notify_off_multiplier,
                    uint32_t* interrupt_status_reg) {
     int ret;
     uint32_t status;
 
+    /* number of request queues is untrusted, but a malicious value only affects performance (we
+     * fail below if the device doesn't really have that many queues) */
+    uint32_t num_request_queues = vm_mmio_readl(&pci_config->num_request_queues);
+    if (num_request_queues == 0)
+        return -PAL_ERROR_DENIED;
+    num_request_queues = MIN(num_request_queues, VIRTIO_FS_MAX_REQUEST_QUEUES);
+
     struct virtio_fs* fs;
-    ret = virtio_fs_alloc(&fs);
+    ret = virtio_fs_alloc(num_request_queues, &fs);
     if (ret < 0)
         return ret;
 
@@ -901,7 +1252,7 @@ int virtio_fs_init(struct virtio_pci_regs* pci_regs, struct virtio_fs_config* pc
         goto fail;
     }
 
-    ret = virtq_add_to_device(pci_regs, fs->hiprio, /*queue_sel=*/0);
+    ret = virtq_add_to_device(pci_regs, fs->hiprio, /*queue_sel=*/0, VIRTIO_MSI_NO_VECTOR);
     if (ret < 0)
         goto fail;
 
@@ -913,21 +1264,24 @@ int virtio_fs_init(struct virtio_pci_regs* pci_regs, struct virtio_fs_config* pc
      *       https://elixir.bootlin.com/linux/v5.15/source/fs/fuse/virtio_fs.c#L33
      */
 
-    ret = virtq_add_to_device(pci_regs, fs->requests, /*queue_sel=*/1);
-    if (ret < 0)
-        goto fail;
+    for (uint32_t i = 0; i < fs->num_request_queues; i++) {
+        struct virtio_fs_request_queue* queue = &fs->request_queues[i];
 
-    vm_mmio_writew(&pci_regs->queue_select, 1);
-    uint64_t requests_notify_off = vm_mmio_readw(&pci_regs->queue_notify_off);
-    fs->requests_notify_addr = (uint16_t*)(notify_off_addr
-                                               + requests_notify_off * notify_off_multiplier);
+        ret = virtq_add_to_device(pci_regs, queue->vq, queue->queue_sel, VIRTIO_MSI_NO_VECTOR);
+        if (ret < 0)
+            goto fail;
 
-    size_t notify_addr_size = sizeof(*fs->requests_notify_addr);
-    if (!(PCI_MMIO_START_ADDR <= (uintptr_t)fs->requests_notify_addr &&
-                (uintptr_t)fs->requests_notify_addr + notify_addr_size < PCI_MMIO_END_ADDR)) {
-        /* incorrect or malicious queue notify addr */
-        ret = -PAL_ERROR_DENIED;
-        goto fail;
+        vm_mmio_writew(&pci_regs->queue_select, queue->queue_sel);
+        uint64_t queue_notify_off = vm_mmio_readw(&pci_regs->queue_notify_off);
+        queue->notify_addr = (uint16_t*)(notify_off_addr + queue_notify_off * notify_off_multiplier);
+
+        size_t notify_addr_size = sizeof(*queue->notify_addr);
+        if (!(PCI_MMIO_START_ADDR <= (uintptr_t)queue->notify_addr &&
+                    (uintptr_t)queue->notify_addr + notify_addr_size < PCI_MMIO_END_ADDR)) {
+            /* incorrect or malicious queue notify addr */
+            ret = -PAL_ERROR_DENIED;
+            goto fail;
+        }
     }
 
     status = vm_mmio_readb(&pci_regs->device_status);
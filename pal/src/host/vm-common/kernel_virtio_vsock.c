@@ -6,21 +6,18 @@
  *
  * Reference: https://docs.oasis-open.org/virtio/virtio/v1.1/csprd01/virtio-v1.1-csprd01.pdf
  *
- * TODO:
- * - Implement guest-side buffer space management via peer_buf_alloc, peer_fwd_cnt, tx_cnt
- *   (see section 5.10.6.3 in spec)
- *
  * Diagram with flows:
  *
- *   Bottomhalves thread (CPU0)                       +  App threads (CPU0-CPUn)
+ *   Bottomhalves threads (CPU0-CPUn)                 +  App threads (CPU0-CPUn)
  *                                                    |
  *   handle_rq()                                      |  virtio_vsock_socket()
  *     +                                              |  virtio_vsock_bind()
  *     +--> g_vsock->rq ops                           |  virtio_vsock_listen()
- *          malloc(packet)                            |  virtio_vsock_accept()
- *          memcpy(packet, g_vsock->rq->rq_buf)       |  virtio_vsock_getsockname()
- *          process_packet(packet)                    |  virtio_vsock_peek()
- *            +                                       |  virtio_vsock_read()
+ *          memcpy(header, g_vsock->rq->rq_buf)       |  virtio_vsock_accept()
+ *          process_packet(header, payload)           |  virtio_vsock_getsockname()
+ *            +                                       |  virtio_vsock_peek()
+ *            +                                       |  virtio_vsock_poll()
+ *            +                                       |  virtio_vsock_readv()
  *            +--> g_vsock->conns ops                 |    +
  *            |    existing conn ops                  |    +--> g_vsock->conns ops
  *            |    new conn ops (on LISTEN)           |         existing conn ops
@@ -35,14 +32,14 @@
  *            |             +                         |    |      +--> copy_into_tq(new_packet)
  *            |             +--> g_vsock->tq ops      |    |
  *            |                                       |    +--> wait(conn) for response packet
- *            +--> free(packet)                       |
+ *            |                                       |
  *            |                                       |  virtio_vsock_write()
  *            +--> ...or recv_rw_packet()             |    +
  *                   +                                |    +--> g_vsock->conns ops
- *                   +--> mv packet to existing conn  |         existing conn ops
- *                                                    |         send_rw_packet()
+ *                   +--> memcpy(conn ring, payload)  |         existing conn ops
+ *                                                    |         send_rw_packets()
  *   cleanup_tq()                                     |           +
- *     +                                              |           +--> copy_into_tq(new_packet)
+ *     +                                              |           +--> g_vsock->tq ops (batch)
  *     +--> g_vsock->tq ops                           |
  *                                                    |  virtio_vsock_shutdown()
  *                                                    |  virtio_vsock_close()
@@ -56,29 +53,68 @@
  *                                                    +    +--> wait(conn) for response packet
  *
  * Notes:
- *   - g_vsock->rq operations happen only in the CPU0-tied bottomhalves thread, thus they do not
- *     really need any sync/locking. But we add a "receive" lock anyway, for uniformity and to be
- *     future proof.
+ *   - g_vsock->rq operations happen in the bottomhalves thread of the CPU that received the RX
+ *     interrupt (with MSI-X, the RX and TX vectors may be steered to any CPUs), thus they must be
+ *     protected with a single global "receive" lock.
  *   - g_vsock->tq operations happen on different CPUs, thus they must be protected with a single
  *     global "transmit" lock.
  *   - g_vsock->pending_tq_control_packets operations happen on different CPUs and operate on the
  *     TQ, thus they must be protected with a single global "transmit" lock.
- *   - g_vsock->conns operations happen on different CPUs, thus they must be protected with a single
- *     global "connections" lock.
- *   - Operations on the same connection happen on different CPUs, thus each connection must be
- *     protected with a lock. For simplicity, all connections are protected with a single global
- *     "connections" lock.
+ *   - g_vsock->conns (fd table) and g_vsock->conns_by_ports (hash table) operations happen on
+ *     different CPUs, thus they must be protected with a single global "connections" lock. This
+ *     lock is held only for short table operations (lookup, insert, remove, port allocation).
+ *   - Operations on the same connection happen on different CPUs, thus each connection is
+ *     protected with its own lock, so that independent connections do not contend. A lookup in the
+ *     tables returns a reference to the connection (the connection is freed when the last reference
+ *     is dropped); since the connection may be removed between the lookup and taking its lock, the
+ *     RX path re-checks under the connection lock that the connection is still hashed.
+ *   - Connections accepted on a listening socket share its guest port (as in Linux), the host port
+ *     distinguishes them. Unbound connections get new guest ports in O(1) via pick_new_port().
  *   - Packets always belong to RQ or TQ or a certain connection, so they can reuse RQ/TQ/conn locks
- *     and don't need separate locks.
+ *     and don't need separate locks. Received payloads are copied straight from the shared RX
+ *     buffer into the connection's receive byte ring (rx_buf), consumed bytes are tracked by the
+ *     free-running rx_cnt/fwd_cnt counters.
+ *
+ * Order of locks must be: g_vsock->rq --> listening conn --> conn --> g_vsock->conns -->
+ * g_vsock->tq. This order guarantees no deadlocks.
  *
- * Order of locks must be: g_vsock->rq --> g_vsock->conns --> g_vsock->tq. This order guarantees no
- * deadlocks.
+ * Buffer space management (credit-based flow control, see section 5.10.6.3 in spec):
+ *   - Each packet sent to the host carries our buf_alloc and fwd_cnt (bytes consumed by the app);
+ *     the host never sends more than buf_alloc bytes ahead of fwd_cnt. Since fwd_cnt advances only
+ *     in virtio_vsock_readv(), we send an explicit CREDIT_UPDATE once a sizeable part of the receive
+ *     buffer was freed (otherwise the host could stall forever on a full window).
+ *   - Each packet received from the host carries peer_buf_alloc and peer_fwd_cnt; we never send
+ *     more than peer_buf_alloc bytes ahead of peer_fwd_cnt (tx_cnt counts the bytes sent). A writer
+ *     without credit gets TRYAGAIN and is woken up when the host reports new credit.
+ *   - Each connection may have at most snd_buf_size payload bytes in the TX queue (SO_SNDBUF, see
+ *     VSOCK_DEFAULT_SND_BUF_SIZE), so that one connection cannot fill the whole TX queue. Each TX
+ *     descriptor with an RW packet remembers its connection (g_vsock->tq_owners); when the device
+ *     consumes the packet, cleanup_tq_locked() decrements the connection's tx_queued and, if the
+ *     connection was found full, queues it for a notification. Notifications need the connection
+ *     lock, which may already be held by the caller of cleanup_tq_locked(), so they are delivered
+ *     later by notify_tq_wakeups() (at the end of the bottomhalf and of the send paths).
+ *
+ * Notifications:
+ *   - virtio_vsock_write() puts a whole burst of RW packets (bounded by credit and free TX
+ *     descriptors) into the TX queue and notifies the device at most once per burst.
+ *   - If the device offers VIRTIO_F_EVENT_IDX, notifications and interrupts are suppressed via the
+ *     avail_event/used_event indices instead of the (coarser) flags. TX interrupts are normally off;
+ *     they are armed only when the TX queue is full, so that the bottomhalf reclaims descriptors and
+ *     wakes up blocked writers.
+ *   - Readiness of each connection (PAL_WAIT_* flags in poll_events) is recomputed under the
+ *     connection lock whenever its state, counters or credit change, see update_poll_events().
+ *     Readiness callbacks and pollers are notified only when new events appear (and on each
+ *     received payload or connection request), and virtio_vsock_poll() just reads the cached
+ *     flags. The only non-per-connection condition is a full TX queue: a poller that finds it full
+ *     sets g_vsock_tq_full_polled, and the connections that are writable are notified once TX
+ *     descriptors are freed (also in notify_tq_wakeups()).
  */
 
 #include "api.h"
 #include "pal_error.h"
 
 #include "kernel_apic.h"
+#include "kernel_interrupts.h"
 #include "kernel_memory.h"
 #include "kernel_pci.h"
 #include "kernel_sched.h"
@@ -90,21 +126,31 @@
 #define VIRTIO_VSOCK_SHARED_BUF_SIZE (VIRTIO_VSOCK_QUEUE_SIZE * sizeof(struct virtio_vsock_packet))
 
 struct virtio_vsock* g_vsock = NULL;
-bool g_vsock_trigger_bottomhalf = false;
+bool g_vsock_rx_trigger_bottomhalf = false;
+bool g_vsock_tx_trigger_bottomhalf = false;
 
-/* coarse-grained locks to sync RX, TX and connections' operations on multi-core systems, see also
- * flow diagram above and kernel_virtio.h */
+/* coarse-grained locks to sync RX, TX and connection tables' operations on multi-core systems (each
+ * connection has its own lock), see also flow diagram above and kernel_virtio.h */
 static spinlock_t g_vsock_receive_lock = INIT_SPINLOCK_UNLOCKED;
 static spinlock_t g_vsock_transmit_lock = INIT_SPINLOCK_UNLOCKED;
 static spinlock_t g_vsock_connections_lock = INIT_SPINLOCK_UNLOCKED;
 
+/* set when a poller found TX queue full; readiness callbacks of all connections must then be invoked
+ * once TX descriptors are freed, as this is not tied to any particular connection */
+static bool g_vsock_tq_full_polled = false;
+
 static int cleanup_tq(void);
-static int process_packet(struct virtio_vsock_packet* packet);
+static int reclaim_tq_locked(uint16_t* out_freed);
+static int process_packet(const struct virtio_vsock_hdr* header, const uint8_t* shared_payload);
 static void remove_connection(struct virtio_vsock_connection* conn);
+static void notify_all_connections(void);
+static void put_connection(struct virtio_vsock_connection* conn);
+static uint32_t update_poll_events(struct virtio_vsock_connection* conn);
+static void notify_connection(struct virtio_vsock_connection* conn, uint32_t events);
 
 /* interrupt handler (interrupt service routine), called by generic handler `isr_c()` */
 int virtio_vsock_isr(void) {
-    if (!g_vsock)
+    if (!g_vsock || g_vsock->msix)
         return 0;
 
     uint32_t interrupt_status = vm_mmio_readl(g_vsock->interrupt_status_reg);
@@ -114,8 +160,9 @@ int virtio_vsock_isr(void) {
     }
 
     if (interrupt_status & VIRTIO_INTERRUPT_STATUS_USED) {
-        /* real work is done in the bottomhalf called in normal context, see below */
-        __atomic_store_n(&g_vsock_trigger_bottomhalf, true, __ATOMIC_RELEASE);
+        /* legacy interrupt doesn't tell which queue was used, so handle both */
+        virtio_vsock_rq_isr();
+        virtio_vsock_tq_isr();
     }
 
     if (interrupt_status & VIRTIO_INTERRUPT_STATUS_CONFIG) {
@@ -125,6 +172,17 @@ int virtio_vsock_isr(void) {
     return 0;
 }
 
+/* RX and TX parts of the interrupt handler; called directly by `isr_c()` for the MSI-X vectors of
+ * RX and TX queues (on whatever CPUs these vectors are steered to) */
+void virtio_vsock_rq_isr(void) {
+    /* real work is done in the bottomhalf called in normal context, see below */
+    __atomic_store_n(&g_vsock_rx_trigger_bottomhalf, true, __ATOMIC_RELEASE);
+}
+
+void virtio_vsock_tq_isr(void) {
+    __atomic_store_n(&g_vsock_tx_trigger_bottomhalf, true, __ATOMIC_RELEASE);
+}
+
 static int handle_rq(uint16_t host_used_idx, bool* out_received) {
     assert(spinlock_is_locked(&g_vsock_receive_lock));
 
@@ -163,13 +221,12 @@ static int handle_rq(uint16_t host_used_idx, bool* out_received) {
             return -PAL_ERROR_DENIED;
         }
 
-        struct virtio_vsock_packet* packet = malloc(sizeof(*packet));
-        if (!packet)
-            return -PAL_ERROR_NOMEM;
-
-        /* copy from untrusted shared memory, these contents should be verified in process_packet */
-        vm_shared_memcpy(packet, (struct virtio_vsock_packet*)addr, sizeof(*packet));
-        process_packet(packet);
+        /* copy only the header from untrusted shared memory, it is verified in process_packet();
+         * the payload (if any) is copied directly into the connection's receive ring */
+        struct virtio_vsock_packet* shared_packet = (struct virtio_vsock_packet*)addr;
+        struct virtio_vsock_hdr header;
+        vm_shared_memcpy(&header, &shared_packet->header, sizeof(header));
+        process_packet(&header, shared_packet->payload);
 
         vm_shared_writeq(&g_vsock->rq->desc[desc_idx].addr,  addr);
         vm_shared_writel(&g_vsock->rq->desc[desc_idx].len,   sizeof(struct virtio_vsock_packet));
@@ -195,8 +252,10 @@ static int handle_rq_with_disabled_notifications(void) {
 
     spinlock_lock(&g_vsock_receive_lock);
 
+    uint16_t old_avail_idx = g_vsock->rq->cached_avail_idx;
+
     /* disable interrupts (we anyhow will consume all inputs on RX) */
-    vm_shared_writew(&g_vsock->rq->avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT);
+    virtq_disable_interrupts(g_vsock->rq);
 
     while (true) {
         uint16_t host_used_idx = vm_shared_readw(&g_vsock->rq->used->idx);
@@ -206,90 +265,67 @@ static int handle_rq_with_disabled_notifications(void) {
                 goto fail;
         }
 
-        vm_shared_writew(&g_vsock->rq->avail->flags, 0); /* reenable interrupts */
+        virtq_enable_interrupts(g_vsock->rq, /*delay=*/0); /* interrupt on next incoming packet */
         uint16_t reread_host_used_idx = vm_shared_readw(&g_vsock->rq->used->idx);
         if (reread_host_used_idx == g_vsock->rq->seen_used)
             break;
 
         /* disable interrupts and process RX again (that's a corner case: after the last check and
          * before enabling interrupts, an interrupt has been suppressed by the device) */
-        vm_shared_writew(&g_vsock->rq->avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT);
+        virtq_disable_interrupts(g_vsock->rq);
     }
 
+    /* all freed RX buffers were re-added to the queue, notify the device once for the whole batch */
+    bool notify = received && virtq_need_notify(g_vsock->rq, old_avail_idx);
+
     spinlock_unlock(&g_vsock_receive_lock);
 
-    if (received) {
-        uint16_t host_device_used_flags = vm_shared_readw(&g_vsock->rq->used->flags);
-        if (!(host_device_used_flags & VIRTQ_USED_F_NO_NOTIFY))
-            vm_mmio_writew(g_vsock->rq_notify_addr, /*queue_sel=*/0);
+    if (notify)
+        vm_mmio_writew(g_vsock->rq_notify_addr, /*queue_sel=*/0);
+    if (received)
         thread_wakeup_vsock(/*is_read=*/true);
-    }
 
     return 0;
 
 fail:
-    vm_shared_writew(&g_vsock->rq->avail->flags, 0); /* reenable interrupts */
+    virtq_enable_interrupts(g_vsock->rq, /*delay=*/0);
     spinlock_unlock(&g_vsock_receive_lock);
     return ret;
 }
 
-/* called only by copy_into_tq_and_free() and copy_into_tq_or_add_to_pending() */
-static void copy_into_tq_internal(struct virtio_vsock_packet* packet, uint64_t packet_size,
-                                 uint16_t desc_idx) {
+/* Writes the packet into the shared TX buffer (into the slot of the `desc_idx` descriptor) and
+ * appends it to the available ring. The device sees the packet only after tq_publish(), so that a
+ * batch of packets can be published with a single avail-idx update and a single notification. */
+static void tq_add_packet(const struct virtio_vsock_hdr* header, const void* payload,
+                          uint16_t desc_idx) {
     assert(spinlock_is_locked(&g_vsock_transmit_lock));
 
     /* the received free descriptor uses a dummy NULL address, let's rewire it */
-    char* shared_packet = (char*)g_vsock->shared_tq_buf + desc_idx * sizeof(*packet);
+    char* shared_packet = (char*)g_vsock->shared_tq_buf
+                              + desc_idx * sizeof(struct virtio_vsock_packet);
     vm_shared_writeq(&g_vsock->tq->desc[desc_idx].addr, (uint64_t)shared_packet);
 
     /* write to untrusted shared memory, safe */
-    vm_shared_memcpy(shared_packet, packet, packet_size);
+    vm_shared_memcpy(shared_packet, header, sizeof(*header));
+    if (header->size)
+        vm_shared_memcpy(shared_packet + sizeof(*header), payload, header->size);
 
     uint16_t avail_idx = g_vsock->tq->cached_avail_idx;
     g_vsock->tq->cached_avail_idx++;
 
     vm_shared_writew(&g_vsock->tq->avail->ring[avail_idx % g_vsock->tq->queue_size], desc_idx);
-    vm_shared_writew(&g_vsock->tq->avail->idx, g_vsock->tq->cached_avail_idx);
-
-    uint16_t host_device_used_flags = vm_shared_readw(&g_vsock->tq->used->flags);
-    if (!(host_device_used_flags & VIRTQ_USED_F_NO_NOTIFY))
-        vm_mmio_writew(g_vsock->tq_notify_addr, /*queue_sel=*/1);
 }
 
-/* used only for data-flow packets (RW) */
-static int copy_into_tq_and_free(struct virtio_vsock_packet* packet) {
-    assert(g_vsock);
-    assert(packet->header.op == VIRTIO_VSOCK_OP_RW);
-
-    spinlock_lock(&g_vsock_transmit_lock);
-
-    uint16_t desc_idx;
-    uint64_t packet_size = sizeof(struct virtio_vsock_hdr) + packet->header.size;
-    int ret = virtq_alloc_desc(g_vsock->tq, /*addr=*/NULL, packet_size, /*flags=*/0, &desc_idx);
-    if (ret < 0) {
-        /* if TQ buffer is full, drain TQ and try again */
-        if (ret != -PAL_ERROR_NOMEM)
-            goto out;
-
-        spinlock_unlock(&g_vsock_transmit_lock);
-        (void)cleanup_tq();
-        spinlock_lock(&g_vsock_transmit_lock);
+/* makes all packets added since `old_avail_idx` visible to the device and kicks it if needed */
+static void tq_publish(uint16_t old_avail_idx) {
+    assert(spinlock_is_locked(&g_vsock_transmit_lock));
 
-        ret = virtq_alloc_desc(g_vsock->tq, /*addr=*/NULL, packet_size, /*flags=*/0, &desc_idx);
-        if (ret < 0) {
-            log_warning("TX vsock queue is full, dropping outgoing RW packet (payload size %lu)",
-                        packet_size);
-            goto out;
-        }
-    }
+    if (g_vsock->tq->cached_avail_idx == old_avail_idx)
+        return;
 
-    copy_into_tq_internal(packet, packet_size, desc_idx);
-    ret = 0;
-out:
-    spinlock_unlock(&g_vsock_transmit_lock);
-    (void)cleanup_tq();
-    free(packet);
-    return ret;
+    vm_shared_writew(&g_vsock->tq->avail->idx, g_vsock->tq->cached_avail_idx);
+    if (virtq_need_notify(g_vsock->tq, old_avail_idx))
+        vm_mmio_writew(g_vsock->tq_notify_addr, /*queue_sel=*/1);
 }
 
 /* used only for control packets */
@@ -309,11 +345,22 @@ static int copy_into_tq_or_add_to_pending(struct virtio_vsock_packet* packet) {
     uint16_t desc_idx;
     uint64_t packet_size = sizeof(struct virtio_vsock_hdr) + packet->header.size;
     int ret = virtq_alloc_desc(g_vsock->tq, /*addr=*/NULL, packet_size, /*flags=*/0, &desc_idx);
+    if (ret == -PAL_ERROR_NOMEM) {
+        /* if TQ buffer is full, drain TQ and try again; if still full, the TX interrupt is armed
+         * and the bottomhalf will send the pending packet */
+        uint16_t freed;
+        ret = reclaim_tq_locked(&freed);
+        if (ret < 0)
+            goto out;
+        ret = virtq_alloc_desc(g_vsock->tq, /*addr=*/NULL, packet_size, /*flags=*/0, &desc_idx);
+    }
     if (ret < 0 && ret != -PAL_ERROR_NOMEM)
         goto out;
 
     if (ret == 0) {
-        copy_into_tq_internal(packet, packet_size, desc_idx);
+        uint16_t old_avail_idx = g_vsock->tq->cached_avail_idx;
+        tq_add_packet(&packet->header, packet->payload, desc_idx);
+        tq_publish(old_avail_idx);
         goto out;
     }
 
@@ -339,18 +386,16 @@ out:
     return ret;
 }
 
-static int cleanup_tq(void) {
-    int ret;
-    bool sent = false;
+static int cleanup_tq_locked(uint16_t* out_freed) {
+    assert(spinlock_is_locked(&g_vsock_transmit_lock));
 
-    spinlock_lock(&g_vsock_transmit_lock);
+    uint16_t freed = 0;
     uint16_t host_used_idx = vm_shared_readw(&g_vsock->tq->used->idx);
 
     if (host_used_idx - g_vsock->tq->seen_used > g_vsock->tq->queue_size) {
         /* malicious (impossible) value reported by the host; note that this check works also in
          * cases of int wrap */
-        ret = -PAL_ERROR_DENIED;
-        goto fail;
+        return -PAL_ERROR_DENIED;
     }
 
     while (host_used_idx != g_vsock->tq->seen_used) {
@@ -359,28 +404,76 @@ static int cleanup_tq(void) {
 
         if (desc_idx >= g_vsock->tq->queue_size) {
             /* malicious (out of bounds) descriptor index */
-            ret = -PAL_ERROR_DENIED;
-            goto fail;
+            return -PAL_ERROR_DENIED;
         }
 
         if (virtq_is_desc_free(g_vsock->tq, desc_idx)) {
             /* malicious descriptor index (attempt at double-free attack) */
-            ret = -PAL_ERROR_DENIED;
-            goto fail;
+            return -PAL_ERROR_DENIED;
+        }
+
+        struct virtio_vsock_tq_owner* owner = &g_vsock->tq_owners[desc_idx];
+        if (owner->conn) {
+            struct virtio_vsock_connection* conn = owner->conn;
+            assert(conn->tx_queued >= owner->size);
+            conn->tx_queued -= owner->size;
+            if (conn->tx_waiting
+                    && conn->tx_queued < __atomic_load_n(&conn->snd_buf_size, __ATOMIC_RELAXED)) {
+                conn->tx_waiting = false;
+                if (LIST_EMPTY(conn, tq_wakeup_list)) {
+                    /* the reference of the descriptor moves to the wakeup list */
+                    LISTP_ADD_TAIL(conn, &g_vsock->tq_wakeup_conns, tq_wakeup_list);
+                } else {
+                    put_connection(conn);
+                }
+            } else {
+                put_connection(conn);
+            }
+            owner->conn = NULL;
+            owner->size = 0;
         }
 
         virtq_free_desc(g_vsock->tq, desc_idx);
         g_vsock->tq->seen_used++;
-        sent = true;
+        freed++;
     }
-    spinlock_unlock(&g_vsock_transmit_lock);
 
-    if (sent)
-        thread_wakeup_vsock(/*is_read=*/false);
+    if (freed) {
+        /* TX interrupts are needed only while the queue is full, see reclaim_tq_locked() */
+        virtq_disable_interrupts(g_vsock->tq);
+    }
 
+    *out_freed = freed;
     return 0;
-fail:
+}
+
+/* Reclaims TX descriptors already consumed by the host. If none can be reclaimed, asks the host to
+ * interrupt us after it consumed most of the (full) queue: the bottomhalf then calls cleanup_tq()
+ * which wakes up the blocked writers. */
+static int reclaim_tq_locked(uint16_t* out_freed) {
+    assert(spinlock_is_locked(&g_vsock_transmit_lock));
+
+    int ret = cleanup_tq_locked(out_freed);
+    if (ret < 0 || *out_freed)
+        return ret;
+
+    uint16_t in_flight = g_vsock->tq->cached_avail_idx - g_vsock->tq->seen_used;
+    virtq_enable_interrupts(g_vsock->tq, /*delay=*/in_flight * 3 / 4);
+
+    /* re-check to not miss descriptors consumed right before the interrupt was armed */
+    return cleanup_tq_locked(out_freed);
+}
+
+static int cleanup_tq(void) {
+    uint16_t freed = 0;
+
+    spinlock_lock(&g_vsock_transmit_lock);
+    int ret = cleanup_tq_locked(&freed);
     spinlock_unlock(&g_vsock_transmit_lock);
+
+    if (freed)
+        thread_wakeup_vsock(/*is_read=*/false);
+
     return ret;
 }
 
@@ -389,6 +482,8 @@ static int send_pending_tq_control_packets(void) {
 
     spinlock_lock(&g_vsock_transmit_lock);
 
+    uint16_t old_avail_idx = g_vsock->tq->cached_avail_idx;
+
     /* prefer to use this while loop instead of for loop to handle uint overflow */
     uint32_t end_idx = g_vsock->pending_tq_control_packets_idx
                            + g_vsock->pending_tq_control_packets_cnt;
@@ -405,7 +500,7 @@ static int send_pending_tq_control_packets(void) {
             goto out;
         }
 
-        copy_into_tq_internal(packet, packet_size, desc_idx);
+        tq_add_packet(&packet->header, packet->payload, desc_idx);
         free(packet);
 
         g_vsock->pending_tq_control_packets_idx++;
@@ -414,22 +509,82 @@ static int send_pending_tq_control_packets(void) {
 
     ret = 0;
 out:
+    tq_publish(old_avail_idx);
     spinlock_unlock(&g_vsock_transmit_lock);
     return ret;
 }
 
-bool virtio_vsock_can_write(void) {
+/* checks whether the TX queue has free descriptors; if not, remembers that a poller waits for them
+ * (the flag is set under the transmit lock, so notify_tq_wakeups() after descriptors are freed is
+ * guaranteed to see it) */
+static bool tq_has_space_for_poller(void) {
+    /* lockless fast path: a stale value can only result in a spurious write readiness */
+    if (__atomic_load_n(&g_vsock->tq->free_desc, __ATOMIC_RELAXED) != g_vsock->tq->queue_size)
+        return true;
+
     spinlock_lock(&g_vsock_transmit_lock);
-    bool can_write = (g_vsock && g_vsock->tq->free_desc != g_vsock->tq->queue_size);
+    bool has_space = g_vsock->tq->free_desc != g_vsock->tq->queue_size;
+    if (!has_space)
+        __atomic_store_n(&g_vsock_tq_full_polled, true, __ATOMIC_RELEASE);
     spinlock_unlock(&g_vsock_transmit_lock);
-    return can_write;
+    return has_space;
 }
 
-/* called from the bottomhalf thread in normal context (not interrupt context) */
-int virtio_vsock_bottomhalf(void) {
-    int handle_rq_ret = handle_rq_with_disabled_notifications();
-    int cleanup_tq_ret = cleanup_tq();
+/* checks whether the connection's send buffer has space; if not, remembers that the connection
+ * waits for it (see cleanup_tq_locked()) */
+static bool snd_buf_has_space(struct virtio_vsock_connection* conn) {
+    assert(spinlock_is_locked(&conn->lock));
+
+    /* lockless fast path: tx_queued only decreases without the connection lock */
+    if (__atomic_load_n(&conn->tx_queued, __ATOMIC_RELAXED) < conn->snd_buf_size)
+        return true;
+
+    spinlock_lock(&g_vsock_transmit_lock);
+    bool has_space = conn->tx_queued < conn->snd_buf_size;
+    if (!has_space)
+        conn->tx_waiting = true;
+    spinlock_unlock(&g_vsock_transmit_lock);
+    return has_space;
+}
+
+/* delivers the notifications queued by cleanup_tq_locked() to connections whose send buffers were
+ * drained, and to all writable connections if a poller found the TX queue full; must be called
+ * without any connection locked */
+static void notify_tq_wakeups(void) {
+    bool tq_has_space = false;
+    while (true) {
+        struct virtio_vsock_connection* conn = NULL;
+
+        spinlock_lock(&g_vsock_transmit_lock);
+        if (!LISTP_EMPTY(&g_vsock->tq_wakeup_conns)) {
+            conn = LISTP_FIRST_ENTRY(&g_vsock->tq_wakeup_conns, struct virtio_vsock_connection,
+                                     tq_wakeup_list);
+            LISTP_DEL_INIT(conn, &g_vsock->tq_wakeup_conns, tq_wakeup_list);
+        }
+        tq_has_space = g_vsock->tq->free_desc != g_vsock->tq->queue_size;
+        spinlock_unlock(&g_vsock_transmit_lock);
+
+        if (!conn)
+            break;
+
+        spinlock_lock(&conn->lock);
+        notify_connection(conn, update_poll_events(conn));
+        spinlock_unlock(&conn->lock);
+        put_connection(conn); /* reference moved from the TX descriptor, see cleanup_tq_locked() */
+    }
+
+    if (tq_has_space && __atomic_load_n(&g_vsock_tq_full_polled, __ATOMIC_ACQUIRE)
+            && __atomic_exchange_n(&g_vsock_tq_full_polled, false, __ATOMIC_ACQ_REL))
+        notify_all_connections();
+}
+
+/* called from the bottomhalves thread in normal context (not interrupt context); RX and TX bottom
+ * halves may run concurrently on different CPUs, they are serialized via receive/transmit locks */
+int virtio_vsock_bottomhalf(bool rx, bool tx) {
+    int handle_rq_ret = rx ? handle_rq_with_disabled_notifications() : 0;
+    int cleanup_tq_ret = tx ? cleanup_tq() : 0;
     int pending_tq_ret = send_pending_tq_control_packets();
+    notify_tq_wakeups();
     return handle_rq_ret ? handle_rq_ret : (cleanup_tq_ret ? cleanup_tq_ret : pending_tq_ret);
 }
 
@@ -451,24 +606,62 @@ static int enlarge_conns(uint32_t new_size) {
     return 0;
 }
 
-static struct virtio_vsock_connection* get_connection(uint32_t fd) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+static void get_connection_ref(struct virtio_vsock_connection* conn) {
+    __atomic_add_fetch(&conn->refcount, 1, __ATOMIC_RELAXED);
+}
 
-    if (fd >= g_vsock->conns_size)
-        return NULL;
+static void put_connection(struct virtio_vsock_connection* conn) {
+    uint32_t refcount = __atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL);
+    if (refcount)
+        return;
 
-    struct virtio_vsock_connection* conn = g_vsock->conns[fd];
-    if (!conn)
-        return NULL;
+    /* last reference: the connection was already detached and cleaned up in remove_connection() */
+    assert(conn->fd == UINT32_MAX);
+    assert(!conn->rx_buf);
+    free(conn->pending_conn_fds);
+    free(conn);
+}
+
+/* returns a new reference to the connection (or NULL), caller must put_connection() it */
+static struct virtio_vsock_connection* get_connection(uint32_t fd) {
+    struct virtio_vsock_connection* conn = NULL;
 
-    assert(conn->fd == fd);
+    spinlock_lock(&g_vsock_connections_lock);
+    if (fd < g_vsock->conns_size) {
+        conn = g_vsock->conns[fd];
+        if (conn) {
+            assert(conn->fd == fd);
+            get_connection_ref(conn);
+        }
+    }
+    spinlock_unlock(&g_vsock_connections_lock);
     return conn;
 }
 
+/* invokes readiness callbacks and wakes up pollers of all writable connections (used when the TX
+ * queue gets free space); must be called without any connection locked */
+static void notify_all_connections(void) {
+    spinlock_lock(&g_vsock_connections_lock);
+    uint32_t conns_size = g_vsock->conns_size;
+    spinlock_unlock(&g_vsock_connections_lock);
+
+    for (uint32_t fd = 0; fd < conns_size; fd++) {
+        struct virtio_vsock_connection* conn = get_connection(fd);
+        if (!conn)
+            continue;
+        spinlock_lock(&conn->lock);
+        if (conn->poll_events & PAL_WAIT_WRITE)
+            notify_connection(conn, PAL_WAIT_WRITE);
+        spinlock_unlock(&conn->lock);
+        put_connection(conn);
+    }
+}
+
 static int attach_connection(struct virtio_vsock_connection* conn) {
     assert(spinlock_is_locked(&g_vsock_connections_lock));
 
-    uint32_t idx = 0;
+    /* all fds below `conns_free_hint` are in use, start searching from there */
+    uint32_t idx = g_vsock->conns_free_hint;
     while (idx < g_vsock->conns_size) {
         if (!g_vsock->conns[idx]) {
             /* found unused idx */
@@ -488,152 +681,265 @@ static int attach_connection(struct virtio_vsock_connection* conn) {
 
     assert(idx < g_vsock->conns_size);
     g_vsock->conns[idx] = conn;
+    g_vsock->conns_free_hint = idx + 1;
     conn->fd = idx;
     return 0;
 }
 
-static void detach_connection(uint32_t fd) {
+static void detach_connection(struct virtio_vsock_connection* conn) {
     assert(spinlock_is_locked(&g_vsock_connections_lock));
 
-    struct virtio_vsock_connection* conn = get_connection(fd);
-    if (!conn)
+    if (conn->fd == UINT32_MAX)
         return;
 
-    g_vsock->conns[fd] = NULL;
+    assert(conn->fd < g_vsock->conns_size && g_vsock->conns[conn->fd] == conn);
+    g_vsock->conns[conn->fd] = NULL;
+    g_vsock->conns_free_hint = MIN(g_vsock->conns_free_hint, conn->fd);
     conn->fd = UINT32_MAX;
 }
 
-static void host_port_add(struct virtio_vsock_connection* conn) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
-    HASH_ADD(hh_host_port, g_vsock->conns_by_host_port, host_port, sizeof(conn->host_port), conn);
+/* vsock ports are 32-bit (see struct virtio_vsock_hdr), so the pair fits into one 64-bit key */
+static uint64_t ports_key(uint64_t host_port, uint64_t guest_port) {
+    return host_port << 32 | (guest_port & 0xFFFFFFFFUL);
 }
 
-static void host_port_delete(struct virtio_vsock_connection* conn) {
+/* Connected connections are hashed by (host port, guest port), listening connections by (0, guest
+ * port); connections accepted on a listening socket share its guest port, as in Linux. */
+static void ports_add(struct virtio_vsock_connection* conn) {
+    assert(spinlock_is_locked(&conn->lock));
     assert(spinlock_is_locked(&g_vsock_connections_lock));
-    HASH_DELETE(hh_host_port, g_vsock->conns_by_host_port, conn);
+    assert(!conn->hashed);
+
+    conn->ports_key = ports_key(conn->host_port, conn->guest_port);
+    HASH_ADD(hh_ports, g_vsock->conns_by_ports, ports_key, sizeof(conn->ports_key), conn);
+    conn->hashed = true;
 }
 
-static void host_port_find(uint64_t host_port, struct virtio_vsock_connection** out_conn) {
+static void ports_delete(struct virtio_vsock_connection* conn) {
+    assert(spinlock_is_locked(&conn->lock));
     assert(spinlock_is_locked(&g_vsock_connections_lock));
+
+    if (!conn->hashed)
+        return;
+
+    HASH_DELETE(hh_ports, g_vsock->conns_by_ports, conn);
+    conn->hashed = false;
+}
+
+/* returns a new reference to the connection (or NULL), caller must put_connection() it */
+static struct virtio_vsock_connection* ports_find(uint64_t host_port, uint64_t guest_port) {
     struct virtio_vsock_connection* conn = NULL;
-    HASH_FIND(hh_host_port, g_vsock->conns_by_host_port, &host_port, sizeof(host_port), conn);
-    *out_conn = conn;
+    uint64_t key = ports_key(host_port, guest_port);
+
+    spinlock_lock(&g_vsock_connections_lock);
+    HASH_FIND(hh_ports, g_vsock->conns_by_ports, &key, sizeof(key), conn);
+    if (conn)
+        get_connection_ref(conn);
+    spinlock_unlock(&g_vsock_connections_lock);
+    return conn;
 }
 
 /* TODO: Use a better scheme (e.g., a bitmap vector) to allow the reuse of the closed ports. */
 static uint64_t pick_new_port(void) {
     assert(spinlock_is_locked(&g_vsock_connections_lock));
-
-    uint64_t max_port = VSOCK_STARTING_PORT;
-    for (uint32_t i = 0; i < g_vsock->conns_size; i++) {
-        struct virtio_vsock_connection* conn = g_vsock->conns[i];
-        if (conn && conn->guest_port > max_port)
-            max_port = conn->guest_port;
-    }
-    return max_port + 1;
+    return ++g_vsock->max_port;
 }
 
+/* must be called with conn->lock held; the connection stays attached to its fd */
 static void cleanup_connection(struct virtio_vsock_connection* conn) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+    assert(spinlock_is_locked(&conn->lock));
 
-    while (conn->consumed_by_user != conn->prepared_for_user) {
-        free(conn->packets_for_user[conn->consumed_by_user % VSOCK_MAX_PACKETS]);
-        conn->consumed_by_user++;
-    }
+    /* drop all received-but-not-consumed data */
+    free(conn->rx_buf);
+    conn->rx_buf = NULL;
+    conn->rx_cnt = conn->fwd_cnt;
 
-    if (conn->host_port)
-        host_port_delete(conn);
+    spinlock_lock(&g_vsock_connections_lock);
+    ports_delete(conn);
     conn->host_port = 0;
     conn->guest_port = 0;
+    spinlock_unlock(&g_vsock_connections_lock);
 
     for (uint32_t i = 0; i < conn->pending_conn_fds_cnt; i++) {
-        /* there may be pending connections, and we clean up a connection that could accept them */
+        /* there may be pending connections, and we clean up a connection that could accept them;
+         * lock order is: listening connection -> its pending connections */
         uint32_t idx = (conn->pending_conn_fds_idx + i) % VSOCK_MAX_PENDING_CONNS;
         struct virtio_vsock_connection* pending_conn = get_connection(conn->pending_conn_fds[idx]);
-        if (pending_conn)
+        if (pending_conn) {
+            spinlock_lock(&pending_conn->lock);
             remove_connection(pending_conn);
+            spinlock_unlock(&pending_conn->lock);
+            put_connection(pending_conn);
+        }
     }
     conn->pending_conn_fds_idx = 0;
     conn->pending_conn_fds_cnt = 0;
     free(conn->pending_conn_fds);
+    conn->pending_conn_fds = NULL;
 
     conn->state_futex = 0; /* the value doesn't matter, set just for sanity */
     conn->state = VIRTIO_VSOCK_CLOSE;
     sched_thread_wakeup(&conn->state_futex);
+    update_poll_events(conn);
+    notify_connection(conn, SCHED_POLL_ALL_EVENTS);
 }
 
+/* returns a new connection attached to an fd (and hashed if `host_port` is non-zero) with a
+ * reference for the caller, who must put_connection() it */
 static struct virtio_vsock_connection* create_connection(uint64_t host_port, uint64_t guest_port,
                                                          enum virtio_vsock_state state) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
-
     struct virtio_vsock_connection* conn = calloc(1, sizeof(*conn));
     if (!conn)
         return NULL;
 
+    spinlock_init(&conn->lock);
+    conn->refcount = 2; /* one for the fd table, one for the caller */
+
     conn->state = state;
     conn->host_port  = host_port;
     conn->guest_port = guest_port;
 
     conn->fwd_cnt   = 0;
-    conn->buf_alloc = VSOCK_MAX_PACKETS * VSOCK_MAX_PAYLOAD_SIZE;
+    conn->buf_alloc = VSOCK_RX_BUF_SIZE;
+    conn->snd_buf_size = VSOCK_DEFAULT_SND_BUF_SIZE;
 
-    if (attach_connection(conn) < 0) {
+    /* the new connection is not yet visible to other threads, but ports_add() expects the lock */
+    spinlock_lock(&conn->lock);
+    update_poll_events(conn);
+    spinlock_lock(&g_vsock_connections_lock);
+    int ret = attach_connection(conn);
+    if (ret == 0 && host_port)
+        ports_add(conn);
+    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+
+    if (ret < 0) {
         free(conn);
         return NULL;
     }
-    if (host_port)
-        host_port_add(conn);
-
     return conn;
 }
 
+/* must be called with conn->lock held and with a reference held by the caller (which is dropped by
+ * the caller after unlocking) */
 static void remove_connection(struct virtio_vsock_connection* conn) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
-    detach_connection(conn->fd);
+    assert(spinlock_is_locked(&conn->lock));
+
     cleanup_connection(conn);
-    free(conn);
+
+    spinlock_lock(&g_vsock_connections_lock);
+    bool was_attached = conn->fd != UINT32_MAX;
+    detach_connection(conn);
+    spinlock_unlock(&g_vsock_connections_lock);
+
+    if (was_attached) {
+        /* drop the reference of the fd table; this is never the last one */
+        uint32_t refcount = __atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL);
+        assert(refcount);
+        __UNUSED(refcount);
+    }
+}
+
+static void fill_header(struct virtio_vsock_connection* conn, enum virtio_vsock_packet_op op,
+                        size_t payload_size, uint32_t flags, struct virtio_vsock_hdr* header) {
+    assert(spinlock_is_locked(&conn->lock));
+
+    assert(conn);
+    assert(payload_size <= VSOCK_MAX_PAYLOAD_SIZE);
+
+    header->dst_cid  = g_vsock->host_cid;
+    header->src_cid  = g_vsock->guest_cid;
+
+    header->dst_port = conn->host_port;
+    header->src_port = conn->guest_port;
+
+    header->type  = VIRTIO_VSOCK_TYPE_STREAM;
+    header->op    = op;
+    header->flags = flags;
+
+    /* every packet informs the host about our buffer space */
+    header->buf_alloc = conn->buf_alloc;
+    header->fwd_cnt   = conn->fwd_cnt;
+    conn->last_fwd_cnt = conn->fwd_cnt;
+
+    header->size = payload_size;
 }
 
 static struct virtio_vsock_packet* generate_packet(struct virtio_vsock_connection* conn,
                                                    enum virtio_vsock_packet_op op,
                                                    const char* payload, size_t payload_size,
                                                    uint32_t flags) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
-
-    assert(conn);
-    assert(payload_size <= VSOCK_MAX_PAYLOAD_SIZE);
+    assert(spinlock_is_locked(&conn->lock));
 
     struct virtio_vsock_packet* packet = malloc(sizeof(*packet));
     if (!packet)
         return NULL;
     memset(packet, 0, sizeof(*packet)); /* for sanity */
 
-    packet->header.dst_cid  = g_vsock->host_cid;
-    packet->header.src_cid  = g_vsock->guest_cid;
+    fill_header(conn, op, payload_size, flags, &packet->header);
+    memcpy(packet->payload, payload, payload_size);
 
-    packet->header.dst_port = conn->host_port;
-    packet->header.src_port = conn->guest_port;
+    return packet;
+}
 
-    packet->header.type  = VIRTIO_VSOCK_TYPE_STREAM;
-    packet->header.op    = op;
-    packet->header.flags = flags;
+/* bytes that may be sent to the host without overflowing its receive buffer for this connection;
+ * a malicious host may report bogus credit, but this can only stall this connection */
+static uint32_t peer_credit(struct virtio_vsock_connection* conn) {
+    uint32_t in_flight = conn->tx_cnt - conn->peer_fwd_cnt;
+    if (in_flight >= conn->peer_buf_alloc)
+        return 0;
+    return conn->peer_buf_alloc - in_flight;
+}
 
-    packet->header.buf_alloc = conn->buf_alloc;
-    packet->header.fwd_cnt   = conn->fwd_cnt;
+/* recomputes readiness of the connection, must be called after each change of its state, counters
+ * or credit; returns the events that were not set before */
+static uint32_t update_poll_events(struct virtio_vsock_connection* conn) {
+    assert(spinlock_is_locked(&conn->lock));
 
-    packet->header.size = payload_size;
-    memcpy(packet->payload, payload, payload_size);
+    uint32_t events = 0;
+    switch (conn->state) {
+        case VIRTIO_VSOCK_LISTEN:
+            if (conn->pending_conn_fds_cnt)
+                events |= PAL_WAIT_READ;
+            break;
+        case VIRTIO_VSOCK_CONNECT:
+            break;
+        case VIRTIO_VSOCK_ESTABLISHED:
+            if (conn->rx_cnt != conn->fwd_cnt)
+                events |= PAL_WAIT_READ;
+            /* writes on a shut down connection fail immediately, so they don't block */
+            if (conn->send_disallowed || (peer_credit(conn) && snd_buf_has_space(conn)))
+                events |= PAL_WAIT_WRITE;
+            break;
+        default:
+            /* CLOSE or CLOSING states -- connection is shutdown or in the process of closing */
+            events |= PAL_WAIT_ERROR;
+            break;
+    }
 
-    return packet;
+    uint32_t new_events = events & ~conn->poll_events;
+    conn->poll_events = events;
+    return new_events;
 }
 
-/* sends the RST response packet and frees the `in` packet */
-static int neglect_packet(struct virtio_vsock_packet* in) {
+/* invokes the readiness callback and wakes up pollers of the connection interested in `events` */
+static void notify_connection(struct virtio_vsock_connection* conn, uint32_t events) {
+    assert(spinlock_is_locked(&conn->lock));
+
+    if (!events)
+        return;
+    if (conn->notify)
+        conn->notify(conn->notify_arg);
+    sched_poll_wakeup(&conn->poll_queue, events);
+}
+
+/* sends the RST response packet to the sender of the `in` packet */
+static int neglect_packet(const struct virtio_vsock_hdr* in) {
     assert(spinlock_is_locked(&g_vsock_receive_lock));
 
     struct virtio_vsock_packet* packet = NULL;
 
-    if (in->header.op == VIRTIO_VSOCK_OP_RST)
+    if (in->op == VIRTIO_VSOCK_OP_RST)
         return 0;
 
     packet = malloc(sizeof(*packet));
@@ -642,12 +948,12 @@ static int neglect_packet(struct virtio_vsock_packet* in) {
 
     memset(packet, 0, sizeof(*packet)); /* for sanity */
 
-    packet->header.dst_cid  = in->header.src_cid;
-    packet->header.src_cid  = in->header.dst_cid;
-    packet->header.dst_port = in->header.src_port;
-    packet->header.src_port = in->header.dst_port;
+    packet->header.dst_cid  = in->src_cid;
+    packet->header.src_cid  = in->dst_cid;
+    packet->header.dst_port = in->src_port;
+    packet->header.src_port = in->dst_port;
 
-    packet->header.type  = in->header.type;
+    packet->header.type  = in->type;
     packet->header.op    = VIRTIO_VSOCK_OP_RST;
     packet->header.flags = 0;
 
@@ -662,7 +968,7 @@ static int neglect_packet(struct virtio_vsock_packet* in) {
 
 static int send_reset_packet(struct virtio_vsock_connection* conn) {
     assert(spinlock_is_locked(&g_vsock_receive_lock));
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+    assert(spinlock_is_locked(&conn->lock));
 
     struct virtio_vsock_packet* packet;
 
@@ -675,7 +981,7 @@ static int send_reset_packet(struct virtio_vsock_connection* conn) {
 }
 
 static int send_request_packet(struct virtio_vsock_connection* conn) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+    assert(spinlock_is_locked(&conn->lock));
 
     struct virtio_vsock_packet* packet;
 
@@ -689,7 +995,7 @@ static int send_request_packet(struct virtio_vsock_connection* conn) {
 
 static int send_response_packet(struct virtio_vsock_connection* conn) {
     assert(spinlock_is_locked(&g_vsock_receive_lock));
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+    assert(spinlock_is_locked(&conn->lock));
 
     struct virtio_vsock_packet* packet;
 
@@ -702,8 +1008,7 @@ static int send_response_packet(struct virtio_vsock_connection* conn) {
 }
 
 static int send_credit_update_packet(struct virtio_vsock_connection* conn) {
-    assert(spinlock_is_locked(&g_vsock_receive_lock));
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+    assert(spinlock_is_locked(&conn->lock));
 
     struct virtio_vsock_packet* packet;
 
@@ -719,7 +1024,7 @@ static int send_credit_update_packet(struct virtio_vsock_connection* conn) {
 
 static int send_shutdown_packet(struct virtio_vsock_connection* conn,
                                 enum virtio_vsock_shutdown flags) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+    assert(spinlock_is_locked(&conn->lock));
 
     struct virtio_vsock_packet* packet;
 
@@ -731,61 +1036,140 @@ static int send_shutdown_packet(struct virtio_vsock_connection* conn,
     return copy_into_tq_or_add_to_pending(packet);
 }
 
-static int send_rw_packet(struct virtio_vsock_connection* conn, const char* payload,
-                          size_t payload_size) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+/* Sends as much of `buf` as allowed by the host's credit, by the send buffer and by free TX
+ * descriptors, as a burst of RW packets with a single device notification. Payload is copied
+ * directly into the shared TX buffer. Returns the number of bytes sent (zero if the caller must
+ * wait) or a negative error. */
+static long send_rw_packets(struct virtio_vsock_connection* conn, const char* buf, size_t count) {
+    assert(spinlock_is_locked(&conn->lock));
+
+    int ret = 0;
+    uint32_t credit = peer_credit(conn);
+    if (!credit) {
+        /* process_packet() wakes us up once the host reports that it consumed some data (the
+         * connection becomes writable again, see update_poll_events()) */
+        return 0;
+    }
+    count = MIN(count, (size_t)credit);
 
-    struct virtio_vsock_packet* packet;
+    size_t sent = 0;
+    uint16_t freed = 0;
 
-    /* payload is memcpy'd into the generated packet, so payload may be freed later */
-    packet = generate_packet(conn, VIRTIO_VSOCK_OP_RW, payload, payload_size, /*flags=*/0);
-    if (!packet)
-        return -PAL_ERROR_NOMEM;
+    spinlock_lock(&g_vsock_transmit_lock);
+    uint16_t old_avail_idx = g_vsock->tq->cached_avail_idx;
+
+    while (sent < count) {
+        if (conn->tx_queued >= conn->snd_buf_size) {
+            /* send buffer is full; we are woken up once the device consumes our packets */
+            conn->tx_waiting = true;
+            break;
+        }
+
+        size_t payload_size = MIN(count - sent, VSOCK_MAX_PAYLOAD_SIZE);
+        uint64_t packet_size = sizeof(struct virtio_vsock_hdr) + payload_size;
+
+        uint16_t desc_idx;
+        ret = virtq_alloc_desc(g_vsock->tq, /*addr=*/NULL, packet_size, /*flags=*/0, &desc_idx);
+        if (ret == -PAL_ERROR_NOMEM) {
+            /* if TQ buffer is full, drain TQ and try again */
+            uint16_t freed_now;
+            ret = reclaim_tq_locked(&freed_now);
+            if (ret < 0 || !freed_now)
+                break;
+            freed += freed_now;
+            continue;
+        }
+        if (ret < 0)
+            break;
+
+        struct virtio_vsock_hdr header;
+        fill_header(conn, VIRTIO_VSOCK_OP_RW, payload_size, /*flags=*/0, &header);
+        tq_add_packet(&header, buf + sent, desc_idx);
+
+        get_connection_ref(conn);
+        g_vsock->tq_owners[desc_idx].conn = conn;
+        g_vsock->tq_owners[desc_idx].size = payload_size;
+        conn->tx_queued += payload_size;
+
+        conn->tx_cnt += payload_size;
+        sent += payload_size;
+    }
+
+    tq_publish(old_avail_idx);
+
+    if (ret >= 0 && g_vsock->tq->free_desc == g_vsock->tq->queue_size) {
+        /* the burst used up the last free descriptor: make sure that TQ is drained eventually, so
+         * that pollers waiting for write readiness are woken up */
+        uint16_t freed_now;
+        ret = reclaim_tq_locked(&freed_now);
+        freed += freed_now;
+    }
+
+    spinlock_unlock(&g_vsock_transmit_lock);
+
+    if (freed)
+        thread_wakeup_vsock(/*is_read=*/false);
 
-    return copy_into_tq_and_free(packet);
+    if (sent)
+        return (long)sent;
+    return ret;
 }
 
-/* takes ownership of the packet */
-static int recv_rw_packet(struct virtio_vsock_connection* conn,
-                          struct virtio_vsock_packet* packet) {
+/* copies the payload from the shared RX buffer into the connection's receive ring (at most one copy
+ * per received byte; the host must respect the credit we advertised, see buf_alloc) */
+static int recv_rw_packet(struct virtio_vsock_connection* conn, const struct virtio_vsock_hdr* header,
+                          const uint8_t* shared_payload) {
     assert(spinlock_is_locked(&g_vsock_receive_lock));
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+    assert(spinlock_is_locked(&conn->lock));
 
-    uint32_t in_flight_packets_cnt = conn->prepared_for_user - conn->consumed_by_user;
-    if (in_flight_packets_cnt >= VSOCK_MAX_PACKETS) {
-        log_warning("RX vsock queue is full, dropping incoming RW packet (payload size %u)",
-                     packet->header.size);
+    uint32_t size = header->size;
+    uint32_t used = conn->rx_cnt - conn->fwd_cnt;
+    if (size > VSOCK_RX_BUF_SIZE - used) {
+        log_warning("RX vsock buffer is full, dropping incoming RW packet (payload size %u)", size);
         return -PAL_ERROR_NOMEM;
     }
 
-    uint32_t idx = conn->prepared_for_user % VSOCK_MAX_PACKETS;
-    conn->packets_for_user[idx] = packet; /* packet is now owned by conn */
-    conn->prepared_for_user++;
+    if (!size)
+        return 0;
+
+    if (!conn->rx_buf) {
+        /* allocated lazily: listening and never-receiving connections don't need the ring */
+        conn->rx_buf = malloc(VSOCK_RX_BUF_SIZE);
+        if (!conn->rx_buf)
+            return -PAL_ERROR_NOMEM;
+    }
+
+    uint32_t off = conn->rx_cnt % VSOCK_RX_BUF_SIZE;
+    uint32_t first = MIN(size, VSOCK_RX_BUF_SIZE - off);
+    vm_shared_memcpy(conn->rx_buf + off, shared_payload, first);
+    if (first < size)
+        vm_shared_memcpy(conn->rx_buf, shared_payload + first, size - first);
+    conn->rx_cnt += size;
 
-    conn->fwd_cnt += packet->header.size;
+    /* fwd_cnt is advanced only when the app consumes the payload, see virtio_vsock_readv() */
     return 0;
 }
 
-static int verify_packet(struct virtio_vsock_packet* packet) {
+static int verify_packet(const struct virtio_vsock_hdr* header) {
     assert(spinlock_is_locked(&g_vsock_receive_lock));
 
-    if (packet->header.size > VSOCK_MAX_PAYLOAD_SIZE) {
-        log_error("malicious size of packet (%u)", packet->header.size);
+    if (header->size > VSOCK_MAX_PAYLOAD_SIZE) {
+        log_error("malicious size of packet (%u)", header->size);
         return -PAL_ERROR_DENIED;
     }
 
-    if (packet->header.type != VIRTIO_VSOCK_TYPE_STREAM) {
+    if (header->type != VIRTIO_VSOCK_TYPE_STREAM) {
         log_error("only stream type packets are supported in vsock");
         return -PAL_ERROR_NOTSUPPORT;
     }
 
-    if (packet->header.op == VIRTIO_VSOCK_OP_INVALID || packet->header.op >= VIRTIO_VSOCK_OP_MAX) {
-        log_error("wrong operation (%d) on vsock packet is received", packet->header.op);
+    if (header->op == VIRTIO_VSOCK_OP_INVALID || header->op >= VIRTIO_VSOCK_OP_MAX) {
+        log_error("wrong operation (%d) on vsock packet is received", header->op);
         return -PAL_ERROR_NOTSUPPORT;
     }
 
-    if (packet->header.dst_cid != g_vsock->guest_cid ||
-            packet->header.src_cid != g_vsock->host_cid) {
+    if (header->dst_cid != g_vsock->guest_cid ||
+            header->src_cid != g_vsock->host_cid) {
         log_error("vsock packet guest/host CIDs do not match guest/host");
         return -PAL_ERROR_INVAL;
     }
@@ -793,54 +1177,57 @@ static int verify_packet(struct virtio_vsock_packet* packet) {
     return 0;
 }
 
-/* takes ownership of the packet and frees it in the end */
-static int process_packet(struct virtio_vsock_packet* packet) {
+/* `header` is in private memory (already copied), `shared_payload` points into the shared RX buffer */
+static int process_packet(const struct virtio_vsock_hdr* header, const uint8_t* shared_payload) {
     assert(spinlock_is_locked(&g_vsock_receive_lock));
 
     int ret;
 
-    ret = verify_packet(packet);
+    ret = verify_packet(header);
     if (ret < 0) {
-        neglect_packet(packet);
-        free(packet);
+        neglect_packet(header);
         return ret;
     }
 
-    bool packet_ownership_transferred = false;
+    bool wakeup_writers = false;
     struct virtio_vsock_connection* conn = NULL;
-
-    spinlock_lock(&g_vsock_connections_lock);
+    uint32_t events;
 
     /* guest and host CIDs are set in stone, so it is enough to distinguish connections based on the
-     * host's port (which is the `src_port` in the incoming packet) */
-    uint64_t host_port = packet->header.src_port;
-    host_port_find(host_port, &conn);
-
-    if (!conn && packet->header.op == VIRTIO_VSOCK_OP_REQUEST) {
-        /* loop through all connections, trying to find a listening conn on this port; this is a
-         * slow O(n) implementation but such ops should be rare */
-        for (uint32_t i = 0; i < g_vsock->conns_size; i++) {
-            struct virtio_vsock_connection* check_conn = g_vsock->conns[i];
-            if (check_conn && check_conn->state == VIRTIO_VSOCK_LISTEN
-                    && check_conn->guest_port == packet->header.dst_port) {
-                conn = check_conn;
-                break;
-            }
-        }
+     * host's port and the guest's port (which are `src_port` and `dst_port` in the incoming packet);
+     * a connection request goes to the listening connection, hashed with a zero host port */
+    uint64_t host_port = header->src_port;
+    uint64_t guest_port = header->dst_port;
+    conn = ports_find(host_port, guest_port);
+    if (!conn && header->op == VIRTIO_VSOCK_OP_REQUEST) {
+        host_port = 0;
+        conn = ports_find(host_port, guest_port);
     }
 
     if (!conn) {
+        ret = -PAL_ERROR_INVAL;
+        goto out_no_conn;
+    }
+
+    spinlock_lock(&conn->lock);
+
+    if (!conn->hashed || conn->ports_key != ports_key(host_port, guest_port)) {
+        /* connection was closed (and maybe reused) between lookup and locking */
         ret = -PAL_ERROR_INVAL;
         goto out;
     }
 
-    conn->peer_fwd_cnt   = packet->header.fwd_cnt;
-    conn->peer_buf_alloc = packet->header.buf_alloc;
+    if (conn->state != VIRTIO_VSOCK_LISTEN) {
+        /* buffer-space info of a REQUEST packet describes the new connection, not the listening one
+         * (see below) */
+        conn->peer_fwd_cnt   = header->fwd_cnt;
+        conn->peer_buf_alloc = header->buf_alloc;
+    }
 
     switch (conn->state) {
         case VIRTIO_VSOCK_LISTEN:
-            if (packet->header.op != VIRTIO_VSOCK_OP_REQUEST) {
-                if (packet->header.op == VIRTIO_VSOCK_OP_RST)
+            if (header->op != VIRTIO_VSOCK_OP_REQUEST) {
+                if (header->op == VIRTIO_VSOCK_OP_RST)
                     cleanup_connection(conn);
                 ret = -PAL_ERROR_DENIED;
                 goto out;
@@ -850,30 +1237,40 @@ static int process_packet(struct virtio_vsock_packet* packet) {
                 ret = -PAL_ERROR_OVERFLOW;
                 goto out;
             }
-            /* create new connection */
-            struct virtio_vsock_connection* new_conn = create_connection(packet->header.src_port,
-                                                                         pick_new_port(),
+            /* create new connection (on the same guest port, like Linux does, so that the host
+             * keeps addressing it via the port it connected to); lock order is: listening
+             * connection -> new connection */
+            struct virtio_vsock_connection* new_conn = create_connection(header->src_port,
+                                                                         conn->guest_port,
                                                                          VIRTIO_VSOCK_ESTABLISHED);
             if (!new_conn) {
                 log_error("no memory for new connection");
                 ret = -PAL_ERROR_NOMEM;
                 goto out;
             }
+            spinlock_lock(&new_conn->lock);
+            new_conn->peer_fwd_cnt   = header->fwd_cnt;
+            new_conn->peer_buf_alloc = header->buf_alloc;
+            update_poll_events(new_conn);
             ret = send_response_packet(new_conn);
             if (ret < 0) {
                 remove_connection(new_conn);
+                spinlock_unlock(&new_conn->lock);
+                put_connection(new_conn);
                 goto out;
             }
             /* unblock accept() syscall */
             uint32_t idx = conn->pending_conn_fds_idx + conn->pending_conn_fds_cnt;
             conn->pending_conn_fds[idx % VSOCK_MAX_PENDING_CONNS] = new_conn->fd;
             conn->pending_conn_fds_cnt++;
+            spinlock_unlock(&new_conn->lock);
+            put_connection(new_conn);
             ret = 0;
             goto out;
 
         case VIRTIO_VSOCK_CONNECT:
-            if (packet->header.op != VIRTIO_VSOCK_OP_RESPONSE) {
-                if (packet->header.op == VIRTIO_VSOCK_OP_RST)
+            if (header->op != VIRTIO_VSOCK_OP_RESPONSE) {
+                if (header->op == VIRTIO_VSOCK_OP_RST)
                     cleanup_connection(conn);
                 ret = -PAL_ERROR_DENIED;
                 goto out;
@@ -884,14 +1281,13 @@ static int process_packet(struct virtio_vsock_packet* packet) {
             goto out;
 
         case VIRTIO_VSOCK_ESTABLISHED:
-            switch (packet->header.op) {
+            switch (header->op) {
                 case VIRTIO_VSOCK_OP_RW:
                     if (conn->recv_disallowed) {
                         /* we were instructed to not receive more packets, silently drop packet */
                         ret = 0;
                     } else {
-                        ret = recv_rw_packet(conn, packet);
-                        packet_ownership_transferred = ret < 0 ? false : true;
+                        ret = recv_rw_packet(conn, header, shared_payload);
                     }
                     goto out;
                 case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
@@ -902,12 +1298,12 @@ static int process_packet(struct virtio_vsock_packet* packet) {
                     ret = 0;
                     goto out;
                 case VIRTIO_VSOCK_OP_SHUTDOWN:
-                    if (packet->header.flags == VIRTIO_VSOCK_SHUTDOWN_RCV
-                            || packet->header.flags == VIRTIO_VSOCK_SHUTDOWN_COMPLETE) {
+                    if (header->flags == VIRTIO_VSOCK_SHUTDOWN_RCV
+                            || header->flags == VIRTIO_VSOCK_SHUTDOWN_COMPLETE) {
                         conn->send_disallowed = true;
                     }
-                    if (packet->header.flags == VIRTIO_VSOCK_SHUTDOWN_SEND
-                            || packet->header.flags == VIRTIO_VSOCK_SHUTDOWN_COMPLETE) {
+                    if (header->flags == VIRTIO_VSOCK_SHUTDOWN_SEND
+                            || header->flags == VIRTIO_VSOCK_SHUTDOWN_COMPLETE) {
                         conn->recv_disallowed = true;
                     }
                     if (conn->recv_disallowed && conn->send_disallowed) {
@@ -930,7 +1326,7 @@ static int process_packet(struct virtio_vsock_packet* packet) {
             }
 
         case VIRTIO_VSOCK_CLOSING:
-            if (packet->header.op == VIRTIO_VSOCK_OP_RST) {
+            if (header->op == VIRTIO_VSOCK_OP_RST) {
                 /* we initiated full shutdown, wait for RST and ignore all other packets */
                 cleanup_connection(conn); /* moves to CLOSE state */
             }
@@ -944,11 +1340,22 @@ static int process_packet(struct virtio_vsock_packet* packet) {
     }
 
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
-    if (ret < 0 && packet->header.op != VIRTIO_VSOCK_OP_RST)
-        neglect_packet(packet);
-    if (!packet_ownership_transferred)
-        free(packet);
+    events = update_poll_events(conn);
+    if (ret == 0 && (header->op == VIRTIO_VSOCK_OP_RW || header->op == VIRTIO_VSOCK_OP_REQUEST)) {
+        /* new data or a new pending connection is an event even on an already readable connection
+         * (e.g. for edge-triggered epoll) */
+        events |= conn->poll_events & PAL_WAIT_READ;
+    }
+    notify_connection(conn, events);
+    if (events & PAL_WAIT_WRITE)
+        wakeup_writers = true;
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
+out_no_conn:
+    if (wakeup_writers)
+        thread_wakeup_vsock(/*is_read=*/false);
+    if (ret < 0 && header->op != VIRTIO_VSOCK_OP_RST)
+        neglect_packet(header);
     return ret;
 }
 
@@ -962,7 +1369,12 @@ static int virtio_vsock_negotiate_features(struct virtio_vsock* vsock) {
     vm_mmio_writel(&pci_regs->device_feature_select, 0);
     advertised_features = vm_mmio_readl(&pci_regs->device_feature);
 
-    (void)advertised_features; /* currently no feature bits for vsock device */
+    if (advertised_features & (1U << VIRTIO_F_EVENT_IDX)) {
+        understood_features |= 1U << VIRTIO_F_EVENT_IDX;
+        vsock->rq->event_idx = true;
+        vsock->tq->event_idx = true;
+        vsock->eq->event_idx = true;
+    }
 
     vm_mmio_writel(&pci_regs->driver_feature_select, 0);
     vm_mmio_writel(&pci_regs->driver_feature, understood_features);
@@ -1015,11 +1427,6 @@ static int virtio_vsock_alloc(struct virtio_vsock** out_vsock) {
     if (ret < 0)
         goto fail;
 
-    /* instruct the host to NOT send interrupts on TX upon consuming messages; the guest performs TX
-     * cleanup itself on demand, see `cleanup_tq()` usage */
-    vm_shared_writew(&tq->avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT);
-    vm_shared_writew(&eq->avail->flags, VIRTQ_AVAIL_F_NO_INTERRUPT); /* for sanity */
-
     vsock->rq = rq;
     vsock->tq = tq;
     vsock->eq = eq;
@@ -1042,6 +1449,13 @@ static int virtio_vsock_alloc(struct virtio_vsock** out_vsock) {
     rq->cached_avail_idx = VIRTIO_VSOCK_QUEUE_SIZE;
     vm_shared_writew(&rq->avail->idx, rq->cached_avail_idx);
 
+    vsock->tq_owners = calloc(VIRTIO_VSOCK_QUEUE_SIZE, sizeof(*vsock->tq_owners));
+    if (!vsock->tq_owners) {
+        ret = -PAL_ERROR_NOMEM;
+        goto fail;
+    }
+    INIT_LISTP(&vsock->tq_wakeup_conns);
+
     vsock->shared_rq_buf = shared_rq_buf;
     vsock->shared_tq_buf = shared_tq_buf;
     vsock->rq = rq;
@@ -1056,6 +1470,7 @@ fail:
     virtq_free(rq, VIRTIO_VSOCK_QUEUE_SIZE);
     virtq_free(tq, VIRTIO_VSOCK_QUEUE_SIZE);
     virtq_free(eq, VIRTIO_VSOCK_EVENT_QUEUE_SIZE);
+    free(vsock->tq_owners);
     free(vsock);
     return ret;
 }
@@ -1066,13 +1481,14 @@ static int virtio_vsock_free(struct virtio_vsock* vsock) {
     virtq_free(vsock->rq, VIRTIO_VSOCK_QUEUE_SIZE);
     virtq_free(vsock->tq, VIRTIO_VSOCK_QUEUE_SIZE);
     virtq_free(vsock->eq, VIRTIO_VSOCK_EVENT_QUEUE_SIZE);
+    free(vsock->tq_owners);
     free(vsock);
     return 0;
 }
 
 int virtio_vsock_init(struct virtio_pci_regs* pci_regs, struct virtio_vsock_config* pci_config,
                       uint64_t notify_off_addr, uint32_t notify_off_multiplier,
-                      uint32_t* interrupt_status_reg) {
+                      uint32_t* interrupt_status_reg, struct pci_msix* msix) {
     int ret;
     uint32_t status;
 
@@ -1114,15 +1530,37 @@ int virtio_vsock_init(struct virtio_pci_regs* pci_regs, struct virtio_vsock_conf
         goto fail;
     }
 
-    ret = virtq_add_to_device(pci_regs, vsock->rq, /*queue_sel=*/0);
+    if (msix) {
+        /* RX and TX queues get separate MSI-X vectors, so that they can be steered to different
+         * vCPUs (see `tdx.irq_affinity` manifest option); event queue and config changes are not
+         * used and get no interrupts */
+        vm_mmio_writew(&pci_regs->config_msix_vector, VIRTIO_MSI_NO_VECTOR);
+        ret = pci_msix_set_vector(msix, /*entry=*/0, MSIX_VECTOR_VSOCK_RQ);
+        if (ret < 0)
+            goto fail;
+        ret = pci_msix_set_vector(msix, /*entry=*/1, MSIX_VECTOR_VSOCK_TQ);
+        if (ret < 0)
+            goto fail;
+        vsock->msix = true;
+    }
+
+    /* instruct the host to NOT send interrupts on TX upon consuming messages; the guest performs TX
+     * cleanup itself on demand and arms TX interrupts only when TX is full, see `cleanup_tq()` and
+     * `reclaim_tq_locked()` usage */
+    virtq_disable_interrupts(vsock->tq);
+    virtq_disable_interrupts(vsock->eq); /* for sanity */
+
+    ret = virtq_add_to_device(pci_regs, vsock->rq, /*queue_sel=*/0,
+                              vsock->msix ? 0 : VIRTIO_MSI_NO_VECTOR);
     if (ret < 0)
         goto fail;
 
-    ret = virtq_add_to_device(pci_regs, vsock->tq, /*queue_sel=*/1);
+    ret = virtq_add_to_device(pci_regs, vsock->tq, /*queue_sel=*/1,
+                              vsock->msix ? 1 : VIRTIO_MSI_NO_VECTOR);
     if (ret < 0)
         goto fail;
 
-    ret = virtq_add_to_device(pci_regs, vsock->eq, /*queue_sel=*/2);
+    ret = virtq_add_to_device(pci_regs, vsock->eq, /*queue_sel=*/2, VIRTIO_MSI_NO_VECTOR);
     if (ret < 0)
         goto fail;
 
@@ -1170,7 +1608,9 @@ int virtio_vsock_init(struct virtio_pci_regs* pci_regs, struct virtio_vsock_conf
     vsock->pending_tq_control_packets_cnt = 0;
     vsock->pending_tq_control_packets_idx = 0;
 
-    vsock->conns_by_host_port = NULL;
+    vsock->conns_free_hint = 0;
+    vsock->conns_by_ports = NULL;
+    vsock->max_port = VSOCK_STARTING_PORT;
 
     g_vsock = vsock;
     return 0;
@@ -1196,17 +1636,14 @@ int virtio_vsock_socket(int domain, int type, int protocol) {
     if (protocol != 0)
         return -PAL_ERROR_NOTSUPPORT;
 
-    spinlock_lock(&g_vsock_connections_lock);
     struct virtio_vsock_connection* conn = create_connection(/*host_port=*/0, /*guest_port=*/0,
                                                              VIRTIO_VSOCK_CLOSE);
     if (!conn) {
         log_error("no memory for new connection");
-        ret = -PAL_ERROR_NOMEM;
-        goto out;
+        return -PAL_ERROR_NOMEM;
     }
     ret = conn->fd;
-out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    put_connection(conn);
     return ret;
 }
 
@@ -1220,13 +1657,11 @@ int virtio_vsock_bind(int sockfd, const void* addr, size_t addrlen, uint16_t* ou
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     if (conn->state != VIRTIO_VSOCK_CLOSE || conn->guest_port != 0) {
         ret = -PAL_ERROR_INVAL;
@@ -1239,15 +1674,20 @@ int virtio_vsock_bind(int sockfd, const void* addr, size_t addrlen, uint16_t* ou
         goto out;
     }
 
+    /* ports and bind-related flags of all connections are modified under the connections lock too,
+     * so we can inspect other connections without taking their locks */
+    spinlock_lock(&g_vsock_connections_lock);
+
     uint32_t bind_to_port = addr_vm->svm_port;
     if (bind_to_port == 0) {
         bind_to_port = pick_new_port();
     } else {
         /* loop through all connections, checking whether the port-to-bind is already occupied; this
-         * is a slow O(n) implementation but such ops should be rare */
+         * is a slow O(n) implementation but such ops should be rare; connected sockets (including
+         * the ones accepted on a listening socket) do not occupy the port */
         for (uint32_t i = 0; i < g_vsock->conns_size; i++) {
             struct virtio_vsock_connection* check_conn = g_vsock->conns[i];
-            if (!check_conn || check_conn->guest_port != bind_to_port)
+            if (!check_conn || check_conn->guest_port != bind_to_port || check_conn->host_port)
                 continue;
 
             if (is_ipv4 && check_conn->ipv6_bound && check_conn->ipv6_v6only) {
@@ -1264,9 +1704,12 @@ int virtio_vsock_bind(int sockfd, const void* addr, size_t addrlen, uint16_t* ou
                 continue;
             }
 
+            spinlock_unlock(&g_vsock_connections_lock);
             ret = -PAL_ERROR_STREAMEXIST;
             goto out;
         }
+        /* new ports are picked above all explicitly bound ones */
+        g_vsock->max_port = MAX(g_vsock->max_port, (uint64_t)bind_to_port);
     }
 
     if (out_new_port)
@@ -1285,9 +1728,12 @@ int virtio_vsock_bind(int sockfd, const void* addr, size_t addrlen, uint16_t* ou
     }
     conn->reuseport = reuseport;
 
+    spinlock_unlock(&g_vsock_connections_lock);
+
     ret = 0;
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
     return ret;
 }
 
@@ -1298,13 +1744,11 @@ int virtio_vsock_listen(int sockfd, int backlog) {
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     if (conn->state != VIRTIO_VSOCK_CLOSE) {
         ret = -PAL_ERROR_STREAMEXIST;
@@ -1327,10 +1771,17 @@ int virtio_vsock_listen(int sockfd, int backlog) {
     conn->pending_conn_fds = pending_conn_fds;
     conn->pending_conn_fds_cnt = 0;
     conn->pending_conn_fds_idx = 0;
+    update_poll_events(conn);
+
+    /* from now on, incoming connection requests find this connection */
+    spinlock_lock(&g_vsock_connections_lock);
+    ports_add(conn);
+    spinlock_unlock(&g_vsock_connections_lock);
 
     ret = 0;
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
     return ret;
 }
 
@@ -1343,13 +1794,11 @@ int virtio_vsock_accept(int sockfd, void* addr, size_t* addrlen) {
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     if (conn->state != VIRTIO_VSOCK_LISTEN) {
         ret = -PAL_ERROR_INVAL;
@@ -1370,19 +1819,27 @@ int virtio_vsock_accept(int sockfd, void* addr, size_t* addrlen) {
         goto out;
     }
 
+    /* lock order is: listening connection -> its pending connections */
+    spinlock_lock(&accepted_conn->lock);
+    uint64_t accepted_host_port = accepted_conn->host_port;
+    spinlock_unlock(&accepted_conn->lock);
+    put_connection(accepted_conn);
+
     *addrlen = sizeof(struct sockaddr_vm);
     struct sockaddr_vm* addr_vm = (struct sockaddr_vm*)addr;
     addr_vm->svm_family = AF_VSOCK;
     addr_vm->svm_reserved1 = 0;
     addr_vm->svm_cid = g_vsock->host_cid;
-    addr_vm->svm_port = accepted_conn->host_port;
+    addr_vm->svm_port = accepted_host_port;
 
     conn->pending_conn_fds_idx++;
     conn->pending_conn_fds_cnt--;
+    update_poll_events(conn);
 
     ret = accepted_conn_fd;
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
     return ret;
 }
 
@@ -1401,13 +1858,11 @@ int virtio_vsock_connect(int sockfd, const void* addr, size_t addrlen, uint64_t
     if (timeout_us == 0)
         return -PAL_ERROR_INVAL;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     if (conn->state != VIRTIO_VSOCK_CLOSE) {
         ret = -PAL_ERROR_STREAMEXIST;
@@ -1425,15 +1880,18 @@ int virtio_vsock_connect(int sockfd, const void* addr, size_t addrlen, uint64_t
         goto out;
 
     assert(conn->host_port == 0 && conn->guest_port == 0);
+    spinlock_lock(&g_vsock_connections_lock);
     conn->host_port  = addr_vm->svm_port;
     conn->guest_port = pick_new_port();
-    host_port_add(conn);
+    ports_add(conn);
+    spinlock_unlock(&g_vsock_connections_lock);
 
     ret = send_request_packet(conn);
     if (ret < 0)
         goto out;
 
     conn->state = VIRTIO_VSOCK_CONNECT;
+    update_poll_events(conn);
 
     while (conn->state != VIRTIO_VSOCK_ESTABLISHED) {
         if (conn->state != VIRTIO_VSOCK_CONNECT) {
@@ -1455,12 +1913,14 @@ int virtio_vsock_connect(int sockfd, const void* addr, size_t addrlen, uint64_t
         }
 
         /* connection state not changed to ESTABLISHED, need to sleep */
-        sched_thread_wait(&conn->state_futex, &g_vsock_connections_lock);
+        sched_thread_wait(&conn->state_futex, &conn->lock);
     }
 
     ret = 0;
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
+    notify_tq_wakeups();
     if (timeout)
         deregister_timeout(timeout);
     return ret;
@@ -1475,13 +1935,11 @@ int virtio_vsock_getsockname(int sockfd, const void* addr, size_t* addrlen) {
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     if (conn->state == VIRTIO_VSOCK_CLOSE) {
         ret = -PAL_ERROR_BADHANDLE;
@@ -1497,7 +1955,8 @@ int virtio_vsock_getsockname(int sockfd, const void* addr, size_t* addrlen) {
 
     ret = 0;
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
     return ret;
 }
 
@@ -1505,34 +1964,123 @@ int virtio_vsock_set_socket_options(int sockfd, bool ipv6_v6only, bool reuseport
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
+    struct virtio_vsock_connection* conn = get_connection(sockfd);
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    /* bind-related flags are modified under both locks, see virtio_vsock_bind() */
+    spinlock_lock(&conn->lock);
     spinlock_lock(&g_vsock_connections_lock);
+    conn->ipv6_v6only = ipv6_v6only;
+    conn->reuseport = reuseport;
+    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+
+    put_connection(conn);
+    return 0;
+}
+
+int virtio_vsock_set_notify(int sockfd, void (*notify)(void* arg), void* arg) {
+    if (sockfd < 0)
+        return -PAL_ERROR_BADHANDLE;
 
     struct virtio_vsock_connection* conn = get_connection(sockfd);
     if (!conn) {
-        spinlock_unlock(&g_vsock_connections_lock);
+        /* uninstalling from a closed connection trivially succeeds, nothing can invoke it */
+        return notify ? -PAL_ERROR_BADHANDLE : 0;
+    }
+
+    spinlock_lock(&conn->lock);
+    conn->notify = notify;
+    conn->notify_arg = notify ? arg : NULL;
+    spinlock_unlock(&conn->lock);
+
+    put_connection(conn);
+    return 0;
+}
+
+int virtio_vsock_set_send_buf_size(int sockfd, size_t size) {
+    if (sockfd < 0)
+        return -PAL_ERROR_BADHANDLE;
+
+    struct virtio_vsock_connection* conn = get_connection(sockfd);
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
+    /* also read by cleanup_tq_locked() without the connection lock */
+    __atomic_store_n(&conn->snd_buf_size,
+                     MAX(MIN(size, (size_t)UINT32_MAX), (size_t)VSOCK_MIN_SND_BUF_SIZE),
+                     __ATOMIC_RELAXED);
+    uint32_t events = update_poll_events(conn);
+    notify_connection(conn, events);
+    spinlock_unlock(&conn->lock);
+
+    if (events & PAL_WAIT_WRITE)
+        thread_wakeup_vsock(/*is_read=*/false);
+
+    put_connection(conn);
+    return 0;
+}
+
+int virtio_vsock_poll(int sockfd, uint32_t events, struct sched_poll_entry* entry,
+                      uint32_t* out_events) {
+    if (sockfd < 0)
+        return -PAL_ERROR_BADHANDLE;
+
+    struct virtio_vsock_connection* conn = get_connection(sockfd);
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    if (entry && entry->queue && entry->queue != &conn->poll_queue) {
+        /* fd was closed and reused during the poll; the old connection already woke us up */
+        put_connection(conn);
         return -PAL_ERROR_BADHANDLE;
     }
 
-    conn->ipv6_v6only = ipv6_v6only;
-    conn->reuseport = reuseport;
+    spinlock_lock(&conn->lock);
+    uint32_t revents = conn->poll_events & (events | PAL_WAIT_ERROR);
+    if ((revents & PAL_WAIT_WRITE) && !tq_has_space_for_poller())
+        revents &= ~PAL_WAIT_WRITE;
 
-    spinlock_unlock(&g_vsock_connections_lock);
+    /* the check and the enqueue are atomic w.r.t. notify_connection() (both under conn->lock) */
+    bool keep_ref = false;
+    if (!revents && entry) {
+        keep_ref = !entry->queue;
+        sched_poll_enqueue(entry, &conn->poll_queue, &conn->lock);
+    }
+    spinlock_unlock(&conn->lock);
+
+    /* the first enqueue keeps the reference until virtio_vsock_poll_dequeue() */
+    if (!keep_ref)
+        put_connection(conn);
+
+    *out_events = revents;
     return 0;
 }
 
+void virtio_vsock_poll_dequeue(struct sched_poll_entry* entry) {
+    if (!entry->queue)
+        return;
+
+    struct virtio_vsock_connection* conn = container_of(entry->queue,
+                                                        struct virtio_vsock_connection,
+                                                        poll_queue);
+    sched_poll_dequeue(entry);
+    put_connection(conn);
+}
+
 long virtio_vsock_peek(int sockfd) {
     long ret;
 
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        spinlock_unlock(&g_vsock_connections_lock);
+    if (!conn)
         return -PAL_ERROR_BADHANDLE;
-    }
+
+    spinlock_lock(&conn->lock);
 
     switch (conn->state) {
         case VIRTIO_VSOCK_LISTEN:
@@ -1541,42 +2089,51 @@ long virtio_vsock_peek(int sockfd) {
         case VIRTIO_VSOCK_CONNECT:
             ret = 0;
             break;
-        case VIRTIO_VSOCK_ESTABLISHED: {
-            size_t peeked = 0;
-            uint32_t peek_at = conn->consumed_by_user;
-            while (conn->prepared_for_user != peek_at) {
-                peeked += conn->packets_for_user[peek_at % VSOCK_MAX_PACKETS]->header.size;
-                peek_at++;
-            }
-            ret = (long)peeked;
+        case VIRTIO_VSOCK_ESTABLISHED:
+            ret = (long)(conn->rx_cnt - conn->fwd_cnt);
             break;
-        }
         default:
             /* CLOSE or CLOSING states -- connection is shutdown or in the process of closing */
             ret = -PAL_ERROR_DENIED;
             break;
     }
 
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
     return ret;
 }
 
-long virtio_vsock_read(int sockfd, void* buf, size_t count) {
+/* copies up to `count` received bytes out of the connection's receive ring, returns their number */
+static size_t copy_from_rx_buf(struct virtio_vsock_connection* conn, char* buf, size_t count) {
+    assert(spinlock_is_locked(&conn->lock));
+
+    size_t size = MIN(count, (size_t)(conn->rx_cnt - conn->fwd_cnt));
+    if (!size)
+        return 0;
+
+    uint32_t off = conn->fwd_cnt % VSOCK_RX_BUF_SIZE;
+    size_t first = MIN(size, (size_t)(VSOCK_RX_BUF_SIZE - off));
+    memcpy(buf, conn->rx_buf + off, first);
+    memcpy(buf + first, conn->rx_buf, size - first);
+
+    conn->fwd_cnt += size;
+    return size;
+}
+
+long virtio_vsock_readv(int sockfd, struct iovec* iov, size_t iov_len) {
     long ret;
 
-    if (!buf)
+    if (!iov && iov_len)
         return -PAL_ERROR_BADADDR;
 
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     if (conn->state != VIRTIO_VSOCK_ESTABLISHED) {
         ret = -PAL_ERROR_NOTCONNECTION;
@@ -1584,12 +2141,16 @@ long virtio_vsock_read(int sockfd, void* buf, size_t count) {
     }
 
     /* must be after all checks on connection, otherwise could return success on broken conn */
-    if (count == 0) {
+    bool empty = true;
+    for (size_t i = 0; i < iov_len; i++)
+        if (iov[i].iov_base && iov[i].iov_len)
+            empty = false;
+    if (empty) {
         ret = 0;
         goto out;
     }
 
-    if (conn->prepared_for_user == conn->consumed_by_user) {
+    if (conn->rx_cnt == conn->fwd_cnt) {
         if (conn->recv_disallowed) {
             /* we were instructed that there will be no more packets, so return "end-of-file" */
             ret = 0;
@@ -1600,34 +2161,26 @@ long virtio_vsock_read(int sockfd, void* buf, size_t count) {
         goto out;
     }
 
+    /* partially consumed packets need no special handling: the ring cursor (fwd_cnt) just moves */
     size_t copied = 0;
-    while (conn->prepared_for_user != conn->consumed_by_user) {
-        uint32_t idx = conn->consumed_by_user % VSOCK_MAX_PACKETS;
-        if (copied + conn->packets_for_user[idx]->header.size > count) {
-            /* user-supplied buffer won't fit the next message: copy whatever is possible,
-             * trim the message and return the result */
-            memcpy(buf + copied, conn->packets_for_user[idx]->payload, count - copied);
-
-            size_t payload_bytes_copied = count - copied;
-            memmove(conn->packets_for_user[idx]->payload,
-                    conn->packets_for_user[idx]->payload + payload_bytes_copied,
-                    conn->packets_for_user[idx]->header.size - payload_bytes_copied);
-            conn->packets_for_user[idx]->header.size -= payload_bytes_copied;
-
-            copied = count;
-            break;
-        }
+    for (size_t i = 0; i < iov_len && conn->rx_cnt != conn->fwd_cnt; i++) {
+        if (!iov[i].iov_base)
+            continue;
+        copied += copy_from_rx_buf(conn, iov[i].iov_base, iov[i].iov_len);
+    }
+    update_poll_events(conn);
 
-        memcpy(buf + copied, conn->packets_for_user[idx]->payload,
-               conn->packets_for_user[idx]->header.size);
-        copied += conn->packets_for_user[idx]->header.size;
-        conn->consumed_by_user++;
-        free(conn->packets_for_user[idx]);
+    if (conn->fwd_cnt - conn->last_fwd_cnt >= conn->buf_alloc / VSOCK_CREDIT_UPDATE_DIVISOR) {
+        /* the host learns about freed space only from our packets, so tell it explicitly; ignore
+         * errors as the data was already consumed (the next update will carry the same info) */
+        (void)send_credit_update_packet(conn);
     }
 
     ret = (long)copied;
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
+    notify_tq_wakeups();
     return ret;
 }
 
@@ -1640,13 +2193,11 @@ long virtio_vsock_write(int sockfd, const void* buf, size_t count) {
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     if (conn->state != VIRTIO_VSOCK_ESTABLISHED) {
         ret = -PAL_ERROR_NOTCONNECTION;
@@ -1665,33 +2216,24 @@ long virtio_vsock_write(int sockfd, const void* buf, size_t count) {
         goto out;
     }
 
-    size_t sent = 0;
-    while (sent < count) {
-        size_t payload_size = MIN(count - sent, VSOCK_MAX_PAYLOAD_SIZE);
-        ret = send_rw_packet(conn, buf + sent, payload_size);
-        if (ret < 0) {
-            if (ret == -PAL_ERROR_NOMEM && sent != 0) {
-                /* TX buffer is full, do not return error but instead whatever was sent */
-                ret = (long)sent;
-            }
-            if (ret == -PAL_ERROR_NOMEM) {
-                /* TX buffer is full and we haven't sent anything -> a write would block;
-                 * non-blocking caller must return TRYAGAIN; blocking caller must sleep on this */
-                ret = -PAL_ERROR_TRYAGAIN;
-            }
-            goto out;
-        }
-        sent += payload_size;
+    ret = send_rw_packets(conn, buf, count);
+    update_poll_events(conn);
+    if (ret == 0) {
+        /* no credit from the host or TX buffer is full, and we haven't sent anything -> a write
+         * would block; non-blocking caller must return TRYAGAIN; blocking caller must sleep on this
+         * (it is woken up on new credit or when TX buffer is drained) */
+        ret = -PAL_ERROR_TRYAGAIN;
     }
-
-    ret = (long)sent;
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
+    /* sending reclaims TX descriptors, which may have drained send buffers of other connections */
+    notify_tq_wakeups();
     return ret;
 }
 
 static int virtio_vsock_close_common(struct virtio_vsock_connection* conn, uint64_t timeout_us) {
-    assert(spinlock_is_locked(&g_vsock_connections_lock));
+    assert(spinlock_is_locked(&conn->lock));
 
     int ret;
     uint64_t timeout_absolute_us = 0;
@@ -1728,6 +2270,7 @@ static int virtio_vsock_close_common(struct virtio_vsock_connection* conn, uint6
         goto out;
 
     conn->state = VIRTIO_VSOCK_CLOSING;
+    update_poll_events(conn);
 
     while (conn->state != VIRTIO_VSOCK_CLOSE) {
         if (conn->state != VIRTIO_VSOCK_CLOSING) {
@@ -1749,7 +2292,7 @@ static int virtio_vsock_close_common(struct virtio_vsock_connection* conn, uint6
         }
 
         /* connection state not changed to CLOSE, need to sleep */
-        sched_thread_wait(&conn->state_futex, &g_vsock_connections_lock);
+        sched_thread_wait(&conn->state_futex, &conn->lock);
     }
 
     ret = 0;
@@ -1765,13 +2308,11 @@ int virtio_vsock_shutdown(int sockfd, enum virtio_vsock_shutdown shutdown) {
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     if (conn->state != VIRTIO_VSOCK_ESTABLISHED && conn->state != VIRTIO_VSOCK_LISTEN) {
         ret = -PAL_ERROR_NOTCONNECTION;
@@ -1782,10 +2323,13 @@ int virtio_vsock_shutdown(int sockfd, enum virtio_vsock_shutdown shutdown) {
         conn->recv_disallowed = true;
     if (shutdown == VIRTIO_VSOCK_SHUTDOWN_SEND || shutdown == VIRTIO_VSOCK_SHUTDOWN_COMPLETE)
         conn->send_disallowed = true;
+    notify_connection(conn, update_poll_events(conn));
 
     ret = send_shutdown_packet(conn, shutdown);
 out:
-    spinlock_unlock(&g_vsock_connections_lock);
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
+    notify_tq_wakeups();
     return ret;
 }
 
@@ -1795,21 +2339,23 @@ int virtio_vsock_close(int sockfd, uint64_t timeout_us) {
     if (sockfd < 0)
         return -PAL_ERROR_BADHANDLE;
 
-    spinlock_lock(&g_vsock_connections_lock);
-
     struct virtio_vsock_connection* conn = get_connection(sockfd);
-    if (!conn) {
-        ret = -PAL_ERROR_BADHANDLE;
-        goto out;
-    }
+    if (!conn)
+        return -PAL_ERROR_BADHANDLE;
+
+    spinlock_lock(&conn->lock);
 
     ret = 0;
     if (conn->state != VIRTIO_VSOCK_CLOSE) {
         ret = virtio_vsock_close_common(conn, timeout_us);
     }
 
+    conn->notify = NULL;
+    conn->notify_arg = NULL;
     remove_connection(conn);
-out:
-    spinlock_unlock(&g_vsock_connections_lock);
+
+    spinlock_unlock(&conn->lock);
+    put_connection(conn);
+    notify_tq_wakeups();
     return ret;
 }
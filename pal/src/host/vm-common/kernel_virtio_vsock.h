@@ -7,10 +7,13 @@
 
 #include <stdint.h>
 
+#include "list.h"
 #include "pal_internal.h"
 #include "spinlock.h"
 #include "uthash.h"
 
+#include "kernel_sched.h"
+
 #define AF_VSOCK 40
 #define VSOCK_HOST_CID 2
 
@@ -24,19 +27,30 @@
  * by default). The corresponding array is a circular buffer, so this macro must be a power of 2. */
 #define VSOCK_MAX_PENDING_CONNS 256
 
-/* Max number of packets stored per connection. The corresponding array is a circular buffer, so
- * this macro must be a power of 2. */
-#define VSOCK_MAX_PACKETS 256
+/* Size of the per-connection receive byte ring, which is also the receive buffer space advertised
+ * to the host (corresponds to the default Linux buffer size). Must be a power of 2. */
+#define VSOCK_RX_BUF_SIZE (256 * 1024U)
 
 /* For simplicity, each packet has statically allocated buffer for recv/send data. We choose the
- * size such that the total vsock packet size (44B header + payload) is a power of 2. The total
- * send/recv buffer size becomes then 1024 * 256 = 262144, which corresponds to the default Linux
- * buffer size. */
+ * size such that the total vsock packet size (44B header + payload) is a power of 2. */
 #define VSOCK_MAX_PAYLOAD_SIZE 980U
 
+/* We send an explicit CREDIT_UPDATE to the host once the app consumed this fraction of the receive
+ * buffer since the last advertised fwd_cnt (similar to Linux, which sends it when the free space
+ * advertised to the peer drops below a threshold). */
+#define VSOCK_CREDIT_UPDATE_DIVISOR 4
+
 /* Sizes of RX and TX virtio queues. */
 #define VIRTIO_VSOCK_QUEUE_SIZE 256
 
+/* Per-connection send buffer: limit on payload bytes of one connection in the TX queue (copied into
+ * the shared TX buffer but not yet consumed by the device), so that a single connection cannot
+ * occupy the whole TX queue. By default, a connection may use half of the TX queue; an explicit
+ * SO_SNDBUF sets the limit (but not below the minimum), as the default SO_SNDBUF value reported to
+ * the app is not enforced (similar to autotuning in Linux). */
+#define VSOCK_DEFAULT_SND_BUF_SIZE (VIRTIO_VSOCK_QUEUE_SIZE / 2 * VSOCK_MAX_PAYLOAD_SIZE)
+#define VSOCK_MIN_SND_BUF_SIZE     (2 * VSOCK_MAX_PAYLOAD_SIZE)
+
 /* Size of the Event virtio queue (currently unused). */
 #define VIRTIO_VSOCK_EVENT_QUEUE_SIZE 32
 
@@ -116,13 +130,21 @@ struct virtio_vsock_packet {
     uint8_t payload[VSOCK_MAX_PAYLOAD_SIZE];
 };
 
+DEFINE_LIST(virtio_vsock_connection);
 struct virtio_vsock_connection {
     uint32_t fd; /* UINT32_MAX if not attached to any fd; synced via g_vsock_connections_lock */
+    uint32_t refcount; /* one ref held by connections table, others by in-flight lookups */
+
+    /* protects all fields below, except the hash-table ones which are additionally protected by
+     * g_vsock_connections_lock */
+    spinlock_t lock;
 
     enum virtio_vsock_state state;
     int state_futex;
 
-    UT_hash_handle hh_host_port;
+    UT_hash_handle hh_ports; /* key is (host_port, guest_port) pair, see ports_key() */
+    uint64_t ports_key;
+    bool hashed;
     uint64_t host_port;
     uint64_t guest_port;
 
@@ -131,17 +153,20 @@ struct virtio_vsock_connection {
     uint32_t pending_conn_fds_cnt;
     uint32_t pending_conn_fds_idx; /* first received-but-not-yet-accepted pending conn */
 
-    struct virtio_vsock_packet* packets_for_user[VSOCK_MAX_PACKETS];
-    uint32_t prepared_for_user;
-    uint32_t consumed_by_user;
+    /* receive byte ring of VSOCK_RX_BUF_SIZE (allocated on first received data); bytes in range
+     * [fwd_cnt, rx_cnt) are received but not yet consumed by the app */
+    char* rx_buf;
+    uint32_t rx_cnt;         /* free-running counter: bytes received from host */
 
-    /* per-connection (per-socket) buffer space management: guest side, not used currently */
+    /* per-connection (per-socket) buffer space management: guest side, limits what we send */
     uint32_t tx_cnt;         /* free-running counter: bytes transmitted to host */
-    uint32_t peer_fwd_cnt;   /* free-running counter: bytes received by host */
+    uint32_t peer_fwd_cnt;   /* free-running counter: bytes consumed by host */
     uint32_t peer_buf_alloc; /* buffer space for this connection on host */
+    uint32_t snd_buf_size;   /* max payload bytes in the TX queue (SO_SNDBUF), see tx_queued */
 
     /* per-connection (per-socket) buffer space management: host side, must inform host */
-    uint32_t fwd_cnt;        /* free-running counter: bytes received by this guest */
+    uint32_t fwd_cnt;        /* free-running counter: bytes consumed by the app in this guest */
+    uint32_t last_fwd_cnt;   /* fwd_cnt as advertised to host in the last sent packet */
     uint32_t buf_alloc;      /* buffer space for this connection on this guest */
 
     /* receive/send is disallowed on this connection (depends on received SHUTDOWN requests) */
@@ -155,6 +180,29 @@ struct virtio_vsock_connection {
     bool ipv6_bound;
     bool ipv6_v6only;
     bool reuseport;
+
+    /* readiness callback installed via PalStreamSetNotify(), invoked with the lock held */
+    void (*notify)(void* arg);
+    void* notify_arg;
+
+    /* pollers of this connection, see virtio_vsock_poll() */
+    LISTP_TYPE(sched_poll_entry) poll_queue;
+    /* readiness of this connection (PAL_WAIT_* flags), updated on each change of the connection
+     * state, see update_poll_events() */
+    uint32_t poll_events;
+
+    /* send buffer accounting, protected by g_vsock_transmit_lock (not by `lock`) as the TX queue is
+     * drained without the connection locked, see cleanup_tq_locked() */
+    uint32_t tx_queued; /* payload bytes of this connection in the TX queue, at most snd_buf_size */
+    bool tx_waiting;    /* send buffer was found full, notify the connection once it drains */
+    LIST_TYPE(virtio_vsock_connection) tq_wakeup_list; /* in g_vsock->tq_wakeup_conns */
+};
+DEFINE_LISTP(virtio_vsock_connection);
+
+/* owner of a TX descriptor with an RW packet (holds a reference to the connection) */
+struct virtio_vsock_tq_owner {
+    struct virtio_vsock_connection* conn;
+    uint32_t size; /* payload size, kept in private memory */
 };
 
 struct sockaddr_vm {
@@ -267,6 +267,19 @@ int unixtime_init(char* unixtime_s, size_t unixtime_size) {
     return 0;
 }
 
+/* optional input, so a missing selector is not an error; only the first character is considered */
+bool lazy_mem_init_requested(void) {
+    uint16_t fw_cfg_selector;
+    uint32_t fw_cfg_size;
+    int ret = find_fw_cfg_selector("opt/gramine/lazy_mem_init", &fw_cfg_selector, &fw_cfg_size);
+    if (ret < 0)
+        return false;
+
+    vm_portio_writew(FW_CFG_PORT_SEL, fw_cfg_selector);
+    char first_char = vm_portio_readb(FW_CFG_PORT_SEL + 1);
+    return first_char == '1';
+}
+
 /* this func is used only in VM PAL (not in TDX PAL), so doesn't need to be hardened */
 int e820_table_init(char* e820_table, size_t* e820_size, size_t max_e820_size) {
     memset(e820_table, 0, max_e820_size);
@@ -7,6 +7,7 @@
  * - Host environment variables
  * - PWD (host's current working directory)
  * - initial UNIX time
+ * - whether boot-time memory initialization should be lazy (optional)
  * - E820 table of VMM-reserved memory ranges (only for VM PAL; TDX PAL uses TDX hobs)
  *
  * Gramine command-line args, host environment variables, PWD, and initial UNIX time are all read
@@ -20,6 +21,8 @@
  * The selector with environment variables has the name "opt/gramine/envs".
  * The selector with PWD has the name "opt/gramine/pwd".
  * The selector with initial UNIX time has the name "opt/gramine/unixtime_s".
+ * The optional selector with lazy memory init flag has the name "opt/gramine/lazy_mem_init" ("1"
+ * means lazy, see memory_boot_init_finish()).
  *
  * For details, see:
  *   - qemu.org/docs/master/specs/fw_cfg.html
@@ -33,6 +36,8 @@
 
 #pragma once
 
+#include <stdbool.h>
+
 #include "kernel_files.h"
 
 #define FW_CFG_PORT_SEL   0x510
@@ -84,4 +89,6 @@ int cmdline_init_envs(char* cmdline_envs, size_t cmdline_envs_size);
 
 int unixtime_init(char* unixtime_s, size_t unixtime_size);
 
+bool lazy_mem_init_requested(void);
+
 int e820_table_init(char* e820_table, size_t* e820_size, size_t max_e820_size);
@@ -4,8 +4,15 @@
 /*
  * Enablement of XSAVE features.
  *
+ * XSAVE areas are always in standard (non-compacted) format, as they are exposed to LibOS (e.g. in
+ * signal frames) and may be restored from LibOS-provided memory. If available, XSAVEOPT is used
+ * instead of XSAVE: it doesn't write state components that are in their initial configuration
+ * (e.g. AVX-512 or AMX state of threads that never used them) or that were not modified since the
+ * last XRSTOR from the same area (e.g. on interrupts that don't touch FP regs), see kernel_events.S.
+ *
  * Notes on multi-core synchronization:
- *   - All functions are called at init, no sync required
+ *   - xsave_init() is called at init, no sync required
+ *   - xsave_area_copy() operates on args and read-only (after init) globals, no sync required
  */
 
 #include <stdint.h>
@@ -20,8 +27,18 @@
 #define CPUID_FEATURE_XSAVE   (1UL << 26)
 #define CPUID_FEATURE_OSXSAVE (1UL << 27)
 
+#define CPUID_FEATURE_XSAVEOPT (1UL << 0) /* in CPUID.(EAX=0DH,ECX=1):EAX */
+
+#define VM_XFEATURES_NUM (VM_XFEATURE_AMX_DATA + 1)
+
 uint64_t g_xcr0 = 0;
 uint32_t g_xsave_size = 0;
+bool g_xsaveopt_enabled = false; /* used in kernel_events.S */
+
+/* offsets and sizes of state components in standard-format XSAVE area; only valid for components
+ * enabled in XCR0 beyond x87/SSE (those are in the legacy region) */
+static uint32_t g_xfeature_offsets[VM_XFEATURES_NUM];
+static uint32_t g_xfeature_sizes[VM_XFEATURES_NUM];
 
 const uint32_t g_xsave_reset_state[VM_XSAVE_RESET_STATE_SIZE / sizeof(uint32_t)]
         __attribute__((aligned(VM_XSAVE_ALIGN))) = {
@@ -80,7 +97,42 @@ int xsave_init(void) {
 
     __asm__ volatile("xsetbv" : : "a"(xcr0), "c"(0), "d"(0));
 
+    for (uint32_t i = VM_XFEATURE_YMM; i < VM_XFEATURES_NUM; i++) {
+        if (!(xcr0 & (1UL << i)))
+            continue;
+        cpuid(EXTENDED_STATE_LEAF, i, words);
+        if ((uint64_t)words[CPUID_WORD_EBX] + words[CPUID_WORD_EAX] > xsavesize)
+            return -PAL_ERROR_INVAL;
+        g_xfeature_sizes[i]   = words[CPUID_WORD_EAX];
+        g_xfeature_offsets[i] = words[CPUID_WORD_EBX];
+    }
+
+    cpuid(EXTENDED_STATE_LEAF, 1, words);
+    g_xsaveopt_enabled = !!(words[CPUID_WORD_EAX] & CPUID_FEATURE_XSAVEOPT);
+
     g_xcr0 = xcr0;
     g_xsave_size = xsavesize;
     return 0;
 }
+
+/* Copies the XSAVE area `src` into `dst` (both of `g_xsave_size` size). State components that are
+ * in their initial configuration (bit in XSTATE_BV is zero) are skipped, because XRSTOR initializes
+ * them without reading their memory; this avoids copying kilobytes of AVX-512 and AMX state for
+ * threads that don't use them. */
+void xsave_area_copy(void* dst, const void* src) {
+    const struct vm_xsave_header* header = src + VM_XSAVE_LEGACY_SIZE;
+    if (header->xcomp_bv & (1UL << 63)) {
+        /* compacted format (e.g. initial state of a thread), component offsets differ */
+        memcpy(dst, src, g_xsave_size);
+        return;
+    }
+
+    memcpy(dst, src, VM_XSAVE_LEGACY_SIZE + sizeof(*header));
+
+    uint64_t xstate_bv = header->xstate_bv & g_xcr0 & ~VM_XFEATURE_MASK_FPSSE;
+    while (xstate_bv) {
+        uint32_t i = __builtin_ctzl(xstate_bv);
+        xstate_bv &= xstate_bv - 1;
+        memcpy(dst + g_xfeature_offsets[i], src + g_xfeature_offsets[i], g_xfeature_sizes[i]);
+    }
+}
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define VM_XSAVE_ALIGN 64
@@ -57,8 +58,18 @@ enum VM_XFEATURE {
 #define VM_XFEATURE_MASK_AVX512    (VM_XFEATURE_MASK_OPMASK | VM_XFEATURE_MASK_ZMM_Hi256 \
                                       | VM_XFEATURE_MASK_Hi16_ZMM)
 
+#define VM_XSAVE_LEGACY_SIZE 512 /* x87 and SSE state, always at the start of XSAVE area */
+
+struct vm_xsave_header {
+    uint64_t xstate_bv; /* state components that are not in their initial configuration */
+    uint64_t xcomp_bv;  /* bit 63 is set if the area is in compacted format */
+    uint64_t reserved[6];
+};
+
 extern uint64_t g_xcr0;
 extern uint32_t g_xsave_size;
+extern bool g_xsaveopt_enabled;
 extern const uint32_t g_xsave_reset_state[VM_XSAVE_RESET_STATE_SIZE / sizeof(uint32_t)];
 
+void xsave_area_copy(void* dst, const void* src);
 int xsave_init(void);
@@ -11,7 +11,8 @@
 
 #include "kernel_thread.h"
 
-#define PIPE_BUF_SIZE PAGE_SIZE
+#define PIPE_DEFAULT_BUF_SIZE (16 * PAGE_SIZE) /* as in Linux; can be changed via F_SETPIPE_SZ */
+#define PIPE_ATOMIC_SIZE      PAGE_SIZE        /* PIPE_BUF in Linux */
 
 struct pal_tcb_vm {
     PAL_TCB common;
@@ -38,6 +39,18 @@ int pal_common_streams_wait_events(size_t count, struct pal_handle** handle_arra
                                    pal_wait_flags_t* events, pal_wait_flags_t* ret_events,
                                    uint64_t* timeout_us);
 
+/* statistics of pal_common_streams_wait_events(), for tuning; updated without locks */
+struct pal_poll_stats {
+    uint64_t num_polls;            /* calls of pal_common_streams_wait_events() */
+    uint64_t num_sleeps;           /* times a poller blocked */
+    uint64_t num_rescans;          /* rescans of the handle array after a wakeup */
+    uint64_t num_spurious_wakeups; /* rescans that found neither events nor an expired timeout */
+    uint64_t num_timeouts;         /* calls that returned because the timeout expired */
+};
+
+void pal_common_get_poll_stats(struct pal_poll_stats* out_stats);
+void pal_common_print_poll_stats(void);
+
 int pal_common_console_open(struct pal_handle** handle, const char* type, const char* uri,
                             enum pal_access access, pal_share_flags_t share,
                             enum pal_create_mode create, pal_stream_options_t options);
@@ -85,8 +98,11 @@ int64_t pal_common_pipe_write(struct pal_handle* handle, uint64_t offset, uint64
                               const void* buffer);
 void pal_common_pipe_destroy(struct pal_handle* handle);
 int pal_common_pipe_delete(struct pal_handle* handle, enum pal_delete_mode delete_mode);
+size_t pal_common_pipe_buf_free_space(struct pal_handle_inner_pipe_buf* pipe_buf);
 int pal_common_pipe_attrquerybyhdl(struct pal_handle* handle, PAL_STREAM_ATTR* attr);
 int pal_common_pipe_attrsetbyhdl(struct pal_handle* handle, PAL_STREAM_ATTR* attr);
+int pal_common_pipe_setnotify(struct pal_handle* handle, pal_stream_notify_cb_t callback,
+                              void* arg);
 
 int pal_common_eventfd_open(struct pal_handle** handle, const char* type, const char* uri,
                             enum pal_access access, pal_share_flags_t share,
@@ -97,6 +113,8 @@ int64_t pal_common_eventfd_write(struct pal_handle* handle, uint64_t offset, uin
                                  const void* buffer);
 void pal_common_eventfd_destroy(struct pal_handle* handle);
 int pal_common_eventfd_attrquerybyhdl(struct pal_handle* handle, PAL_STREAM_ATTR* attr);
+int pal_common_eventfd_setnotify(struct pal_handle* handle, pal_stream_notify_cb_t callback,
+                                 void* arg);
 
 int pal_common_socket_create(enum pal_socket_domain domain, enum pal_socket_type type,
                              pal_stream_options_t options, struct pal_handle** out_handle);
@@ -108,9 +126,11 @@ int pal_common_thread_set_cpu_affinity(struct pal_handle* thread, unsigned long*
                                        size_t cpu_mask_len);
 int pal_common_thread_get_cpu_affinity(struct pal_handle* thread, unsigned long* cpu_mask,
                                        size_t cpu_mask_len);
+int pal_common_thread_stack_cache_init(void);
 
 int pal_common_random_bits_read(void* buffer, size_t size);
 double pal_common_get_bogomips(void);
 int pal_common_get_topo_info(struct pal_topo_info* topo_info);
 int pal_common_segment_base_get(enum pal_segment_reg reg, uintptr_t* addr);
 int pal_common_segment_base_set(enum pal_segment_reg reg, uintptr_t addr);
+int pal_common_irq_affinity_init(void);
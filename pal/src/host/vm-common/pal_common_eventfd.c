@@ -72,8 +72,9 @@ int64_t pal_common_eventfd_read(struct pal_handle* handle, uint64_t offset, uint
         handle->eventfd.val--;
     }
 
-    if (handle->eventfd.poll_waiting)
-        sched_thread_wakeup(&g_streams_waiting_events_futex);
+    if (handle->eventfd.notify_callback)
+        handle->eventfd.notify_callback(handle->eventfd.notify_arg);
+    sched_poll_wakeup(&handle->eventfd.poll_queue, PAL_WAIT_WRITE);
     sched_thread_wakeup(&handle->eventfd.writer_futex);
     spinlock_unlock(&handle->eventfd.lock);
     return 8;
@@ -109,8 +110,9 @@ int64_t pal_common_eventfd_write(struct pal_handle* handle, uint64_t offset, uin
 
     handle->eventfd.val = val;
 
-    if (handle->eventfd.poll_waiting)
-        sched_thread_wakeup(&g_streams_waiting_events_futex);
+    if (handle->eventfd.notify_callback)
+        handle->eventfd.notify_callback(handle->eventfd.notify_arg);
+    sched_poll_wakeup(&handle->eventfd.poll_queue, PAL_WAIT_READ);
     sched_thread_wakeup(&handle->eventfd.reader_futex);
     spinlock_unlock(&handle->eventfd.lock);
     return 8;
@@ -130,3 +132,12 @@ int pal_common_eventfd_attrquerybyhdl(struct pal_handle* handle, PAL_STREAM_ATTR
 
     return 0;
 }
+
+int pal_common_eventfd_setnotify(struct pal_handle* handle, pal_stream_notify_cb_t callback,
+                                 void* arg) {
+    spinlock_lock(&handle->eventfd.lock);
+    handle->eventfd.notify_callback = callback;
+    handle->eventfd.notify_arg      = callback ? arg : NULL;
+    spinlock_unlock(&handle->eventfd.lock);
+    return 0;
+}
@@ -35,8 +35,11 @@ void pal_common_event_set(struct pal_handle* handle) {
     spinlock_lock(&handle->event.lock);
     __atomic_store_n(&handle->event.signaled, 1, __ATOMIC_RELEASE);
     bool need_wake = handle->event.waiters_cnt > 0;
-    if (need_wake)
-        sched_thread_wakeup(&handle->event.signaled);
+    if (need_wake) {
+        /* auto-clear event is consumed by exactly one waiter, so there is no need to wake others */
+        sched_thread_wakeup_n(&handle->event.signaled,
+                              handle->event.auto_clear ? 1 : SCHED_WAKEUP_ALL);
+    }
     spinlock_unlock(&handle->event.lock);
 }
 
@@ -258,6 +258,7 @@ int pal_common_file_open(struct pal_handle** handle, const char* type, const cha
             goto out;
 
         hdl->file.chunk_hashes = chunk_hashes;
+        hdl->file.trusted_file = chunk_hashes ? tf : NULL;
         hdl->file.size = tf->size;
     }
 
@@ -287,7 +288,7 @@ int64_t pal_common_file_read(struct pal_handle* handle, uint64_t offset, uint64_
         /* case of passthrough/allowed file */
 
         /* try to read the whole buffer (this is important for some workloads like Java); do it in
-         * FILE_CHUNK_SIZE chunks because virtio-fs cannot consume more than this limit at a time */
+         * FILE_CHUNK_SIZE chunks to bound the amount of data bounced in one virtio-fs call */
         uint64_t total_read_size = 0;
         while (total_read_size < count) {
             uint64_t read_size;
@@ -320,7 +321,7 @@ int64_t pal_common_file_read(struct pal_handle* handle, uint64_t offset, uint64_
     int64_t aligned_end    = ALIGN_UP(end, TRUSTED_CHUNK_SIZE);
 
     ret = copy_and_verify_trusted_file(handle, buffer, aligned_offset, aligned_end, offset, end,
-                                       handle->file.chunk_hashes, file_size);
+                                       handle->file.trusted_file, file_size);
     if (ret < 0)
         return ret;
 
@@ -336,7 +337,7 @@ int64_t pal_common_file_write(struct pal_handle* handle, uint64_t offset, uint64
     }
 
     /* try to write the whole buffer (this is important for some workloads like Python3); do it in
-     * FILE_CHUNK_SIZE chunks because virtio-fs cannot consume more than this limit at a time */
+     * FILE_CHUNK_SIZE chunks to bound the amount of data bounced in one virtio-fs call */
     uint64_t total_written_size = 0;
     while (total_written_size < count) {
         uint64_t written_size;
@@ -409,7 +410,7 @@ int pal_common_file_map(struct pal_handle* handle, void* addr, pal_prot_flags_t
         int64_t aligned_end    = ALIGN_UP(end, TRUSTED_CHUNK_SIZE);
 
         ret = copy_and_verify_trusted_file(handle, addr, aligned_offset, aligned_end, offset, end,
-                                           handle->file.chunk_hashes, handle->file.size);
+                                           handle->file.trusted_file, handle->file.size);
         if (ret < 0) {
             log_error("Verification of trusted file failed during mmap: %s", pal_strerror(ret));
             goto out;
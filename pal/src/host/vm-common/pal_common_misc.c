@@ -12,7 +12,11 @@
 #include "pal_error.h"
 #include "pal_internal.h"
 
+#include "toml_utils.h"
+
+#include "kernel_interrupts.h"
 #include "kernel_multicore.h"
+#include "kernel_pci.h"
 #include "kernel_sched.h"
 
 int pal_common_random_bits_read(void* buffer, size_t size) {
@@ -144,3 +148,40 @@ int pal_common_segment_base_set(enum pal_segment_reg reg, uintptr_t addr) {
     }
     return -PAL_ERROR_NOTIMPLEMENTED;
 }
+
+static int steer_irq(const char* key, uint8_t vector, uint32_t default_cpu_id) {
+    int64_t cpu_id;
+    int ret = toml_int_in(g_pal_public_state.manifest_root, key, default_cpu_id, &cpu_id);
+    if (ret < 0) {
+        log_error("Cannot parse '%s'", key);
+        return -PAL_ERROR_INVAL;
+    }
+
+    if (cpu_id < 0 || cpu_id >= g_num_cpus) {
+        log_error("'%s' must be a vCPU index in [0, %u)", key, g_num_cpus);
+        return -PAL_ERROR_INVAL;
+    }
+
+    ret = pci_msix_steer_vector(vector, (uint32_t)cpu_id);
+    if (ret == -PAL_ERROR_NOTSUPPORT) {
+        /* device is absent or uses legacy interrupts, which are always handled on CPU0 */
+        return 0;
+    }
+    return ret;
+}
+
+/* Steer MSI-X interrupts of virtio queues to vCPUs according to `tdx.irq_affinity` manifest table.
+ * By default, console input stays on CPU0 and vsock RX/TX go to the last vCPU, so that network
+ * bottom halves do not compete with the main app thread (which starts on CPU0). Every MSI-X vector
+ * must be steered here: table entries stay masked until their vector is steered. */
+int pal_common_irq_affinity_init(void) {
+    int ret = steer_irq("tdx.irq_affinity.console", MSIX_VECTOR_CONSOLE_RQ, /*default_cpu_id=*/0);
+    if (ret < 0)
+        return ret;
+
+    ret = steer_irq("tdx.irq_affinity.vsock_rx", MSIX_VECTOR_VSOCK_RQ, g_num_cpus - 1);
+    if (ret < 0)
+        return ret;
+
+    return steer_irq("tdx.irq_affinity.vsock_tx", MSIX_VECTOR_VSOCK_TQ, g_num_cpus - 1);
+}
@@ -17,12 +17,44 @@
 #include "kernel_time.h"
 #include "kernel_virtio.h"
 
-/* Global lock and futex for waiting for some events (very naive but good enough) */
-static spinlock_t g_streams_waiting_events_lock = INIT_SPINLOCK_UNLOCKED;
-int g_streams_waiting_events_futex;
+/*
+ * Each polled object (pipe buffer, pipesrv/connecting pipe, eventfd, vsock connection) has its own
+ * wait queue. A poller that finds no events arms a single waiter on its stack, enqueues one entry
+ * per handle into the corresponding wait queues (under the objects' locks, atomically with checking
+ * the object state) and blocks; an event on an object wakes up only the pollers enqueued on it and
+ * interested in this kind of event. The timeout (if any) sets the waiter's futex word, so it cannot
+ * be lost even if it fires before the poller blocks.
+ */
+#define POLL_INLINE_ENTRIES 8
+
+static struct pal_poll_stats g_poll_stats;
+
+static void poll_stats_inc(uint64_t* counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+void pal_common_get_poll_stats(struct pal_poll_stats* out_stats) {
+    out_stats->num_polls            = __atomic_load_n(&g_poll_stats.num_polls, __ATOMIC_RELAXED);
+    out_stats->num_sleeps           = __atomic_load_n(&g_poll_stats.num_sleeps, __ATOMIC_RELAXED);
+    out_stats->num_rescans          = __atomic_load_n(&g_poll_stats.num_rescans, __ATOMIC_RELAXED);
+    out_stats->num_spurious_wakeups = __atomic_load_n(&g_poll_stats.num_spurious_wakeups,
+                                                      __ATOMIC_RELAXED);
+    out_stats->num_timeouts         = __atomic_load_n(&g_poll_stats.num_timeouts, __ATOMIC_RELAXED);
+}
+
+void pal_common_print_poll_stats(void) {
+    struct pal_poll_stats stats;
+    pal_common_get_poll_stats(&stats);
+    if (!stats.num_polls)
+        return;
+
+    log_debug("PalStreamsWaitEvents: %lu calls, %lu sleeps, %lu rescans, %lu spurious wakeups, "
+              "%lu timeouts", stats.num_polls, stats.num_sleeps, stats.num_rescans,
+              stats.num_spurious_wakeups, stats.num_timeouts);
+}
 
 static int check_pipesrv_handle(struct pal_handle* handle, pal_wait_flags_t events,
-                                pal_wait_flags_t* out_events) {
+                                struct sched_poll_entry* entry, pal_wait_flags_t* out_events) {
     assert(handle->hdr.type == PAL_TYPE_PIPESRV);
 
     pal_wait_flags_t revents = 0;
@@ -42,7 +74,8 @@ static int check_pipesrv_handle(struct pal_handle* handle, pal_wait_flags_t even
         if (any_connecting_pipe_found)
             revents |= PAL_WAIT_READ;
     }
-    handle->pipe.connect_poll_waiting = (revents == 0);
+    if (!revents && entry)
+        sched_poll_enqueue(entry, &handle->pipe.connect_poll_queue, &g_connecting_pipes_lock);
     spinlock_unlock(&g_connecting_pipes_lock);
 
     *out_events = revents;
@@ -50,15 +83,28 @@ static int check_pipesrv_handle(struct pal_handle* handle, pal_wait_flags_t even
 }
 
 static int check_pipe_handle(struct pal_handle* handle, pal_wait_flags_t events,
-                             pal_wait_flags_t* out_events) {
+                             struct sched_poll_entry* entry, pal_wait_flags_t* out_events) {
     assert(handle->hdr.type == PAL_TYPE_PIPECLI || handle->hdr.type == PAL_TYPE_PIPE);
 
     struct pal_handle_inner_pipe_buf* pipe_buf = handle->pipe.pipe_buf;
+    if (!pipe_buf && entry) {
+        /* connecting pipe not yet accepted by the other end, wait for pipe_waitforclient() */
+        spinlock_lock(&g_connecting_pipes_lock);
+        pipe_buf = handle->pipe.pipe_buf;
+        if (!pipe_buf)
+            sched_poll_enqueue(entry, &handle->pipe.connect_poll_queue, &g_connecting_pipes_lock);
+        spinlock_unlock(&g_connecting_pipes_lock);
+    }
     if (!pipe_buf) {
         *out_events = 0;
         return 0;
     }
 
+    if (entry && entry->queue != &pipe_buf->poll_queue) {
+        /* the pipe got connected since the previous scan, move the entry to the pipe buffer */
+        sched_poll_dequeue(entry);
+    }
+
     pal_wait_flags_t revents = 0;
 
     spinlock_lock(&pipe_buf->lock);
@@ -80,14 +126,15 @@ static int check_pipe_handle(struct pal_handle* handle, pal_wait_flags_t events,
 
     if ((events & PAL_WAIT_WRITE) && pipe_buf->writable) {
         /* write event requested, and pipe is opened for write... */
-        if (pipe_buf->write_pos - pipe_buf->read_pos < PIPE_BUF_SIZE) {
-            /* ...and there is room to write */
+        if (pal_common_pipe_buf_free_space(pipe_buf) >= PIPE_ATOMIC_SIZE) {
+            /* ...and there is room for an atomic write (as in Linux) */
             revents |= PAL_WAIT_WRITE;
         }
     }
 
 out:
-    pipe_buf->poll_waiting = (revents == 0);
+    if (!revents && entry)
+        sched_poll_enqueue(entry, &pipe_buf->poll_queue, &pipe_buf->lock);
     spinlock_unlock(&pipe_buf->lock);
 
     *out_events = revents;
@@ -95,33 +142,26 @@ out:
 }
 
 static int check_socket_handle(struct pal_handle* handle, pal_wait_flags_t events,
-                               pal_wait_flags_t* out_events) {
-    pal_wait_flags_t revents = 0;
-
-    spinlock_lock(&handle->sock.lock);
-
-    long peeked = virtio_vsock_peek(handle->sock.fd);
-    if (peeked < 0) {
+                               struct sched_poll_entry* entry, pal_wait_flags_t* out_events) {
+    /* the driver keeps per-connection readiness up to date, so this only reads cached flags (the
+     * socket fd never changes, no need for the handle lock) */
+    uint32_t revents;
+    int ret = virtio_vsock_poll(handle->sock.fd, events, entry, &revents);
+    if (ret < 0 || (revents & PAL_WAIT_ERROR)) {
         /* socket is invalid or was shutdown or in the process of closing */
+        spinlock_lock(&handle->sock.lock);
         handle->flags |= PAL_HANDLE_FD_ERROR;
-        *out_events = PAL_WAIT_ERROR;
         spinlock_unlock(&handle->sock.lock);
+        *out_events = PAL_WAIT_ERROR;
         return 0;
     }
 
-    if ((events & PAL_WAIT_READ) && peeked)
-        revents |= PAL_WAIT_READ;
-
-    if ((events & PAL_WAIT_WRITE) && virtio_vsock_can_write())
-        revents |= PAL_WAIT_WRITE;
-
     *out_events = revents;
-    spinlock_unlock(&handle->sock.lock);
     return 0;
 }
 
 static int check_eventfd_handle(struct pal_handle* handle, pal_wait_flags_t events,
-                                pal_wait_flags_t* out_events) {
+                                struct sched_poll_entry* entry, pal_wait_flags_t* out_events) {
     assert(handle->hdr.type == PAL_TYPE_EVENTFD);
 
     spinlock_lock(&handle->eventfd.lock);
@@ -134,65 +174,73 @@ static int check_eventfd_handle(struct pal_handle* handle, pal_wait_flags_t even
         revents |= PAL_WAIT_WRITE;
     }
 
-    handle->eventfd.poll_waiting = (revents == 0);
+    if (!revents && entry)
+        sched_poll_enqueue(entry, &handle->eventfd.poll_queue, &handle->eventfd.lock);
     *out_events = revents;
     spinlock_unlock(&handle->eventfd.lock);
     return 0;
 }
 
+/* checks the handle for events; if there are none and `entry` is not NULL, also enqueues `entry`
+ * into the wait queue of the handle's object */
 static int check_handle(struct pal_handle* handle, pal_wait_flags_t events,
-                        pal_wait_flags_t* out_events) {
+                        struct sched_poll_entry* entry, pal_wait_flags_t* out_events) {
     if (!handle) {
         *out_events = PAL_WAIT_ERROR;
         return 0;
     }
 
     if (handle->hdr.type == PAL_TYPE_PIPESRV) {
-        return check_pipesrv_handle(handle, events, out_events);
+        return check_pipesrv_handle(handle, events, entry, out_events);
     } else if (handle->hdr.type == PAL_TYPE_PIPECLI || handle->hdr.type == PAL_TYPE_PIPE) {
-        return check_pipe_handle(handle, events, out_events);
+        return check_pipe_handle(handle, events, entry, out_events);
     } else if (handle->hdr.type == PAL_TYPE_SOCKET) {
-        return check_socket_handle(handle, events, out_events);
+        return check_socket_handle(handle, events, entry, out_events);
     } else if (handle->hdr.type == PAL_TYPE_EVENTFD) {
-        return check_eventfd_handle(handle, events, out_events);
+        return check_eventfd_handle(handle, events, entry, out_events);
     }
 
     /* cannot recognize this handle */
     return -PAL_ERROR_INVAL;
 }
 
+static void dequeue_entry(struct pal_handle* handle, struct sched_poll_entry* entry) {
+    if (handle && handle->hdr.type == PAL_TYPE_SOCKET)
+        virtio_vsock_poll_dequeue(entry);
+    else
+        sched_poll_dequeue(entry);
+}
+
 int pal_common_streams_wait_events(size_t count, struct pal_handle** handle_array,
                                    pal_wait_flags_t* events, pal_wait_flags_t* ret_events,
                                    uint64_t* timeout_us) {
     int ret;
-    bool any_event_found = false;
     uint64_t timeout_absolute_us = 0;
     void* timeout = NULL;
 
-    spinlock_lock(&g_streams_waiting_events_lock);
+    struct sched_poll_waiter waiter = {0};
+    struct sched_poll_entry inline_entries[POLL_INLINE_ENTRIES];
+    struct sched_poll_entry* entries = NULL; /* set up only if this poller has to sleep */
+    bool woken_up = false;
+
+    poll_stats_inc(&g_poll_stats.num_polls);
 
     if (timeout_us && *timeout_us != 0) {
         uint64_t curr_time_us;
         ret = get_time_in_us(&curr_time_us);
-        if (ret < 0) {
-            spinlock_unlock(&g_streams_waiting_events_lock);
+        if (ret < 0)
             return ret;
-        }
-
         timeout_absolute_us = curr_time_us + *timeout_us;
-        ret = register_timeout(timeout_absolute_us, &g_streams_waiting_events_futex, &timeout);
-        if (ret < 0) {
-            spinlock_unlock(&g_streams_waiting_events_lock);
-            return ret;
-        }
     }
 
-    while (!any_event_found) {
+    while (true) {
+        bool any_event_found = false;
         for (size_t i = 0; i < count; i++) {
             ret_events[i] = 0;
 
             pal_wait_flags_t revents = 0;
-            ret = check_handle(handle_array[i], events[i], &revents);
+            ret = check_handle(handle_array[i], events[i], entries ? &entries[i] : NULL,
+                               &revents);
             if (ret < 0)
                 goto out;
 
@@ -202,6 +250,9 @@ int pal_common_streams_wait_events(size_t count, struct pal_handle** handle_arra
             }
         }
 
+        if (woken_up)
+            poll_stats_inc(&g_poll_stats.num_rescans);
+
         if (any_event_found)
             break;
 
@@ -220,18 +271,58 @@ int pal_common_streams_wait_events(size_t count, struct pal_handle** handle_arra
                 goto out;
 
             if (timeout_absolute_us <= curr_time_us) {
+                poll_stats_inc(&g_poll_stats.num_timeouts);
                 ret = -PAL_ERROR_TRYAGAIN;
                 goto out;
             }
         }
 
-        /* no events found, need to sleep for any new events */
-        sched_thread_wait(&g_streams_waiting_events_futex, &g_streams_waiting_events_lock);
+        if (woken_up)
+            poll_stats_inc(&g_poll_stats.num_spurious_wakeups);
+
+        if (!entries) {
+            /* no events found, need to sleep: rescan while enqueueing into the wait queues of all
+             * handles, to not miss events that happen after checking the handle */
+            if (count <= ARRAY_SIZE(inline_entries)) {
+                entries = inline_entries;
+            } else {
+                entries = malloc(count * sizeof(*entries));
+                if (!entries) {
+                    ret = -PAL_ERROR_NOMEM;
+                    goto out;
+                }
+            }
+            memset(entries, 0, count * sizeof(*entries));
+            for (size_t i = 0; i < count; i++) {
+                entries[i].waiter = &waiter;
+                entries[i].events = events[i] | PAL_WAIT_ERROR | PAL_WAIT_HANG_UP;
+            }
+
+            if (timeout_absolute_us) {
+                ret = register_timeout_set_futex(timeout_absolute_us, &waiter.futex, &timeout);
+                if (ret < 0)
+                    goto out;
+            }
+            continue;
+        }
+
+        /* a wakeup or the timeout that happened after the previous reset of the futex word makes
+         * this return immediately */
+        poll_stats_inc(&g_poll_stats.num_sleeps);
+        sched_thread_futex_wait(&waiter.futex, 0);
+        __atomic_store_n(&waiter.futex, 0, __ATOMIC_RELAXED);
+        woken_up = true;
     }
 
     ret = 0;
 out:
-    spinlock_unlock(&g_streams_waiting_events_lock);
+    if (entries) {
+        /* the waiter lives on our stack, so no wakeup may be in flight when we return */
+        for (size_t i = 0; i < count; i++)
+            dequeue_entry(handle_array[i], &entries[i]);
+        if (entries != inline_entries)
+            free(entries);
+    }
 
     if (timeout)
         deregister_timeout(timeout);
@@ -6,6 +6,18 @@
  *
  * Two pipes (two ends of the same pipe) share a single buffer object. This buffer object is created
  * when two pipes establish a connection, and it is destroyed when the last of two pipes is closed.
+ *
+ * The buffer is a ring of page slots (PIPE_DEFAULT_BUF_SIZE by default, resizable via the
+ * `pipe.buf_size` attribute). Pages are allocated on write and released once fully read, except for
+ * one spare page that is kept for the next write, so an idle pipe holds at most a page or two.
+ * Resizing moves the pages holding unread data to their new slots, without copying the data.
+ *
+ * Writes of up to PIPE_ATOMIC_SIZE bytes are atomic, as required by POSIX for PIPE_BUF: they wait
+ * (or fail with PAL_ERROR_TRYAGAIN on a non-blocking pipe) until the whole data fits. Once the pipe
+ * becomes empty, both positions move to the next page boundary, so that an empty pipe always has
+ * room for such a write, even if its size is a single page. All pages such a write needs are
+ * allocated (outside of the buffer lock) before any of its bytes is copied, so it never ends up
+ * partially written.
  */
 
 #include "api.h"
@@ -18,6 +30,8 @@
 
 #include "kernel_sched.h"
 
+static_assert(PIPE_ATOMIC_SIZE <= PAGE_SIZE, "atomic pipe writes must span at most two pages");
+
 /* Global lock for all connecting operations: waiting for clients, connecting to server, etc.
  * This lock also protects `pal_handle::pipe.pipe_buf` reference. */
 spinlock_t g_connecting_pipes_lock = INIT_SPINLOCK_UNLOCKED;
@@ -30,6 +44,90 @@ LISTP_TYPE(pal_handle) g_server_pipes_list = LISTP_INIT;
  * each accepting pipe during pipe_waitforclient() */
 LISTP_TYPE(pal_handle) g_connecting_pipes_list = LISTP_INIT;
 
+/* invokes readiness callbacks of both pipe ends, see PalStreamSetNotify() */
+static void pipe_buf_notify(struct pal_handle_inner_pipe_buf* pipe_buf) {
+    assert(spinlock_is_locked(&pipe_buf->lock));
+
+    for (size_t i = 0; i < ARRAY_SIZE(pipe_buf->notify); i++)
+        if (pipe_buf->notify[i].callback)
+            pipe_buf->notify[i].callback(pipe_buf->notify[i].arg);
+}
+
+size_t pal_common_pipe_buf_free_space(struct pal_handle_inner_pipe_buf* pipe_buf) {
+    assert(spinlock_is_locked(&pipe_buf->lock));
+    /* the slot of the page at read_pos becomes writable only after this page is fully read */
+    return ALIGN_DOWN(pipe_buf->read_pos, PAGE_SIZE) + pipe_buf->pages_cnt * PAGE_SIZE
+           - pipe_buf->write_pos;
+}
+
+/* returns how many empty page slots must be filled to write `len` bytes at the write position */
+static size_t pipe_buf_missing_pages(struct pal_handle_inner_pipe_buf* pipe_buf, size_t len) {
+    assert(spinlock_is_locked(&pipe_buf->lock));
+
+    size_t cnt = 0;
+    for (uint64_t pos = ALIGN_DOWN(pipe_buf->write_pos, PAGE_SIZE);
+            pos < pipe_buf->write_pos + len; pos += PAGE_SIZE)
+        if (!pipe_buf->pages[(pos / PAGE_SIZE) % pipe_buf->pages_cnt])
+            cnt++;
+    return cnt;
+}
+
+static void pipe_buf_release_page(struct pal_handle_inner_pipe_buf* pipe_buf, char** slot) {
+    assert(spinlock_is_locked(&pipe_buf->lock));
+
+    if (!pipe_buf->spare_page)
+        pipe_buf->spare_page = *slot;
+    else
+        free(*slot);
+    *slot = NULL;
+}
+
+static void pipe_buf_free(struct pal_handle_inner_pipe_buf* pipe_buf) {
+    if (pipe_buf->pages) {
+        for (size_t i = 0; i < pipe_buf->pages_cnt; i++)
+            free(pipe_buf->pages[i]);
+        free(pipe_buf->pages);
+    }
+    free(pipe_buf->spare_page);
+    free(pipe_buf);
+}
+
+static int pipe_buf_resize(struct pal_handle_inner_pipe_buf* pipe_buf, size_t size) {
+    assert(spinlock_is_locked(&pipe_buf->lock));
+
+    if (!size || !IS_ALIGNED(size, PAGE_SIZE))
+        return -PAL_ERROR_INVAL;
+
+    size_t old_cnt = pipe_buf->pages_cnt;
+    size_t new_cnt = size / PAGE_SIZE;
+
+    /* pages that hold unread data (the last one may be partially written) */
+    uint64_t first_page = pipe_buf->read_pos / PAGE_SIZE;
+    uint64_t end_page   = ALIGN_UP(pipe_buf->write_pos, PAGE_SIZE) / PAGE_SIZE;
+    if (end_page - first_page > new_cnt) {
+        /* unread data doesn't fit into the new size, Linux returns EBUSY in this case */
+        return -PAL_ERROR_OVERFLOW;
+    }
+
+    char** new_pages = calloc(new_cnt, sizeof(*new_pages));
+    if (!new_pages)
+        return -PAL_ERROR_NOMEM;
+
+    for (uint64_t i = first_page; i < end_page; i++) {
+        new_pages[i % new_cnt] = pipe_buf->pages[i % old_cnt];
+        pipe_buf->pages[i % old_cnt] = NULL;
+    }
+
+    /* other slots never hold pages, see pipe_buf_release_page() */
+    for (size_t i = 0; i < old_cnt; i++)
+        assert(!pipe_buf->pages[i]);
+    free(pipe_buf->pages);
+
+    pipe_buf->pages     = new_pages;
+    pipe_buf->pages_cnt = new_cnt;
+    return 0;
+}
+
 static int pipe_listen(struct pal_handle** handle, const char* name, pal_stream_options_t options) {
     int ret;
 
@@ -96,8 +194,7 @@ static int pipe_connect(struct pal_handle** handle, const char* name,
 
     /* notify the other end's waitforclient() and any other waiting events (select/poll) */
     LISTP_ADD(pipe, &g_connecting_pipes_list, list);
-    if (found_server_pipe->pipe.connect_poll_waiting)
-        sched_thread_wakeup(&g_streams_waiting_events_futex);
+    sched_poll_wakeup(&found_server_pipe->pipe.connect_poll_queue, PAL_WAIT_READ);
     sched_thread_wakeup(&found_server_pipe->pipe.connect_futex);
 
     *handle = pipe;
@@ -135,13 +232,20 @@ int pal_common_pipe_waitforclient(struct pal_handle* server, struct pal_handle**
     if (server->hdr.type != PAL_TYPE_PIPESRV)
         return -PAL_ERROR_NOTSERVER;
 
-    struct pal_handle_inner_pipe_buf* pipe_buf = calloc(1, sizeof(*pipe_buf) + PIPE_BUF_SIZE);
+    struct pal_handle_inner_pipe_buf* pipe_buf = calloc(1, sizeof(*pipe_buf));
     if (!pipe_buf)
         return -PAL_ERROR_NOMEM;
 
+    pipe_buf->pages_cnt = PIPE_DEFAULT_BUF_SIZE / PAGE_SIZE;
+    pipe_buf->pages = calloc(pipe_buf->pages_cnt, sizeof(*pipe_buf->pages));
+    if (!pipe_buf->pages) {
+        free(pipe_buf);
+        return -PAL_ERROR_NOMEM;
+    }
+
     struct pal_handle* pipe = calloc(1, sizeof(*pipe));
     if (!pipe) {
-        free(pipe_buf);
+        pipe_buf_free(pipe_buf);
         return -PAL_ERROR_NOMEM;
     }
 
@@ -184,12 +288,15 @@ int pal_common_pipe_waitforclient(struct pal_handle* server, struct pal_handle**
     found_connecting_pipe->pipe.pipe_buf = pipe_buf;
     pipe_buf->refcount = 2;
 
+    /* pollers of the connecting pipe can now wait on the pipe buffer */
+    sched_poll_wakeup(&found_connecting_pipe->pipe.connect_poll_queue, SCHED_POLL_ALL_EVENTS);
+
     *client = pipe;
     ret = 0;
 out:
     spinlock_unlock(&g_connecting_pipes_lock);
     if (ret < 0) {
-        free(pipe_buf);
+        pipe_buf_free(pipe_buf);
         free(pipe);
     }
     return ret;
@@ -234,24 +341,38 @@ int64_t pal_common_pipe_read(struct pal_handle* handle, uint64_t offset, uint64_
     }
 
     assert(pipe_buf->read_pos != pipe_buf->write_pos);
-    assert(pipe_buf->write_pos - pipe_buf->read_pos <= PIPE_BUF_SIZE);
+    assert(pipe_buf->write_pos - pipe_buf->read_pos <= pipe_buf->pages_cnt * PAGE_SIZE);
 
     bytes = 0;
     while (bytes < (ssize_t)len && pipe_buf->read_pos != pipe_buf->write_pos) {
         /* limited by three factors: how much is requested by caller, how much is available in the
-         * pipe buf, and how much left until wrap around in the pipe buf */
+         * pipe buf, and how much left until the end of the current page */
+        size_t offset_in_page = pipe_buf->read_pos % PAGE_SIZE;
         size_t x = MIN(MIN(len - bytes, pipe_buf->write_pos - pipe_buf->read_pos),
-                       ALIGN_UP(pipe_buf->read_pos + 1, PIPE_BUF_SIZE) - pipe_buf->read_pos);
+                       PAGE_SIZE - offset_in_page);
 
-        memcpy(&buf[bytes], &pipe_buf->buf[pipe_buf->read_pos % PIPE_BUF_SIZE], x);
+        char** slot = &pipe_buf->pages[(pipe_buf->read_pos / PAGE_SIZE) % pipe_buf->pages_cnt];
+        assert(*slot);
+        memcpy(&buf[bytes], *slot + offset_in_page, x);
 
         pipe_buf->read_pos += x;
         bytes += x;
+
+        if (offset_in_page + x == PAGE_SIZE) {
+            pipe_buf_release_page(pipe_buf, slot);
+        } else if (pipe_buf->read_pos == pipe_buf->write_pos) {
+            /* pipe became empty in the middle of a page, see the comment at the top of the file */
+            pipe_buf_release_page(pipe_buf, slot);
+            pipe_buf->read_pos = ALIGN_UP(pipe_buf->read_pos, PAGE_SIZE);
+            pipe_buf->write_pos = pipe_buf->read_pos;
+        }
     }
 
 out:
-    if (pipe_buf->poll_waiting)
-        sched_thread_wakeup(&g_streams_waiting_events_futex);
+    if (bytes > 0) {
+        pipe_buf_notify(pipe_buf);
+        sched_poll_wakeup(&pipe_buf->poll_queue, PAL_WAIT_WRITE);
+    }
     sched_thread_wakeup(&pipe_buf->writer_futex);
     spinlock_unlock(&pipe_buf->lock);
     return bytes;
@@ -262,6 +383,11 @@ int64_t pal_common_pipe_write(struct pal_handle* handle, uint64_t offset, uint64
     ssize_t bytes;
     const char* buf = buffer;
 
+    /* pages allocated outside of `pipe_buf->lock`; a write of up to PIPE_ATOMIC_SIZE bytes spans at
+     * most two pages, any other write fills one page at a time */
+    char* reserved_pages[2];
+    size_t reserved_cnt = 0;
+
     if (offset)
         return -PAL_ERROR_INVAL;
 
@@ -280,10 +406,13 @@ int64_t pal_common_pipe_write(struct pal_handle* handle, uint64_t offset, uint64
 
     spinlock_lock(&pipe_buf->lock);
 
-    /* must guarantee that PIPE_BUF_SIZE bytes are written atomically (for a blocking pipe) */
+    /* must guarantee that PIPE_ATOMIC_SIZE bytes are written atomically, i.e. wait until all of
+     * them fit; longer writes may be split */
+    size_t atomic_len = len <= PIPE_ATOMIC_SIZE ? len : 1;
+
     bytes = 0;
     while (bytes < (ssize_t)len) {
-        while (pipe_buf->write_pos - pipe_buf->read_pos == PIPE_BUF_SIZE) {
+        while (pal_common_pipe_buf_free_space(pipe_buf) < (bytes ? 1 : atomic_len)) {
             if (!pipe_buf->readable) {
                 /* pipe was closed for read, this write must fail */
                 bytes = -PAL_ERROR_CONNFAILED_PIPE;
@@ -296,28 +425,75 @@ int64_t pal_common_pipe_write(struct pal_handle* handle, uint64_t offset, uint64
                 goto out;
             }
 
-            if (pipe_buf->poll_waiting)
-                sched_thread_wakeup(&g_streams_waiting_events_futex);
+            if (bytes > 0) {
+                pipe_buf_notify(pipe_buf);
+                sched_poll_wakeup(&pipe_buf->poll_queue, PAL_WAIT_READ);
+            }
             sched_thread_wakeup(&pipe_buf->reader_futex);
             sched_thread_wait(&pipe_buf->writer_futex, &pipe_buf->lock);
         }
 
         /* limited by three factors: how much is requested by caller, how much left for writing in
-         * the pipe buf, and how much left until wrap around in the pipe buf */
-        size_t x = MIN(MIN(len - bytes, PIPE_BUF_SIZE - (pipe_buf->write_pos - pipe_buf->read_pos)),
-                       ALIGN_UP(pipe_buf->write_pos + 1, PIPE_BUF_SIZE) - pipe_buf->write_pos);
+         * the pipe buf, and how much left until the end of the current page */
+        size_t offset_in_page = pipe_buf->write_pos % PAGE_SIZE;
+        size_t x = MIN(MIN(len - bytes, pal_common_pipe_buf_free_space(pipe_buf)),
+                       PAGE_SIZE - offset_in_page);
+
+        /* all pages of an atomic write are reserved before copying any of its bytes, so that it
+         * cannot be cut short by a failed allocation */
+        size_t missing = pipe_buf_missing_pages(pipe_buf, bytes ? x : MAX(x, atomic_len));
+        if (missing > reserved_cnt + (pipe_buf->spare_page ? 1 : 0)) {
+            /* allocate without holding the lock; the pipe may change meanwhile, so re-check it */
+            spinlock_unlock(&pipe_buf->lock);
+            bool nomem = false;
+            while (reserved_cnt < missing) {
+                char* page = malloc(PAGE_SIZE);
+                if (!page) {
+                    nomem = true;
+                    break;
+                }
+                reserved_pages[reserved_cnt++] = page;
+            }
+            spinlock_lock(&pipe_buf->lock);
+            if (nomem) {
+                if (!bytes)
+                    bytes = -PAL_ERROR_NOMEM;
+                goto out;
+            }
+            continue;
+        }
 
-        memcpy(&pipe_buf->buf[pipe_buf->write_pos % PIPE_BUF_SIZE], &buf[bytes], x);
+        char** slot = &pipe_buf->pages[(pipe_buf->write_pos / PAGE_SIZE) % pipe_buf->pages_cnt];
+        if (!*slot) {
+            assert(!offset_in_page);
+            if (pipe_buf->spare_page) {
+                *slot = pipe_buf->spare_page;
+                pipe_buf->spare_page = NULL;
+            } else {
+                assert(reserved_cnt);
+                *slot = reserved_pages[--reserved_cnt];
+            }
+        }
+        memcpy(*slot + offset_in_page, &buf[bytes], x);
 
         pipe_buf->write_pos += x;
         bytes += x;
     }
 
 out:
-    if (pipe_buf->poll_waiting)
-        sched_thread_wakeup(&g_streams_waiting_events_futex);
+    if (bytes != -PAL_ERROR_TRYAGAIN) {
+        pipe_buf_notify(pipe_buf);
+        /* a failed write means that the pipe was closed for read, which is of interest to all */
+        sched_poll_wakeup(&pipe_buf->poll_queue,
+                          bytes > 0 ? PAL_WAIT_READ : SCHED_POLL_ALL_EVENTS);
+    }
     sched_thread_wakeup(&pipe_buf->reader_futex);
+    if (reserved_cnt && !pipe_buf->spare_page)
+        pipe_buf->spare_page = reserved_pages[--reserved_cnt];
     spinlock_unlock(&pipe_buf->lock);
+
+    while (reserved_cnt)
+        free(reserved_pages[--reserved_cnt]);
     return bytes;
 }
 
@@ -368,16 +544,17 @@ void pal_common_pipe_destroy(struct pal_handle* handle) {
         } else if (new_count > 0) {
             spinlock_lock(&pipe_buf->lock);
             pipe_buf->readable = pipe_buf->writable = false; /* close both pipe ends */
+            for (size_t i = 0; i < ARRAY_SIZE(pipe_buf->notify); i++)
+                if (pipe_buf->notify[i].handle == handle)
+                    memset(&pipe_buf->notify[i], 0, sizeof(pipe_buf->notify[i]));
+            pipe_buf_notify(pipe_buf);
+            sched_poll_wakeup(&pipe_buf->poll_queue, SCHED_POLL_ALL_EVENTS);
             sched_thread_wakeup(&pipe_buf->reader_futex);
             sched_thread_wakeup(&pipe_buf->writer_futex);
-            if (pipe_buf->poll_waiting) {
-                /* should be impossible: poll waits on a pipe that is freed?! just in case */
-                sched_thread_wakeup(&g_streams_waiting_events_futex);
-            }
             spinlock_unlock(&pipe_buf->lock);
         } else {
             assert(!new_count);
-            free(pipe_buf);
+            pipe_buf_free(pipe_buf);
         }
     }
 
@@ -403,8 +580,7 @@ int pal_common_pipe_delete(struct pal_handle* handle, enum pal_delete_mode delet
     struct pal_handle_inner_pipe_buf* pipe_buf = NULL;
 
     spinlock_lock(&g_connecting_pipes_lock);
-    if (handle->pipe.connect_poll_waiting)
-        sched_thread_wakeup(&g_streams_waiting_events_futex);
+    sched_poll_wakeup(&handle->pipe.connect_poll_queue, SCHED_POLL_ALL_EVENTS);
     pipe_buf = handle->pipe.pipe_buf;
     spinlock_unlock(&g_connecting_pipes_lock);
 
@@ -414,8 +590,8 @@ int pal_common_pipe_delete(struct pal_handle* handle, enum pal_delete_mode delet
             pipe_buf->readable = false;
         if (delete_mode == PAL_DELETE_ALL || delete_mode == PAL_DELETE_WRITE)
             pipe_buf->writable = false;
-        if (pipe_buf->poll_waiting)
-            sched_thread_wakeup(&g_streams_waiting_events_futex);
+        pipe_buf_notify(pipe_buf);
+        sched_poll_wakeup(&pipe_buf->poll_queue, SCHED_POLL_ALL_EVENTS);
         spinlock_unlock(&pipe_buf->lock);
     }
 
@@ -426,6 +602,7 @@ int pal_common_pipe_attrquerybyhdl(struct pal_handle* handle, PAL_STREAM_ATTR* a
     attr->handle_type  = handle->hdr.type;
     attr->nonblocking  = handle->pipe.nonblocking;
     attr->pending_size = 0;
+    attr->pipe.buf_size = PIPE_DEFAULT_BUF_SIZE;
 
     struct pal_handle_inner_pipe_buf* pipe_buf = NULL;
     spinlock_lock(&g_connecting_pipes_lock);
@@ -435,7 +612,8 @@ int pal_common_pipe_attrquerybyhdl(struct pal_handle* handle, PAL_STREAM_ATTR* a
     if (pipe_buf) {
         spinlock_lock(&pipe_buf->lock);
         attr->pending_size = pipe_buf->write_pos - pipe_buf->read_pos;
-        assert(attr->pending_size <= PIPE_BUF_SIZE);
+        attr->pipe.buf_size = pipe_buf->pages_cnt * PAGE_SIZE;
+        assert(attr->pending_size <= attr->pipe.buf_size);
         spinlock_unlock(&pipe_buf->lock);
     }
 
@@ -443,6 +621,70 @@ int pal_common_pipe_attrquerybyhdl(struct pal_handle* handle, PAL_STREAM_ATTR* a
 }
 
 int pal_common_pipe_attrsetbyhdl(struct pal_handle* handle, PAL_STREAM_ATTR* attr) {
+    struct pal_handle_inner_pipe_buf* pipe_buf = NULL;
+    spinlock_lock(&g_connecting_pipes_lock);
+    pipe_buf = handle->pipe.pipe_buf;
+    spinlock_unlock(&g_connecting_pipes_lock);
+
+    if (pipe_buf && attr->pipe.buf_size) {
+        int ret = 0;
+        spinlock_lock(&pipe_buf->lock);
+        if (attr->pipe.buf_size != pipe_buf->pages_cnt * PAGE_SIZE) {
+            ret = pipe_buf_resize(pipe_buf, attr->pipe.buf_size);
+            if (!ret) {
+                /* a bigger buffer may have room for blocked writers */
+                pipe_buf_notify(pipe_buf);
+                sched_poll_wakeup(&pipe_buf->poll_queue, PAL_WAIT_WRITE);
+                sched_thread_wakeup(&pipe_buf->writer_futex);
+            }
+        }
+        spinlock_unlock(&pipe_buf->lock);
+        if (ret < 0)
+            return ret;
+    }
+
     handle->pipe.nonblocking = attr->nonblocking;
     return 0;
 }
+
+int pal_common_pipe_setnotify(struct pal_handle* handle, pal_stream_notify_cb_t callback,
+                              void* arg) {
+    if (handle->hdr.type != PAL_TYPE_PIPECLI && handle->hdr.type != PAL_TYPE_PIPE)
+        return -PAL_ERROR_NOTSUPPORT;
+
+    spinlock_lock(&g_connecting_pipes_lock);
+    struct pal_handle_inner_pipe_buf* pipe_buf = handle->pipe.pipe_buf;
+    spinlock_unlock(&g_connecting_pipes_lock);
+
+    if (!pipe_buf)
+        return -PAL_ERROR_NOTCONNECTION;
+
+    int ret = 0;
+    spinlock_lock(&pipe_buf->lock);
+
+    /* find the slot of this pipe end, or a free slot if the callback is not yet installed */
+    ssize_t slot = -1;
+    for (size_t i = 0; i < ARRAY_SIZE(pipe_buf->notify); i++) {
+        if (pipe_buf->notify[i].handle == handle) {
+            slot = i;
+            break;
+        }
+        if (!pipe_buf->notify[i].handle && slot < 0)
+            slot = i;
+    }
+
+    if (!callback) {
+        if (slot >= 0 && pipe_buf->notify[slot].handle == handle)
+            memset(&pipe_buf->notify[slot], 0, sizeof(pipe_buf->notify[slot]));
+    } else if (slot < 0) {
+        /* cannot happen: a pipe buffer is shared by exactly two pipe ends */
+        ret = -PAL_ERROR_NOMEM;
+    } else {
+        pipe_buf->notify[slot].handle   = handle;
+        pipe_buf->notify[slot].callback = callback;
+        pipe_buf->notify[slot].arg      = arg;
+    }
+
+    spinlock_unlock(&pipe_buf->lock);
+    return ret;
+}
@@ -37,8 +37,9 @@ static size_t g_default_send_buf_size = 0x4000;
 static int g_sockets_reader_futex;
 static int g_sockets_writer_futex;
 
+/* pollers (PalStreamsWaitEvents) are not woken up here: they wait on per-connection queues, see
+ * virtio_vsock_poll() */
 void thread_wakeup_vsock(bool is_read) {
-    sched_thread_wakeup(&g_streams_waiting_events_futex);
     sched_thread_wakeup(is_read ? &g_sockets_reader_futex : &g_sockets_writer_futex);
 }
 
@@ -358,7 +359,27 @@ static int pal_common_socket_attrsetbyhdl(struct pal_handle* handle, PAL_STREAM_
 
     int ret = virtio_vsock_set_socket_options(handle->sock.fd, handle->sock.ipv6_v6only,
                                               handle->sock.reuseport);
+    if (ret < 0)
+        goto out;
+
+    if (attr->socket.send_buf_size != handle->sock.send_buf_size) {
+        /* only an explicit SO_SNDBUF limits the connection's bytes in flight, the default value
+         * reported to the app is not enforced (similar to autotuning in Linux) */
+        ret = virtio_vsock_set_send_buf_size(handle->sock.fd, attr->socket.send_buf_size);
+        if (ret < 0)
+            goto out;
+        handle->sock.send_buf_size = attr->socket.send_buf_size;
+    }
+
+out:
+    spinlock_unlock(&handle->sock.lock);
+    return ret;
+}
 
+static int pal_common_socket_setnotify(struct pal_handle* handle, pal_stream_notify_cb_t callback,
+                                      void* arg) {
+    spinlock_lock(&handle->sock.lock);
+    int ret = virtio_vsock_set_notify(handle->sock.fd, callback, arg);
     spinlock_unlock(&handle->sock.lock);
     return ret;
 }
@@ -439,51 +460,25 @@ static int pal_common_tcp_recv(struct pal_handle* handle, struct iovec* iov, siz
 
     spinlock_lock(&handle->sock.lock);
 
-    size_t total_bytes = 0;
-    size_t iov_idx = 0;
-    while (iov_idx < iov_len) {
-        if (!iov[iov_idx].iov_base || !iov[iov_idx].iov_len) {
-            iov_idx++;
-            continue;
-        }
-
-        int64_t bytes = virtio_vsock_read(handle->sock.fd, iov[iov_idx].iov_base,
-                                          iov[iov_idx].iov_len);
-        if (bytes < 0) {
-            if (bytes != -PAL_ERROR_TRYAGAIN) {
-                /* unrecoverable error, fail immediately */
-                spinlock_unlock(&handle->sock.lock);
-                return bytes;
-            }
-            if (total_bytes) {
-                /* don't wait/error out if received something; consider this call successful */
-                goto out;
-            }
-            if (!handle->sock.is_nonblocking && !force_nonblocking) {
-                /* blocking socket that didn't receive anything must wait */
-                sched_thread_wait(&g_sockets_reader_futex, &handle->sock.lock);
-                continue;
-            }
+    int64_t bytes;
+    while (true) {
+        /* scatter read: all iovecs are filled directly from the connection's receive ring */
+        bytes = virtio_vsock_readv(handle->sock.fd, iov, iov_len);
+        if (bytes != -PAL_ERROR_TRYAGAIN)
+            break;
+        if (handle->sock.is_nonblocking || force_nonblocking) {
             /* non-blocking socket that didn't receive anything must error out with TRYAGAIN */
-            spinlock_unlock(&handle->sock.lock);
-            return -PAL_ERROR_TRYAGAIN;
-        }
-
-        /* read succeeded, at least partially */
-        total_bytes += bytes;
-
-        if ((size_t)bytes < iov[iov_idx].iov_len) {
-            /* partial read, let's not try further; should be a rare condition */
-            goto out;
+            break;
         }
-
-        assert((size_t)bytes == iov[iov_idx].iov_len);
-        iov_idx++;
+        /* blocking socket that didn't receive anything must wait */
+        sched_thread_wait(&g_sockets_reader_futex, &handle->sock.lock);
     }
 
-out:
     spinlock_unlock(&handle->sock.lock);
-    *out_total_size = total_bytes;
+    if (bytes < 0)
+        return bytes;
+
+    *out_total_size = bytes;
     return 0;
 }
 
@@ -553,6 +548,7 @@ static struct handle_ops g_tcp_handle_ops = {
     .attrsetbyhdl = pal_common_socket_attrsetbyhdl,
     .delete = pal_common_tcp_delete,
     .destroy = pal_common_socket_destroy,
+    .setnotify = pal_common_socket_setnotify,
 };
 
 static struct handle_ops g_udp_handle_ops = {
@@ -560,4 +556,5 @@ static struct handle_ops g_udp_handle_ops = {
     .attrsetbyhdl = pal_common_socket_attrsetbyhdl,
     .delete = pal_common_udp_delete,
     .destroy = pal_common_socket_destroy,
+    .setnotify = pal_common_socket_setnotify,
 };
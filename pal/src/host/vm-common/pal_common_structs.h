@@ -43,6 +43,7 @@ struct pal_handle_inner_file {
     /* below fields are used only for trusted files */
     size_t size;
     void*  chunk_hashes; /* array of hashes of file chunks (of type tdx_chunk_hash_t) */
+    void*  trusted_file; /* corresponding trusted file (of type struct trusted_file) */
 };
 
 struct pal_handle_inner_dir {
@@ -61,12 +62,25 @@ struct pal_handle_inner_pipe_buf {
     int        refcount;
     bool       writable;
     bool       readable;
-    uint64_t   write_pos;    /* must be always used as buf[write_pos % PIPE_BUF_SIZE] */
-    uint64_t   read_pos;     /* must be always used as buf[read_pos % PIPE_BUF_SIZE] */
+    /* byte at position `pos` lives in pages[(pos / PAGE_SIZE) % pages_cnt] at offset
+     * `pos % PAGE_SIZE`; a page slot is reused only after the page is fully read */
+    uint64_t   write_pos;
+    uint64_t   read_pos;
     int        writer_futex;
     int        reader_futex;
-    bool       poll_waiting; /* for PalStreamsWaitEvents; protected by lock */
-    char       buf[];        /* ring buffer of size PIPE_BUF_SIZE */
+    /* pollers of both pipe ends (see PalStreamsWaitEvents); protected by lock */
+    LISTP_TYPE(sched_poll_entry) poll_queue;
+    /* readiness callbacks of the two pipe ends (see PalStreamSetNotify); protected by lock */
+    struct {
+        struct pal_handle* handle;
+        void (*callback)(void* arg);
+        void* arg;
+    } notify[2];
+    /* ring of pages_cnt page slots (capacity of the pipe, see F_SETPIPE_SZ); only slots holding
+     * unread data have pages, a fully read page is kept as `spare_page` for the next write */
+    size_t     pages_cnt;
+    char**     pages;
+    char*      spare_page;
 };
 
 struct pal_handle_inner_pipe {
@@ -75,7 +89,10 @@ struct pal_handle_inner_pipe {
 
     /* only for pipesrv type */
     int  connect_futex;
-    bool connect_poll_waiting; /* for PalStreamsWaitEvents; protected by g_connecting_pipes_lock */
+
+    /* pollers waiting for an incoming connection (pipesrv type) or for being accepted (pipe type);
+     * protected by g_connecting_pipes_lock */
+    LISTP_TYPE(sched_poll_entry) connect_poll_queue;
 
     /* only for pipe/pipecli types -- read/write ends of the pipe */
     struct pal_handle_inner_pipe_buf* pipe_buf; /* protected by g_connecting_pipes_lock */
@@ -126,5 +143,7 @@ struct pal_handle_inner_eventfd {
     uint64_t val;
     int  writer_futex;
     int  reader_futex;
-    bool poll_waiting; /* for PalStreamsWaitEvents; protected by lock */
+    LISTP_TYPE(sched_poll_entry) poll_queue; /* for PalStreamsWaitEvents; protected by lock */
+    void (*notify_callback)(void* arg); /* see PalStreamSetNotify; protected by lock */
+    void* notify_arg;
 };
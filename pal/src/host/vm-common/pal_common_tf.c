@@ -20,6 +20,8 @@
 #include "toml_utils.h"
 
 #include "kernel_files.h"
+#include "kernel_multicore.h"
+#include "kernel_sched.h"
 #include "kernel_virtio.h"
 
 DEFINE_LISTP(trusted_file);
@@ -27,15 +29,71 @@ static LISTP_TYPE(trusted_file) g_trusted_file_list = LISTP_INIT;
 static spinlock_t g_trusted_file_lock = INIT_SPINLOCK_UNLOCKED;
 static int g_file_check_policy = FILE_CHECK_POLICY_STRICT;
 
+/*
+ * Verified-chunk cache: contents of trusted-file chunks that were already read into private memory
+ * and verified. Reads and mmaps copy cached chunks instead of re-reading them via virtio-fs and
+ * re-hashing them. The total size of the cache is bounded by "tdx.trusted_files_cache_size", the
+ * least recently used chunks are evicted first.
+ *
+ * The cache is filled with chunks of small requests (up to TF_CACHE_MAX_REQUEST_SIZE, plus a few
+ * chunks read ahead), with partially requested chunks of any request, and with whole files of up to
+ * a quarter of the cache size when they are opened for the first time (so that e.g. mmaps of a
+ * freshly opened shared library don't re-read it). Full chunks of big requests are not cached, so
+ * that e.g. mmaps of huge files don't flush the cache.
+ */
+#define TF_CACHE_DEFAULT_SIZE     (32 * 1024 * 1024UL)
+#define TF_CACHE_MAX_REQUEST_SIZE (256 * 1024UL)
+#define TF_READ_AHEAD_CHUNKS      8
+#define TF_STAGING_SIZE           (TF_CACHE_MAX_REQUEST_SIZE + TF_READ_AHEAD_CHUNKS * TRUSTED_CHUNK_SIZE)
+
+/* runs of chunks of at least this size are hashed also by idle CPUs */
+#define TF_PARALLEL_HASH_MIN_SIZE (1024 * 1024UL)
+
+DEFINE_LIST(tf_cached_chunk);
+struct tf_cached_chunk {
+    LIST_TYPE(tf_cached_chunk) lru_list;
+    struct trusted_file* tf;
+    size_t idx;
+    size_t size;
+    uint8_t data[];
+};
+DEFINE_LISTP(tf_cached_chunk);
+
+/* protects the LRU list, the cache size and `cached_chunks` arrays of all trusted files */
+static spinlock_t g_tf_cache_lock = INIT_SPINLOCK_UNLOCKED;
+static LISTP_TYPE(tf_cached_chunk) g_tf_cache_lru = LISTP_INIT; /* most recently used first */
+static size_t g_tf_cache_size = 0;
+static uint64_t g_tf_cache_max_size = TF_CACHE_DEFAULT_SIZE;
+
 static int register_file(const char* uri, const char* hash_str, bool check_duplicates);
 
-static int read_whole_buf(struct pal_handle* handle, void* buf, uint64_t size, uint64_t offset) {
-    uint64_t bytes_read = 0;
-    while (bytes_read < size) {
+struct read_whole_buf_ctx {
+    virtio_fs_progress_cb_t progress;
+    void* progress_arg;
+    uint64_t bytes_read;
+};
+
+static void read_whole_buf_progress(void* arg, uint64_t done_size) {
+    struct read_whole_buf_ctx* ctx = arg;
+    ctx->progress(ctx->progress_arg, ctx->bytes_read + done_size);
+}
+
+/* if `progress` is not NULL, it is called with the number of bytes at the start of `buf` that are
+ * already read, while the rest of `buf` is still being read */
+static int read_whole_buf(struct pal_handle* handle, void* buf, uint64_t size, uint64_t offset,
+                          virtio_fs_progress_cb_t progress, void* progress_arg) {
+    struct read_whole_buf_ctx ctx = {
+        .progress = progress,
+        .progress_arg = progress_arg,
+        .bytes_read = 0,
+    };
+    while (ctx.bytes_read < size) {
         uint64_t read_size;
-        int ret = virtio_fs_fuse_read(handle->file.nodeid, handle->file.fh,
-                                      MIN(size - bytes_read, FILE_CHUNK_SIZE), bytes_read + offset,
-                                      buf + bytes_read, &read_size);
+        int ret = virtio_fs_fuse_read_progress(handle->file.nodeid, handle->file.fh,
+                                               MIN(size - ctx.bytes_read, FILE_CHUNK_SIZE),
+                                               ctx.bytes_read + offset, buf + ctx.bytes_read,
+                                               progress ? read_whole_buf_progress : NULL, &ctx,
+                                               &read_size);
         if (ret < 0) {
             if (ret == -PAL_ERROR_INTERRUPTED)
                 continue;
@@ -43,12 +101,256 @@ static int read_whole_buf(struct pal_handle* handle, void* buf, uint64_t size, u
         }
         if (read_size == 0)
             return -PAL_ERROR_INVAL; /* unexpected EOF */
-        bytes_read += read_size;
+        ctx.bytes_read += read_size;
     }
-    assert(bytes_read == size);
+    assert(ctx.bytes_read == size);
     return 0;
 }
 
+static int hash_chunk(const uint8_t* data, size_t size, tdx_chunk_hash_t* out_hash) {
+    tdx_chunk_hash_t chunk_hash[2]; /* each chunk_hash is 128 bits in size but we need 256 */
+    static_assert(sizeof(chunk_hash) * 8 == 256, "");
+
+    LIB_SHA256_CONTEXT chunk_sha;
+    int ret = lib_SHA256Init(&chunk_sha);
+    if (ret < 0)
+        return ret;
+
+    ret = lib_SHA256Update(&chunk_sha, data, size);
+    if (ret < 0)
+        return ret;
+
+    ret = lib_SHA256Final(&chunk_sha, (uint8_t*)&chunk_hash[0]);
+    if (ret < 0)
+        return ret;
+
+    /* note that we truncate SHA256 to 128 bits */
+    memcpy(out_hash, &chunk_hash[0], sizeof(*out_hash));
+    return 0;
+}
+
+/* copies `size` bytes at `offset` inside chunk `idx` from the cache; returns false on cache miss */
+static bool tf_cache_read(struct trusted_file* tf, size_t idx, size_t offset, size_t size,
+                          uint8_t* dst) {
+    bool found = false;
+
+    spinlock_lock(&g_tf_cache_lock);
+    struct tf_cached_chunk* chunk = idx < tf->cached_chunks_cnt ? tf->cached_chunks[idx] : NULL;
+    if (chunk && offset + size <= chunk->size) {
+        memcpy(dst, chunk->data + offset, size);
+        if (LISTP_FIRST_ENTRY(&g_tf_cache_lru, struct tf_cached_chunk, lru_list) != chunk) {
+            LISTP_DEL(chunk, &g_tf_cache_lru, lru_list);
+            LISTP_ADD(chunk, &g_tf_cache_lru, lru_list);
+        }
+        found = true;
+    }
+    spinlock_unlock(&g_tf_cache_lock);
+
+    return found;
+}
+
+static bool tf_cache_contains(struct trusted_file* tf, size_t idx) {
+    spinlock_lock(&g_tf_cache_lock);
+    bool found = idx < tf->cached_chunks_cnt && tf->cached_chunks[idx];
+    spinlock_unlock(&g_tf_cache_lock);
+    return found;
+}
+
+/* inserts a verified chunk into the cache, evicting least recently used chunks if needed; the cache
+ * is best effort, so allocation failures are ignored */
+static void tf_cache_insert(struct trusted_file* tf, size_t idx, const uint8_t* data, size_t size) {
+    if (size > g_tf_cache_max_size)
+        return;
+
+    if (!__atomic_load_n(&tf->cached_chunks, __ATOMIC_ACQUIRE)) {
+        size_t chunks_cnt = UDIV_ROUND_UP(tf->size, TRUSTED_CHUNK_SIZE);
+        struct tf_cached_chunk** cached_chunks = calloc(chunks_cnt, sizeof(*cached_chunks));
+        if (!cached_chunks)
+            return;
+
+        spinlock_lock(&g_tf_cache_lock);
+        if (!tf->cached_chunks) {
+            tf->cached_chunks_cnt = chunks_cnt;
+            __atomic_store_n(&tf->cached_chunks, cached_chunks, __ATOMIC_RELEASE);
+            cached_chunks = NULL;
+        }
+        spinlock_unlock(&g_tf_cache_lock);
+        free(cached_chunks);
+    }
+
+    struct tf_cached_chunk* new = malloc(sizeof(*new) + size);
+    if (!new)
+        return;
+    new->tf   = tf;
+    new->idx  = idx;
+    new->size = size;
+    memcpy(new->data, data, size);
+
+    LISTP_TYPE(tf_cached_chunk) evicted = LISTP_INIT;
+
+    spinlock_lock(&g_tf_cache_lock);
+    if (idx >= tf->cached_chunks_cnt || tf->cached_chunks[idx]) {
+        /* file size changed or the chunk was cached concurrently */
+        spinlock_unlock(&g_tf_cache_lock);
+        free(new);
+        return;
+    }
+
+    while (g_tf_cache_size + size > g_tf_cache_max_size) {
+        assert(!LISTP_EMPTY(&g_tf_cache_lru));
+        struct tf_cached_chunk* victim = LISTP_LAST_ENTRY(&g_tf_cache_lru, struct tf_cached_chunk,
+                                                          lru_list);
+        LISTP_DEL(victim, &g_tf_cache_lru, lru_list);
+        victim->tf->cached_chunks[victim->idx] = NULL;
+        g_tf_cache_size -= victim->size;
+        LISTP_ADD(victim, &evicted, lru_list);
+    }
+
+    tf->cached_chunks[idx] = new;
+    LISTP_ADD(new, &g_tf_cache_lru, lru_list);
+    g_tf_cache_size += size;
+    spinlock_unlock(&g_tf_cache_lock);
+
+    struct tf_cached_chunk* victim;
+    struct tf_cached_chunk* tmp;
+    LISTP_FOR_EACH_ENTRY_SAFE(victim, tmp, &evicted, lru_list) {
+        LISTP_DEL(victim, &evicted, lru_list);
+        free(victim);
+    }
+}
+
+/*
+ * Verification of a run of consecutive chunks that is read via virtio-fs in one go: chunks are
+ * hashed as soon as their data arrives, while the rest of the run is still in flight. Big runs are
+ * additionally published as idle work, so that idle CPUs hash chunks in parallel with the reading
+ * thread; chunks are claimed via the `next_idx` cursor, so each chunk is hashed exactly once.
+ */
+struct tf_verify_job {
+    struct sched_idle_work work;
+    const tdx_chunk_hash_t* chunk_hashes; /* reference hashes of the chunks of the run */
+    const uint8_t* data;
+    size_t size;       /* size of the run, only its last chunk may be shorter than a full chunk */
+    size_t chunks_cnt;
+    bool parallel;     /* published as idle work */
+    size_t ready_cnt;  /* chunks whose data already arrived, accessed atomically */
+    size_t next_idx;   /* next chunk to hash, accessed atomically */
+    size_t bad_idx;    /* some chunk with mismatching hash, or SIZE_MAX; accessed atomically */
+    int error;         /* error during hashing, accessed atomically */
+};
+
+static void tf_verify_help(void* arg) {
+    struct tf_verify_job* job = arg;
+
+    size_t idx = __atomic_load_n(&job->next_idx, __ATOMIC_RELAXED);
+    while (idx < __atomic_load_n(&job->ready_cnt, __ATOMIC_ACQUIRE)) {
+        if (!__atomic_compare_exchange_n(&job->next_idx, &idx, idx + 1, /*weak=*/true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue;
+
+        size_t chunk_offset = idx * TRUSTED_CHUNK_SIZE;
+        tdx_chunk_hash_t chunk_hash;
+        int ret = hash_chunk(job->data + chunk_offset,
+                             MIN(job->size - chunk_offset, TRUSTED_CHUNK_SIZE), &chunk_hash);
+        if (ret < 0) {
+            __atomic_store_n(&job->error, ret, __ATOMIC_RELAXED);
+        } else if (memcmp(&job->chunk_hashes[idx], &chunk_hash, sizeof(chunk_hash))) {
+            __atomic_store_n(&job->bad_idx, idx, __ATOMIC_RELAXED);
+        }
+
+        idx = __atomic_load_n(&job->next_idx, __ATOMIC_RELAXED);
+    }
+}
+
+static void tf_verify_progress(void* arg, uint64_t done_size) {
+    struct tf_verify_job* job = arg;
+
+    size_t ready_cnt = done_size == job->size ? job->chunks_cnt : done_size / TRUSTED_CHUNK_SIZE;
+    __atomic_store_n(&job->ready_cnt, ready_cnt, __ATOMIC_RELEASE);
+    if (job->parallel)
+        sched_kick_idle_cpus();
+
+    tf_verify_help(job);
+}
+
+/* reads chunks of the run [offset, offset + size) of the file into `buf` and verifies them; `offset`
+ * must be aligned to TRUSTED_CHUNK_SIZE and `size` must end at a chunk boundary or at end of file */
+static int read_and_verify_run(struct pal_handle* file, struct trusted_file* tf, uint8_t* buf,
+                               uint64_t offset, size_t size) {
+    assert(IS_ALIGNED(offset, TRUSTED_CHUNK_SIZE));
+
+    struct tf_verify_job job = {
+        .chunk_hashes = tf->chunk_hashes + offset / TRUSTED_CHUNK_SIZE,
+        .data = buf,
+        .size = size,
+        .chunks_cnt = UDIV_ROUND_UP(size, TRUSTED_CHUNK_SIZE),
+        .bad_idx = SIZE_MAX,
+    };
+    job.work = (struct sched_idle_work){ .help = tf_verify_help, .arg = &job };
+    job.parallel = size >= TF_PARALLEL_HASH_MIN_SIZE && g_num_cpus > 1
+                       && sched_idle_work_publish(&job.work);
+
+    int ret = read_whole_buf(file, buf, size, offset, tf_verify_progress, &job);
+    if (ret == 0) {
+        /* hash the chunks that are not yet claimed by anyone */
+        __atomic_store_n(&job.ready_cnt, job.chunks_cnt, __ATOMIC_RELEASE);
+        tf_verify_help(&job);
+    }
+
+    /* wait until idle CPUs finish the chunks they claimed */
+    if (job.parallel)
+        sched_idle_work_retract(&job.work);
+
+    if (ret < 0)
+        return ret;
+    if (job.error < 0)
+        return job.error;
+
+    if (job.bad_idx != SIZE_MAX) {
+        uint64_t chunk_offset = offset + job.bad_idx * TRUSTED_CHUNK_SIZE;
+        log_error("Accessing file '%s' is denied: incorrect hash of file chunk at %lu-%lu.",
+                  file->file.realpath, chunk_offset,
+                  chunk_offset + MIN(size - job.bad_idx * TRUSTED_CHUNK_SIZE, TRUSTED_CHUNK_SIZE));
+        return -PAL_ERROR_DENIED;
+    }
+    return 0;
+}
+
+/* Initial hashing of a whole trusted file, overlapped with reading it: whole-file hash and chunk
+ * hashes are updated as soon as data of complete chunks arrives */
+struct tf_load_job {
+    LIB_SHA256_CONTEXT file_sha;
+    tdx_chunk_hash_t* chunk_hashes; /* hashes of the chunks in `data` */
+    const uint8_t* data;
+    size_t size;
+    size_t hashed_size;
+    int error;
+};
+
+static void tf_load_progress(void* arg, uint64_t done_size) {
+    struct tf_load_job* job = arg;
+
+    while (!job->error && job->hashed_size < done_size) {
+        size_t chunk_size = MIN(job->size - job->hashed_size, TRUSTED_CHUNK_SIZE);
+        if (job->hashed_size + chunk_size > done_size)
+            break;
+
+        /* For each file chunk of size TRUSTED_CHUNK_SIZE, generate 128-bit hash from SHA-256 hash
+         * over contents of this file chunk (we simply truncate SHA-256 hash to first 128 bits; this
+         * is fine for integrity purposes). Also, generate a SHA-256 hash for the whole file
+         * contents to compare with the manifest "reference" hash value. */
+        const uint8_t* chunk = job->data + job->hashed_size;
+        int ret = lib_SHA256Update(&job->file_sha, chunk, chunk_size);
+        if (ret == 0)
+            ret = hash_chunk(chunk, chunk_size,
+                             &job->chunk_hashes[job->hashed_size / TRUSTED_CHUNK_SIZE]);
+        if (ret < 0) {
+            job->error = ret;
+            break;
+        }
+        job->hashed_size += chunk_size;
+    }
+}
+
 /* assumes `path` is normalized */
 static bool path_is_equal_or_subpath(const struct trusted_file* tf, const char* path,
                                      size_t path_len) {
@@ -105,6 +407,7 @@ struct trusted_file* get_trusted_or_allowed_file(const char* path) {
     return tf;
 }
 
+
 int load_trusted_or_allowed_file(struct trusted_file* tf, struct pal_handle* file, bool create,
                                  void** out_chunk_hashes) {
     int ret;
@@ -123,7 +426,7 @@ int load_trusted_or_allowed_file(struct trusted_file* tf, struct pal_handle* fil
 
     /* trusted files: need integrity, so calculate chunk hashes and compare with hash in manifest */
     tdx_chunk_hash_t* chunk_hashes = NULL;
-    uint8_t* tmp_chunk = NULL; /* scratch buf to calculate whole-file and chunk-of-file hashes */
+    uint8_t* window = NULL; /* scratch buf to calculate whole-file and chunk-of-file hashes */
 
     spinlock_lock(&g_trusted_file_lock);
     if (tf->chunk_hashes) {
@@ -139,55 +442,45 @@ int load_trusted_or_allowed_file(struct trusted_file* tf, struct pal_handle* fil
         goto fail;
     }
 
-    tmp_chunk = malloc(TRUSTED_CHUNK_SIZE);
-    if (!tmp_chunk) {
-        ret = -PAL_ERROR_NOMEM;
-        goto fail;
-    }
+    /* small files are read at once and their contents are put into the verified-chunk cache below;
+     * bigger files are read in windows of FILE_CHUNK_SIZE (a multiple of TRUSTED_CHUNK_SIZE) */
+    bool cache_whole_file = tf->size <= g_tf_cache_max_size / 4;
+    size_t window_size = cache_whole_file ? tf->size : FILE_CHUNK_SIZE;
+    static_assert(FILE_CHUNK_SIZE % TRUSTED_CHUNK_SIZE == 0, "");
 
-    tdx_chunk_hash_t* chunk_hashes_item = chunk_hashes;
-    uint64_t offset = 0;
-    LIB_SHA256_CONTEXT file_sha;
+    if (window_size) {
+        window = malloc(window_size);
+        if (!window) {
+            ret = -PAL_ERROR_NOMEM;
+            goto fail;
+        }
+    }
 
-    ret = lib_SHA256Init(&file_sha);
+    struct tf_load_job job = { 0 };
+    ret = lib_SHA256Init(&job.file_sha);
     if (ret < 0)
         goto fail;
 
-    for (; offset < tf->size; offset += TRUSTED_CHUNK_SIZE, chunk_hashes_item++) {
-        /* For each file chunk of size TRUSTED_CHUNK_SIZE, generate 128-bit hash from SHA-256 hash
-         * over contents of this file chunk (we simply truncate SHA-256 hash to first 128 bits; this
-         * is fine for integrity purposes). Also, generate a SHA-256 hash for the whole file
-         * contents to compare with the manifest "reference" hash value. */
-        uint64_t chunk_size = MIN(tf->size - offset, TRUSTED_CHUNK_SIZE);
-        LIB_SHA256_CONTEXT chunk_sha;
-        ret = lib_SHA256Init(&chunk_sha);
-        if (ret < 0)
-            goto fail;
-
-        ret = read_whole_buf(file, tmp_chunk, chunk_size, offset);
-        if (ret < 0)
-            goto fail;
+    for (uint64_t offset = 0; offset < tf->size; offset += window_size) {
+        job.chunk_hashes = chunk_hashes + offset / TRUSTED_CHUNK_SIZE;
+        job.data = window;
+        job.size = MIN(tf->size - offset, window_size);
+        job.hashed_size = 0;
 
-        ret = lib_SHA256Update(&file_sha, tmp_chunk, chunk_size);
+        /* chunks are hashed by tf_load_progress() while the rest of the window is being read */
+        ret = read_whole_buf(file, window, job.size, offset, tf_load_progress, &job);
         if (ret < 0)
             goto fail;
 
-        ret = lib_SHA256Update(&chunk_sha, tmp_chunk, chunk_size);
-        if (ret < 0)
-            goto fail;
-
-        tdx_chunk_hash_t chunk_hash[2]; /* each chunk_hash is 128 bits in size */
-        static_assert(sizeof(chunk_hash) * 8 == 256, "");
-        ret = lib_SHA256Final(&chunk_sha, (uint8_t*)&chunk_hash[0]);
-        if (ret < 0)
+        if (job.error < 0) {
+            ret = job.error;
             goto fail;
-
-        /* note that we truncate SHA256 to 128 bits */
-        memcpy(chunk_hashes_item, &chunk_hash[0], sizeof(*chunk_hashes_item));
+        }
+        assert(job.hashed_size == job.size);
     }
 
     tdx_file_hash_t file_hash;
-    ret = lib_SHA256Final(&file_sha, file_hash.bytes);
+    ret = lib_SHA256Final(&job.file_sha, file_hash.bytes);
     if (ret < 0)
         goto fail;
 
@@ -204,102 +497,133 @@ int load_trusted_or_allowed_file(struct trusted_file* tf, struct pal_handle* fil
         *out_chunk_hashes = tf->chunk_hashes;
         spinlock_unlock(&g_trusted_file_lock);
         free(chunk_hashes);
-        free(tmp_chunk);
+        free(window);
         return 0;
     }
     tf->chunk_hashes = chunk_hashes;
     *out_chunk_hashes = chunk_hashes;
     spinlock_unlock(&g_trusted_file_lock);
 
-    free(tmp_chunk);
+    if (cache_whole_file) {
+        /* the whole file was verified against the manifest hash, cache its contents */
+        for (uint64_t offset = 0; offset < tf->size; offset += TRUSTED_CHUNK_SIZE)
+            tf_cache_insert(tf, offset / TRUSTED_CHUNK_SIZE, window + offset,
+                            MIN(tf->size - offset, TRUSTED_CHUNK_SIZE));
+    }
+
+    free(window);
     return 0;
 
 fail:
     free(chunk_hashes);
-    free(tmp_chunk);
+    free(window);
     return ret;
 }
 
 int copy_and_verify_trusted_file(struct pal_handle* file, uint8_t* buf, int64_t aligned_offset,
                                  int64_t aligned_end, int64_t offset, int64_t end,
-                                 void* _chunk_hashes, size_t file_size) {
-    tdx_chunk_hash_t* chunk_hashes = (tdx_chunk_hash_t*)_chunk_hashes;
+                                 struct trusted_file* tf, size_t file_size) {
     int ret = 0;
 
     assert(IS_ALIGNED(aligned_offset, TRUSTED_CHUNK_SIZE));
     assert(offset >= aligned_offset && end <= aligned_end);
 
-    uint8_t* tmp_chunk = malloc(TRUSTED_CHUNK_SIZE);
-    if (!tmp_chunk) {
-        ret = -PAL_ERROR_NOMEM;
-        goto failed;
-    }
-
-    tdx_chunk_hash_t* chunk_hashes_item = chunk_hashes + aligned_offset / TRUSTED_CHUNK_SIZE;
+    /* Chunks are read in runs of consecutive chunks that are not in the verified-chunk cache. Full
+     * chunks of big requests are read directly into `buf`. Chunks of small requests and partially
+     * requested chunks are read into a staging buffer, verified, copied into `buf` and cached;
+     * small requests also read ahead a few chunks, in anticipation of sequential reads. */
+    bool use_cache = g_tf_cache_max_size > 0;
+    bool small_request = use_cache && end - offset <= (int64_t)TF_CACHE_MAX_REQUEST_SIZE;
+    int64_t staging_end = small_request
+                              ? MIN(aligned_end + TF_READ_AHEAD_CHUNKS * TRUSTED_CHUNK_SIZE,
+                                    (int64_t)file_size)
+                              : aligned_end;
+    uint8_t* staging = NULL;
 
     uint8_t* buf_pos = buf;
     int64_t chunk_offset = aligned_offset;
-    for (; chunk_offset < aligned_end; chunk_offset += TRUSTED_CHUNK_SIZE, chunk_hashes_item++) {
+    while (chunk_offset < aligned_end) {
         size_t chunk_size = MIN(file_size - chunk_offset, TRUSTED_CHUNK_SIZE);
-        int64_t chunk_end   = chunk_offset + chunk_size;
+        int64_t chunk_end = chunk_offset + chunk_size;
 
-        tdx_chunk_hash_t chunk_hash[2]; /* each chunk_hash is 128 bits in size but we need 256 */
+        /* determine which part of the chunk is needed by the caller */
+        int64_t copy_start = MAX(chunk_offset, offset);
+        int64_t copy_end   = MIN(chunk_end, end);
+        assert(copy_end > copy_start);
 
-        LIB_SHA256_CONTEXT chunk_sha;
-        ret = lib_SHA256Init(&chunk_sha);
-        if (ret < 0)
-            goto failed;
+        if (use_cache && tf_cache_read(tf, chunk_offset / TRUSTED_CHUNK_SIZE,
+                                       copy_start - chunk_offset, copy_end - copy_start, buf_pos)) {
+            buf_pos += copy_end - copy_start;
+            chunk_offset = chunk_end;
+            continue;
+        }
 
-        if (chunk_offset >= offset && chunk_end <= end) {
-            /* if current chunk-to-copy completely resides in the requested region-to-copy,
-             * directly copy into buf (without a scratch buffer) and hash in-place */
-            ret = read_whole_buf(file, buf_pos, chunk_size, chunk_offset);
-            if (ret < 0)
-                goto failed;
+        int64_t run_end = chunk_end;
+        if (!small_request && copy_start == chunk_offset && copy_end == chunk_end) {
+            /* full chunks of a big request: read and verify in place */
+            while (run_end < aligned_end) {
+                int64_t next_end = MIN(run_end + (int64_t)TRUSTED_CHUNK_SIZE, (int64_t)file_size);
+                if (next_end > end)
+                    break;
+                if (use_cache && tf_cache_contains(tf, run_end / TRUSTED_CHUNK_SIZE))
+                    break;
+                run_end = next_end;
+            }
 
-            ret = lib_SHA256Update(&chunk_sha, buf_pos, chunk_size);
+            ret = read_and_verify_run(file, tf, buf_pos, chunk_offset, run_end - chunk_offset);
             if (ret < 0)
                 goto failed;
 
-            buf_pos += chunk_size;
-        } else {
-            /* if current chunk-to-copy only partially overlaps with the requested region-to-copy,
-             * read the file contents into a scratch buffer, verify hash and then copy only the part
-             * needed by the caller */
-            ret = read_whole_buf(file, tmp_chunk, chunk_size, chunk_offset);
-            if (ret < 0)
-                goto failed;
+            buf_pos += run_end - chunk_offset;
+            chunk_offset = run_end;
+            continue;
+        }
 
-            ret = lib_SHA256Update(&chunk_sha, tmp_chunk, chunk_size);
-            if (ret < 0)
+        /* chunks of a small request (including read-ahead chunks) or a single partially requested
+         * chunk: read and verify in the staging buffer */
+        if (!staging) {
+            staging = malloc(small_request ? TF_STAGING_SIZE : TRUSTED_CHUNK_SIZE);
+            if (!staging) {
+                ret = -PAL_ERROR_NOMEM;
                 goto failed;
+            }
+        }
 
-            /* determine which part of the chunk is needed by the caller */
-            int64_t copy_start = MAX(chunk_offset, offset);
-            int64_t copy_end   = MIN(chunk_offset + (int64_t)chunk_size, end);
-            assert(copy_end > copy_start);
-
-            memcpy(buf_pos, tmp_chunk + copy_start - chunk_offset, copy_end - copy_start);
-            buf_pos += copy_end - copy_start;
+        if (small_request) {
+            while (run_end < staging_end && run_end - chunk_offset < (int64_t)TF_STAGING_SIZE) {
+                if (tf_cache_contains(tf, run_end / TRUSTED_CHUNK_SIZE))
+                    break;
+                run_end = MIN(run_end + (int64_t)TRUSTED_CHUNK_SIZE, (int64_t)file_size);
+            }
         }
 
-        ret = lib_SHA256Final(&chunk_sha, (uint8_t*)&chunk_hash[0]);
+        ret = read_and_verify_run(file, tf, staging, chunk_offset, run_end - chunk_offset);
         if (ret < 0)
             goto failed;
 
-        if (memcmp(chunk_hashes_item, &chunk_hash[0], sizeof(*chunk_hashes_item))) {
-            log_error("Accessing file '%s' is denied: incorrect hash of file chunk at %lu-%lu.",
-                      file->file.realpath, chunk_offset, chunk_end);
-            ret = -PAL_ERROR_DENIED;
-            goto failed;
+        for (int64_t run_chunk = chunk_offset; run_chunk < run_end;
+                run_chunk += TRUSTED_CHUNK_SIZE) {
+            size_t run_chunk_size = MIN(run_end - run_chunk, (int64_t)TRUSTED_CHUNK_SIZE);
+            uint8_t* run_chunk_data = staging + (run_chunk - chunk_offset);
+
+            if (run_chunk < aligned_end) {
+                copy_start = MAX(run_chunk, offset);
+                copy_end   = MIN(run_chunk + (int64_t)run_chunk_size, end);
+                memcpy(buf_pos, run_chunk_data + copy_start - run_chunk, copy_end - copy_start);
+                buf_pos += copy_end - copy_start;
+            }
+            if (use_cache)
+                tf_cache_insert(tf, run_chunk / TRUSTED_CHUNK_SIZE, run_chunk_data, run_chunk_size);
         }
+
+        chunk_offset = MIN(run_end, aligned_end);
     }
 
-    free(tmp_chunk);
+    free(staging);
     return 0;
 
 failed:
-    free(tmp_chunk);
+    free(staging);
     memset(buf, 0, end - offset);
     return ret;
 }
@@ -338,6 +662,8 @@ static int register_file(const char* uri, const char* hash_str, bool check_dupli
     INIT_LIST_HEAD(new, list);
     new->size = 0;
     new->chunk_hashes = NULL;
+    new->cached_chunks = NULL;
+    new->cached_chunks_cnt = 0;
     new->allowed = false;
     new->uri_len = uri_len;
     memcpy(new->uri, uri, uri_len + 1);
@@ -410,6 +736,13 @@ out:
 int init_trusted_files(void) {
     int ret;
 
+    ret = toml_sizestring_in(g_pal_public_state.manifest_root, "tdx.trusted_files_cache_size",
+                             TF_CACHE_DEFAULT_SIZE, &g_tf_cache_max_size);
+    if (ret < 0) {
+        log_error("Cannot parse 'tdx.trusted_files_cache_size'");
+        return -PAL_ERROR_INVAL;
+    }
+
     toml_table_t* manifest_tdx = toml_table_in(g_pal_public_state.manifest_root, "tdx");
     if (!manifest_tdx) {
         /* hack to re-use `sgx` key if `tdx` not found */
@@ -51,6 +51,8 @@ typedef struct {
     uint8_t bytes[16];
 } tdx_chunk_hash_t;
 
+struct tf_cached_chunk;
+
 /*
  * Perhaps confusingly, `struct trusted_file` describes not only "tdx.trusted_files" but also
  * "tdx.allowed_files". For allowed files, `allowed = true`, `chunk_hashes = NULL`, and `uri` can be
@@ -63,6 +65,10 @@ struct trusted_file {
     bool allowed;
     tdx_file_hash_t file_hash;      /* hash over the whole file, retrieved from the manifest */
     tdx_chunk_hash_t* chunk_hashes; /* array of hashes over separate file chunks */
+    /* verified contents of file chunks (NULL for chunks not in the cache), allocated lazily; see
+     * verified-chunk cache in pal_common_tf.c */
+    struct tf_cached_chunk** cached_chunks;
+    size_t cached_chunks_cnt;
     size_t uri_len;
     char uri[]; /* must be NULL-terminated */
 };
@@ -93,20 +99,22 @@ int load_trusted_or_allowed_file(struct trusted_file* tf, struct pal_handle* fil
 /*!
  * \brief Copy and check file contents from untrusted outside buffer to in-enclave buffer
  *
+ * Chunks found in the verified-chunk cache are copied without re-reading and re-hashing them.
+ *
  * \param file            File handle.
  * \param buf             In-enclave buffer where contents of the file are copied.
  * \param aligned_offset  Offset into file contents to copy, aligned to TRUSTED_CHUNK_SIZE.
  * \param aligned_end     End of file contents to copy, aligned to TRUSTED_CHUNK_SIZE.
  * \param offset          Unaligned offset into file contents to copy.
  * \param end             Unaligned end of file contents to copy.
- * \param chunk_hashes    Array of hashes of all file chunks.
+ * \param tf              Trusted file struct corresponding to this file.
  * \param file_size       Total size of the file.
  *
  * \returns 0 on success, negative error code on failure
  */
 int copy_and_verify_trusted_file(struct pal_handle* file, uint8_t* buf, int64_t aligned_offset,
                                  int64_t aligned_end, int64_t offset, int64_t end,
-                                 void* chunk_hashes, size_t file_size);
+                                 struct trusted_file* tf, size_t file_size);
 
 int init_trusted_files(void);
 int init_allowed_files(void);
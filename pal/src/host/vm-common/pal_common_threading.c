@@ -10,6 +10,7 @@
 #include "pal_common.h"
 #include "pal_error.h"
 #include "pal_internal.h"
+#include "toml_utils.h"
 
 #include "kernel_multicore.h"
 #include "kernel_sched.h"
@@ -122,6 +123,22 @@ int pal_common_thread_get_cpu_affinity(struct pal_handle* thread, unsigned long*
     return 0;
 }
 
+/* Reads the retention cap of the thread-stack pool from `tdx.max_cached_thread_stacks` manifest
+ * option; free stacks above this cap are returned to the system, see kernel_thread.c. */
+int pal_common_thread_stack_cache_init(void) {
+    int64_t max_cached_stacks;
+    int ret = toml_int_in(g_pal_public_state.manifest_root, "tdx.max_cached_thread_stacks",
+                          DEFAULT_MAX_CACHED_THREAD_STACKS, &max_cached_stacks);
+    if (ret < 0 || max_cached_stacks < 0) {
+        log_error("Cannot parse 'tdx.max_cached_thread_stacks' (the value must be a non-negative "
+                  "integer)");
+        return -PAL_ERROR_INVAL;
+    }
+
+    thread_set_max_cached_stacks(max_cached_stacks);
+    return 0;
+}
+
 struct thread* get_thread_ptr(uintptr_t curr_gs_base) {
     struct pal_tcb_vm* curr_tcb = (struct pal_tcb_vm*)curr_gs_base;
     return &curr_tcb->kernel_thread;
@@ -42,3 +42,8 @@ void vm_portio_writew(uint16_t port, uint16_t val);
 void vm_portio_writel(uint16_t port, uint32_t val);
 
 int vm_virtualization_exception(struct isr_regs* regs);
+
+/* halts the current vCPU until the next interrupt; must be called with interrupts disabled (so that
+ * an interrupt arriving right before the halt is not lost), returns with interrupts enabled and
+ * after the pending interrupt was served */
+void vm_cpu_halt(void);
@@ -11,4 +11,5 @@ struct handle_ops g_eventfd_ops = {
     .write          = &pal_common_eventfd_write,
     .destroy        = &pal_common_eventfd_destroy,
     .attrquerybyhdl = &pal_common_eventfd_attrquerybyhdl,
+    .setnotify      = &pal_common_eventfd_setnotify,
 };
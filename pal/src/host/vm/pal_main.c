@@ -107,44 +107,6 @@ static int add_preloaded_range(uintptr_t addr, size_t size, const char* comment)
     return pal_add_initial_range(addr, size, /*pal_prot=*/0, comment);
 }
 
-static void zero_out_memory_and_prot_none(void) {
-    extern struct pal_initial_mem_range g_initial_mem_ranges[];
-
-    uint64_t cur_mem_range_idx = 0;
-    uintptr_t addr = (uintptr_t)g_pal_public_state.memory_address_end;
-    while (true) {
-        if (!addr)
-            return;
-        addr -= PAGE_SIZE;
-
-        while (cur_mem_range_idx < g_pal_public_state.initial_mem_ranges_len
-                && addr < g_initial_mem_ranges[cur_mem_range_idx].start) {
-            /* skip too-high mem ranges; we rely on mem ranges to be sorted in desc order */
-            cur_mem_range_idx++;
-        }
-
-        while (cur_mem_range_idx < g_pal_public_state.initial_mem_ranges_len
-                && addr >= g_initial_mem_ranges[cur_mem_range_idx].start
-                && addr <  g_initial_mem_ranges[cur_mem_range_idx].end) {
-            /* jump over a mem range; we rely on mem ranges to be sorted in desc order */
-            addr = g_initial_mem_ranges[cur_mem_range_idx].start;
-            if (!addr)
-                return;
-            addr -= PAGE_SIZE;
-            cur_mem_range_idx++;
-        }
-
-        if (addr < (uintptr_t)g_pal_public_state.memory_address_start)
-            return;
-
-        memset((void*)addr, 0, PAGE_SIZE);
-        int ret = memory_protect((void*)addr, PAGE_SIZE, /*read=*/false, /*write=*/false,
-                                 /*execute=*/false);
-        if (ret < 0)
-            BUG();
-    }
-}
-
 noreturn static void print_usage_and_exit(void) {
     log_always("USAGE: init <application> args...");
     log_always("This is an internal interface. Use gramine-vm to launch applications.");
@@ -159,6 +121,7 @@ __attribute_no_sanitize_address /* starts with dummy page tables w/o ASan shared
 noreturn void pal_start_c(void) {
     int ret;
 
+    uint64_t boot_start_tsc = get_tsc();
     set_dummy_gs_base();
 
     /* initialize alloc_align as early as possible, a lot of PAL APIs depend on this being set */
@@ -188,21 +151,28 @@ noreturn void pal_start_c(void) {
     if (ret < 0)
         INIT_FAIL("Failed to initialize page tables");
 
+    boot_phases_start(boot_start_tsc);
+
     ret = memory_preload_ranges(e820, e820_size, &add_preloaded_range);
     if (ret < 0)
         INIT_FAIL("Failed to initialize preloaded ranges");
 
     /* PAL binary is located at 1MB and may occupy until 4MB, see pal.lds */
     /* FIXME: whole PAL binary is RWX because memory_pagetables_init() marked everything as RWX and
-     *        zero_out_memory_and_prot_none() did *not* modify perms for PAL binary memory pages */
+     *        memory_boot_init_prepare() does *not* modify perms for PAL binary memory pages */
     ret = add_preloaded_range(0x100000UL, 0x300000UL, "pal_binary");
     if (ret < 0)
         INIT_FAIL("Failed to preload PAL-binary memory range");
 
     /* Common memory-allocation logic relies on all memory pages to be zeroed out after boot.
      * This is not true for common hypervisors like QEMU/KVM, so must do it ourselves. Also,
-     * memory_pagetables_init() marked all pages as RWX, now is good time to revert to NONE. */
-    zero_out_memory_and_prot_none();
+     * memory_pagetables_init() marked all pages as RWX, must revert them to NONE. This is done
+     * later, on all CPUs, see memory_boot_init_finish(). */
+    ret = memory_boot_init_prepare(g_pal_public_state.memory_address_start,
+                                   g_pal_public_state.memory_address_end, /*zero_memory=*/true);
+    if (ret < 0)
+        INIT_FAIL("Failed to prepare boot-time memory initialization");
+    boot_phase_done("memory map and page tables");
 
     call_init_array();
 
@@ -238,6 +208,7 @@ noreturn void pal_start_c(void) {
     ret = syscalls_init();
     if (ret < 0)
         INIT_FAIL("Failed to initialize system call handling");
+    boot_phase_done("timers, devices and CPU features");
 
     /* must be called before interrupts_init() because it allocates interrupt stacks/XSAVE areas */
     ret = init_multicore_prepare(num_cpus);
@@ -252,6 +223,10 @@ noreturn void pal_start_c(void) {
     ret = init_multicore(num_cpus, /*hob_list_addr=*/NULL);
     if (ret < 0)
         INIT_FAIL("Failed to initialize multicore (BSP CPU couldn't init AP CPUs)");
+    boot_phase_done("multicore");
+
+    memory_boot_init_finish(/*lazy=*/lazy_mem_init_requested());
+    boot_phase_done("memory zeroing and protection");
 
     if (!g_console)
         INIT_FAIL("Failed to initialize virtio-console driver");
@@ -279,6 +254,7 @@ noreturn void pal_start_c(void) {
     ret = virtio_fs_fuse_init();
     if (ret < 0)
         INIT_FAIL("Failed FUSE_INIT request of virtio-fs driver");
+    boot_phase_done("VMM inputs and virtio-fs");
 
     ret = _PalThreadCreate(&g_first_thread_handle, pal_start_continue, g_cmdline);
     if (ret < 0)
@@ -350,11 +326,21 @@ noreturn int pal_start_continue(void* cmdline_) {
     g_pal_public_state.vm_user_rip_offset = offsetof(struct pal_tcb_vm,
                                                      kernel_thread.context.user_rip);
 
+    get_tsc_time_info(&g_pal_public_state.tsc_time_info);
+
     ret = pal_common_get_topo_info(&g_pal_public_state.topo_info);
     if (ret < 0)
         INIT_FAIL("Failed to get topology information: %s", pal_strerror(ret));
 
+    ret = pal_common_irq_affinity_init();
+    if (ret < 0)
+        INIT_FAIL("Failed to steer device interrupts to vCPUs: %s", pal_strerror(ret));
+
+    ret = pal_common_thread_stack_cache_init();
+    if (ret < 0)
+        INIT_FAIL("Failed to configure the thread-stack pool: %s", pal_strerror(ret));
+
     pal_main(/*instance_id=*/0, /*parent_process=*/NULL, g_first_thread_handle, argv + 1, envp,
-             /*post_callback=*/NULL);
+             /*post_callback=*/boot_phases_print);
     __builtin_unreachable();
 }
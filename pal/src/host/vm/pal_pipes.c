@@ -14,4 +14,5 @@ struct handle_ops g_pipe_ops = {
     .delete         = &pal_common_pipe_delete,
     .attrquerybyhdl = &pal_common_pipe_attrquerybyhdl,
     .attrsetbyhdl   = &pal_common_pipe_attrsetbyhdl,
+    .setnotify      = &pal_common_pipe_setnotify,
 };
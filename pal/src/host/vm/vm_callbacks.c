@@ -133,3 +133,10 @@ int vm_virtualization_exception(struct isr_regs* regs) {
     __UNUSED(regs);
     BUG();
 }
+
+void vm_cpu_halt(void) {
+    /* STI delays recognition of interrupts until after the next instruction, so an interrupt that
+     * is pending at this point wakes up HLT instead of being served before it. MWAIT is not used as
+     * hypervisors typically intercept it or do not expose it to guests at all. */
+    __asm__ volatile("sti; hlt" ::: "memory");
+}
@@ -34,3 +34,20 @@ int PalStreamsWaitEvents(size_t count, PAL_HANDLE* handle_array, pal_wait_flags_
 
     return _PalStreamsWaitEvents(count, handle_array, events, ret_events, timeout_us);
 }
+
+int PalStreamSetNotify(PAL_HANDLE handle, pal_stream_notify_cb_t callback, void* arg) {
+    if (!handle) {
+        return -PAL_ERROR_INVAL;
+    }
+
+    const struct handle_ops* ops = HANDLE_OPS(handle);
+    if (!ops) {
+        return -PAL_ERROR_BADHANDLE;
+    }
+
+    if (!ops->setnotify) {
+        return -PAL_ERROR_NOTSUPPORT;
+    }
+
+    return ops->setnotify(handle, callback, arg);
+}